@@ -81,6 +81,11 @@ function connectToRawInputService() {
             if (line) {
                 try {
                     const event = JSON.parse(line);
+                    if (event.type === 'heartbeat') {
+                        // Keeps us connected to a service run with --pong-timeout-ms
+                        rawInputSocket.write('pong\n');
+                        continue;
+                    }
                     broadcastToClients({ type: 'input', ...event });
                 } catch (e) {
                     console.error('JSON parse error:', e.message);
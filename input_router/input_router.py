@@ -32,6 +32,7 @@ MOUSEEVENTF_RIGHTDOWN = 0x0008
 MOUSEEVENTF_RIGHTUP = 0x0010
 MOUSEEVENTF_MIDDLEDOWN = 0x0020
 MOUSEEVENTF_MIDDLEUP = 0x0040
+MOUSEEVENTF_VIRTUALDESK = 0x4000
 MOUSEEVENTF_ABSOLUTE = 0x8000
 
 # Raw Input button flags (from Windows headers)
@@ -91,6 +92,89 @@ class INPUT(ctypes.Structure):
 user32 = ctypes.windll.user32
 kernel32 = ctypes.windll.kernel32
 
+# libinputstream (raw_input_service/inputstream.h) - optional native decoder
+IS_KIND_KEYBOARD = 0
+IS_KIND_MOUSE = 1
+IS_KIND_GAP = 3
+IS_KIND_CURSOR = 9
+IS_KIND_HOTKEY = 10
+IS_FLAG_SYNTHETIC = 0x01  # Also the JSON "flags" bit: replayed by a service macro
+IS_BATCH_SIZE = 256
+
+class IS_EVENT(ctypes.Structure):
+    _fields_ = [
+        ("seq", ctypes.c_uint64),
+        ("timestamp", ctypes.c_uint64),
+        ("gap_to", ctypes.c_uint64),
+        ("kind", ctypes.c_int32),
+        ("vkey", ctypes.c_int32),
+        ("dx", ctypes.c_int32),
+        ("dy", ctypes.c_int32),
+        ("buttons", ctypes.c_int32),
+        ("device_id", ctypes.c_char * 48),
+        ("x", ctypes.c_int32),
+        ("y", ctypes.c_int32),
+        ("abs_x", ctypes.c_int32),
+        ("abs_y", ctypes.c_int32),
+        ("scan", ctypes.c_int32),
+        ("ch", ctypes.c_int32),
+        ("mods", ctypes.c_int32),
+        ("hotkey", ctypes.c_int32),
+        ("flags", ctypes.c_int32),
+    ]
+
+
+class NativeEventStream:
+    """Event stream decoded by libinputstream on a native thread.
+
+    ctypes releases the GIL for the duration of each foreign call, so the GIL
+    is only held while a finished batch is copied out of the shared array.
+    """
+
+    ABI_VERSION = 7  # Oldest library with every field used here
+
+    def __init__(self, lib_path: str):
+        lib = ctypes.CDLL(lib_path)
+        lib.is_abi_version.restype = ctypes.c_int
+        lib.is_connect.restype = ctypes.c_void_p
+        lib.is_connect.argtypes = [ctypes.c_char_p, ctypes.c_uint16]
+        lib.is_poll_batch.restype = ctypes.c_int
+        lib.is_poll_batch.argtypes = [ctypes.c_void_p, ctypes.POINTER(IS_EVENT), ctypes.c_size_t, ctypes.c_int, ctypes.c_int]
+        lib.is_subscribe.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+        lib.is_unsubscribe.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+        lib.is_dropped.restype = ctypes.c_uint64
+        lib.is_dropped.argtypes = [ctypes.c_void_p]
+        lib.is_close.argtypes = [ctypes.c_void_p]
+        if lib.is_abi_version() < self.ABI_VERSION:
+            raise OSError(f"{lib_path}: unsupported ABI version {lib.is_abi_version()}")
+        self.lib = lib
+        self.handle = None
+        self.batch = (IS_EVENT * IS_BATCH_SIZE)()
+
+    def connect(self, host: str, port: int) -> bool:
+        self.handle = self.lib.is_connect(host.encode(), port)
+        return bool(self.handle)
+
+    def subscribe(self, device_id: str):
+        if self.handle:
+            self.lib.is_subscribe(self.handle, device_id.encode())
+
+    def unsubscribe(self, device_id: str):
+        if self.handle:
+            self.lib.is_unsubscribe(self.handle, device_id.encode())
+
+    def poll(self, timeout_ms: int = 500) -> int:
+        """Fill self.batch; returns count, 0 on timeout, -1 when closed"""
+        return self.lib.is_poll_batch(self.handle, self.batch, ctypes.sizeof(IS_EVENT), IS_BATCH_SIZE, timeout_ms)
+
+    def dropped(self) -> int:
+        return self.lib.is_dropped(self.handle) if self.handle else 0
+
+    def close(self):
+        if self.handle:
+            self.lib.is_close(self.handle)
+            self.handle = None
+
 
 @dataclass
 class UserSession:
@@ -101,6 +185,8 @@ class UserSession:
     project_dir: str = ""
     editor: str = "cursor"
     pid: int = 0
+    paused: bool = False
+    cursor: bool = False  # The service moves this user's virtual cursor (--cursors)
 
 
 class InputRouter:
@@ -113,6 +199,7 @@ class InputRouter:
         self.user_sessions: Dict[str, UserSession] = {}
         self.running = False
         self.socket: Optional[socket.socket] = None
+        self.native: Optional[NativeEventStream] = None
         self.last_active_user: Optional[str] = None
         self.lock = threading.Lock()
         
@@ -182,6 +269,8 @@ class InputRouter:
         """Add or update a device mapping"""
         with self.lock:
             self.device_mappings[device_id] = user_id
+            if self.native:
+                self.native.subscribe(device_id)
             self._save_config()
             self.logger.info(f"Mapped device '{device_id}' to '{user_id}'")
     
@@ -190,6 +279,8 @@ class InputRouter:
         with self.lock:
             if device_id in self.device_mappings:
                 del self.device_mappings[device_id]
+                if self.native:
+                    self.native.unsubscribe(device_id)
                 self._save_config()
                 self.logger.info(f"Removed mapping for device '{device_id}'")
 
@@ -378,10 +469,17 @@ class InputRouter:
         if result != 1:
             self.logger.warning(f"SendInput keyboard failed: {kernel32.GetLastError()}")
     
-    def inject_keyboard_to_window(self, hwnd: int, vkey: int):
-        """Inject keyboard event directly to a window using PostMessage (NO FOCUS SWITCH!)"""
-        # Get scan code for the virtual key
-        scan_code = user32.MapVirtualKeyW(vkey, 0)
+    def inject_keyboard_to_window(self, hwnd: int, vkey: int, scan: int = 0, char_code: int = 0):
+        """Inject keyboard event directly to a window using PostMessage (NO FOCUS SWITCH!)
+
+        The service sends the scan code and the WM_CHAR value in the keyboard's
+        layout; without them (an older service) they are looked up here.
+        """
+        if scan == 0:
+            scan = user32.MapVirtualKeyW(vkey, 0)
+            char_code = user32.MapVirtualKeyW(vkey, 2)  # MAPVK_VK_TO_CHAR
+        scan_code = scan & 0xFF
+        extended = (1 << 24) if (scan & 0xFF00) == 0xE000 else 0
         
         # Build lParam for key messages
         # Bits 0-15: repeat count (1)
@@ -392,14 +490,13 @@ class InputRouter:
         # Bit 30: previous key state (0 for down, 1 for up)
         # Bit 31: transition state (0 for down, 1 for up)
         
-        lparam_down = (scan_code << 16) | 1
-        lparam_up = (scan_code << 16) | 1 | (1 << 30) | (1 << 31)
+        lparam_down = (scan_code << 16) | extended | 1
+        lparam_up = (scan_code << 16) | extended | 1 | (1 << 30) | (1 << 31)
         
         # Post key down
         user32.PostMessageW(hwnd, WM_KEYDOWN, vkey, lparam_down)
         
-        # Post WM_CHAR for printable characters
-        char_code = user32.MapVirtualKeyW(vkey, 2)  # MAPVK_VK_TO_CHAR
+        # Post WM_CHAR for keys that type something
         if char_code > 0:
             user32.PostMessageW(hwnd, WM_CHAR, char_code, lparam_down)
         
@@ -407,7 +504,7 @@ class InputRouter:
         user32.PostMessageW(hwnd, WM_KEYUP, vkey, lparam_up)
     
     def inject_mouse_move(self, dx: int, dy: int, absolute: bool = False):
-        """Inject mouse movement"""
+        """Inject mouse movement; absolute dx/dy are 0..65535 over the whole virtual desktop"""
         inp = INPUT()
         inp.type = INPUT_MOUSE
         inp.union.mi.dx = dx
@@ -415,7 +512,7 @@ class InputRouter:
         inp.union.mi.mouseData = 0
         inp.union.mi.dwFlags = MOUSEEVENTF_MOVE
         if absolute:
-            inp.union.mi.dwFlags |= MOUSEEVENTF_ABSOLUTE
+            inp.union.mi.dwFlags |= MOUSEEVENTF_ABSOLUTE | MOUSEEVENTF_VIRTUALDESK
         inp.union.mi.time = 0
         inp.union.mi.dwExtraInfo = None
         
@@ -457,11 +554,75 @@ class InputRouter:
             self.logger.warning(f"SendInput mouse button failed: {kernel32.GetLastError()}")
 
 
+    def handle_hotkey(self, device_id: str, hotkey: int):
+        """Run the action config.json's "hotkeys" gives a hotkey typed on device_id"""
+        user_id = self.device_mappings.get(device_id)
+        session = self.user_sessions.get(user_id) if user_id else None
+        action = self.config.get('hotkeys', {}).get(str(hotkey))
+        if not session or not action:
+            self.logger.debug(f"Hotkey {hotkey} on {device_id} has no session or action")
+            return
+        
+        if action == 'pause':
+            session.paused = not session.paused
+            self.logger.info(f"Routing for {user_id} {'paused' if session.paused else 'resumed'}")
+        elif action == 'next-window':
+            self.next_window(user_id, session)
+        else:
+            self.logger.warning(f"Unknown hotkey action '{action}' for hotkey {hotkey}")
+    
+    def handle_cursor(self, user_id: str, abs_x: int, abs_y: int):
+        """Move the pointer to a user's virtual cursor, as the service placed it"""
+        session = self.user_sessions.get(user_id)
+        if not session or session.paused:
+            return
+        if not session.cursor:
+            # The cursor event already has the motion, with ballistics; from
+            # now on the user's mice only click
+            session.cursor = True
+            self.logger.info(f"Following the service's cursor for {user_id}")
+        self.inject_mouse_move(abs_x, abs_y, absolute=True)
+    
+    def next_window(self, user_id: str, session: UserSession):
+        """Point a user at the next editor window that no other user has"""
+        taken = {s.hwnd for uid, s in self.user_sessions.items() if uid != user_id}
+        windows = [w['hwnd'] for w in self.list_open_windows() if w['hwnd'] not in taken]
+        if not windows:
+            self.logger.warning(f"No free editor window for {user_id}")
+            return
+        
+        index = (windows.index(session.hwnd) + 1) % len(windows) if session.hwnd in windows else 0
+        session.hwnd = windows[index]
+        self.logger.info(f"{user_id} now types into hwnd={session.hwnd}")
+
+    def replays_macros(self) -> bool:
+        """False if config.json's settings drop events replayed by service macros"""
+        return self.config.get('settings', {}).get('replay_macros', True)
+
     def route_event(self, event: Dict):
+        """Route a decoded JSON input event to the appropriate user's window"""
+        if event.get('flags', 0) & IS_FLAG_SYNTHETIC and not self.replays_macros():
+            return
+        if event.get('type') == 'hotkey':
+            self.handle_hotkey(event.get('device_id', ''), event.get('hotkey', 0))
+            return
+        if event.get('type') == 'cursor':
+            self.handle_cursor(event.get('device_id', ''), event.get('abs_x', 0), event.get('abs_y', 0))
+            return
+        self.route_input(
+            event.get('device_id', ''),
+            event.get('type', ''),
+            event.get('vkey', 0),
+            event.get('dx', 0),
+            event.get('dy', 0),
+            event.get('buttons', 0),
+            event.get('scan', 0),
+            event.get('char', 0),
+        )
+
+    def route_input(self, device_id: str, event_type: str, vkey: int, dx: int, dy: int, buttons: int,
+                    scan: int = 0, char_code: int = 0):
         """Route an input event to the appropriate user's window"""
-        device_id = event.get('device_id', '')
-        event_type = event.get('type', '')
-        
         # Find user for this device
         user_id = self.device_mappings.get(device_id)
         if not user_id:
@@ -474,6 +635,8 @@ class InputRouter:
         if not session:
             self.logger.warning(f"No session for user {user_id}")
             return
+        if session.paused:
+            return
         
         # Check if process is still running
         if session.process and session.process.poll() is not None:
@@ -495,18 +658,13 @@ class InputRouter:
         
         # Inject the input - NO FOCUS SWITCHING for keyboard!
         if event_type == 'keyboard':
-            vkey = event.get('vkey', 0)
             # Use PostMessage - sends directly to window without focus change
-            self.inject_keyboard_to_window(session.hwnd, vkey)
+            self.inject_keyboard_to_window(session.hwnd, vkey, scan, char_code)
             self.logger.debug(f"Posted key {vkey} to {user_id} (hwnd={session.hwnd})")
             
         elif event_type == 'mouse':
-            dx = event.get('dx', 0)
-            dy = event.get('dy', 0)
-            buttons = event.get('buttons', 0)
-            
-            # Inject movement
-            if dx != 0 or dy != 0:
+            # Inject movement, unless cursor events place the pointer
+            if (dx != 0 or dy != 0) and not session.cursor:
                 self.inject_mouse_move(dx, dy)
             
             # Inject button events
@@ -561,6 +719,10 @@ class InputRouter:
                     if line.strip():
                         try:
                             event = json.loads(line)
+                            if event.get('type') == 'heartbeat':
+                                # Keeps us connected to a service run with --pong-timeout-ms
+                                self.socket.sendall(b'pong\n')
+                                continue
                             self.route_event(event)
                         except json.JSONDecodeError as e:
                             self.logger.error(f"JSON parse error: {e}")
@@ -572,6 +734,62 @@ class InputRouter:
                     self.logger.error(f"Event loop error: {e}")
                 break
     
+    def _open_native_stream(self) -> bool:
+        """Use libinputstream when configured and loadable"""
+        service = self.config.get('raw_input_service', {})
+        lib_path = service.get('native_lib')
+        if not lib_path:
+            return False
+        
+        try:
+            native = NativeEventStream(lib_path)
+        except OSError as e:
+            self.logger.warning(f"libinputstream unavailable, using JSON stream: {e}")
+            return False
+        
+        host = service.get('host', '127.0.0.1')
+        port = service.get('port', 9999)
+        if not native.connect(host, port):
+            self.logger.error(f"libinputstream failed to connect to {host}:{port}")
+            return False
+        
+        self.native = native
+        with self.lock:
+            for device_id in self.device_mappings:
+                native.subscribe(device_id)
+            # Cursor events carry the user as their device_id
+            for user_id in self.config.get('users', {}):
+                native.subscribe(user_id)
+        self.logger.info(f"Connected to Raw Input Service at {host}:{port} via libinputstream")
+        return True
+    
+    def native_event_loop(self):
+        """Event loop over batches decoded by libinputstream"""
+        kind_names = {IS_KIND_KEYBOARD: 'keyboard', IS_KIND_MOUSE: 'mouse'}
+        
+        while self.running:
+            count = self.native.poll()
+            if count < 0:
+                break
+            
+            for ev in self.native.batch[:count]:
+                if ev.kind == IS_KIND_GAP:
+                    self.logger.warning(f"Lost events {ev.seq}..{ev.gap_to} while reconnecting")
+                    continue
+                if ev.flags & IS_FLAG_SYNTHETIC and not self.replays_macros():
+                    continue
+                if ev.kind == IS_KIND_HOTKEY:
+                    self.handle_hotkey(ev.device_id.decode(), ev.hotkey)
+                    continue
+                if ev.kind == IS_KIND_CURSOR:
+                    self.handle_cursor(ev.device_id.decode(), ev.abs_x, ev.abs_y)
+                    continue
+                self.route_input(ev.device_id.decode(), kind_names.get(ev.kind, ''),
+                                 ev.vkey, ev.dx, ev.dy, ev.buttons, ev.scan, ev.ch)
+        
+        self.native.close()
+        self.native = None
+    
     def run(self):
         """Main daemon run loop with reconnection"""
         self.running = True
@@ -579,6 +797,12 @@ class InputRouter:
         
         self.logger.info("Input Router Daemon starting...")
         
+        # libinputstream reconnects and resumes on its own
+        if self._open_native_stream():
+            self.native_event_loop()
+            self.logger.info("Input Router Daemon stopped")
+            return
+        
         while self.running:
             if self.connect_to_service():
                 self.event_loop()
@@ -0,0 +1,405 @@
+// async_io.cpp - Coroutine socket layer implementation
+#include "async_io.h"
+#include <chrono>
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// ---------------------------------------------------------------- FramePool
+
+void* FramePool::allocate(size_t size) {
+    size_t index = size ? (size - 1) / CLASS_SIZE : 0;
+    if (index < CLASS_COUNT) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (FreeFrame* frame = free_[index]) {
+            free_[index] = frame->next;
+            return frame;
+        }
+        size = (index + 1) * CLASS_SIZE;
+    }
+    heapAllocations_++;
+    return ::operator new(size);
+}
+
+void FramePool::deallocate(void* frame, size_t size) {
+    size_t index = size ? (size - 1) / CLASS_SIZE : 0;
+    if (index >= CLASS_COUNT) {
+        ::operator delete(frame);
+        return;
+    }
+    // Kept for the next session; the pool only grows to the peak session count
+    std::lock_guard<std::mutex> lock(mutex_);
+    FreeFrame* entry = static_cast<FreeFrame*>(frame);
+    entry->next = free_[index];
+    free_[index] = entry;
+}
+
+// ---------------------------------------------------------------- Timers
+
+static uint64_t steadyNowMs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t IoContext::clockNow() const {
+    return virtualClock_ ? virtualNow_ : steadyNowMs();
+}
+
+uint64_t IoContext::now() {
+    std::lock_guard<std::mutex> lock(timersMutex_);
+    return clockNow();
+}
+
+TimerHandle IoContext::addTimer(uint64_t delayMs, TimerWheel::Callback callback) {
+    TimerHandle handle;
+    {
+        std::lock_guard<std::mutex> lock(timersMutex_);
+        handle = timers_.scheduleAt(clockNow() + delayMs, std::move(callback));
+    }
+    // The loop itself recomputes its timeout before it waits again
+    if (std::this_thread::get_id() != runThread_) {
+        wake();
+    }
+    return handle;
+}
+
+bool IoContext::cancelTimer(TimerHandle& handle) {
+    std::lock_guard<std::mutex> lock(timersMutex_);
+    return timers_.cancel(handle);
+}
+
+void IoContext::useVirtualClock(uint64_t startMs) {
+    std::lock_guard<std::mutex> lock(timersMutex_);
+    virtualClock_ = true;
+    virtualNow_ = startMs;
+    timers_ = TimerWheel(startMs);
+}
+
+void IoContext::advanceClock(uint64_t ms) {
+    {
+        std::lock_guard<std::mutex> lock(timersMutex_);
+        virtualNow_ += ms;
+    }
+    wake();
+}
+
+int64_t IoContext::runTimers() {
+    std::vector<TimerWheel::Callback> due;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(timersMutex_);
+            timers_.advance(clockNow(), due);
+            if (due.empty()) {
+                // A virtual clock does not move while we wait
+                return virtualClock_ ? -1 : timers_.timeUntilNext();
+            }
+        }
+        for (TimerWheel::Callback& callback : due) {
+            callback();
+        }
+        due.clear();
+    }
+}
+
+#ifdef _WIN32
+// ---------------------------------------------------------------- IOCP
+
+constexpr ULONG_PTR IO_KEY_SOCKET = 1;
+constexpr ULONG_PTR IO_KEY_STOP = 2;
+constexpr ULONG_PTR IO_KEY_WAKE = 3;
+
+IoContext::IoContext() : timers_(steadyNowMs()), virtualClock_(false), virtualNow_(0), port_(nullptr) {}
+
+bool IoContext::open() {
+    if (port_) return true;
+    port_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+    if (!port_) {
+        LOG("Failed to create I/O completion port: " + std::to_string(GetLastError()));
+    }
+    return port_ != nullptr;
+}
+
+void IoContext::close() {
+    if (port_) {
+        CloseHandle(port_);
+        port_ = nullptr;
+    }
+}
+
+void IoContext::run() {
+    runThread_ = std::this_thread::get_id();
+    while (true) {
+        int64_t timeout = runTimers();
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED* overlapped = nullptr;
+        BOOL ok = GetQueuedCompletionStatus(port_, &bytes, &key, &overlapped, timeout < 0 ? INFINITE : (DWORD)timeout);
+        if (!overlapped) {
+            if (!ok && GetLastError() == WAIT_TIMEOUT) {
+                continue; // A timer is due
+            }
+            if (!ok || key == IO_KEY_STOP) {
+                break;
+            }
+            continue; // IO_KEY_WAKE
+        }
+
+        IoOperation* op = CONTAINING_RECORD(overlapped, IoOperation, overlapped);
+        DWORD error = ok ? 0 : GetLastError();
+        op->result.bytes = bytes;
+        op->result.error = error == ERROR_OPERATION_ABORTED ? IO_CANCELLED : (int)error;
+        op->waiter.resume();
+    }
+    runThread_ = std::thread::id();
+}
+
+void IoContext::stop() {
+    PostQueuedCompletionStatus(port_, 0, IO_KEY_STOP, nullptr);
+}
+
+void IoContext::wake() {
+    PostQueuedCompletionStatus(port_, 0, IO_KEY_WAKE, nullptr);
+}
+
+bool IoContext::associate(NativeSocket socket) {
+    if (CreateIoCompletionPort((HANDLE)socket, port_, IO_KEY_SOCKET, 0) != port_) {
+        LOG("Failed to associate socket with the completion port: " + std::to_string(GetLastError()));
+        return false;
+    }
+    return true;
+}
+
+// A socket stays bound to its completion port for its lifetime, and a
+// duplicate in another process shares that binding. Windows 8.1+ can
+// remove it (FileReplaceCompletionInformation with a null port), which
+// lets a hand-off target bind the socket to its own port.
+void IoContext::release(NativeSocket socket) {
+    struct IoStatusBlock {
+        union {
+            LONG status;
+            void* pointer;
+        };
+        ULONG_PTR information;
+    };
+    struct FileCompletionInformation {
+        HANDLE port;
+        void* key;
+    };
+    constexpr int FILE_REPLACE_COMPLETION_INFORMATION = 61;
+    using SetInformationFile = LONG(WINAPI*)(HANDLE, IoStatusBlock*, void*, ULONG, int);
+
+    static SetInformationFile setInformation = reinterpret_cast<SetInformationFile>(
+        GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "NtSetInformationFile"));
+    if (!setInformation) return;
+
+    IoStatusBlock status = {};
+    FileCompletionInformation info = { nullptr, nullptr };
+    LONG result = setInformation((HANDLE)socket, &status, &info, sizeof(info), FILE_REPLACE_COMPLETION_INFORMATION);
+    if (result < 0) {
+        LOG("Failed to detach socket from the completion port: " + std::to_string(result));
+    }
+}
+
+void IoContext::cancel(NativeSocket socket) {
+    CancelIoEx((HANDLE)socket, nullptr);
+}
+
+bool IoContext::begin(IoOperation& op, std::coroutine_handle<> waiter) {
+    op.waiter = waiter;
+    WSABUF buffer = { (ULONG)op.size, op.data };
+    int rc;
+    if (op.write) {
+        rc = WSASend(op.socket, &buffer, 1, nullptr, 0, &op.overlapped, nullptr);
+    } else {
+        DWORD flags = 0;
+        rc = WSARecv(op.socket, &buffer, 1, nullptr, &flags, &op.overlapped, nullptr);
+    }
+    if (rc == SOCKET_ERROR) {
+        int error = WSAGetLastError();
+        if (error != WSA_IO_PENDING) {
+            op.result = { 0, error };
+            return false;
+        }
+    }
+    // The completion packet resumes the waiter, also when the operation
+    // finished at once. op may already be gone here.
+    return true;
+}
+
+#else
+// ---------------------------------------------------------------- epoll
+
+// Runs the operation once; false if the socket is not ready for it
+static bool attempt(IoOperation& op) {
+    while (true) {
+        ssize_t n = op.write ? ::send(op.socket, op.data, op.size, MSG_NOSIGNAL) : ::recv(op.socket, op.data, op.size, 0);
+        if (n >= 0) {
+            op.result = { (size_t)n, 0 };
+            return true;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+        op.result = { 0, errno };
+        return true;
+    }
+}
+
+IoContext::IoContext()
+    : timers_(steadyNowMs()), virtualClock_(false), virtualNow_(0), epoll_(-1), wakeup_(-1), stopRequested_(false) {}
+
+bool IoContext::open() {
+    if (epoll_ >= 0) return true;
+    epoll_ = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wakeup_;
+    if (epoll_ < 0 || wakeup_ < 0 || epoll_ctl(epoll_, EPOLL_CTL_ADD, wakeup_, &event) != 0) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void IoContext::close() {
+    if (wakeup_ >= 0) ::close(wakeup_);
+    if (epoll_ >= 0) ::close(epoll_);
+    wakeup_ = epoll_ = -1;
+}
+
+void IoContext::rearm(int socket, const Watch& watch) {
+    // One-shot, so a socket nobody waits on cannot spin the loop
+    epoll_event event = {};
+    event.events = EPOLLONESHOT | (watch.read ? (uint32_t)EPOLLIN : 0u) | (watch.write ? (uint32_t)EPOLLOUT : 0u);
+    event.data.fd = socket;
+    epoll_ctl(epoll_, EPOLL_CTL_MOD, socket, &event);
+}
+
+void IoContext::run() {
+    epoll_event events[64];
+    std::vector<IoOperation*> ready;
+    runThread_ = std::this_thread::get_id();
+
+    while (true) {
+        int64_t timeout = runTimers();
+        int count = epoll_wait(epoll_, events, 64, (int)timeout);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        bool stopping;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (int i = 0; i < count; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == wakeup_) {
+                    uint64_t value;
+                    while (::read(wakeup_, &value, sizeof(value)) > 0) {}
+                    continue;
+                }
+                auto it = watches_.find(fd);
+                if (it == watches_.end()) continue;
+                Watch& watch = it->second;
+                uint32_t flags = events[i].events;
+                if (watch.read && (flags & (EPOLLIN | EPOLLERR | EPOLLHUP)) && attempt(*watch.read)) {
+                    ready.push_back(watch.read);
+                    watch.read = nullptr;
+                }
+                if (watch.write && (flags & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && attempt(*watch.write)) {
+                    ready.push_back(watch.write);
+                    watch.write = nullptr;
+                }
+                if (watch.read || watch.write) {
+                    rearm(fd, watch);
+                }
+            }
+
+            for (int fd : cancelled_) {
+                auto it = watches_.find(fd);
+                if (it == watches_.end()) continue;
+                for (IoOperation** op : { &it->second.read, &it->second.write }) {
+                    if (*op) {
+                        (*op)->result = { 0, IO_CANCELLED };
+                        ready.push_back(*op);
+                        *op = nullptr;
+                    }
+                }
+            }
+            cancelled_.clear();
+            stopping = stopRequested_;
+            stopRequested_ = false;
+        }
+
+        // Resumed outside the lock; sessions start their next operation
+        for (IoOperation* op : ready) {
+            op->waiter.resume();
+        }
+        ready.clear();
+        if (stopping) break;
+    }
+    runThread_ = std::thread::id();
+}
+
+void IoContext::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopRequested_ = true;
+    }
+    wake();
+}
+
+void IoContext::wake() {
+    uint64_t one = 1;
+    (void)!::write(wakeup_, &one, sizeof(one));
+}
+
+bool IoContext::associate(NativeSocket socket) {
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+    epoll_event event = {};
+    event.events = EPOLLONESHOT;
+    event.data.fd = socket;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, socket, &event) != 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    watches_[socket] = Watch();
+    return true;
+}
+
+void IoContext::release(NativeSocket socket) {
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, socket, nullptr);
+    std::lock_guard<std::mutex> lock(mutex_);
+    watches_.erase(socket);
+}
+
+void IoContext::cancel(NativeSocket socket) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cancelled_.push_back(socket);
+    }
+    wake();
+}
+
+bool IoContext::begin(IoOperation& op, std::coroutine_handle<> waiter) {
+    op.waiter = waiter;
+    // A ready socket needs no trip through epoll
+    if (attempt(op)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = watches_.find(op.socket);
+    if (it == watches_.end()) {
+        op.result = { 0, EBADF };
+        return false;
+    }
+    (op.write ? it->second.write : it->second.read) = &op;
+    rearm(op.socket, it->second);
+    return true;
+}
+#endif
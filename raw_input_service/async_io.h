@@ -0,0 +1,223 @@
+// async_io.h - Coroutine socket layer (IOCP on Windows, epoll on Linux)
+//
+// A session is a coroutine returning Session that awaits socket reads and
+// writes on an IoContext:
+//
+//     Session echo(IoContext& io, NativeSocket s) {
+//         char buffer[256];
+//         IoResult r = co_await io.recv(s, buffer, sizeof(buffer));
+//         ...
+//     }
+//
+// One thread calls IoContext::run() and resumes sessions as their I/O
+// completes, so sessions on one context never run concurrently with each
+// other. A session starts running on the thread that calls it and moves to
+// the I/O thread at its first co_await.
+//
+// Coroutine frames come from FramePool, which keeps freed frames on
+// per-size free lists instead of returning them to the heap.
+//
+// Timers (TimerWheel) fire on the I/O thread; the loop sleeps until the
+// next one is due. With useVirtualClock() they only see the time passed to
+// advanceClock(), so timer-driven code can be stepped deterministically.
+#pragma once
+#ifdef _WIN32
+#include "common.h"
+#endif
+#include "timer_wheel.h"
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+using NativeSocket = SOCKET;
+#else
+using NativeSocket = int;
+#endif
+
+// ---------------------------------------------------------------- Frame allocator
+
+class FramePool {
+public:
+    static FramePool& instance() {
+        static FramePool inst;
+        return inst;
+    }
+
+    void* allocate(size_t size);
+    void deallocate(void* frame, size_t size);
+
+    size_t heapAllocations() const { return heapAllocations_; }   // Frames not served from a free list
+
+private:
+    FramePool() = default;
+
+    static constexpr size_t CLASS_SIZE = 512;     // Frames are rounded up to this
+    static constexpr size_t CLASS_COUNT = 16;     // Pooled up to 8 KB; bigger frames use the heap
+
+    struct FreeFrame {
+        FreeFrame* next;
+    };
+
+    std::mutex mutex_;
+    FreeFrame* free_[CLASS_COUNT] = {};           // Guarded by mutex_
+    std::atomic<size_t> heapAllocations_{ 0 };
+};
+
+// ---------------------------------------------------------------- Session
+
+// Return type of a fire-and-forget coroutine. It starts right away and its
+// frame goes back to FramePool when it finishes.
+class Session {
+public:
+    struct promise_type {
+        Session get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        // Nobody is left to rethrow to; a throwing session is a bug
+        void unhandled_exception() { std::terminate(); }
+
+        static void* operator new(size_t size) { return FramePool::instance().allocate(size); }
+        static void operator delete(void* frame, size_t size) { FramePool::instance().deallocate(frame, size); }
+    };
+};
+
+// ---------------------------------------------------------------- I/O
+
+constexpr int IO_CANCELLED = -1;     // IoResult::error after IoContext::cancel
+
+struct IoResult {
+    size_t bytes;
+    int error;                          // 0, IO_CANCELLED or the socket error code
+
+    bool ok() const { return error == 0; }
+};
+
+// One read or write in flight
+struct IoOperation {
+#ifdef _WIN32
+    OVERLAPPED overlapped;              // Completions map back with CONTAINING_RECORD
+#endif
+    std::coroutine_handle<> waiter;
+    NativeSocket socket;
+    char* data;
+    size_t size;
+    bool write;
+    IoResult result;
+};
+
+class IoContext {
+public:
+    IoContext();
+    ~IoContext() { close(); }
+
+    IoContext(const IoContext&) = delete;
+    IoContext& operator=(const IoContext&) = delete;
+
+    bool open();
+    void close();
+
+    // Resumes sessions until stop(); call from one thread
+    void run();
+    // Makes run() return once; thread-safe
+    void stop();
+
+    // A socket must be associated before sessions await it, and released
+    // before it is closed or handed to another process
+    bool associate(NativeSocket socket);
+    void release(NativeSocket socket);
+    // Completes the reads and writes pending on a socket with IO_CANCELLED;
+    // thread-safe. The socket stays open.
+    void cancel(NativeSocket socket);
+
+    // One-shot timer; thread-safe, the callback runs on the I/O thread
+    TimerHandle addTimer(uint64_t delayMs, TimerWheel::Callback callback);
+    bool cancelTimer(TimerHandle& handle);
+
+    // Call before adding timers. From then on the clock only moves by
+    // advanceClock(); timers due by then fire on the I/O thread.
+    void useVirtualClock(uint64_t startMs = 0);
+    void advanceClock(uint64_t ms);
+    uint64_t now();
+
+    class Awaiter {
+    public:
+        Awaiter(IoContext& io, NativeSocket socket, char* data, size_t size, bool write)
+            : io_(io), op_{} {
+            op_.socket = socket;
+            op_.data = data;
+            op_.size = size;
+            op_.write = write;
+        }
+
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> waiter) { return io_.begin(op_, waiter); }
+        IoResult await_resume() const { return op_.result; }
+
+    private:
+        IoContext& io_;
+        IoOperation op_;
+    };
+
+    class SleepAwaiter {
+    public:
+        SleepAwaiter(IoContext& io, uint64_t ms) : io_(io), ms_(ms) {}
+
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> waiter) { io_.addTimer(ms_, [waiter] { waiter.resume(); }); }
+        void await_resume() const {}
+
+    private:
+        IoContext& io_;
+        uint64_t ms_;
+    };
+
+    // At most one recv and one send per socket may be pending
+    Awaiter recv(NativeSocket socket, char* data, size_t size) { return Awaiter(*this, socket, data, size, false); }
+    Awaiter send(NativeSocket socket, const char* data, size_t size) {
+        return Awaiter(*this, socket, const_cast<char*>(data), size, true);
+    }
+    // Not woken by cancel()
+    SleepAwaiter sleep(uint64_t ms) { return SleepAwaiter(*this, ms); }
+
+private:
+    // Starts the operation; false if it finished at once and the waiter
+    // should continue without suspending
+    bool begin(IoOperation& op, std::coroutine_handle<> waiter);
+
+    // Fires due timers; returns ms until the next one, or -1 to wait for I/O only
+    int64_t runTimers();
+    uint64_t clockNow() const;          // Caller holds timersMutex_
+    void wake();                        // Makes the loop recompute its timeout
+
+    std::mutex timersMutex_;
+    TimerWheel timers_;                 // Guarded by timersMutex_
+    bool virtualClock_;                 // Guarded by timersMutex_
+    uint64_t virtualNow_;               // Guarded by timersMutex_
+    std::atomic<std::thread::id> runThread_;
+
+#ifdef _WIN32
+    HANDLE port_;
+#else
+    struct Watch {
+        IoOperation* read = nullptr;
+        IoOperation* write = nullptr;
+    };
+
+    void rearm(int socket, const Watch& watch);
+
+    int epoll_;
+    int wakeup_;                        // eventfd for stop(), cancel() and wake()
+    std::mutex mutex_;
+    std::unordered_map<int, Watch> watches_;      // Guarded by mutex_
+    std::vector<int> cancelled_;                  // Guarded by mutex_
+    bool stopRequested_;                          // Guarded by mutex_
+#endif
+};
@@ -0,0 +1,80 @@
+// bench.h - Shared helpers for the benchmarks in this directory
+//
+// Each benchmark is a small executable that prints one line per measured
+// case. Times are the best of several runs, which is the least disturbed
+// by other work on the machine. Build with -DBUILD_BENCHMARKS=ON and a
+// Release configuration.
+#pragma once
+#include "event_types.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+constexpr int BENCH_RUNS = 15;
+
+// Best wall time of runs calls to body, in nanoseconds
+template <typename Body>
+double bestOfNs(int runs, Body&& body) {
+    double best = 1e300;
+    for (int run = 0; run < runs; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count());
+    }
+    return best;
+}
+
+// Keeps the compiler from dropping a result nobody reads
+template <typename T>
+inline void keep(const T& value) {
+#if defined(__GNUC__)
+    asm volatile("" : : "g"(&value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+inline const char* simdBuild() {
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE4_1__)
+    return "sse4.1";
+#elif defined(__SSE2__) || defined(_M_X64)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+// A capture-like mix: three mouse reports to one key event, from a few devices
+inline std::vector<InputEvent> mixedEvents(size_t count, uint32_t seed = 1) {
+    static const char* const ids[] = { "0x1A2B3C", "0x4D5E6F", "0x10F0042", "0x7A8B9C" };
+    std::mt19937 random(seed);
+    std::vector<InputEvent> events(count);
+    for (size_t i = 0; i < count; ++i) {
+        InputEvent& event = events[i];
+        event = {};
+        const char* id = ids[random() % 4];
+        setDeviceId(event, id, std::strlen(id));
+        if (i % 4 == 3) {
+            event.type = DeviceType::Keyboard;
+            event.data.keyboard.vkey = 0x41 + (int)(random() % 26);
+            event.data.keyboard.scan = (uint16_t)(0x10 + random() % 40);
+            event.data.keyboard.ch = (uint16_t)('a' + random() % 26);
+            event.data.keyboard.mods = (uint16_t)(random() % 4 == 0 ? KEY_MOD_SHIFT : 0);
+        } else {
+            event.type = DeviceType::Mouse;
+            event.data.mouse.dx = (int)(random() % 41) - 20;
+            event.data.mouse.dy = (int)(random() % 41) - 20;
+            event.data.mouse.buttons = random() % 16 == 0 ? 1 : 0;
+        }
+        event.timestamp = 1700000000000ull + i / 8;
+        event.seq = i + 1;
+    }
+    return events;
+}
@@ -0,0 +1,64 @@
+// encode_bench.cpp - Bytes and time per event for each stream format
+//
+// Encodes 100k mixed events the way the sender does for one batch: json,
+// binary and cbor through appendEvent, compact through one CompactEncoder.
+// Each output is decoded again with the SDK and must give back the same
+// events; the run fails otherwise.
+#include "bench.h"
+#include "compact_codec.h"
+#include "event_schema.h"
+#include "input_client.h"
+#include <string>
+
+constexpr size_t EVENTS = 100000;
+
+static void encodeAll(StreamFormat format, const std::vector<InputEvent>& events, std::string& out) {
+    out.clear();
+    if (format == StreamFormat::Compact) {
+        CompactEncoder encoder;
+        for (const InputEvent& event : events) encoder.encode(event, out);
+    } else {
+        for (const InputEvent& event : events) appendEvent(format, event, out);
+    }
+}
+
+// Number of events that decode back to the sequence numbers they were sent
+// with, after the format record a client sees when it switches
+static size_t roundTrip(StreamFormat format, const std::string& stream) {
+    std::string switched;
+    ControlRecord record = { "format", { { "format", 0, STREAM_FORMAT_NAMES[(int)format] } }, 1 };
+    appendControl(StreamFormat::Json, record, switched);
+
+    StreamDecoder decoder;
+    size_t matched = 0;
+    auto onEvent = [&](const EventView& view) {
+        if (view.kind != EventKind::Format && view.seq == matched + 1) matched++;
+    };
+    decoder.decode(switched.data(), switched.size(), onEvent);
+    decoder.decode(stream.data(), stream.size(), onEvent);
+    return matched;
+}
+
+int main() {
+    std::vector<InputEvent> events = mixedEvents(EVENTS);
+    std::string out;
+    out.reserve(EVENTS * MAX_ENCODED_EVENT);
+
+    std::printf("%zu events, %s build\n", EVENTS, simdBuild());
+    bool ok = true;
+    for (int f = 0; f <= (int)StreamFormat::Compact; ++f) {
+        StreamFormat format = (StreamFormat)f;
+        double ns = bestOfNs(BENCH_RUNS, [&] {
+            encodeAll(format, events, out);
+            keep(out);
+        });
+        size_t decoded = roundTrip(format, out);
+        std::printf("  %-8s %5.1f bytes/event  %5.1f ns/event\n", STREAM_FORMAT_NAMES[f], (double)out.size() / EVENTS,
+                    ns / EVENTS);
+        if (decoded != EVENTS) {
+            std::printf("MISMATCH: %zu of %zu %s events decoded\n", decoded, EVENTS, STREAM_FORMAT_NAMES[f]);
+            ok = false;
+        }
+    }
+    return ok ? 0 : 1;
+}
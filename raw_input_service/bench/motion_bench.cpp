@@ -0,0 +1,104 @@
+// motion_bench.cpp - Motion scaling: the kernel and RemapStage
+//
+// The kernel alone on 4096-delta arrays, scalar reference against
+// scaleMotion(), in ns per delta. Then RemapStage scaling 8 mice at 8 kHz,
+// one second of 1 ms batches of 64 motion events, with the devices
+// interleaved event by event and in runs of 8; the copy that restores each
+// batch is measured apart and taken off. Build once without and once with
+// -mavx2 to compare the scalar and vector paths.
+#include "bench.h"
+#include "remap.h"
+#include <cstring>
+
+constexpr size_t DELTAS = 4096;
+constexpr int KERNEL_PASSES = 2000;
+constexpr size_t DEVICES = 8;
+constexpr size_t BATCH = 64;            // 8 devices x 8 kHz, in 1 ms
+constexpr size_t BATCHES = 1000;
+
+static std::vector<InputEvent> motionBatches(size_t run, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::vector<InputEvent> events(BATCH * BATCHES);
+    for (size_t i = 0; i < events.size(); ++i) {
+        InputEvent& event = events[i];
+        event = {};
+        char id[16];
+        std::snprintf(id, sizeof(id), "0x1A2B%02zu", (i / run) % DEVICES);
+        setDeviceId(event, id, std::strlen(id));
+        event.type = DeviceType::Mouse;
+        event.data.mouse.dx = (int)(random() % 41) - 20;
+        event.data.mouse.dy = (int)(random() % 41) - 20;
+        event.timestamp = 1700000000000ull + i / BATCH;
+        event.seq = i + 1;
+    }
+    return events;
+}
+
+// ns per event for one second of batches, with restoring each batch taken off
+static double stageNs(const RemapSource& source, const std::vector<InputEvent>& events, size_t& kept) {
+    RemapStage stage(&source);
+    InputEvent batch[BATCH];
+    double copyNs = bestOfNs(BENCH_RUNS, [&] {
+        for (size_t b = 0; b < BATCHES; ++b) {
+            std::memcpy(batch, &events[b * BATCH], sizeof(batch));
+            keep(batch);
+        }
+    });
+    double ns = bestOfNs(BENCH_RUNS, [&] {
+        kept = 0;
+        for (size_t b = 0; b < BATCHES; ++b) {
+            std::memcpy(batch, &events[b * BATCH], sizeof(batch));
+            kept += stage.process(batch, BATCH);
+            keep(batch);
+        }
+    });
+    return std::max(ns - copyNs, 0.0) / events.size();
+}
+
+int main() {
+    std::mt19937 random(7);
+    std::vector<int32_t> deltas(DELTAS);
+    for (int32_t& delta : deltas) delta = (int32_t)(random() % 21) - 10;
+    std::vector<int32_t> work = deltas;
+    int32_t carry = MOTION_SCALE_ONE / 2;
+    double scalarNs = bestOfNs(BENCH_RUNS, [&] {
+        for (int pass = 0; pass < KERNEL_PASSES; ++pass) {
+            std::memcpy(work.data(), deltas.data(), DELTAS * sizeof(int32_t));
+            scaleMotionScalar(work.data(), DELTAS, 98304, carry);
+            keep(work);
+        }
+    });
+    double kernelNs = bestOfNs(BENCH_RUNS, [&] {
+        for (int pass = 0; pass < KERNEL_PASSES; ++pass) {
+            std::memcpy(work.data(), deltas.data(), DELTAS * sizeof(int32_t));
+            scaleMotion(work.data(), DELTAS, 98304, carry);
+            keep(work);
+        }
+    });
+
+    auto path = std::filesystem::temp_directory_path() / "motion_bench_remap.txt";
+    {
+        std::ofstream file(path);
+        file << "* scale 1.5\n";
+    }
+    RemapSource source;
+    std::string error;
+    bool loaded = source.load(path.string(), error);
+    std::filesystem::remove(path);
+    if (!loaded) {
+        std::printf("remap file: %s\n", error.c_str());
+        return 1;
+    }
+    size_t interleavedKept = 0;
+    size_t runsKept = 0;
+    double interleavedNs = stageNs(source, motionBatches(1, 11), interleavedKept);
+    double runsNs = stageNs(source, motionBatches(8, 11), runsKept);
+
+    std::printf("%s build\n", simdBuild());
+    std::printf("  kernel, %zu deltas   scalar %.2f ns/delta  scaleMotion %.2f ns/delta\n", DELTAS,
+                scalarNs / (KERNEL_PASSES * DELTAS), kernelNs / (KERNEL_PASSES * DELTAS));
+    std::printf("  RemapStage, %zu mice at 8 kHz  interleaved %.1f ns/event  runs of 8 %.1f ns/event\n", DEVICES,
+                interleavedNs, runsNs);
+    keep(carry);
+    return interleavedKept > 0 && runsKept > 0 ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+// ndjson_bench.cpp - NDJSON stream decoding throughput (input_client.h)
+//
+// Decodes 200k mixed records as the service writes them, two ways:
+//   naive   std::string::find('\n') per line, then the general parseEventJson
+//   decoder decodeNdjson: SIMD newline scan and the fixed-order fast path
+// Both must decode every field the same; the run fails otherwise.
+#include "bench.h"
+#include "event_schema.h"
+#include "input_client.h"
+#include <string>
+
+constexpr size_t RECORDS = 200000;
+
+// Folds the fields of a decoded record into a checksum
+static uint64_t fold(uint64_t sum, const EventView& view) {
+    uint64_t fields[] = { (uint64_t)view.kind, view.device_id.size(), (uint64_t)view.vkey, (uint64_t)view.scan,
+                          (uint64_t)view.ch, (uint64_t)view.mods, (uint64_t)view.dx, (uint64_t)view.dy,
+                          (uint64_t)view.buttons, view.timestamp, view.seq };
+    for (uint64_t field : fields) {
+        sum = (sum ^ field) * 1099511628211ull;
+    }
+    return sum;
+}
+
+int main() {
+    std::string stream;
+    char record[MAX_ENCODED_EVENT + 1];
+    for (const InputEvent& event : mixedEvents(RECORDS)) {
+        size_t n = encodeEventJson(event, record);
+        record[n++] = '\n';
+        stream.append(record, n);
+    }
+
+    uint64_t naiveSum = 0;
+    size_t naiveCount = 0;
+    double naiveNs = bestOfNs(BENCH_RUNS, [&] {
+        naiveSum = 0;
+        naiveCount = 0;
+        EventView view;
+        size_t start = 0;
+        size_t nl;
+        while ((nl = stream.find('\n', start)) != std::string::npos) {
+            if (parseEventJson(std::string_view(stream).substr(start, nl - start), view)) {
+                naiveSum = fold(naiveSum, view);
+                naiveCount++;
+            }
+            start = nl + 1;
+        }
+    });
+
+    uint64_t fastSum = 0;
+    size_t fastCount = 0;
+    double fastNs = bestOfNs(BENCH_RUNS, [&] {
+        fastSum = 0;
+        fastCount = 0;
+        decodeNdjson(stream.data(), stream.size(), [&](const EventView& view) {
+            fastSum = fold(fastSum, view);
+            fastCount++;
+        });
+    });
+
+    double bytes = (double)stream.size();
+    std::printf("%zu records, %.1f bytes each, %s build\n", RECORDS, bytes / RECORDS, simdBuild());
+    std::printf("  naive split + general parser  %.2f GB/s  %.1f ns/record\n", bytes / naiveNs, naiveNs / RECORDS);
+    std::printf("  decodeNdjson                  %.2f GB/s  %.1f ns/record\n", bytes / fastNs, fastNs / RECORDS);
+    if (naiveCount != RECORDS || fastCount != RECORDS || naiveSum != fastSum) {
+        std::printf("MISMATCH: %zu and %zu records decoded, checksums %llx and %llx\n", naiveCount, fastCount,
+                    (unsigned long long)naiveSum, (unsigned long long)fastSum);
+        return 1;
+    }
+    return 0;
+}
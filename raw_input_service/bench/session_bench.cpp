@@ -0,0 +1,167 @@
+// session_bench.cpp - Coroutine sessions against a thread per client
+//
+// Serves 1000 loopback connections that each send 50 "hello" commands and
+// read every reply, two ways:
+//   threads     one blocking thread per client, as before async_io.h
+//   coroutines  one Session per client on an IoContext (epoll backend)
+// Prints requests per second and the server's resident memory growth per
+// session. Each case runs in a forked process, so memory is measured from
+// the same start. Linux only.
+#include "bench.h"
+#include "async_io.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <thread>
+
+constexpr int SESSIONS = 1000;
+constexpr int ROUNDS = 50;
+static const char REPLY[] = "{\"type\":\"hello\",\"protocol\":1,\"seq\":123456}\n";
+constexpr size_t REPLY_SIZE = sizeof(REPLY) - 1;
+
+static std::atomic<int> liveSessions{ 0 };
+
+// Answers each command line with REPLY
+static Session serveCoroutine(IoContext& io, NativeSocket socket) {
+    char buffer[4096];
+    std::string pending;
+    liveSessions++;
+    while (true) {
+        IoResult read = co_await io.recv(socket, buffer, sizeof(buffer));
+        if (!read.ok() || read.bytes == 0) break;
+        pending.append(buffer, read.bytes);
+        size_t newline;
+        bool sent = true;
+        while (sent && (newline = pending.find('\n')) != std::string::npos) {
+            pending.erase(0, newline + 1);
+            sent = (co_await io.send(socket, REPLY, REPLY_SIZE)).ok();
+        }
+        if (!sent) break;
+    }
+    io.release(socket);
+    close(socket);
+    liveSessions--;
+}
+
+static void serveThread(int socket) {
+    char buffer[4096];
+    std::string pending;
+    ssize_t n;
+    while ((n = recv(socket, buffer, sizeof(buffer), 0)) > 0) {
+        pending.append(buffer, (size_t)n);
+        size_t newline;
+        while ((newline = pending.find('\n')) != std::string::npos) {
+            pending.erase(0, newline + 1);
+            send(socket, REPLY, REPLY_SIZE, MSG_NOSIGNAL);
+        }
+    }
+    close(socket);
+}
+
+static long residentKb() {
+    long kb = 0;
+    if (FILE* status = std::fopen("/proc/self/status", "r")) {
+        char line[256];
+        while (std::fgets(line, sizeof(line), status)) {
+            if (std::strncmp(line, "VmRSS:", 6) == 0) kb = std::atol(line + 6);
+        }
+        std::fclose(status);
+    }
+    return kb;
+}
+
+static int runCase(bool coroutines) {
+    rlimit files = { 4096, 4096 };
+    setrlimit(RLIMIT_NOFILE, &files);
+    int one = 1;
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLength = sizeof(address);
+    if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 4096) != 0 ||
+        getsockname(listener, (sockaddr*)&address, &addressLength) != 0) {
+        std::perror("listen");
+        return 1;
+    }
+
+    long before = residentKb();
+    IoContext io;
+    std::thread ioThread;
+    std::vector<std::thread> threads;
+    std::vector<int> clients;
+    if (coroutines && !io.open()) return 1;
+    for (int i = 0; i < SESSIONS; ++i) {
+        int client = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(client, (sockaddr*)&address, sizeof(address)) != 0) {
+            std::perror("connect");
+            return 1;
+        }
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        clients.push_back(client);
+        int served = accept(listener, nullptr, nullptr);
+        setsockopt(served, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (coroutines) {
+            io.associate(served);
+            serveCoroutine(io, served);
+        } else {
+            threads.emplace_back(serveThread, served);
+        }
+    }
+    if (coroutines) ioThread = std::thread([&io] { io.run(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    long grown = residentKb() - before;
+
+    char buffer[256];
+    double ns = bestOfNs(1, [&] {
+        for (int round = 0; round < ROUNDS; ++round) {
+            for (int client : clients) send(client, "hello\n", 6, 0);
+            for (int client : clients) {
+                size_t got = 0;
+                while (got < REPLY_SIZE) {
+                    ssize_t n = recv(client, buffer, sizeof(buffer), 0);
+                    if (n <= 0) std::exit(1);
+                    got += (size_t)n;
+                }
+            }
+        }
+    });
+    std::printf("  %-10s  %5.1f k req/s  server RSS +%.1f MB (%.1f KB/session)\n",
+                coroutines ? "coroutines" : "threads", SESSIONS * ROUNDS / ns * 1e6, grown / 1024.0,
+                (double)grown / SESSIONS);
+
+    for (int client : clients) close(client);
+    if (coroutines) {
+        while (liveSessions > 0) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        io.stop();
+        ioThread.join();
+        std::printf("  %zu coroutine frames came from the heap\n", FramePool::instance().heapAllocations());
+    }
+    for (std::thread& thread : threads) thread.join();
+    close(listener);
+    return 0;
+}
+
+int main() {
+    std::printf("%d sessions, %d round trips each, loopback\n", SESSIONS, ROUNDS);
+    bool ok = true;
+    for (bool coroutines : { false, true }) {
+        std::fflush(stdout);
+        pid_t child = fork();
+        if (child == 0) {
+            int result = runCase(coroutines);
+            std::fflush(stdout);
+            _exit(result);
+        }
+        int status = 0;
+        ok = waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0 && ok;
+    }
+    return ok ? 0 : 1;
+}
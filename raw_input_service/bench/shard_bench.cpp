@@ -0,0 +1,116 @@
+// shard_bench.cpp - ShardedPipeline throughput by worker count
+//
+// Synthetic sources: 8 devices, interleaved event by event, in 256-event
+// capture batches. Each batch goes through a RuntimePipeline on the calling
+// thread ("inline", as without --workers), then through ShardedPipeline
+// with 1, 2, 4 and 8 workers, until drain() returns. Two per-event costs:
+// none, which leaves only the split, queueing and merge, and a
+// 200-iteration LCG standing in for heavy stages. Prints millions of events
+// per second and the busiest worker's share, which caps the speedup a
+// worker count can give with these devices. Speedups need as many cores as
+// workers; the first line gives the machine's.
+#include "bench.h"
+#include "sharded_pipeline.h"
+#include <cstring>
+
+constexpr size_t DEVICES = 8;
+constexpr size_t BATCH = 256;
+constexpr size_t BATCHES = 4096;        // 1M events per run
+constexpr int SHARD_RUNS = 5;
+constexpr size_t WORKER_COUNTS[] = { 1, 2, 4, 8 };
+
+static std::vector<InputEvent> sourceEvents(uint32_t seed) {
+    std::mt19937 random(seed);
+    std::vector<InputEvent> events(BATCH * BATCHES);
+    for (size_t i = 0; i < events.size(); ++i) {
+        InputEvent& event = events[i];
+        event = {};
+        char id[16];
+        std::snprintf(id, sizeof(id), "0x1A2B%02zu", i % DEVICES);
+        setDeviceId(event, id, std::strlen(id));
+        event.type = DeviceType::Mouse;
+        event.data.mouse.dx = (int)(random() % 41) - 20;
+        event.data.mouse.dy = (int)(random() % 41) - 20;
+        event.timestamp = 1700000000000ull + i / BATCH;
+        event.seq = i + 1;
+    }
+    return events;
+}
+
+// Per-event work of a stage: iterations of an LCG seeded by the event
+struct Spin {
+    int iterations;
+    void operator()(InputEvent& event) const {
+        uint32_t state = (uint32_t)event.seq;
+        for (int i = 0; i < iterations; ++i) state = state * 1664525u + 1013904223u;
+        event.data.mouse.buttons = (int)(state >> 31);
+    }
+};
+
+static void addStages(RuntimePipeline& pipeline, int iterations) {
+    pipeline.add(TransformStage<Spin>(Spin{ iterations }));
+}
+
+// Million events per second through the pipeline on the calling thread
+static double inlineMeps(const std::vector<InputEvent>& events, int iterations, size_t& out) {
+    RuntimePipeline pipeline;
+    addStages(pipeline, iterations);
+    std::vector<InputEvent> batch(BATCH);
+    double ns = bestOfNs(SHARD_RUNS, [&] {
+        out = 0;
+        for (size_t b = 0; b < BATCHES; ++b) {
+            std::memcpy(batch.data(), &events[b * BATCH], BATCH * sizeof(InputEvent));
+            out += pipeline.process(batch.data(), BATCH);
+            keep(batch);
+        }
+    });
+    return events.size() * 1e3 / ns;
+}
+
+// The same through workers, from the first submit until drain() returns
+static double shardedMeps(const std::vector<InputEvent>& events, int iterations, size_t workers, size_t& out) {
+    ShardedPipeline<RuntimePipeline> shards(
+        workers, [iterations](RuntimePipeline& pipeline) { addStages(pipeline, iterations); },
+        [&out](EventSpan span) { out += span.size; });
+    double ns = bestOfNs(SHARD_RUNS, [&] {
+        out = 0;
+        for (size_t b = 0; b < BATCHES; ++b) {
+            shards.submit(&events[b * BATCH], BATCH);
+        }
+        shards.drain();
+    });
+    return events.size() * 1e3 / ns;
+}
+
+// Share of the events that the busiest of workers gets
+static double busiestShare(size_t workers) {
+    std::vector<size_t> perWorker(workers);
+    for (size_t d = 0; d < DEVICES; ++d) {
+        char id[16];
+        std::snprintf(id, sizeof(id), "0x1A2B%02zu", d);
+        perWorker[hashDeviceId(id) % workers]++;
+    }
+    return (double)*std::max_element(perWorker.begin(), perWorker.end()) / DEVICES;
+}
+
+int main() {
+    std::vector<InputEvent> events = sourceEvents(3);
+    bool complete = true;
+
+    std::printf("%u hardware threads, %zu devices, %zu-event batches\n", std::thread::hardware_concurrency(),
+                DEVICES, BATCH);
+    for (int iterations : { 0, 200 }) {
+        std::printf("  %d LCG iterations per event\n", iterations);
+        size_t out = 0;
+        double meps = inlineMeps(events, iterations, out);
+        complete = complete && out == events.size();
+        std::printf("    inline     %6.2f M events/s\n", meps);
+        for (size_t workers : WORKER_COUNTS) {
+            meps = shardedMeps(events, iterations, workers, out);
+            complete = complete && out == events.size();
+            std::printf("    workers=%zu  %6.2f M events/s  busiest worker %3.0f%%\n", workers, meps,
+                        busiestShare(workers) * 100);
+        }
+    }
+    return complete ? 0 : 1;
+}
@@ -19,11 +19,11 @@ if not exist "build" mkdir build
 
 echo.
 echo Compiling console version...
-cl /EHsc /std:c++17 /O2 /W4 ^
+cl /EHsc /std:c++20 /O2 /W4 ^
     /Fe:build\raw_input_service_console.exe ^
     /Fo:build\ ^
-    raw_input_service.cpp device_detector.cpp socket_server.cpp ^
-    ws2_32.lib hid.lib setupapi.lib user32.lib ^
+    raw_input_service.cpp device_detector.cpp socket_server.cpp relay.cpp handoff.cpp handoff_channel.cpp stream_fanout.cpp task_pool.cpp async_io.cpp timer_wheel.cpp ^
+    ws2_32.lib hid.lib setupapi.lib user32.lib shell32.lib winmm.lib ^
     /link /SUBSYSTEM:CONSOLE
 
 if %ERRORLEVEL% NEQ 0 (
@@ -33,11 +33,11 @@ if %ERRORLEVEL% NEQ 0 (
 
 echo.
 echo Compiling Windows subsystem version (no console)...
-cl /EHsc /std:c++17 /O2 /W4 ^
+cl /EHsc /std:c++20 /O2 /W4 ^
     /Fe:build\raw_input_service.exe ^
     /Fo:build\ ^
-    raw_input_service.cpp device_detector.cpp socket_server.cpp ^
-    ws2_32.lib hid.lib setupapi.lib user32.lib ^
+    raw_input_service.cpp device_detector.cpp socket_server.cpp relay.cpp handoff.cpp handoff_channel.cpp stream_fanout.cpp task_pool.cpp async_io.cpp timer_wheel.cpp ^
+    ws2_32.lib hid.lib setupapi.lib user32.lib shell32.lib winmm.lib ^
     /link /SUBSYSTEM:WINDOWS /ENTRY:wWinMainCRTStartup
 
 if %ERRORLEVEL% NEQ 0 (
@@ -45,10 +45,24 @@ if %ERRORLEVEL% NEQ 0 (
     exit /b 1
 )
 
+echo.
+echo Compiling libinputstream...
+cl /EHsc /std:c++17 /O2 /W4 /LD ^
+    /Fe:build\inputstream.dll ^
+    /Fo:build\ ^
+    inputstream.cpp ^
+    ws2_32.lib
+
+if %ERRORLEVEL% NEQ 0 (
+    echo libinputstream build failed!
+    exit /b 1
+)
+
 echo.
 echo === Build Complete ===
 echo Output files:
 echo   build\raw_input_service_console.exe  (with console window)
 echo   build\raw_input_service.exe          (no console window)
+echo   build\inputstream.dll                 (C ABI client library)
 echo.
 echo Run as Administrator for full functionality.
@@ -14,8 +14,11 @@
 #include <mutex>
 #include <fstream>
 #include <ctime>
+#include <cstdio>
 #include <sstream>
 #include <iomanip>
+#include "event_types.h"
+#include "task_pool.h"
 
 #pragma comment(lib, "ws2_32.lib")
 #pragma comment(lib, "hid.lib")
@@ -24,26 +27,13 @@
 constexpr int TCP_PORT = 9999;
 constexpr int MAX_CLIENTS = 10;
 constexpr size_t BUFFER_SIZE = 4096;
+constexpr size_t HISTORY_SIZE = 4096;   // Events kept for client resume
+constexpr int SOCKET_POLL_MS = 200;     // Socket threads check for stop/hand-off this often
+constexpr int SHUTDOWN_DRAIN_MS = 2000;  // Default time to flush clients on shutdown
+constexpr size_t CAPTURE_BATCH_MAX = 256; // Raw input events per pipeline run
 
-// Device types
-enum class DeviceType {
-    Keyboard,
-    Mouse,
-    Unknown
-};
-
-// Input event structure
-struct InputEvent {
-    std::string device_id;
-    DeviceType type;
-    union {
-        struct { int vkey; } keyboard;
-        struct { int dx; int dy; int buttons; } mouse;
-    } data;
-    ULONGLONG timestamp;
-};
-
-// Logger class
+// Logger class. Lines are timestamped by the caller and written to the file
+// by a background job, so logging never waits on disk.
 class Logger {
 public:
     static Logger& instance() {
@@ -52,30 +42,64 @@ public:
     }
 
     void log(const std::string& message) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        std::time_t now = std::time(nullptr);
-        char timeStr[64];
-        std::strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", std::localtime(&now));
-        
-        if (logFile_.is_open()) {
-            logFile_ << "[" << timeStr << "] " << message << std::endl;
-            logFile_.flush();
+        bool schedule = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!open_) return;
+            std::time_t now = std::time(nullptr);
+            char timeStr[64];
+            std::strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", std::localtime(&now));
+            pending_.push_back("[" + std::string(timeStr) + "] " + message);
+            schedule = !flushQueued_;
+            flushQueued_ = true;
+        }
+        // Without the pool (startup, shutdown) the caller writes the line itself
+        if (schedule && !TaskPool::instance().submit([this] { flush(); })) {
+            flush();
         }
     }
 
+    // Writes every pending line
+    void flush() {
+        std::lock_guard<std::mutex> writeLock(writeMutex_);
+        std::vector<std::string> lines;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            lines.swap(pending_);
+            flushQueued_ = false;
+        }
+        for (const std::string& line : lines) {
+            logFile_ << line << '\n';
+        }
+        logFile_.flush();
+    }
+
     void init(const std::string& filename) {
+        std::lock_guard<std::mutex> writeLock(writeMutex_);
         std::lock_guard<std::mutex> lock(mutex_);
         logFile_.open(filename, std::ios::app);
+        open_ = logFile_.is_open();
     }
 
 private:
     Logger() = default;
-    std::ofstream logFile_;
+    std::ofstream logFile_;             // Guarded by writeMutex_
+    std::mutex writeMutex_;             // Taken before mutex_; keeps batches in order
     std::mutex mutex_;
+    std::vector<std::string> pending_;  // Guarded by mutex_
+    bool flushQueued_ = false;          // Guarded by mutex_
+    bool open_ = false;                 // Guarded by mutex_
 };
 
 #define LOG(msg) Logger::instance().log(msg)
 
+// Write device handle as hex ID ("0x...") straight into an event
+inline void deviceHandleToId(HANDLE hDevice, InputEvent& event) {
+    int len = snprintf(event.device_id, DEVICE_ID_MAX, "0x%llX",
+                       (unsigned long long)reinterpret_cast<uintptr_t>(hDevice));
+    if (len < 0) event.device_id[0] = '\0';
+}
+
 // Convert device handle to hex string ID
 inline std::string deviceHandleToId(HANDLE hDevice) {
     std::stringstream ss;
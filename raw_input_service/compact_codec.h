@@ -0,0 +1,309 @@
+// compact_codec.h - Varint delta encoding for high-rate event streams
+//
+// Every record starts with a varint header: (device index << 3) | tag.
+//
+//   TAG_KEYBOARD  varint vkey, varint scan, varint char, varint mods,
+//                 varint timestamp delta
+//   TAG_MOUSE     zigzag dx, zigzag dy, varint buttons, varint timestamp delta
+//   TAG_KEYFRAME  varint timestamp, varint seq of the next event
+//   TAG_DEVICE    varint length, device ID bytes (defines the header's index)
+//   TAG_CONTROL   varint length, JSON control record
+//   TAG_CURSOR    zigzag x, zigzag y, varint abs_x, varint abs_y,
+//                 varint timestamp delta
+//   TAG_HOTKEY    varint hotkey, varint timestamp delta
+//   TAG_FLAGS     varint flags of the next event record (only when nonzero)
+//
+// A keyframe resets the device table and the timestamp base, so a decoder
+// can start at any keyframe. Events carry no seq: each is one more than the
+// previous, and the encoder emits a keyframe whenever that would not hold
+// (or the clock goes backwards). A typical mouse record is 4-5 bytes.
+#pragma once
+#include "event_schema.h"
+#include <vector>
+
+constexpr unsigned COMPACT_TAG_KEYBOARD = 0;
+constexpr unsigned COMPACT_TAG_MOUSE = 1;
+constexpr unsigned COMPACT_TAG_KEYFRAME = 2;
+constexpr unsigned COMPACT_TAG_DEVICE = 3;
+constexpr unsigned COMPACT_TAG_CONTROL = 4;
+constexpr unsigned COMPACT_TAG_CURSOR = 5;
+constexpr unsigned COMPACT_TAG_HOTKEY = 6;
+constexpr unsigned COMPACT_TAG_FLAGS = 7;
+constexpr unsigned COMPACT_TAG_BITS = 3;
+constexpr uint32_t COMPACT_KEYFRAME_INTERVAL = 256;    // Records between forced keyframes
+constexpr size_t COMPACT_MAX_DEVICES = 256;            // Table is reset by a keyframe when full
+
+inline char* putVarint(char* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (char)value;
+    return out;
+}
+
+inline uint64_t zigzagEncode(int64_t value) { return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63); }
+inline int64_t zigzagDecode(uint64_t value) { return (int64_t)(value >> 1) ^ -(int64_t)(value & 1); }
+
+// Returns 1 on success, 0 if more bytes are needed, -1 if over-long
+inline int readVarint(const uint8_t*& in, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    const uint8_t* p = in;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (p >= end) return 0;
+        uint8_t byte = *p++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            in = p;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// A varint length, then the bytes
+inline void putBytes(std::string& out, const char* data, size_t size) {
+    char header[10];
+    out.append(header, (size_t)(putVarint(header, size) - header));
+    out.append(data, size);
+}
+
+// Reads what putBytes wrote; false if it is cut short or longer than max
+inline bool readBytes(const uint8_t*& in, const uint8_t* end, size_t max, std::string& bytes) {
+    uint64_t size;
+    if (readVarint(in, end, size) <= 0 || size > max || size > (uint64_t)(end - in)) return false;
+    bytes.assign((const char*)in, (size_t)size);
+    in += size;
+    return true;
+}
+
+class CompactEncoder {
+public:
+    // Next event starts with a keyframe (new subscriber or lost state)
+    void reset() { needKeyframe_ = true; }
+
+    void encode(const InputEvent& event, std::string& out) {
+        // Keyframe + device definition + event fit with room to spare
+        char buffer[96 + DEVICE_ID_MAX];
+        char* p = buffer;
+        if (needKeyframe_ || event.seq != nextSeq_ || event.timestamp < prevTimestamp_ ||
+            sinceKeyframe_ >= COMPACT_KEYFRAME_INTERVAL) {
+            p = keyframe(event, p);
+        }
+
+        uint64_t index = deviceIndex(event, p);
+        if (event.flags) {
+            p = putVarint(p, COMPACT_TAG_FLAGS);
+            p = putVarint(p, event.flags);
+        }
+        if (event.type == DeviceType::Mouse) {
+            p = putVarint(p, (index << COMPACT_TAG_BITS) | COMPACT_TAG_MOUSE);
+            p = putVarint(p, zigzagEncode(event.data.mouse.dx));
+            p = putVarint(p, zigzagEncode(event.data.mouse.dy));
+            p = putVarint(p, (uint32_t)event.data.mouse.buttons);
+        } else if (event.type == DeviceType::Cursor) {
+            p = putVarint(p, (index << COMPACT_TAG_BITS) | COMPACT_TAG_CURSOR);
+            p = putVarint(p, zigzagEncode(event.data.cursor.x));
+            p = putVarint(p, zigzagEncode(event.data.cursor.y));
+            p = putVarint(p, event.data.cursor.abs_x);
+            p = putVarint(p, event.data.cursor.abs_y);
+        } else if (event.type == DeviceType::Hotkey) {
+            p = putVarint(p, (index << COMPACT_TAG_BITS) | COMPACT_TAG_HOTKEY);
+            p = putVarint(p, event.data.hotkey.id);
+        } else {
+            p = putVarint(p, (index << COMPACT_TAG_BITS) | COMPACT_TAG_KEYBOARD);
+            p = putVarint(p, (uint32_t)event.data.keyboard.vkey);
+            p = putVarint(p, event.data.keyboard.scan);
+            p = putVarint(p, event.data.keyboard.ch);
+            p = putVarint(p, event.data.keyboard.mods);
+        }
+        p = putVarint(p, event.timestamp - prevTimestamp_);
+        out.append(buffer, (size_t)(p - buffer));
+
+        prevTimestamp_ = event.timestamp;
+        nextSeq_ = event.seq + 1;
+        sinceKeyframe_++;
+    }
+
+    static void encodeControl(const ControlRecord& record, std::string& out) {
+        char buffer[20 + MAX_ENCODED_EVENT];
+        char json[MAX_ENCODED_EVENT];
+        size_t n = encodeControlJson(record, json);
+        char* p = putVarint(buffer, COMPACT_TAG_CONTROL);
+        p = putVarint(p, n);
+        std::memcpy(p, json, n);
+        out.append(buffer, (size_t)(p + n - buffer));
+    }
+
+private:
+    char* keyframe(const InputEvent& next, char* out) {
+        out = putVarint(out, COMPACT_TAG_KEYFRAME);
+        out = putVarint(out, next.timestamp);
+        out = putVarint(out, next.seq);
+        devices_.clear();
+        lastDevice_ = 0;
+        prevTimestamp_ = next.timestamp;
+        nextSeq_ = next.seq;
+        sinceKeyframe_ = 0;
+        needKeyframe_ = false;
+        return out;
+    }
+
+    // Returns the device's table index, defining it first if it is new
+    uint64_t deviceIndex(const InputEvent& event, char*& out) {
+        // Consecutive events usually come from the same device
+        if (lastDevice_ < devices_.size() &&
+            std::strncmp(devices_[lastDevice_].id, event.device_id, DEVICE_ID_MAX) == 0) {
+            return lastDevice_;
+        }
+        for (size_t i = 0; i < devices_.size(); ++i) {
+            if (std::strncmp(devices_[i].id, event.device_id, DEVICE_ID_MAX) == 0) {
+                lastDevice_ = i;
+                return i;
+            }
+        }
+        if (devices_.size() >= COMPACT_MAX_DEVICES) {
+            out = keyframe(event, out);
+        }
+
+        DeviceId entry = {};
+        size_t len = strnlen(event.device_id, DEVICE_ID_MAX - 1);
+        std::memcpy(entry.id, event.device_id, len);
+        devices_.push_back(entry);
+
+        lastDevice_ = devices_.size() - 1;
+        out = putVarint(out, ((uint64_t)lastDevice_ << COMPACT_TAG_BITS) | COMPACT_TAG_DEVICE);
+        out = putVarint(out, len);
+        std::memcpy(out, event.device_id, len);
+        out += len;
+        return lastDevice_;
+    }
+
+    struct DeviceId { char id[DEVICE_ID_MAX]; };
+
+    std::vector<DeviceId> devices_;
+    size_t lastDevice_ = 0;
+    uint64_t prevTimestamp_ = 0;
+    uint64_t nextSeq_ = 0;
+    uint32_t sinceKeyframe_ = 0;
+    bool needKeyframe_ = true;
+};
+
+// One decoded compact record
+struct CompactRecord {
+    enum Kind { Event, Control, State } kind;
+    InputEvent event;                   // Kind == Event
+    const char* text;                   // Kind == Control: JSON, not NUL-terminated
+    size_t textLength;
+};
+
+class CompactDecoder {
+public:
+    void reset() {
+        synced_ = false;
+        devices_.clear();
+        flags_ = 0;
+    }
+
+    // Decodes one record. Returns bytes used, 0 if incomplete, -1 if the
+    // data is malformed or an event arrives before the first keyframe.
+    long decode(const uint8_t* data, size_t size, CompactRecord& out) {
+        const uint8_t* in = data;
+        const uint8_t* end = data + size;
+        uint64_t header;
+        int r = readVarint(in, end, header);
+        if (r <= 0) return r;
+
+        unsigned tag = (unsigned)(header & ((1u << COMPACT_TAG_BITS) - 1));
+        uint64_t index = header >> COMPACT_TAG_BITS;
+        out.kind = CompactRecord::State;
+
+        if (tag == COMPACT_TAG_KEYFRAME) {
+            uint64_t timestamp, seq;
+            if ((r = readVarint(in, end, timestamp)) <= 0) return r;
+            if ((r = readVarint(in, end, seq)) <= 0) return r;
+            devices_.clear();
+            prevTimestamp_ = timestamp;
+            nextSeq_ = seq;
+            synced_ = true;
+        } else if (tag == COMPACT_TAG_DEVICE || tag == COMPACT_TAG_CONTROL) {
+            uint64_t length;
+            if ((r = readVarint(in, end, length)) <= 0) return r;
+            if ((uint64_t)(end - in) < length) return 0;
+            if (tag == COMPACT_TAG_CONTROL) {
+                out.kind = CompactRecord::Control;
+                out.text = (const char*)in;
+                out.textLength = (size_t)length;
+            } else {
+                if (!synced_ || index != devices_.size() || length >= DEVICE_ID_MAX) return -1;
+                DeviceId entry = {};
+                std::memcpy(entry.id, in, (size_t)length);
+                entry.id[length] = '\0';
+                devices_.push_back(entry);
+            }
+            in += length;
+        } else if (tag == COMPACT_TAG_FLAGS) {
+            uint64_t flags;
+            if ((r = readVarint(in, end, flags)) <= 0) return r;
+            if (flags > UINT8_MAX) return -1;
+            flags_ = (uint8_t)flags;
+        } else if (tag == COMPACT_TAG_KEYBOARD || tag == COMPACT_TAG_MOUSE || tag == COMPACT_TAG_CURSOR ||
+                   tag == COMPACT_TAG_HOTKEY) {
+            if (!synced_ || index >= devices_.size()) return -1;
+            InputEvent& event = out.event;
+            event = InputEvent();
+            uint64_t a, b = 0, c = 0, d = 0, delta;
+            if ((r = readVarint(in, end, a)) <= 0) return r;
+            if (tag == COMPACT_TAG_MOUSE) {
+                if ((r = readVarint(in, end, b)) <= 0) return r;
+                if ((r = readVarint(in, end, c)) <= 0) return r;
+                event.type = DeviceType::Mouse;
+                event.data.mouse.dx = (int)zigzagDecode(a);
+                event.data.mouse.dy = (int)zigzagDecode(b);
+                event.data.mouse.buttons = (int)c;
+            } else if (tag == COMPACT_TAG_CURSOR) {
+                if ((r = readVarint(in, end, b)) <= 0) return r;
+                if ((r = readVarint(in, end, c)) <= 0) return r;
+                if ((r = readVarint(in, end, d)) <= 0) return r;
+                event.type = DeviceType::Cursor;
+                event.data.cursor.x = (int)zigzagDecode(a);
+                event.data.cursor.y = (int)zigzagDecode(b);
+                event.data.cursor.abs_x = (uint16_t)c;
+                event.data.cursor.abs_y = (uint16_t)d;
+            } else if (tag == COMPACT_TAG_HOTKEY) {
+                event.type = DeviceType::Hotkey;
+                event.data.hotkey.id = (uint16_t)a;
+            } else {
+                if ((r = readVarint(in, end, b)) <= 0) return r;
+                if ((r = readVarint(in, end, c)) <= 0) return r;
+                if ((r = readVarint(in, end, d)) <= 0) return r;
+                event.type = DeviceType::Keyboard;
+                event.data.keyboard.vkey = (int)a;
+                event.data.keyboard.scan = (uint16_t)b;
+                event.data.keyboard.ch = (uint16_t)c;
+                event.data.keyboard.mods = (uint16_t)d;
+            }
+            if ((r = readVarint(in, end, delta)) <= 0) return r;
+
+            std::memcpy(event.device_id, devices_[index].id, DEVICE_ID_MAX);
+            event.timestamp = prevTimestamp_ + delta;
+            event.seq = nextSeq_++;
+            event.flags = flags_;
+            flags_ = 0;
+            prevTimestamp_ = event.timestamp;
+            out.kind = CompactRecord::Event;
+        } else {
+            return -1;
+        }
+        return (long)(in - data);
+    }
+
+private:
+    struct DeviceId { char id[DEVICE_ID_MAX]; };
+
+    std::vector<DeviceId> devices_;
+    uint64_t prevTimestamp_ = 0;
+    uint64_t nextSeq_ = 0;
+    uint8_t flags_ = 0;                 // From TAG_FLAGS, for the next event
+    bool synced_ = false;
+};
@@ -0,0 +1,163 @@
+// credit_queue.h - Credit-based flow control for one client
+//
+// A client that sends "credit <n>" gets at most n more events until it
+// grants again. Events it has no credit for are held here and collapse by
+// class, so what is held stays bounded however long the client waits:
+//
+//   - Mouse motion (no button flags) merges into the device's last held
+//     motion event with the same event flags, as long as no key or button
+//     change from that device came after it: dx/dy add up, seq and
+//     timestamp become the newest. Real and replayed (synthetic) motion
+//     thus stay apart without splitting each other, and may reach the
+//     client in a different order than they came in.
+//   - Cursor positions (cursor.h) merge the same way, the newest position
+//     replacing the held one.
+//   - Keys, hotkeys and button changes are kept in order while fewer than
+//     CREDIT_HOLD_MAX events are held, or the lower limit the memory budget
+//     sets. Held motion counts too, so motion split off by a button change
+//     uses up the limit like the button change does. Beyond the limit, new
+//     keys and button changes are dropped and counted; a dropped button
+//     change still adds its motion.
+//
+// Motion is never dropped, but once the limit is reached nothing splits a
+// device's held motion any more, so each device adds at most one event per
+// flag combination past it: at most the limit + one motion event per
+// device and flags are held.
+// Nothing is merged while the client has credit, so a client that keeps
+// granting in time gets every event.
+#pragma once
+#include "event_types.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+constexpr size_t CREDIT_HOLD_MAX = 1024;        // Events held per client before keys and button changes are dropped
+
+class CreditQueue {
+public:
+    bool enabled() const { return enabled_; }
+
+    // Turns credit mode on with the first grant
+    void grant(uint64_t credits) {
+        enabled_ = true;
+        credits_ = credits > UINT64_MAX - credits_ ? UINT64_MAX : credits_ + credits;
+    }
+
+    // Lowers the hold limit below CREDIT_HOLD_MAX (memory_budget.h).
+    // Events already held stay.
+    void setHoldLimit(size_t events) { holdLimit_ = std::min(events, CREDIT_HOLD_MAX); }
+
+    // Hands the event to emit right away if there is credit and nothing
+    // older is held, otherwise holds it
+    template <typename Emit>
+    void offer(const InputEvent& event, Emit&& emit) {
+        if (held_.empty() && credits_ > 0) {
+            credits_--;
+            emit(event);
+        } else {
+            hold(event);
+        }
+    }
+
+    // Emits held events, oldest first, while there is credit
+    template <typename Emit>
+    size_t release(Emit&& emit) {
+        size_t released = 0;
+        while (!held_.empty() && credits_ > 0) {
+            credits_--;
+            emit(held_.front());
+            held_.pop_front();
+            base_++;
+            released++;
+        }
+        return released;
+    }
+
+    // Continues a queue exported by a hand-off
+    void restore(uint64_t credits, const std::vector<InputEvent>& held) {
+        enabled_ = true;
+        credits_ = credits;
+        for (const InputEvent& event : held) {
+            hold(event);
+        }
+    }
+
+    uint64_t credits() const { return credits_; }
+    const std::deque<InputEvent>& held() const { return held_; }
+    uint64_t merged() const { return merged_; }     // Motion events folded into an earlier one
+    uint64_t dropped() const { return dropped_; }   // Keys and button changes over the limit
+
+private:
+    struct MotionTail {
+        char deviceId[DEVICE_ID_MAX];
+        uint8_t flags;
+        uint64_t index;                 // Absolute index of the last held motion with these flags; UINT64_MAX if none
+    };
+
+    static bool isMotion(const InputEvent& event) {
+        return (event.type == DeviceType::Mouse && event.data.mouse.buttons == 0) ||
+               event.type == DeviceType::Cursor;
+    }
+
+    MotionTail& tail(const char* deviceId, uint8_t flags) {
+        for (MotionTail& entry : tails_) {
+            if (entry.flags == flags && std::strncmp(entry.deviceId, deviceId, DEVICE_ID_MAX) == 0) return entry;
+        }
+        MotionTail entry = {};
+        size_t len = strnlen(deviceId, DEVICE_ID_MAX - 1);
+        std::memcpy(entry.deviceId, deviceId, len);
+        entry.deviceId[len] = '\0';
+        entry.flags = flags;
+        entry.index = UINT64_MAX;
+        tails_.push_back(entry);
+        return tails_.back();
+    }
+
+    void hold(const InputEvent& event) {
+        if (isMotion(event)) {
+            MotionTail& last = tail(event.device_id, event.flags);
+            if (last.index != UINT64_MAX && last.index >= base_) {
+                InputEvent& merged = held_[(size_t)(last.index - base_)];
+                if (event.type == DeviceType::Cursor) {
+                    merged.data.cursor = event.data.cursor;
+                } else {
+                    merged.data.mouse.dx += event.data.mouse.dx;
+                    merged.data.mouse.dy += event.data.mouse.dy;
+                }
+                merged.seq = event.seq;
+                merged.timestamp = event.timestamp;
+                merged_++;
+                return;
+            }
+            last.index = base_ + held_.size();
+            held_.push_back(event);
+            return;
+        }
+
+        if (held_.size() >= holdLimit_) {
+            dropped_++;
+            if (event.type == DeviceType::Mouse) {
+                // The button change is lost, its motion is not
+                InputEvent motion = event;
+                motion.data.mouse.buttons = 0;
+                hold(motion);
+            }
+            return;
+        }
+        // Later motion must not jump ahead of this event
+        for (MotionTail& entry : tails_) {
+            if (std::strncmp(entry.deviceId, event.device_id, DEVICE_ID_MAX) == 0) entry.index = UINT64_MAX;
+        }
+        held_.push_back(event);
+    }
+
+    bool enabled_ = false;
+    uint64_t credits_ = 0;
+    std::deque<InputEvent> held_;
+    uint64_t base_ = 0;                 // Absolute index of held_.front()
+    size_t holdLimit_ = CREDIT_HOLD_MAX;
+    std::vector<MotionTail> tails_;
+    uint64_t merged_ = 0;
+    uint64_t dropped_ = 0;
+};
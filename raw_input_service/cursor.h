@@ -0,0 +1,432 @@
+// cursor.h - Per-user virtual cursors with pointer ballistics
+//
+// A cursor file (--cursors) gives each user of the users file
+// (user_rules.h), whose mice drive their cursor, a screen rectangle and an
+// acceleration curve, one rule per line:
+//
+//     user_2   screen  1920 0 1920 1080        # left top width height
+//     *        curve   0 1.0  4 1.0  16 2.0  40 3.0
+//     *        monitor 0 0 1920 1080               # left top width height [scale]
+//     *        monitor 1920 0 2560 1440 1.5
+//     user_1   monitors 0                          # "*" monitor lines, counted from 0
+//
+// Curve points are (speed, gain) pairs: speed is the length of one report's
+// motion in counts, gain multiplies it. "*" sets the screen, curve and
+// monitors for users without their own; the screen otherwise defaults to
+// the whole desktop, the curve to a gain of 1 and the monitors to all.
+//
+// Monitor lines describe the desktop (desktop_layout.h) and only go on "*";
+// without them the desktop is one monitor of scale 1. Every user has one
+// cursor, on one of their monitors. Motion from any of the user's mice
+// moves it by the curve's gain for that report's speed times the monitor's
+// DPI scale, and it stops at the screen's edges. It crosses to another of
+// the user's monitors where the two share an edge; anywhere else, such as
+// into a gap, past a shorter neighbour or onto a monitor not theirs, it
+// stops at the current monitor's edge and slides along it.
+//
+// After each batch, every cursor that moved is published as a "cursor"
+// event whose device_id is the user, whose x/y are the desktop pixel and
+// whose abs_x/abs_y are the same point in the 0..65535 range that
+// MOUSEEVENTF_ABSOLUTE | MOUSEEVENTF_VIRTUALDESK expects, so consumers need
+// not redo the ballistics or the mapping themselves.
+//
+// The curve is compiled into a table with one gain per whole count of
+// speed, and a lookup interpolates between two entries.
+//
+// Portable; the service only supplies the desktop size.
+#pragma once
+#include "compact_codec.h"
+#include "desktop_layout.h"
+#include "device_table.h"
+#include "pipeline.h"
+#include "user_rules.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+constexpr size_t CURSOR_CURVE_SIZE = 64;        // Table entries, for speeds 0..63 counts per report
+constexpr double CURSOR_GAIN_MAX = 64.0;        // Larger gains are rejected
+constexpr double CURSOR_SAVED_ONE = 65536.0;    // Fixed point of positions saved for a hand-off
+
+struct CursorScreen {
+    int left = 0;
+    int top = 0;
+    int width = 0;                      // 0: not set
+    int height = 0;
+};
+
+// Gain as a function of speed: a table and linear interpolation between
+// its entries. Speeds past the end use the last entry.
+class CursorCurve {
+public:
+    CursorCurve() { std::fill(std::begin(gain_), std::end(gain_), 1.0f); }
+
+    // points are (speed, gain) pairs with rising speeds; the curve is flat
+    // before the first and after the last
+    explicit CursorCurve(const std::vector<std::pair<double, double>>& points) {
+        size_t next = 0;
+        for (size_t speed = 0; speed < CURSOR_CURVE_SIZE; ++speed) {
+            while (next < points.size() && points[next].first <= (double)speed) ++next;
+            if (next == 0) {
+                gain_[speed] = (float)points.front().second;
+            } else if (next == points.size()) {
+                gain_[speed] = (float)points.back().second;
+            } else {
+                const auto& [s0, g0] = points[next - 1];
+                const auto& [s1, g1] = points[next];
+                gain_[speed] = (float)(g0 + (g1 - g0) * ((double)speed - s0) / (s1 - s0));
+            }
+        }
+    }
+
+    float gain(float speed) const {
+        if (speed >= (float)(CURSOR_CURVE_SIZE - 1)) return gain_[CURSOR_CURVE_SIZE - 1];
+        size_t index = (size_t)speed;
+        float fraction = speed - (float)index;
+        return gain_[index] + (gain_[index + 1] - gain_[index]) * fraction;
+    }
+
+private:
+    float gain_[CURSOR_CURVE_SIZE];
+};
+
+struct CursorUser {
+    std::string name;                   // Published as the cursor event's device_id
+    std::vector<std::string> devices;
+    CursorScreen screen;
+    CursorCurve curve;
+    bool hasCurve = false;
+    uint32_t monitorMask = 0;           // Bit per monitor index; 0: not set
+};
+
+class CursorConfig : public UserRules<CursorConfig, CursorUser> {
+public:
+    const std::vector<MonitorRect>& monitors() const { return monitors_; }
+
+private:
+    friend class UserRules<CursorConfig, CursorUser>;
+
+    bool parseRule(CursorUser& user, const std::string& directive, std::istringstream& fields) {
+        if (directive == "screen") {
+            CursorScreen& screen = user.screen;
+            std::string extra;
+            return fields >> screen.left >> screen.top >> screen.width >> screen.height &&
+                   !(fields >> extra) && screen.width > 0 && screen.height > 0;
+        }
+        if (directive == "monitor") {
+            MonitorRect monitor;
+            std::string extra;
+            if (!isDefaults(user) || !(fields >> monitor.left >> monitor.top >> monitor.width >> monitor.height)) {
+                return false;
+            }
+            if (fields >> extra) {
+                char* scaleEnd = nullptr;
+                monitor.scale = std::strtof(extra.c_str(), &scaleEnd);
+                if (*scaleEnd || fields >> extra) return false;
+            }
+            monitors_.push_back(monitor);
+            return true;
+        }
+        if (directive == "monitors") {
+            size_t index;
+            user.monitorMask = 0;
+            while (fields >> index) {
+                if (index >= LAYOUT_MONITORS_MAX) return false;
+                user.monitorMask |= (uint32_t)1 << index;
+            }
+            return fields.eof() && user.monitorMask != 0;
+        }
+        if (directive == "curve") {
+            std::vector<std::pair<double, double>> points;
+            std::string speedText, gainText;
+            while (fields >> speedText) {
+                char* speedEnd = nullptr;
+                char* gainEnd = nullptr;
+                if (!(fields >> gainText)) return false;
+                double speed = std::strtod(speedText.c_str(), &speedEnd);
+                double gain = std::strtod(gainText.c_str(), &gainEnd);
+                if (*speedEnd || *gainEnd || !(speed >= 0) || !(gain > 0 && gain <= CURSOR_GAIN_MAX) ||
+                    (!points.empty() && speed <= points.back().first)) {
+                    return false;
+                }
+                points.emplace_back(speed, gain);
+            }
+            if (points.empty()) return false;
+            user.curve = CursorCurve(points);
+            user.hasCurve = true;
+            return true;
+        }
+        return false;
+    }
+
+    // Gives users the "*" settings they have none of; then the monitors
+    // must form a layout, every monitor index must name one, and every
+    // screen must reach one of its user's monitors
+    bool finish(std::string& error) {
+        for (CursorUser& user : users_) {
+            if (user.screen.width == 0) user.screen = defaults_.screen;
+            if (!user.hasCurve) user.curve = defaults_.curve;
+            if (user.monitorMask == 0) user.monitorMask = defaults_.monitorMask;
+        }
+        if (monitors_.empty()) {
+            for (const CursorUser& user : users_) {
+                if (user.monitorMask != 0) {
+                    error = user.name + ": monitors given without monitor lines";
+                    return false;
+                }
+            }
+            return true;
+        }
+        if (!DesktopLayout::validate(monitors_, error)) return false;
+        uint32_t known = monitors_.size() == 32 ? UINT32_MAX : ((uint32_t)1 << monitors_.size()) - 1;
+        for (const CursorUser& user : users_) {
+            uint32_t mask = user.monitorMask ? user.monitorMask : known;
+            bool reached = user.screen.width == 0;
+            for (size_t index = 0; index < monitors_.size(); ++index) {
+                const MonitorRect& monitor = monitors_[index];
+                if ((mask >> index & 1) && !reached) {
+                    reached = monitor.left < user.screen.left + user.screen.width &&
+                              user.screen.left < monitor.right() &&
+                              monitor.top < user.screen.top + user.screen.height && user.screen.top < monitor.bottom();
+                }
+            }
+            if ((mask & ~known) != 0 || !reached) {
+                error = user.name + ": monitors or screen do not match the monitor lines";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::vector<MonitorRect> monitors_;
+};
+
+// The cursors of every user. update() may be called from several worker
+// shards at once; a user's mice may sit on different shards.
+class CursorEngine {
+public:
+    // Call before any update(). desktop is the monitor when the file has
+    // no monitor lines, and the screen for users without one.
+    void configure(const CursorConfig& config, const CursorScreen& desktop) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cursors_.clear();
+        devices_.clear();
+        std::vector<MonitorRect> monitors = config.monitors();
+        if (monitors.empty()) {
+            MonitorRect whole;
+            whole.left = desktop.left;
+            whole.top = desktop.top;
+            whole.width = std::clamp(desktop.width, 1, LAYOUT_EXTENT_MAX);
+            whole.height = std::clamp(desktop.height, 1, LAYOUT_EXTENT_MAX);
+            monitors.push_back(whole);
+        }
+        layout_.build(monitors);
+        const MonitorRect& bounds = layout_.bounds();
+        for (const CursorUser& user : config.users()) {
+            Cursor cursor = {};
+            std::strncpy(cursor.name, user.name.c_str(), DEVICE_ID_MAX - 1);
+            if (user.screen.width > 0) {
+                cursor.screen = user.screen;
+            } else {
+                cursor.screen = CursorScreen{ bounds.left, bounds.top, bounds.width, bounds.height };
+            }
+            cursor.curve = user.curve;
+            cursor.allowed = user.monitorMask ? user.monitorMask : UINT32_MAX;
+            place(cursor);
+            size_t index = cursors_.size();
+            for (const std::string& id : user.devices) {
+                devices_.find(id.c_str(), [index](const char*) { return index; });
+            }
+            cursors_.push_back(cursor);
+        }
+    }
+
+    size_t users() const { return cursors_.size(); }
+    const DesktopLayout& layout() const { return layout_; }
+
+    // Moves the cursors of the batch's mice and appends one cursor event
+    // per user whose position changed
+    void update(const InputEvent* events, size_t count, std::vector<InputEvent>& moved) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < count; ++i) {
+            const InputEvent& event = events[i];
+            if (event.type != DeviceType::Mouse) continue;
+            size_t cursor = devices_[devices_.find(event.device_id, [](const char*) { return SIZE_MAX; })];
+            if (cursor != SIZE_MAX && (event.data.mouse.dx != 0 || event.data.mouse.dy != 0)) {
+                move(cursors_[cursor], event);
+            }
+        }
+        for (Cursor& entry : cursors_) {
+            if (!entry.dirty) continue;
+            entry.dirty = false;
+            int x = (int)std::floor(entry.x);
+            int y = (int)std::floor(entry.y);
+            if (x == entry.publishedX && y == entry.publishedY) continue;
+            entry.publishedX = x;
+            entry.publishedY = y;
+            InputEvent event = {};
+            std::memcpy(event.device_id, entry.name, DEVICE_ID_MAX);
+            event.type = DeviceType::Cursor;
+            event.data.cursor.x = x;
+            event.data.cursor.y = y;
+            // A screen past the desktop is only possible without monitor lines
+            const MonitorRect& bounds = layout_.bounds();
+            layout_.normalize(std::clamp(x, bounds.left, bounds.right() - 1),
+                              std::clamp(y, bounds.top, bounds.bottom() - 1),
+                              event.data.cursor.abs_x, event.data.cursor.abs_y);
+            event.timestamp = entry.timestamp;
+            moved.push_back(event);
+        }
+    }
+
+    // Appends every cursor's user and position, for a hand-off (handoff.h)
+    void save(std::string& out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        char buffer[30];
+        out.append(buffer, (size_t)(putVarint(buffer, cursors_.size()) - buffer));
+        for (const Cursor& cursor : cursors_) {
+            putBytes(out, cursor.name, strnlen(cursor.name, DEVICE_ID_MAX - 1));
+            char* p = putVarint(buffer, zigzagEncode(std::llround(cursor.x * CURSOR_SAVED_ONE)));
+            p = putVarint(p, zigzagEncode(std::llround(cursor.y * CURSOR_SAVED_ONE)));
+            out.append(buffer, (size_t)(p - buffer));
+        }
+    }
+
+    // Puts the cursors of the users save() wrote back where they were,
+    // unless that is now off their screen or monitors. Returns false if the
+    // saved state is malformed.
+    bool restore(const uint8_t*& in, const uint8_t* end) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t count;
+        if (readVarint(in, end, count) <= 0) return false;
+        for (uint64_t i = 0; i < count; ++i) {
+            std::string name;
+            uint64_t savedX, savedY;
+            if (!readBytes(in, end, DEVICE_ID_MAX - 1, name) || readVarint(in, end, savedX) <= 0 ||
+                readVarint(in, end, savedY) <= 0) {
+                return false;
+            }
+            double x = (double)zigzagDecode(savedX) / CURSOR_SAVED_ONE;
+            double y = (double)zigzagDecode(savedY) / CURSOR_SAVED_ONE;
+            for (Cursor& cursor : cursors_) {
+                const CursorScreen& screen = cursor.screen;
+                if (name != cursor.name || x < screen.left || x >= screen.left + screen.width || y < screen.top ||
+                    y >= screen.top + screen.height) {
+                    continue;
+                }
+                uint8_t monitor = allowedAt(cursor, x, y);
+                if (monitor == LAYOUT_NO_MONITOR && cursor.monitor != LAYOUT_NO_MONITOR) continue;
+                cursor.x = x;
+                cursor.y = y;
+                cursor.monitor = monitor;
+                // The old process published this pixel already
+                cursor.publishedX = (int)std::floor(x);
+                cursor.publishedY = (int)std::floor(y);
+            }
+        }
+        return true;
+    }
+
+private:
+    struct Cursor {
+        char name[DEVICE_ID_MAX];
+        CursorScreen screen;
+        CursorCurve curve;
+        uint32_t allowed;               // Monitors the cursor may enter, bit per index
+        uint8_t monitor;                // The one it is on, or LAYOUT_NO_MONITOR
+        double x;                       // Sub-pixel position
+        double y;
+        int publishedX = INT32_MIN;     // Last published, to skip moves within a pixel
+        int publishedY = INT32_MIN;
+        uint64_t timestamp;             // Of the last motion
+        bool dirty;                     // Moved in this batch
+    };
+
+    // Starts the cursor in the middle of its screen, or if that is not on
+    // one of its monitors, in the middle of the first monitor it can reach
+    void place(Cursor& cursor) const {
+        const CursorScreen& screen = cursor.screen;
+        cursor.x = screen.left + screen.width / 2.0;
+        cursor.y = screen.top + screen.height / 2.0;
+        cursor.monitor = allowedAt(cursor, cursor.x, cursor.y);
+        for (size_t index = 0; index < layout_.monitors() && cursor.monitor == LAYOUT_NO_MONITOR; ++index) {
+            const MonitorRect& monitor = layout_.monitor(index);
+            int left = std::max(monitor.left, screen.left);
+            int top = std::max(monitor.top, screen.top);
+            int right = std::min(monitor.right(), screen.left + screen.width);
+            int bottom = std::min(monitor.bottom(), screen.top + screen.height);
+            if ((cursor.allowed >> index & 1) && left < right && top < bottom) {
+                cursor.x = (left + right) / 2.0;
+                cursor.y = (top + bottom) / 2.0;
+                cursor.monitor = (uint8_t)index;
+            }
+        }
+    }
+
+    uint8_t allowedAt(const Cursor& cursor, double x, double y) const {
+        uint8_t index = layout_.monitorAt((int)std::floor(x), (int)std::floor(y));
+        return index != LAYOUT_NO_MONITOR && (cursor.allowed >> index & 1) ? index : LAYOUT_NO_MONITOR;
+    }
+
+    void move(Cursor& cursor, const InputEvent& event) const {
+        float dx = (float)event.data.mouse.dx;
+        float dy = (float)event.data.mouse.dy;
+        double gain = cursor.curve.gain(std::sqrt(dx * dx + dy * dy));
+        const CursorScreen& screen = cursor.screen;
+        if (cursor.monitor != LAYOUT_NO_MONITOR) gain *= layout_.monitor(cursor.monitor).scale;
+        double x = std::clamp(cursor.x + dx * gain, (double)screen.left, (double)(screen.left + screen.width) - 1e-6);
+        double y = std::clamp(cursor.y + dy * gain, (double)screen.top, (double)(screen.top + screen.height) - 1e-6);
+        if (cursor.monitor != LAYOUT_NO_MONITOR) {
+            uint8_t next = allowedAt(cursor, x, y);
+            if (next != LAYOUT_NO_MONITOR) {
+                cursor.monitor = next;
+            } else {
+                // Off the user's monitors: stay on this one, at the edge. The
+                // screen overlaps it, so clamping to both keeps x/y in each.
+                const MonitorRect& monitor = layout_.monitor(cursor.monitor);
+                x = std::clamp(std::clamp(x, (double)monitor.left, (double)monitor.right() - 1e-6),
+                               (double)screen.left, (double)(screen.left + screen.width) - 1e-6);
+                y = std::clamp(std::clamp(y, (double)monitor.top, (double)monitor.bottom() - 1e-6),
+                               (double)screen.top, (double)(screen.top + screen.height) - 1e-6);
+            }
+        }
+        cursor.x = x;
+        cursor.y = y;
+        cursor.timestamp = event.timestamp;
+        cursor.dirty = true;
+    }
+
+    std::mutex mutex_;
+    DesktopLayout layout_;
+    std::vector<Cursor> cursors_;
+    DeviceTable<size_t> devices_;       // Cursor of each mouse; SIZE_MAX: none
+};
+
+// Feeds the batch's motion to a CursorEngine and hands the cursor events
+// to publish(span); the batch itself passes on unchanged. Goes before any
+// coalescing, since the gain depends on the speed of each report. Without
+// an engine it does nothing.
+template <typename Publisher>
+class CursorStage {
+public:
+    explicit CursorStage(CursorEngine* engine = nullptr, Publisher publish = Publisher())
+        : engine_(engine), publish_(std::move(publish)) {}
+
+    size_t process(InputEvent* events, size_t count) {
+        if (!engine_ || count == 0) return count;
+        moved_.clear();
+        engine_->update(events, count, moved_);
+        if (!moved_.empty()) publish_(EventSpan{ moved_.data(), moved_.size() });
+        return count;
+    }
+
+private:
+    CursorEngine* engine_;
+    Publisher publish_;
+    std::vector<InputEvent> moved_;
+};
@@ -0,0 +1,165 @@
+// desktop_layout.h - Monitor rectangles, point lookup and absolute coordinates
+//
+// A DesktopLayout holds the monitors of the virtual desktop, each a
+// rectangle in desktop pixels with its DPI scale. Monitors may not overlap
+// and the desktop may be at most LAYOUT_EXTENT_MAX pixels on either side.
+//
+// monitorAt() is O(1): the distinct left and right edges cut the desktop
+// into columns, the top and bottom edges into rows, and every cell of that
+// grid lies within at most one monitor. Two tables map each pixel column
+// and row to its grid column and row, so a lookup is three loads.
+//
+// normalize() turns a desktop pixel into the 0..65535 coordinates that
+// SendInput expects with MOUSEEVENTF_ABSOLUTE | MOUSEEVENTF_VIRTUALDESK,
+// aimed at the centre of the pixel so that it lands on that pixel however
+// the result is rounded back. A multiply by a precomputed reciprocal
+// stands in for the division.
+#pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+constexpr size_t LAYOUT_MONITORS_MAX = 32;      // Monitor masks are 32 bits
+constexpr int LAYOUT_EXTENT_MAX = 32768;        // Desktop width and height, in pixels
+constexpr float LAYOUT_SCALE_MAX = 5.0f;       // 500%, the largest Windows offers
+constexpr uint8_t LAYOUT_NO_MONITOR = 0xFF;
+
+struct MonitorRect {
+    int left = 0;
+    int top = 0;
+    int width = 0;
+    int height = 0;
+    float scale = 1.0f;                 // DPI scale; motion is multiplied by it
+
+    int right() const { return left + width; }
+    int bottom() const { return top + height; }
+    bool contains(int x, int y) const { return x >= left && x < right() && y >= top && y < bottom(); }
+    bool overlaps(const MonitorRect& other) const {
+        return left < other.right() && other.left < right() && top < other.bottom() && other.top < bottom();
+    }
+};
+
+class DesktopLayout {
+public:
+    // Checks a monitor list before build(); error says what is wrong
+    static bool validate(const std::vector<MonitorRect>& monitors, std::string& error) {
+        if (monitors.empty() || monitors.size() > LAYOUT_MONITORS_MAX) {
+            error = "between 1 and " + std::to_string(LAYOUT_MONITORS_MAX) + " monitors are needed";
+            return false;
+        }
+        for (size_t i = 0; i < monitors.size(); ++i) {
+            const MonitorRect& monitor = monitors[i];
+            if (monitor.width <= 0 || monitor.height <= 0 || monitor.width > LAYOUT_EXTENT_MAX ||
+                monitor.height > LAYOUT_EXTENT_MAX || std::abs(monitor.left) > LAYOUT_EXTENT_MAX ||
+                std::abs(monitor.top) > LAYOUT_EXTENT_MAX || !(monitor.scale > 0 && monitor.scale <= LAYOUT_SCALE_MAX)) {
+                error = "monitor " + std::to_string(i) + " is out of range";
+                return false;
+            }
+        }
+        MonitorRect bounds = boundsOf(monitors);
+        if (bounds.width > LAYOUT_EXTENT_MAX || bounds.height > LAYOUT_EXTENT_MAX) {
+            error = "monitors span more than " + std::to_string(LAYOUT_EXTENT_MAX) + " pixels";
+            return false;
+        }
+        for (size_t i = 0; i < monitors.size(); ++i) {
+            for (size_t j = 0; j < i; ++j) {
+                if (monitors[i].overlaps(monitors[j])) {
+                    error = "monitors " + std::to_string(j) + " and " + std::to_string(i) + " overlap";
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // monitors must pass validate()
+    void build(const std::vector<MonitorRect>& monitors) {
+        monitors_ = monitors;
+        bounds_ = boundsOf(monitors);
+
+        std::vector<int> xs, ys;
+        for (const MonitorRect& monitor : monitors) {
+            xs.push_back(monitor.left);
+            xs.push_back(monitor.right());
+            ys.push_back(monitor.top);
+            ys.push_back(monitor.bottom());
+        }
+        cutAt(xs, bounds_.left, bounds_.width, columnOf_);
+        cutAt(ys, bounds_.top, bounds_.height, rowOf_);
+        columns_ = xs.size() - 1;
+        cells_.assign(columns_ * (ys.size() - 1), LAYOUT_NO_MONITOR);
+        for (size_t row = 0; row + 1 < ys.size(); ++row) {
+            for (size_t column = 0; column < columns_; ++column) {
+                for (size_t index = 0; index < monitors.size(); ++index) {
+                    if (monitors[index].contains(xs[column], ys[row])) {
+                        cells_[row * columns_ + column] = (uint8_t)index;
+                    }
+                }
+            }
+        }
+
+        // ceil(2^47 / extent): exact for every pixel, see normalize()
+        normalX_ = ((uint64_t)1 << 47) / (uint64_t)bounds_.width + 1;
+        normalY_ = ((uint64_t)1 << 47) / (uint64_t)bounds_.height + 1;
+    }
+
+    // Index of the monitor under the pixel, or LAYOUT_NO_MONITOR
+    uint8_t monitorAt(int x, int y) const {
+        unsigned dx = (unsigned)(x - bounds_.left);
+        unsigned dy = (unsigned)(y - bounds_.top);
+        if (dx >= (unsigned)bounds_.width || dy >= (unsigned)bounds_.height) return LAYOUT_NO_MONITOR;
+        return cells_[rowOf_[dy] * columns_ + columnOf_[dx]];
+    }
+
+    // Desktop pixel to 0..65535: floor((offset + 0.5) * 65536 / extent).
+    // The pixel must lie within bounds().
+    void normalize(int x, int y, uint16_t& absX, uint16_t& absY) const {
+        absX = (uint16_t)(((uint64_t)(2 * (x - bounds_.left) + 1) * normalX_) >> 32);
+        absY = (uint16_t)(((uint64_t)(2 * (y - bounds_.top) + 1) * normalY_) >> 32);
+    }
+
+    const MonitorRect& monitor(size_t index) const { return monitors_[index]; }
+    size_t monitors() const { return monitors_.size(); }
+    const MonitorRect& bounds() const { return bounds_; }
+
+private:
+    static MonitorRect boundsOf(const std::vector<MonitorRect>& monitors) {
+        int left = INT32_MAX, top = INT32_MAX, right = INT32_MIN, bottom = INT32_MIN;
+        for (const MonitorRect& monitor : monitors) {
+            left = std::min(left, monitor.left);
+            top = std::min(top, monitor.top);
+            right = std::max(right, monitor.right());
+            bottom = std::max(bottom, monitor.bottom());
+        }
+        MonitorRect bounds;
+        bounds.left = left;
+        bounds.top = top;
+        bounds.width = right - left;
+        bounds.height = bottom - top;
+        return bounds;
+    }
+
+    // Sorts and dedupes edges and fills table with the interval of each
+    // pixel from origin
+    static void cutAt(std::vector<int>& edges, int origin, int extent, std::vector<uint8_t>& table) {
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+        table.resize((size_t)extent);
+        size_t interval = 0;
+        for (int pixel = 0; pixel < extent; ++pixel) {
+            while (origin + pixel >= edges[interval + 1]) ++interval;
+            table[(size_t)pixel] = (uint8_t)interval;
+        }
+    }
+
+    std::vector<MonitorRect> monitors_;
+    MonitorRect bounds_;
+    std::vector<uint8_t> columnOf_;     // Pixel column (from bounds_.left) to grid column
+    std::vector<uint8_t> rowOf_;
+    std::vector<uint8_t> cells_;        // Grid cell to monitor index
+    size_t columns_ = 0;
+    uint64_t normalX_ = 0;              // Reciprocals of the desktop size, see build()
+    uint64_t normalY_ = 0;
+};
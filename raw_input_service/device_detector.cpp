@@ -2,8 +2,9 @@
 #include "device_detector.h"
 
 void DeviceDetector::enumerateDevices() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    devices_.clear();
+    // Build the new table unlocked; the capture thread keeps looking devices
+    // up in the old one until the swap
+    std::map<HANDLE, DeviceInfo> devices;
 
     UINT numDevices = 0;
     if (GetRawInputDeviceList(nullptr, &numDevices, sizeof(RAWINPUTDEVICELIST)) != 0) {
@@ -13,6 +14,8 @@ void DeviceDetector::enumerateDevices() {
 
     if (numDevices == 0) {
         LOG("No raw input devices found");
+        std::lock_guard<std::mutex> lock(mutex_);
+        devices_.clear();
         return;
     }
 
@@ -36,16 +39,57 @@ void DeviceDetector::enumerateDevices() {
         DeviceInfo info;
         info.handle = device.hDevice;
         info.type = type;
-        info.name = getDeviceName(device.hDevice);
         info.id = deviceHandleToId(device.hDevice);
 
-        devices_[device.hDevice] = info;
+        devices[device.hDevice] = info;
 
         std::string typeStr = (type == DeviceType::Keyboard) ? "Keyboard" : "Mouse";
         LOG("Found device: " + typeStr + " ID=" + info.id);
     }
 
-    LOG("Total devices enumerated: " + std::to_string(devices_.size()));
+    size_t found = devices.size();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        devices_.swap(devices);
+    }
+    LOG("Total devices enumerated: " + std::to_string(found));
+
+    // Names take a driver round trip each; look them up in parallel
+    for (const auto& device : deviceList) {
+        if (device.dwType == RIM_TYPEKEYBOARD || device.dwType == RIM_TYPEMOUSE) {
+            scheduleNameResolution(device.hDevice);
+        }
+    }
+}
+
+void DeviceDetector::requestRescan() {
+    // Several notifications for one plug event collapse into one rescan
+    if (rescanQueued_.exchange(true)) {
+        return;
+    }
+    bool queued = TaskPool::instance().submit([this] {
+        rescanQueued_ = false;
+        enumerateDevices();
+    });
+    if (!queued) {
+        rescanQueued_ = false;
+        enumerateDevices();
+    }
+}
+
+void DeviceDetector::resolveName(HANDLE hDevice) {
+    std::wstring name = getDeviceName(hDevice);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = devices_.find(hDevice);
+    if (it != devices_.end()) {
+        it->second.name = std::move(name);
+    }
+}
+
+void DeviceDetector::scheduleNameResolution(HANDLE hDevice) {
+    if (!TaskPool::instance().submit([this, hDevice] { resolveName(hDevice); })) {
+        resolveName(hDevice);
+    }
 }
 
 std::wstring DeviceDetector::getDeviceName(HANDLE hDevice) {
@@ -77,6 +121,7 @@ DeviceInfo* DeviceDetector::getDevice(HANDLE hDevice) {
 }
 
 std::vector<DeviceInfo> DeviceDetector::getAllDevices() const {
+    std::lock_guard<std::mutex> lock(mutex_);
     std::vector<DeviceInfo> result;
     for (const auto& pair : devices_) {
         result.push_back(pair.second);
@@ -85,22 +130,25 @@ std::vector<DeviceInfo> DeviceDetector::getAllDevices() const {
 }
 
 void DeviceDetector::addDevice(HANDLE hDevice, DeviceType type) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    
-    if (devices_.find(hDevice) != devices_.end()) {
-        return; // Already exists
-    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (devices_.find(hDevice) != devices_.end()) {
+            return; // Already exists
+        }
 
-    DeviceInfo info;
-    info.handle = hDevice;
-    info.type = type;
-    info.name = getDeviceName(hDevice);
-    info.id = deviceHandleToId(hDevice);
+        // Called from the capture thread; the name is filled in later
+        DeviceInfo info;
+        info.handle = hDevice;
+        info.type = type;
+        info.id = deviceHandleToId(hDevice);
+
+        devices_[hDevice] = info;
+    }
 
-    devices_[hDevice] = info;
-    
     std::string typeStr = (type == DeviceType::Keyboard) ? "Keyboard" : "Mouse";
-    LOG("Device added: " + typeStr + " ID=" + info.id);
+    LOG("Device added: " + typeStr + " ID=" + deviceHandleToId(hDevice));
+    scheduleNameResolution(hDevice);
 }
 
 void DeviceDetector::removeDevice(HANDLE hDevice) {
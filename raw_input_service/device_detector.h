@@ -1,6 +1,7 @@
 // device_detector.h - HID device enumeration
 #pragma once
 #include "common.h"
+#include <atomic>
 #include <map>
 
 struct DeviceInfo {
@@ -18,6 +19,7 @@ public:
     }
 
     void enumerateDevices();
+    void requestRescan();               // Re-enumerates on the task pool
     DeviceInfo* getDevice(HANDLE hDevice);
     std::vector<DeviceInfo> getAllDevices() const;
     void addDevice(HANDLE hDevice, DeviceType type);
@@ -26,7 +28,10 @@ public:
 private:
     DeviceDetector() = default;
     std::map<HANDLE, DeviceInfo> devices_;
-    std::mutex mutex_;
+    mutable std::mutex mutex_;
+    std::atomic<bool> rescanQueued_{ false };
     
     std::wstring getDeviceName(HANDLE hDevice);
+    void resolveName(HANDLE hDevice);
+    void scheduleNameResolution(HANDLE hDevice);
 };
@@ -0,0 +1,61 @@
+// device_table.h - Per-device state, looked up by device ID
+//
+// Stages that keep state per device (remainders, held keys, hotkey
+// progress, macro owners, cursors) look it up on every event. Events come
+// in runs per device, so the table remembers the entry it found last and a
+// lookup within a run is one string compare, against the table's own copy
+// of the ID since callers compact the batch as they go. Other lookups
+// compare a hash of the ID before the string.
+//
+// Not thread-safe; a stage on several worker shards has one table per
+// shard, or guards a shared one.
+#pragma once
+#include "event_types.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+template <typename State>
+class DeviceTable {
+public:
+    // The index of deviceId's entry. A device seen for the first time gets
+    // one holding make(id), where id is the table's copy. Indices stay
+    // valid until clear().
+    template <typename Make>
+    size_t find(const char* deviceId, Make make) {
+        if (last_ < entries_.size() && std::strncmp(entries_[last_].id, deviceId, DEVICE_ID_MAX) == 0) return last_;
+        uint32_t hash = (uint32_t)hashDeviceId(deviceId);
+        for (size_t index = 0; index < entries_.size(); ++index) {
+            const Entry& entry = entries_[index];
+            if (entry.hash == hash && std::strncmp(entry.id, deviceId, DEVICE_ID_MAX) == 0) return last_ = index;
+        }
+        entries_.emplace_back();
+        Entry& entry = entries_.back();
+        size_t len = strnlen(deviceId, DEVICE_ID_MAX - 1);
+        std::memcpy(entry.id, deviceId, len);
+        entry.id[len] = '\0';
+        entry.hash = hash;
+        entry.state = make(static_cast<const char*>(entry.id));
+        return last_ = entries_.size() - 1;
+    }
+
+    State& operator[](size_t index) { return entries_[index].state; }
+    const State& operator[](size_t index) const { return entries_[index].state; }
+    const char* id(size_t index) const { return entries_[index].id; }
+    size_t size() const { return entries_.size(); }
+
+    void clear() {
+        entries_.clear();
+        last_ = SIZE_MAX;
+    }
+
+private:
+    struct Entry {
+        char id[DEVICE_ID_MAX] = {};
+        uint32_t hash = 0;
+        State state = State();
+    };
+
+    std::vector<Entry> entries_;
+    size_t last_ = SIZE_MAX;            // Entry of the last lookup
+};
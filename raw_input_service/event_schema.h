@@ -0,0 +1,718 @@
+// event_schema.h - Single definition of the event wire schema
+//
+// EVENT_FIELDS lists every InputEvent field exactly once: its key, wire type,
+// offset and the device types it applies to. The JSON, binary and CBOR
+// encoders and the binary/CBOR decoders are generated from that list with
+// templates, with keys spelled out as compile-time byte arrays. For a given
+// device type each encoder unrolls into a fixed run of stores; there is no
+// per-field branching or lookup at runtime. Decoders find a key's field with
+// a perfect hash built at compile time (KeyIndex) and then run that field's
+// generated reader. Adding a field here updates every format at once, and
+// the SDK (input_client.h) fails to compile until EventView has a member
+// for it.
+//
+// Event flags are written only on events that have any: the "flags" field
+// is present when flags are nonzero, like a field of a device type of its
+// own, so ordinary events keep their size.
+#pragma once
+#include "event_types.h"
+#include <array>
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <utility>
+
+enum class FieldType : uint8_t {
+    Text,       // NUL-terminated char array
+    Kind,       // DeviceType, written as its name
+    UInt8,
+    Int32,
+    UInt16,
+    UInt64
+};
+
+// Which device types carry a field
+constexpr uint8_t presenceBit(DeviceType type) { return (uint8_t)(1u << (unsigned)type); }
+constexpr uint8_t PRESENT_KEYBOARD = presenceBit(DeviceType::Keyboard);
+constexpr uint8_t PRESENT_MOUSE = presenceBit(DeviceType::Mouse);
+constexpr uint8_t PRESENT_CURSOR = presenceBit(DeviceType::Cursor);
+constexpr uint8_t PRESENT_HOTKEY = presenceBit(DeviceType::Hotkey);
+constexpr uint8_t PRESENT_FLAGGED = 0x80;       // Events with nonzero flags, of any type
+constexpr uint8_t PRESENT_ALL = 0xFF;
+
+struct FieldDesc {
+    const char* name;
+    FieldType type;
+    size_t offset;
+    uint8_t presence;
+};
+
+constexpr FieldDesc EVENT_FIELDS[] = {
+    { "device_id", FieldType::Text,   offsetof(InputEvent, device_id),          PRESENT_ALL },
+    { "type",      FieldType::Kind,   offsetof(InputEvent, type),               PRESENT_ALL },
+    { "flags",     FieldType::UInt8,  offsetof(InputEvent, flags),              PRESENT_FLAGGED },
+    { "vkey",      FieldType::Int32,  offsetof(InputEvent, data.keyboard.vkey), PRESENT_KEYBOARD },
+    { "scan",      FieldType::UInt16, offsetof(InputEvent, data.keyboard.scan), PRESENT_KEYBOARD },
+    { "char",      FieldType::UInt16, offsetof(InputEvent, data.keyboard.ch),   PRESENT_KEYBOARD },
+    { "mods",      FieldType::UInt16, offsetof(InputEvent, data.keyboard.mods), PRESENT_KEYBOARD },
+    { "dx",        FieldType::Int32,  offsetof(InputEvent, data.mouse.dx),      PRESENT_MOUSE },
+    { "dy",        FieldType::Int32,  offsetof(InputEvent, data.mouse.dy),      PRESENT_MOUSE },
+    { "buttons",   FieldType::Int32,  offsetof(InputEvent, data.mouse.buttons), PRESENT_MOUSE },
+    { "x",         FieldType::Int32,  offsetof(InputEvent, data.cursor.x),      PRESENT_CURSOR },
+    { "y",         FieldType::Int32,  offsetof(InputEvent, data.cursor.y),      PRESENT_CURSOR },
+    { "abs_x",     FieldType::UInt16, offsetof(InputEvent, data.cursor.abs_x),  PRESENT_CURSOR },
+    { "abs_y",     FieldType::UInt16, offsetof(InputEvent, data.cursor.abs_y),  PRESENT_CURSOR },
+    { "hotkey",    FieldType::UInt16, offsetof(InputEvent, data.hotkey.id),     PRESENT_HOTKEY },
+    { "timestamp", FieldType::UInt64, offsetof(InputEvent, timestamp),          PRESENT_ALL },
+    { "seq",       FieldType::UInt64, offsetof(InputEvent, seq),                PRESENT_ALL },
+};
+
+constexpr size_t EVENT_FIELD_COUNT = sizeof(EVENT_FIELDS) / sizeof(EVENT_FIELDS[0]);
+constexpr const char* DEVICE_TYPE_NAMES[] = { "keyboard", "mouse", "unknown", "cursor", "hotkey" };
+constexpr unsigned DEVICE_TYPE_COUNT = sizeof(DEVICE_TYPE_NAMES) / sizeof(DEVICE_TYPE_NAMES[0]);
+static_assert(DEVICE_TYPE_COUNT < 8, "Presence bits of device types must stay clear of PRESENT_FLAGGED");
+
+// Upper bound for one encoded event in any format
+constexpr size_t MAX_ENCODED_EVENT = 384;
+
+static_assert(EVENT_FIELDS[0].presence == PRESENT_ALL, "JSON writer assumes the first field is always present");
+static_assert(EVENT_FIELDS[1].type == FieldType::Kind && EVENT_FIELDS[1].presence == PRESENT_ALL,
+              "Decoders need the device type before any per-type field");
+
+constexpr size_t literalLength(const char* s) {
+    size_t n = 0;
+    while (s[n]) ++n;
+    return n;
+}
+
+// Compile-time encoded keys for field I
+template <size_t I>
+struct FieldKey {
+    static constexpr size_t length = literalLength(EVENT_FIELDS[I].name);
+    static_assert(length < 24, "CBOR keys must fit a one-byte header");
+
+    // ,"name":
+    static constexpr std::array<char, length + 4> makeJson() {
+        std::array<char, length + 4> key = {};
+        key[0] = ',';
+        key[1] = '"';
+        for (size_t i = 0; i < length; ++i) key[2 + i] = EVENT_FIELDS[I].name[i];
+        key[length + 2] = '"';
+        key[length + 3] = ':';
+        return key;
+    }
+
+    // CBOR text string: major type 3 header + bytes
+    static constexpr std::array<uint8_t, length + 1> makeCbor() {
+        std::array<uint8_t, length + 1> key = {};
+        key[0] = (uint8_t)(0x60 | length);
+        for (size_t i = 0; i < length; ++i) key[1 + i] = (uint8_t)EVENT_FIELDS[I].name[i];
+        return key;
+    }
+
+    static constexpr std::array<char, length + 4> json = makeJson();
+    static constexpr std::array<uint8_t, length + 1> cbor = makeCbor();
+};
+
+template <typename T>
+inline T loadField(const InputEvent& event, size_t offset) {
+    T value;
+    std::memcpy(&value, reinterpret_cast<const char*>(&event) + offset, sizeof(T));
+    return value;
+}
+
+template <typename T>
+inline void storeField(InputEvent& event, size_t offset, T value) {
+    std::memcpy(reinterpret_cast<char*>(&event) + offset, &value, sizeof(T));
+}
+
+inline const char* deviceTypeName(DeviceType type) {
+    unsigned index = (unsigned)type;
+    return DEVICE_TYPE_NAMES[index < DEVICE_TYPE_COUNT ? index : (unsigned)DeviceType::Unknown];
+}
+
+template <uint8_t Flagged, typename F>
+inline auto visitType(DeviceType type, F&& f) {
+    switch (type) {
+        case DeviceType::Keyboard: return f(std::integral_constant<uint8_t, PRESENT_KEYBOARD | Flagged>());
+        case DeviceType::Mouse:    return f(std::integral_constant<uint8_t, PRESENT_MOUSE | Flagged>());
+        case DeviceType::Cursor:   return f(std::integral_constant<uint8_t, PRESENT_CURSOR | Flagged>());
+        case DeviceType::Hotkey:   return f(std::integral_constant<uint8_t, PRESENT_HOTKEY | Flagged>());
+        default:                   return f(std::integral_constant<uint8_t, presenceBit(DeviceType::Unknown) | Flagged>());
+    }
+}
+
+// Calls f(std::integral_constant<uint8_t, presence>) for the event's type
+// and whether it has flags, so encoders can be instantiated once per case
+template <typename F>
+inline auto visitPresence(const InputEvent& event, F&& f) {
+    if (event.flags) return visitType<PRESENT_FLAGGED>(event.type, f);
+    return visitType<0>(event.type, f);
+}
+
+template <uint8_t Presence, size_t... I>
+constexpr size_t presentFieldCount(std::index_sequence<I...>) {
+    return (0 + ... + ((EVENT_FIELDS[I].presence & Presence) ? 1 : 0));
+}
+
+// ---------------------------------------------------------------- Key lookup
+//
+// A key is found with one table lookup and one compare: a hash of its
+// length and its first and last bytes picks the only candidate. The hash is
+// salted at compile time until every key of the set has a slot of its own.
+
+constexpr size_t KEY_INDEX_SLOTS = 64;
+constexpr uint32_t KEY_INDEX_NO_SALT = UINT32_MAX;      // No salt separates the keys
+
+constexpr uint32_t keySlot(const char* key, size_t length, uint32_t salt) {
+    uint32_t hash = (uint32_t)length * 0x9E3779B1u;
+    hash ^= (uint32_t)(uint8_t)key[0] * 0x85EBCA6Bu;
+    hash ^= (uint32_t)(uint8_t)key[length - 1] * 0xC2B2AE35u;
+    hash = (hash ^ salt) * 0x27D4EB2Fu;
+    return hash >> 26;
+}
+static_assert(KEY_INDEX_SLOTS == 64, "keySlot returns 6 bits");
+
+template <size_t N>
+struct KeyIndex {
+    const char* names[N];
+    uint8_t lengths[N];
+    uint32_t salt;
+    uint8_t slots[KEY_INDEX_SLOTS];     // Key number + 1, 0 for none
+
+    // The number of key in the set, or N if it is not one of them
+    size_t find(std::string_view key) const {
+        if (key.empty()) return N;
+        uint8_t entry = slots[keySlot(key.data(), key.size(), salt)];
+        if (entry == 0) return N;
+        size_t i = entry - 1u;
+        return lengths[i] == key.size() && std::memcmp(names[i], key.data(), key.size()) == 0 ? i : N;
+    }
+};
+
+template <size_t N>
+constexpr KeyIndex<N> makeKeyIndex(const std::array<const char*, N>& names) {
+    static_assert(N < KEY_INDEX_SLOTS / 2, "Too many keys for one index");
+    KeyIndex<N> index = {};
+    for (size_t i = 0; i < N; ++i) {
+        index.names[i] = names[i];
+        index.lengths[i] = (uint8_t)literalLength(names[i]);
+    }
+    for (uint32_t salt = 0; salt < 4096; ++salt) {
+        uint64_t taken = 0;
+        bool separated = true;
+        for (size_t i = 0; i < N && separated; ++i) {
+            uint64_t bit = 1ull << keySlot(names[i], index.lengths[i], salt);
+            separated = !(taken & bit);
+            taken |= bit;
+        }
+        if (separated) {
+            index.salt = salt;
+            for (size_t i = 0; i < N; ++i) {
+                index.slots[keySlot(names[i], index.lengths[i], salt)] = (uint8_t)(i + 1);
+            }
+            return index;
+        }
+    }
+    index.salt = KEY_INDEX_NO_SALT;
+    return index;
+}
+
+template <size_t... I>
+constexpr std::array<const char*, EVENT_FIELD_COUNT> eventFieldNames(std::index_sequence<I...>) {
+    return { EVENT_FIELDS[I].name... };
+}
+
+template <size_t... I>
+constexpr std::array<const char*, DEVICE_TYPE_COUNT> deviceTypeNames(std::index_sequence<I...>) {
+    return { DEVICE_TYPE_NAMES[I]... };
+}
+
+constexpr KeyIndex<EVENT_FIELD_COUNT> EVENT_FIELD_INDEX =
+    makeKeyIndex(eventFieldNames(std::make_index_sequence<EVENT_FIELD_COUNT>()));
+constexpr KeyIndex<DEVICE_TYPE_COUNT> DEVICE_TYPE_INDEX =
+    makeKeyIndex(deviceTypeNames(std::make_index_sequence<DEVICE_TYPE_COUNT>()));
+static_assert(EVENT_FIELD_INDEX.salt != KEY_INDEX_NO_SALT && DEVICE_TYPE_INDEX.salt != KEY_INDEX_NO_SALT,
+              "Schema keys must hash apart");
+
+template <typename F, size_t... I>
+inline bool visitFieldIndex(size_t index, F& f, std::index_sequence<I...>) {
+    bool result = false;
+    (void)((index == I ? (result = f(std::integral_constant<size_t, I>()), true) : false) || ...);
+    return result;
+}
+
+// Calls f(std::integral_constant<size_t, index>) so the field's reader is
+// generated for it; returns what f returns, or false for no such field
+template <typename F>
+inline bool visitField(size_t index, F&& f) {
+    return visitFieldIndex(index, f, std::make_index_sequence<EVENT_FIELD_COUNT>());
+}
+
+// ---------------------------------------------------------------- JSON
+
+template <size_t I>
+inline void writeJsonField(const InputEvent& event, char*& out) {
+    constexpr auto& key = FieldKey<I>::json;
+    constexpr size_t skip = (I == 0) ? 1 : 0;  // No comma before the first key
+    std::memcpy(out, key.data() + skip, key.size() - skip);
+    out += key.size() - skip;
+
+    constexpr FieldType type = EVENT_FIELDS[I].type;
+    constexpr size_t offset = EVENT_FIELDS[I].offset;
+    if constexpr (type == FieldType::Text) {
+        const char* text = reinterpret_cast<const char*>(&event) + offset;
+        *out++ = '"';
+        for (size_t i = 0; i < DEVICE_ID_MAX && text[i]; ++i) {
+            char c = text[i];
+            if (c == '"' || c == '\\') *out++ = '\\';
+            if ((unsigned char)c >= 0x20) *out++ = c;
+        }
+        *out++ = '"';
+    } else if constexpr (type == FieldType::Kind) {
+        const char* name = deviceTypeName(loadField<DeviceType>(event, offset));
+        size_t len = std::strlen(name);
+        *out++ = '"';
+        std::memcpy(out, name, len);
+        out += len;
+        *out++ = '"';
+    } else if constexpr (type == FieldType::UInt8) {
+        out = std::to_chars(out, out + 3, loadField<uint8_t>(event, offset)).ptr;
+    } else if constexpr (type == FieldType::Int32) {
+        out = std::to_chars(out, out + 11, loadField<int32_t>(event, offset)).ptr;
+    } else if constexpr (type == FieldType::UInt16) {
+        out = std::to_chars(out, out + 5, loadField<uint16_t>(event, offset)).ptr;
+    } else {
+        out = std::to_chars(out, out + 20, loadField<uint64_t>(event, offset)).ptr;
+    }
+}
+
+template <uint8_t Presence, size_t... I>
+inline char* writeJsonFields(const InputEvent& event, char* out, std::index_sequence<I...>) {
+    *out++ = '{';
+    ((void)((EVENT_FIELDS[I].presence & Presence) ? (writeJsonField<I>(event, out), 0) : 0), ...);
+    *out++ = '}';
+    return out;
+}
+
+// Writes one JSON object without trailing newline; out must hold
+// MAX_ENCODED_EVENT bytes. Returns the number of bytes written.
+inline size_t encodeEventJson(const InputEvent& event, char* out) {
+    return visitPresence(event, [&](auto presence) {
+        return (size_t)(writeJsonFields<decltype(presence)::value>(
+            event, out, std::make_index_sequence<EVENT_FIELD_COUNT>()) - out);
+    });
+}
+
+// ---------------------------------------------------------------- Binary
+//
+// Fields in schema order, little-endian: Text = u8 length + bytes,
+// Kind = u8, UInt8 = 1 byte, Int32 = 4 bytes, UInt16 = 2 bytes,
+// UInt64 = 8 bytes. The Kind byte has BINARY_KIND_FLAGGED set when the
+// flags field follows.
+
+constexpr uint8_t BINARY_KIND_FLAGGED = 0x80;
+
+template <typename T>
+inline void storeLE(uint8_t*& out, T value) {
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        *out++ = (uint8_t)((uint64_t)value >> (8 * i));
+    }
+}
+
+template <typename T>
+inline T loadLE(const uint8_t* in) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        value |= (uint64_t)in[i] << (8 * i);
+    }
+    return (T)value;
+}
+
+template <size_t I>
+inline void writeBinaryField(const InputEvent& event, uint8_t*& out) {
+    constexpr FieldType type = EVENT_FIELDS[I].type;
+    constexpr size_t offset = EVENT_FIELDS[I].offset;
+    if constexpr (type == FieldType::Text) {
+        const char* text = reinterpret_cast<const char*>(&event) + offset;
+        size_t len = strnlen(text, DEVICE_ID_MAX - 1);
+        *out++ = (uint8_t)len;
+        std::memcpy(out, text, len);
+        out += len;
+    } else if constexpr (type == FieldType::Kind) {
+        *out++ = (uint8_t)loadField<DeviceType>(event, offset) | (event.flags ? BINARY_KIND_FLAGGED : 0);
+    } else if constexpr (type == FieldType::UInt8) {
+        *out++ = loadField<uint8_t>(event, offset);
+    } else if constexpr (type == FieldType::Int32) {
+        storeLE(out, loadField<uint32_t>(event, offset));
+    } else if constexpr (type == FieldType::UInt16) {
+        storeLE(out, loadField<uint16_t>(event, offset));
+    } else {
+        storeLE(out, loadField<uint64_t>(event, offset));
+    }
+}
+
+template <uint8_t Presence, size_t... I>
+inline uint8_t* writeBinaryFields(const InputEvent& event, uint8_t* out, std::index_sequence<I...>) {
+    ((void)((EVENT_FIELDS[I].presence & Presence) ? (writeBinaryField<I>(event, out), 0) : 0), ...);
+    return out;
+}
+
+// Packs one event; out must hold MAX_ENCODED_EVENT bytes. Returns its size.
+inline size_t encodeEventBinary(const InputEvent& event, uint8_t* out) {
+    return visitPresence(event, [&](auto presence) {
+        return (size_t)(writeBinaryFields<decltype(presence)::value>(
+            event, out, std::make_index_sequence<EVENT_FIELD_COUNT>()) - out);
+    });
+}
+
+// presence starts as the Unknown type's and is set by the Kind byte
+template <size_t I>
+inline bool readBinaryField(InputEvent& event, const uint8_t*& in, const uint8_t* end, uint8_t& presence) {
+    if (!(EVENT_FIELDS[I].presence & presence)) return true;
+
+    constexpr FieldType type = EVENT_FIELDS[I].type;
+    constexpr size_t offset = EVENT_FIELDS[I].offset;
+    if constexpr (type == FieldType::Text) {
+        if (in >= end) return false;
+        size_t len = *in++;
+        if (len >= DEVICE_ID_MAX || (size_t)(end - in) < len) return false;
+        char* text = reinterpret_cast<char*>(&event) + offset;
+        std::memcpy(text, in, len);
+        text[len] = '\0';
+        in += len;
+    } else if constexpr (type == FieldType::Kind) {
+        if (in >= end || (*in & ~BINARY_KIND_FLAGGED) >= DEVICE_TYPE_COUNT) return false;
+        DeviceType kind = (DeviceType)(*in & ~BINARY_KIND_FLAGGED);
+        presence = presenceBit(kind) | ((*in++ & BINARY_KIND_FLAGGED) ? PRESENT_FLAGGED : 0);
+        storeField(event, offset, kind);
+    } else if constexpr (type == FieldType::UInt8) {
+        if (in >= end) return false;
+        storeField(event, offset, *in++);
+    } else if constexpr (type == FieldType::Int32) {
+        if (end - in < 4) return false;
+        storeField(event, offset, loadLE<int32_t>(in));
+        in += 4;
+    } else if constexpr (type == FieldType::UInt16) {
+        if (end - in < 2) return false;
+        storeField(event, offset, loadLE<uint16_t>(in));
+        in += 2;
+    } else {
+        if (end - in < 8) return false;
+        storeField(event, offset, loadLE<uint64_t>(in));
+        in += 8;
+    }
+    return true;
+}
+
+template <size_t... I>
+inline bool readBinaryFields(InputEvent& event, const uint8_t*& in, const uint8_t* end, std::index_sequence<I...>) {
+    uint8_t presence = presenceBit(DeviceType::Unknown);
+    return (readBinaryField<I>(event, in, end, presence) && ...);
+}
+
+// Unpacks one event. Returns the number of bytes used, or 0 if malformed.
+inline size_t decodeEventBinary(const uint8_t* data, size_t size, InputEvent& event) {
+    event = InputEvent();
+    event.type = DeviceType::Unknown;
+    const uint8_t* in = data;
+    if (!readBinaryFields(event, in, data + size, std::make_index_sequence<EVENT_FIELD_COUNT>())) {
+        return 0;
+    }
+    return (size_t)(in - data);
+}
+
+// ---------------------------------------------------------------- CBOR
+//
+// One definite-length map per event with text keys (RFC 8949). A stream of
+// these is a CBOR sequence (RFC 8742) and needs no further framing.
+
+inline void writeCborHead(uint8_t*& out, uint8_t major, uint64_t value) {
+    major <<= 5;
+    if (value < 24) {
+        *out++ = (uint8_t)(major | value);
+    } else if (value <= 0xFF) {
+        *out++ = (uint8_t)(major | 24);
+        *out++ = (uint8_t)value;
+    } else if (value <= 0xFFFF) {
+        *out++ = (uint8_t)(major | 25);
+        *out++ = (uint8_t)(value >> 8);
+        *out++ = (uint8_t)value;
+    } else if (value <= 0xFFFFFFFFull) {
+        *out++ = (uint8_t)(major | 26);
+        for (int shift = 24; shift >= 0; shift -= 8) *out++ = (uint8_t)(value >> shift);
+    } else {
+        *out++ = (uint8_t)(major | 27);
+        for (int shift = 56; shift >= 0; shift -= 8) *out++ = (uint8_t)(value >> shift);
+    }
+}
+
+inline void writeCborText(uint8_t*& out, const char* text, size_t len) {
+    writeCborHead(out, 3, len);
+    std::memcpy(out, text, len);
+    out += len;
+}
+
+template <size_t I>
+inline void writeCborField(const InputEvent& event, uint8_t*& out) {
+    constexpr auto& key = FieldKey<I>::cbor;
+    std::memcpy(out, key.data(), key.size());
+    out += key.size();
+
+    constexpr FieldType type = EVENT_FIELDS[I].type;
+    constexpr size_t offset = EVENT_FIELDS[I].offset;
+    if constexpr (type == FieldType::Text) {
+        const char* text = reinterpret_cast<const char*>(&event) + offset;
+        writeCborText(out, text, strnlen(text, DEVICE_ID_MAX - 1));
+    } else if constexpr (type == FieldType::Kind) {
+        const char* name = deviceTypeName(loadField<DeviceType>(event, offset));
+        writeCborText(out, name, std::strlen(name));
+    } else if constexpr (type == FieldType::UInt8) {
+        writeCborHead(out, 0, loadField<uint8_t>(event, offset));
+    } else if constexpr (type == FieldType::Int32) {
+        int32_t value = loadField<int32_t>(event, offset);
+        if (value >= 0) writeCborHead(out, 0, (uint64_t)value);
+        else writeCborHead(out, 1, (uint64_t)(-1 - (int64_t)value));
+    } else if constexpr (type == FieldType::UInt16) {
+        writeCborHead(out, 0, loadField<uint16_t>(event, offset));
+    } else {
+        writeCborHead(out, 0, loadField<uint64_t>(event, offset));
+    }
+}
+
+template <uint8_t Presence, size_t... I>
+inline uint8_t* writeCborFields(const InputEvent& event, uint8_t* out, std::index_sequence<I...> seq) {
+    constexpr size_t count = presentFieldCount<Presence>(seq);
+    static_assert(count < 24, "CBOR map header must fit one byte");
+    *out++ = (uint8_t)(0xA0 | count);
+    ((void)((EVENT_FIELDS[I].presence & Presence) ? (writeCborField<I>(event, out), 0) : 0), ...);
+    return out;
+}
+
+// Encodes one event as a CBOR map; out must hold MAX_ENCODED_EVENT bytes
+inline size_t encodeEventCbor(const InputEvent& event, uint8_t* out) {
+    return visitPresence(event, [&](auto presence) {
+        return (size_t)(writeCborFields<decltype(presence)::value>(
+            event, out, std::make_index_sequence<EVENT_FIELD_COUNT>()) - out);
+    });
+}
+
+inline bool readCborHead(const uint8_t*& in, const uint8_t* end, uint8_t& major, uint64_t& value) {
+    if (in >= end) return false;
+    major = *in >> 5;
+    uint8_t info = *in++ & 0x1F;
+    if (info < 24) {
+        value = info;
+        return true;
+    }
+    if (info > 27) return false;    // Indefinite lengths are never produced
+    size_t bytes = (size_t)1 << (info - 24);
+    if ((size_t)(end - in) < bytes) return false;
+    value = 0;
+    for (size_t i = 0; i < bytes; ++i) value = (value << 8) | *in++;
+    return true;
+}
+
+// Stores one CBOR value in field I if it has the field's kind
+template <size_t I>
+inline bool readCborField(InputEvent& event, uint8_t major, uint64_t value, const uint8_t* text) {
+    constexpr FieldType type = EVENT_FIELDS[I].type;
+    constexpr size_t offset = EVENT_FIELDS[I].offset;
+    if constexpr (type == FieldType::Text) {
+        if (major != 3 || value >= DEVICE_ID_MAX) return false;
+        char* dst = reinterpret_cast<char*>(&event) + offset;
+        std::memcpy(dst, text, value);
+        dst[value] = '\0';
+    } else if constexpr (type == FieldType::Kind) {
+        if (major != 3) return false;
+        size_t kind = DEVICE_TYPE_INDEX.find(std::string_view(reinterpret_cast<const char*>(text), value));
+        if (kind < DEVICE_TYPE_COUNT) storeField(event, offset, (DeviceType)kind);
+    } else if constexpr (type == FieldType::UInt8) {
+        if (major != 0 || value > UINT8_MAX) return false;
+        storeField(event, offset, (uint8_t)value);
+    } else if constexpr (type == FieldType::Int32) {
+        if (major == 3) return false;
+        storeField(event, offset, major == 0 ? (int32_t)value : (int32_t)(-1 - (int64_t)value));
+    } else if constexpr (type == FieldType::UInt16) {
+        if (major != 0 || value > UINT16_MAX) return false;
+        storeField(event, offset, (uint16_t)value);
+    } else {
+        if (major != 0) return false;
+        storeField(event, offset, value);
+    }
+    return true;
+}
+
+// Decodes one CBOR map written by encodeEventCbor. Keys are matched against
+// the schema; unknown keys with integer or text values are skipped.
+// Returns the number of bytes used, or 0 if malformed.
+inline size_t decodeEventCbor(const uint8_t* data, size_t size, InputEvent& event) {
+    event = InputEvent();
+    event.type = DeviceType::Unknown;
+    const uint8_t* in = data;
+    const uint8_t* end = data + size;
+
+    uint8_t major;
+    uint64_t pairs;
+    if (!readCborHead(in, end, major, pairs) || major != 5) return 0;
+
+    for (uint64_t p = 0; p < pairs; ++p) {
+        uint64_t keyLen;
+        if (!readCborHead(in, end, major, keyLen) || major != 3 || (uint64_t)(end - in) < keyLen) return 0;
+        std::string_view key(reinterpret_cast<const char*>(in), (size_t)keyLen);
+        in += keyLen;
+
+        uint64_t value;
+        if (!readCborHead(in, end, major, value)) return 0;
+        const uint8_t* text = in;
+        if (major == 3) {
+            if ((uint64_t)(end - in) < value) return 0;
+            in += value;
+        } else if (major != 0 && major != 1) {
+            return 0;
+        }
+
+        size_t field = EVENT_FIELD_INDEX.find(key);
+        if (field < EVENT_FIELD_COUNT && !visitField(field, [&](auto index) {
+                return readCborField<decltype(index)::value>(event, major, value, text);
+            })) {
+            return 0;
+        }
+    }
+    return (size_t)(in - data);
+}
+
+// ---------------------------------------------------------------- Streams
+//
+// Each client picks one stream format. JSON records end in '\n', CBOR maps
+// follow each other directly, and binary records are framed as
+// [u16 LE payload length][u8 frame type][payload]. Compact streams are
+// stateful and are written by CompactEncoder (compact_codec.h), not by
+// appendEvent/appendControl.
+
+enum class StreamFormat : uint8_t {
+    Json,
+    Binary,
+    Cbor,
+    Compact
+};
+
+constexpr int PROTOCOL_VERSION = 1;     // Reported in "hello" replies
+constexpr size_t STREAM_FORMAT_COUNT = 4;
+constexpr const char* STREAM_FORMAT_NAMES[] = { "json", "binary", "cbor", "compact" };
+
+constexpr uint8_t FRAME_EVENT = 0;      // Payload from encodeEventBinary
+constexpr uint8_t FRAME_CONTROL = 1;    // Payload is a JSON control record
+constexpr size_t FRAME_HEADER_SIZE = 3;
+
+inline bool parseStreamFormat(std::string_view name, StreamFormat& format) {
+    for (size_t i = 0; i < STREAM_FORMAT_COUNT; ++i) {
+        if (name == STREAM_FORMAT_NAMES[i]) {
+            format = (StreamFormat)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Non-event records such as hello, gap and format replies. Fields hold an
+// unsigned value, or a string when text is set.
+struct ControlField {
+    const char* key;
+    uint64_t value;
+    const char* text;
+};
+
+struct ControlRecord {
+    const char* type;
+    ControlField fields[10];
+    size_t count;
+};
+
+inline size_t encodeControlJson(const ControlRecord& record, char* out) {
+    char* p = out;
+    auto put = [&p](const char* text) { size_t len = std::strlen(text); std::memcpy(p, text, len); p += len; };
+
+    put("{\"type\":\"");
+    put(record.type);
+    *p++ = '"';
+    for (size_t i = 0; i < record.count; ++i) {
+        const ControlField& field = record.fields[i];
+        put(",\"");
+        put(field.key);
+        put("\":");
+        if (field.text) {
+            *p++ = '"';
+            put(field.text);
+            *p++ = '"';
+        } else {
+            p = std::to_chars(p, p + 20, field.value).ptr;
+        }
+    }
+    *p++ = '}';
+    return (size_t)(p - out);
+}
+
+inline size_t encodeControlCbor(const ControlRecord& record, uint8_t* out) {
+    uint8_t* p = out;
+    writeCborHead(p, 5, record.count + 1);
+    writeCborText(p, "type", 4);
+    writeCborText(p, record.type, std::strlen(record.type));
+    for (size_t i = 0; i < record.count; ++i) {
+        const ControlField& field = record.fields[i];
+        writeCborText(p, field.key, std::strlen(field.key));
+        if (field.text) writeCborText(p, field.text, std::strlen(field.text));
+        else writeCborHead(p, 0, field.value);
+    }
+    return (size_t)(p - out);
+}
+
+inline void writeFrameHeader(char* out, size_t payloadSize, uint8_t frameType) {
+    out[0] = (char)(payloadSize & 0xFF);
+    out[1] = (char)(payloadSize >> 8);
+    out[2] = (char)frameType;
+}
+
+// Appends one event to out in the given stream format
+inline void appendEvent(StreamFormat format, const InputEvent& event, std::string& out) {
+    char buffer[FRAME_HEADER_SIZE + MAX_ENCODED_EVENT];
+    size_t n;
+
+    switch (format) {
+        case StreamFormat::Binary:
+            n = encodeEventBinary(event, reinterpret_cast<uint8_t*>(buffer + FRAME_HEADER_SIZE));
+            writeFrameHeader(buffer, n, FRAME_EVENT);
+            n += FRAME_HEADER_SIZE;
+            break;
+        case StreamFormat::Cbor:
+            n = encodeEventCbor(event, reinterpret_cast<uint8_t*>(buffer));
+            break;
+        default:
+            n = encodeEventJson(event, buffer);
+            buffer[n++] = '\n';
+            break;
+    }
+    out.append(buffer, n);
+}
+
+// Appends one control record to out in the given stream format
+inline void appendControl(StreamFormat format, const ControlRecord& record, std::string& out) {
+    char buffer[FRAME_HEADER_SIZE + MAX_ENCODED_EVENT];
+    size_t n;
+
+    switch (format) {
+        case StreamFormat::Binary:
+            n = encodeControlJson(record, buffer + FRAME_HEADER_SIZE);
+            writeFrameHeader(buffer, n, FRAME_CONTROL);
+            n += FRAME_HEADER_SIZE;
+            break;
+        case StreamFormat::Cbor:
+            n = encodeControlCbor(record, reinterpret_cast<uint8_t*>(buffer));
+            break;
+        default:
+            n = encodeControlJson(record, buffer);
+            buffer[n++] = '\n';
+            break;
+    }
+    out.append(buffer, n);
+}
@@ -0,0 +1,63 @@
+// event_types.h - Portable event definitions shared by the service and clients
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+constexpr size_t DEVICE_ID_MAX = 48;    // Including the terminating NUL
+
+// Device types
+enum class DeviceType : uint8_t {
+    Keyboard,
+    Mouse,
+    Unknown,
+    Cursor,         // A user's virtual cursor (cursor.h); device_id is the user
+    Hotkey          // A hotkey was typed (hotkey.h); device_id is the keyboard
+};
+
+// Modifiers of a keyboard event (keymap.h)
+constexpr uint16_t KEY_MOD_SHIFT = 1 << 0;
+constexpr uint16_t KEY_MOD_CTRL = 1 << 1;
+constexpr uint16_t KEY_MOD_ALT = 1 << 2;
+constexpr uint16_t KEY_MOD_WIN = 1 << 3;
+constexpr uint16_t KEY_MOD_CAPS = 1 << 4;       // Caps Lock is on
+constexpr uint16_t KEY_MOD_ALTGR = 1 << 5;      // Set instead of Ctrl and Alt
+
+// InputEvent::flags
+constexpr uint8_t EVENT_FLAG_SYNTHETIC = 1 << 0;    // Replayed by a macro (macro.h), not typed
+
+// Input event structure (POD so it can be batched, copied and packed freely)
+struct InputEvent {
+    char device_id[DEVICE_ID_MAX];
+    DeviceType type;
+    uint8_t flags;          // EVENT_FLAG_*
+    union {
+        struct {
+            int vkey;
+            uint16_t scan;      // Set 1 make code, 0xE0xx if extended
+            uint16_t ch;        // WM_CHAR value in the keyboard's layout; 0: none
+            uint16_t mods;      // KEY_MOD_*
+            uint8_t up;         // Release; only seen by the service's stages
+        } keyboard;
+        struct { int dx; int dy; int buttons; } mouse;
+        struct { int x; int y; uint16_t abs_x; uint16_t abs_y; } cursor;     // abs_*: 0..65535 over the desktop
+        struct { uint16_t id; } hotkey;     // The number the hotkey file gives it
+    } data;
+    uint64_t timestamp;
+    uint64_t seq;           // Assigned by SocketServer::publish, starts at 1
+};
+
+// FNV-1a of a device ID, for sharding and per-device state tables
+inline uint64_t hashDeviceId(const char* id) {
+    uint64_t hash = 1469598103934665603ull;
+    for (size_t i = 0; i < DEVICE_ID_MAX && id[i]; ++i) {
+        hash = (hash ^ (uint8_t)id[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+inline void setDeviceId(InputEvent& event, const char* id, size_t len) {
+    if (len >= DEVICE_ID_MAX) len = DEVICE_ID_MAX - 1;
+    std::memcpy(event.device_id, id, len);
+    event.device_id[len] = '\0';
+}
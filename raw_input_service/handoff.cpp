@@ -0,0 +1,173 @@
+// handoff.cpp - Hand-off pipe protocol
+//
+// New process -> old:  u32 magic, u32 version, u32 tick it registered for
+//                      raw input at
+// Old process -> new:  the state (handoff_channel.cpp), taken after
+//                      capture stopped
+// New process -> old:  u8 1 once it serves the clients, 0 if it gave up
+// Old process -> new:  events published after the state was taken (relays)
+#include "handoff.h"
+#include "socket_server.h"
+
+constexpr DWORD HANDOFF_CONNECT_TIMEOUT_MS = 5000;
+constexpr DWORD HANDOFF_PIPE_BUFFER = 64 * 1024;
+
+static std::wstring handoffPipeName(int port) {
+    return L"\\\\.\\pipe\\raw_input_service_handoff_" + std::to_wstring(port);
+}
+
+bool HandoffServer::start(int port, DWORD notifyThreadId, const CaptureControl& capture) {
+    if (running_) return false;
+    pipeName_ = handoffPipeName(port);
+    notifyThreadId_ = notifyThreadId;
+    capture_ = capture;
+    running_ = true;
+    finished_ = false;
+    thread_ = std::thread(&HandoffServer::listenLoop, this);
+    return true;
+}
+
+void HandoffServer::stop() {
+    if (!running_ && !thread_.joinable()) return;
+    running_ = false;
+
+    // Wake ConnectNamedPipe by connecting to ourselves
+    while (!finished_) {
+        HANDLE wake = CreateFileW(pipeName_.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (wake != INVALID_HANDLE_VALUE) {
+            CloseHandle(wake);
+        }
+        Sleep(10);
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void HandoffServer::listenLoop() {
+    bool handedOff = false;
+
+    while (running_ && !handedOff) {
+        // Local clients only; the default DACL limits write access to the
+        // owner and administrators
+        HANDLE pipe = CreateNamedPipeW(pipeName_.c_str(), PIPE_ACCESS_DUPLEX,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            1, HANDOFF_PIPE_BUFFER, HANDOFF_PIPE_BUFFER, 0, nullptr);
+        if (pipe == INVALID_HANDLE_VALUE) {
+            LOG("Failed to create hand-off pipe: " + std::to_string(GetLastError()));
+            break;
+        }
+
+        bool connected = ConnectNamedPipe(pipe, nullptr) || GetLastError() == ERROR_PIPE_CONNECTED;
+        if (connected && running_) {
+            handedOff = serveRequest(pipe);
+        }
+        FlushFileBuffers(pipe);
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
+    }
+
+    finished_ = true;
+    if (handedOff) {
+        PostThreadMessageW(notifyThreadId_, WM_QUIT, 0, 0);
+    }
+}
+
+bool HandoffServer::serveRequest(HANDLE pipe) {
+    // Sockets are duplicated for the process at the other end, whatever it claims
+    ULONG clientPid = 0;
+    uint32_t request[3];
+    if (!GetNamedPipeClientProcessId(pipe, &clientPid)) {
+        return false;
+    }
+    HandoffChannel channel(pipe, clientPid);
+    if (!channel.read(request, sizeof(request)) || request[0] != HANDOFF_MAGIC || request[1] != HANDOFF_VERSION) {
+        return false;
+    }
+    LOG("Hand-off requested by process " + std::to_string(clientPid));
+
+    // Everything captured up to the cut is published before the state is
+    // taken; the new process has the rest in its own queue
+    HandoffState state;
+    DWORD frozenAt = GetTickCount();
+    if (!capture_.freeze(request[2], state.cut, state.stages)) {
+        LOG("Hand-off refused: capture did not stop");
+        capture_.resume();
+        return false;
+    }
+    if (!SocketServer::instance().beginHandoff(state)) {
+        capture_.resume();
+        return false;
+    }
+
+    uint8_t ack = 0;
+    bool ok = writeHandoffState(channel, state) && channel.read(&ack, 1) && ack == 1;
+    if (!ok) {
+        LOG("Hand-off to process " + std::to_string(clientPid) + " failed: " + std::to_string(WSAGetLastError()));
+    }
+    std::vector<InputEvent> published;
+    SocketServer::instance().finishHandoff(ok, published);
+    if (!ok) {
+        capture_.resume();
+        LOG("Raw input from tick " + std::to_string(frozenAt) + " to " + std::to_string(GetTickCount()) +
+            " was not captured");
+        return false;
+    }
+    if (!writeHandoffEvents(channel, published)) {
+        LOG("Failed to pass on " + std::to_string(published.size()) + " events published during the hand-off");
+    }
+    return true;
+}
+
+bool takeOver(int port, DWORD registeredTick, CaptureCut& cut, std::string& stages) {
+    std::wstring name = handoffPipeName(port);
+    if (!WaitNamedPipeW(name.c_str(), HANDOFF_CONNECT_TIMEOUT_MS)) {
+        LOG("No service to take over on port " + std::to_string(port));
+        return false;
+    }
+    HANDLE pipe = CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        LOG("Failed to open hand-off pipe: " + std::to_string(GetLastError()));
+        return false;
+    }
+
+    // Keeps Winsock loaded while importing; adopt() takes its own reference
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        CloseHandle(pipe);
+        return false;
+    }
+
+    HandoffChannel channel(pipe, 0);
+    uint32_t request[3] = { HANDOFF_MAGIC, HANDOFF_VERSION, (uint32_t)registeredTick };
+    HandoffState state;
+    bool ok = channel.write(request, sizeof(request)) && readHandoffState(channel, state);
+    if (!ok) {
+        LOG("Invalid hand-off state: " + std::to_string(WSAGetLastError()));
+    } else if (state.clients.size() > MAX_CLIENTS || state.history.size() > HISTORY_SIZE) {
+        LOG("Hand-off state exceeds this build's limits");
+        ok = false;
+    }
+
+    ok = ok && SocketServer::instance().adopt(state);
+    uint8_t ack = ok ? 1 : 0;
+    std::vector<InputEvent> published;
+    if (!channel.write(&ack, 1) && ok) {
+        // The old process did not hear back and keeps serving
+        LOG("Failed to confirm hand-off");
+        SocketServer::instance().release();
+        ok = false;
+    } else if (!ok) {
+        closeHandoffSockets(state);
+    } else if (readHandoffEvents(channel, published)) {
+        SocketServer::instance().publishBatch(published);
+    } else {
+        LOG("Events published during the hand-off were not received");
+    }
+
+    WSACleanup();
+    CloseHandle(pipe);
+    cut = state.cut;
+    stages = std::move(state.stages);
+    return ok;
+}
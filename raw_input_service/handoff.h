@@ -0,0 +1,66 @@
+// handoff.h - Zero-downtime restart by handing sockets to a new process
+//
+// A running service listens on a named pipe. A new instance started with
+// --takeover registers for raw input and connects to it. The old one then
+// stops capture (the new process already receives the same input), lets
+// everything captured so far reach its server, freezes the server and
+// sends the listening and client sockets over the pipe (handoff_channel.h)
+// with the queued events, unsent bytes, credit state, history and sequence
+// counters. Clients keep their connections and see no gap in seq, and each
+// raw input is published by exactly one of the two processes.
+//
+// Cursor positions (cursor.h) and users' recorded macros (macro.h) go
+// along with that state. The rest of the pipeline stages' state is kept
+// per worker shard or in flight, and starts over in the new process, which
+// logs so: held modifiers, hotkey sequences and recordings in progress,
+// and sub-pixel motion remainders. Caps Lock starts from the host's state,
+// as at any start (keymap.h).
+#pragma once
+#include "common.h"
+#include "handoff_channel.h"
+#include <atomic>
+#include <thread>
+
+// How the hand-off stops and restarts the old process's event sources.
+// freeze stops raw input capture once GetTickCount() is past
+// registeredTick, the tick the new process registered at, and returns once
+// everything captured is published; it reports where capture stopped and
+// the stage state to pass on. resume restarts capture when the hand-off
+// fails.
+struct CaptureControl {
+    bool (*freeze)(DWORD registeredTick, CaptureCut& cut, std::string& stages) = nullptr;
+    void (*resume)() = nullptr;
+};
+
+// Runs in every instance and serves one hand-off request
+class HandoffServer {
+public:
+    static HandoffServer& instance() {
+        static HandoffServer inst;
+        return inst;
+    }
+
+    // After a successful hand-off, WM_QUIT is posted to notifyThreadId
+    bool start(int port, DWORD notifyThreadId, const CaptureControl& capture);
+    void stop();
+
+private:
+    HandoffServer() : running_(false), finished_(true), notifyThreadId_(0) {}
+    ~HandoffServer() { stop(); }
+
+    void listenLoop();
+    bool serveRequest(HANDLE pipe);
+
+    std::wstring pipeName_;
+    std::atomic<bool> running_;
+    std::atomic<bool> finished_;
+    DWORD notifyThreadId_;
+    CaptureControl capture_;
+    std::thread thread_;
+};
+
+// Takes the server over from the instance listening on port, after raw
+// input was registered at registeredTick. On success SocketServer is
+// running with the adopted sockets, cut tells which raw input the old
+// process already published, and stages holds the old process's stage state.
+bool takeOver(int port, DWORD registeredTick, CaptureCut& cut, std::string& stages);
@@ -0,0 +1,255 @@
+// handoff_channel.cpp - Hand-off state format and socket passing
+//
+// State, old process -> new:
+//   HandoffHeader, the listening socket, then per client a
+//   HandoffClientHeader, its partial command bytes, its unsent stream bytes,
+//   the events it holds for credit as raw InputEvents and its socket, then
+//   the history and pending events as raw InputEvent records, then the
+//   stage state bytes
+// Events:  u32 count, then the raw InputEvent records
+//
+// A socket is a WSAPROTOCOL_INFOW on Windows, and one byte carrying the
+// descriptor as SCM_RIGHTS ancillary data elsewhere.
+#include "handoff_channel.h"
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+#include <cstring>
+
+struct HandoffHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t nextSeq;
+    uint64_t lastSentSeq;
+    uint32_t cutTick;
+    uint32_t cutCount;
+    uint32_t clientCount;
+    uint32_t historyCount;
+    uint32_t pendingCount;
+    uint32_t stagesLength;
+};
+
+struct HandoffClientHeader {
+    uint32_t format;
+    uint32_t partialLength;
+    uint32_t backlogLength;
+    uint32_t credited;
+    uint32_t heldCount;
+    uint64_t credits;
+};
+
+#ifdef _WIN32
+
+bool HandoffChannel::read(void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        DWORD read = 0;
+        if (!ReadFile(pipe_, p, (DWORD)size, &read, nullptr) || read == 0) {
+            return false;
+        }
+        p += read;
+        size -= read;
+    }
+    return true;
+}
+
+bool HandoffChannel::write(const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        DWORD written = 0;
+        if (!WriteFile(pipe_, p, (DWORD)size, &written, nullptr) || written == 0) {
+            return false;
+        }
+        p += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool HandoffChannel::sendSocket(NativeSocket socket) {
+    WSAPROTOCOL_INFOW info;
+    return WSADuplicateSocketW(socket, peerProcessId_, &info) == 0 && write(&info, sizeof(info));
+}
+
+bool HandoffChannel::receiveSocket(NativeSocket& socket) {
+    WSAPROTOCOL_INFOW info;
+    if (!read(&info, sizeof(info))) return false;
+    socket = WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &info, 0, WSA_FLAG_OVERLAPPED);
+    return socket != INVALID_SOCKET;
+}
+
+#else
+
+bool HandoffChannel::read(void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = ::read(fd_, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+bool HandoffChannel::write(const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd_, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+bool HandoffChannel::sendSocket(NativeSocket socket) {
+    char byte = 0;
+    iovec iov = { &byte, 1 };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(header), &socket, sizeof(int));
+
+    ssize_t n;
+    do {
+        n = sendmsg(fd_, &message, 0);
+    } while (n < 0 && errno == EINTR);
+    return n == 1;
+}
+
+bool HandoffChannel::receiveSocket(NativeSocket& socket) {
+    char byte;
+    iovec iov = { &byte, 1 };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(fd_, &message, 0);
+    } while (n < 0 && errno == EINTR);
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if (n != 1 || (message.msg_flags & MSG_CTRUNC) || !header || header->cmsg_level != SOL_SOCKET ||
+        header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(sizeof(int))) {
+        return false;
+    }
+    std::memcpy(&socket, CMSG_DATA(header), sizeof(int));
+    return true;
+}
+
+#endif
+
+static bool writeEvents(HandoffChannel& channel, const std::vector<InputEvent>& events) {
+    return channel.write(events.data(), events.size() * sizeof(InputEvent));
+}
+
+static bool readEvents(HandoffChannel& channel, std::vector<InputEvent>& events, size_t count) {
+    events.resize(count);
+    return channel.read(events.data(), count * sizeof(InputEvent));
+}
+
+bool writeHandoffState(HandoffChannel& channel, const HandoffState& state) {
+    HandoffHeader header = { HANDOFF_MAGIC, HANDOFF_VERSION, state.nextSeq, state.lastSentSeq, state.cut.tick,
+                             state.cut.count, (uint32_t)state.clients.size(), (uint32_t)state.history.size(),
+                             (uint32_t)state.pending.size(), (uint32_t)state.stages.size() };
+    if (!channel.write(&header, sizeof(header)) || !channel.sendSocket(state.listenSocket)) {
+        return false;
+    }
+
+    for (const HandoffClient& client : state.clients) {
+        HandoffClientHeader clientHeader = {};
+        clientHeader.format = (uint32_t)client.format;
+        clientHeader.partialLength = (uint32_t)client.partial.size();
+        clientHeader.backlogLength = (uint32_t)client.backlog.size();
+        clientHeader.credited = client.credited ? 1 : 0;
+        clientHeader.heldCount = (uint32_t)client.held.size();
+        clientHeader.credits = client.credits;
+        if (!channel.write(&clientHeader, sizeof(clientHeader)) ||
+            !channel.write(client.partial.data(), client.partial.size()) ||
+            !channel.write(client.backlog.data(), client.backlog.size()) || !writeEvents(channel, client.held) ||
+            !channel.sendSocket(client.socket)) {
+            return false;
+        }
+    }
+    return writeEvents(channel, state.history) && writeEvents(channel, state.pending) &&
+           channel.write(state.stages.data(), state.stages.size());
+}
+
+bool readHandoffState(HandoffChannel& channel, HandoffState& state) {
+    HandoffHeader header;
+    if (!channel.read(&header, sizeof(header)) || header.magic != HANDOFF_MAGIC ||
+        header.version != HANDOFF_VERSION || header.clientCount > HANDOFF_MAX_CLIENTS ||
+        header.historyCount > HANDOFF_MAX_EVENTS || header.pendingCount > HANDOFF_MAX_EVENTS ||
+        header.stagesLength > HANDOFF_MAX_STAGE_BYTES || !channel.receiveSocket(state.listenSocket)) {
+        return false;
+    }
+    state.nextSeq = header.nextSeq;
+    state.lastSentSeq = header.lastSentSeq;
+    state.cut.tick = header.cutTick;
+    state.cut.count = header.cutCount;
+
+    for (uint32_t i = 0; i < header.clientCount; ++i) {
+        HandoffClientHeader clientHeader;
+        if (!channel.read(&clientHeader, sizeof(clientHeader)) || clientHeader.partialLength > HANDOFF_MAX_BYTES ||
+            clientHeader.backlogLength > HANDOFF_MAX_BYTES || clientHeader.format >= STREAM_FORMAT_COUNT ||
+            clientHeader.heldCount > HANDOFF_MAX_EVENTS) {
+            return false;
+        }
+        HandoffClient client;
+        client.format = (StreamFormat)clientHeader.format;
+        client.credited = clientHeader.credited != 0;
+        client.credits = clientHeader.credits;
+        client.partial.resize(clientHeader.partialLength);
+        client.backlog.resize(clientHeader.backlogLength);
+        if (!channel.read(&client.partial[0], client.partial.size()) ||
+            !channel.read(&client.backlog[0], client.backlog.size()) ||
+            !readEvents(channel, client.held, clientHeader.heldCount) || !channel.receiveSocket(client.socket)) {
+            return false;
+        }
+        state.clients.push_back(std::move(client));
+    }
+    state.stages.resize(header.stagesLength);
+    return readEvents(channel, state.history, header.historyCount) &&
+           readEvents(channel, state.pending, header.pendingCount) &&
+           channel.read(&state.stages[0], state.stages.size());
+}
+
+bool writeHandoffEvents(HandoffChannel& channel, const std::vector<InputEvent>& events) {
+    uint32_t count = (uint32_t)events.size();
+    return channel.write(&count, sizeof(count)) && writeEvents(channel, events);
+}
+
+bool readHandoffEvents(HandoffChannel& channel, std::vector<InputEvent>& events) {
+    uint32_t count;
+    return channel.read(&count, sizeof(count)) && count <= HANDOFF_MAX_EVENTS && readEvents(channel, events, count);
+}
+
+void closeHandoffSockets(const HandoffState& state) {
+    std::vector<NativeSocket> sockets;
+    sockets.push_back(state.listenSocket);
+    for (const HandoffClient& client : state.clients) {
+        sockets.push_back(client.socket);
+    }
+    for (NativeSocket socket : sockets) {
+        if (socket == HANDOFF_NO_SOCKET) continue;
+#ifdef _WIN32
+        closesocket(socket);
+#else
+        close(socket);
+#endif
+    }
+}
@@ -0,0 +1,94 @@
+// handoff_channel.h - State and sockets passed from one process to another
+//
+// The transport half of the hand-off (handoff.h). A HandoffChannel is a
+// byte stream between the old and the new process that can also carry
+// sockets: on Windows a named pipe plus WSADuplicateSocketW, elsewhere an
+// AF_UNIX stream socket with SCM_RIGHTS. writeHandoffState and
+// readHandoffState move a whole HandoffState over one; they are portable,
+// so the format is tested off Windows.
+#pragma once
+#include "async_io.h"
+#include "event_schema.h"
+#include <string>
+#include <vector>
+
+constexpr uint32_t HANDOFF_MAGIC = 0x46444852;         // "RHDF"
+constexpr uint32_t HANDOFF_VERSION = 5;
+constexpr size_t HANDOFF_MAX_CLIENTS = 1024;           // Sanity limits on imported state
+constexpr size_t HANDOFF_MAX_EVENTS = 1 << 20;
+constexpr size_t HANDOFF_MAX_BYTES = 4 << 20;
+constexpr size_t HANDOFF_MAX_STAGE_BYTES = 64 << 20;
+
+#ifdef _WIN32
+constexpr NativeSocket HANDOFF_NO_SOCKET = INVALID_SOCKET;
+#else
+constexpr NativeSocket HANDOFF_NO_SOCKET = -1;
+#endif
+
+// Where raw input capture stopped in the old process: the message time of
+// the last input it published and how many inputs it published with that
+// time. The new process skips its own copies of those.
+struct CaptureCut {
+    uint32_t tick = 0;
+    uint32_t count = 0;
+};
+
+// Server state that moves between processes
+struct HandoffClient {
+    NativeSocket socket = HANDOFF_NO_SOCKET;
+    StreamFormat format = StreamFormat::Json;
+    std::string partial;                // Command bytes received without a newline yet
+    std::string backlog;                // Encoded bytes the socket had not taken yet
+    bool credited = false;              // Under credit flow control (credit_queue.h)
+    uint64_t credits = 0;
+    std::vector<InputEvent> held;       // Events waiting for credit, oldest first
+};
+
+struct HandoffState {
+    NativeSocket listenSocket = HANDOFF_NO_SOCKET;
+    std::vector<HandoffClient> clients;
+    std::vector<InputEvent> history;    // Oldest first
+    std::vector<InputEvent> pending;    // Published but not sent yet
+    uint64_t nextSeq = 1;
+    uint64_t lastSentSeq = 0;
+    CaptureCut cut;
+    std::string stages;                 // Pipeline stage state (cursors, macros); opaque here
+};
+
+class HandoffChannel {
+public:
+#ifdef _WIN32
+    // A connected pipe. Sockets can only be sent to peerProcessId.
+    HandoffChannel(HANDLE pipe, DWORD peerProcessId) : pipe_(pipe), peerProcessId_(peerProcessId) {}
+#else
+    // A connected AF_UNIX stream socket
+    explicit HandoffChannel(int fd) : fd_(fd) {}
+#endif
+
+    bool read(void* data, size_t size);
+    bool write(const void* data, size_t size);
+
+    // The socket stays open here; the peer gets its own descriptor
+    bool sendSocket(NativeSocket socket);
+    bool receiveSocket(NativeSocket& socket);
+
+private:
+#ifdef _WIN32
+    HANDLE pipe_;
+    DWORD peerProcessId_;
+#else
+    int fd_;
+#endif
+};
+
+// The old process sends its state, the new one reads it. On failure the
+// sockets read so far are in state and belong to the caller.
+bool writeHandoffState(HandoffChannel& channel, const HandoffState& state);
+bool readHandoffState(HandoffChannel& channel, HandoffState& state);
+
+// Events published after the state was taken, sent once the new process
+// serves the clients
+bool writeHandoffEvents(HandoffChannel& channel, const std::vector<InputEvent>& events);
+bool readHandoffEvents(HandoffChannel& channel, std::vector<InputEvent>& events);
+
+void closeHandoffSockets(const HandoffState& state);
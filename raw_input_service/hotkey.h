@@ -0,0 +1,382 @@
+// hotkey.h - Per-user hotkeys and key sequences, matched at capture
+//
+// A hotkey file (--hotkeys) gives hotkeys to the users of the users file
+// (user_rules.h), whose keyboards they are typed on, one rule per line:
+//
+//     user_1   hotkey  1  Ctrl+Alt+P
+//     user_1   hotkey  2  Ctrl+Space W             # Ctrl+Space, then W
+//     *        hotkey  3  Ctrl+Shift+F12
+//
+// A hotkey is a number from 1 to 65535, which consumers give a meaning
+// (the router's "hotkeys" setting), and a sequence of up to
+// HOTKEY_STEPS_MAX chords. A chord is key names (keyName() in keymap.h)
+// joined by '+'. "*" hotkeys are every user's, and also those of keyboards
+// that belong to no user. No user may have a sequence twice, one that
+// starts another, or two that part where one set of held keys types both
+// chords (Ctrl+P and LCtrl+P).
+//
+// A chord is typed when one of its keys goes down last while all of them,
+// and no other modifiers, are held on the same keyboard: Ctrl+P does not
+// fire on Ctrl+Shift+P, but other keys may be held. Shift, Ctrl and Alt
+// stand for either side, LShift, RCtrl and the like for one. A chord of
+// only modifiers is typed when its last modifier goes down.
+//
+// The key that completes a hotkey is replaced by a "hotkey" event whose
+// device_id is the keyboard. The keys that complete the earlier steps of a
+// sequence are dropped, and so are the auto-repeats and releases of both.
+// A sequence starts over when a key other than a modifier completes none
+// of its next steps, or when more than HOTKEY_STEP_MS pass between steps;
+// that key is then tried as the start of another.
+//
+// Each user's sequences form a trie whose edges are chords. An edge holds
+// two 256-bit key masks, the keys it needs and the keys it looks at (its
+// own and every modifier), so testing it against a keyboard's key-down
+// bitmap is (held & care) == need over four words. Edges are indexed by
+// the keys that can complete them, so a key-down tests only the chords
+// with that key in them.
+#pragma once
+#include "device_table.h"
+#include "keymap.h"
+#include "pipeline.h"
+#include "user_rules.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+constexpr size_t HOTKEY_STEPS_MAX = 4;          // Chords in one sequence
+constexpr uint64_t HOTKEY_STEP_MS = 1500;       // Longest wait between the steps of a sequence
+constexpr uint32_t HOTKEY_NO_NODE = UINT32_MAX;
+
+// One bit per virtual key
+struct KeySet {
+    uint64_t words[4] = {};
+
+    void set(uint8_t key) { words[key >> 6] |= 1ull << (key & 63); }
+    void reset(uint8_t key) { words[key >> 6] &= ~(1ull << (key & 63)); }
+    bool test(uint8_t key) const { return words[key >> 6] >> (key & 63) & 1; }
+    bool operator==(const KeySet& other) const = default;
+};
+
+// Shift, Ctrl and Alt with or without a side, and the Win keys
+inline bool isModifierKey(uint8_t vkey) {
+    return (vkey >= 0x10 && vkey <= 0x12) || (vkey >= 0xA0 && vkey <= 0xA5) || vkey == 0x5B || vkey == 0x5C;
+}
+
+struct HotkeyRule {
+    uint16_t id = 0;
+    std::vector<KeySet> steps;          // A sided modifier also sets its sideless key
+};
+
+struct HotkeyUser {
+    std::string name;
+    std::vector<std::string> devices;
+    std::vector<HotkeyRule> hotkeys;
+};
+
+class HotkeyConfig : public UserRules<HotkeyConfig, HotkeyUser> {
+public:
+    // Key names joined by '+'
+    static bool parseChord(const std::string& text, KeySet& keys) {
+        keys = KeySet();
+        size_t start = 0;
+        while (true) {
+            size_t plus = text.find('+', start);
+            std::string_view name(text.data() + start, (plus == std::string::npos ? text.size() : plus) - start);
+            int vkey = keyFromName(name);
+            if (vkey < 0) return false;
+            keys.set((uint8_t)vkey);
+            keys.set(sidelessKey((uint8_t)vkey));
+            if (plus == std::string::npos) return true;
+            start = plus + 1;
+        }
+    }
+
+private:
+    friend class UserRules<HotkeyConfig, HotkeyUser>;
+
+    bool parseRule(HotkeyUser& user, const std::string& directive, std::istringstream& fields) {
+        if (directive == "hotkey") {
+            std::string idText, chordText;
+            if (!(fields >> idText)) return false;
+            char* idEnd = nullptr;
+            unsigned long id = std::strtoul(idText.c_str(), &idEnd, 10);
+            if (*idEnd || id == 0 || id > UINT16_MAX) return false;
+            HotkeyRule rule;
+            rule.id = (uint16_t)id;
+            while (fields >> chordText) {
+                KeySet keys;
+                if (rule.steps.size() == HOTKEY_STEPS_MAX || !parseChord(chordText, keys)) return false;
+                rule.steps.push_back(keys);
+            }
+            if (rule.steps.empty()) return false;
+            user.hotkeys.push_back(rule);
+            return true;
+        }
+        return false;
+    }
+};
+
+// Every user's hotkeys compiled into one trie per user. Built at startup,
+// read-only afterwards, so worker shards may share it.
+class HotkeyTable {
+public:
+    // On failure, error names the user whose sequences clash
+    bool build(const HotkeyConfig& config, std::string& error) {
+        hotkeys_.clear();
+        edges_.clear();
+        devices_.clear();
+        defaultRoot_ = HOTKEY_NO_NODE;
+        std::vector<const HotkeyRule*> rules;
+        for (const HotkeyUser& user : config.users()) {
+            rules.clear();
+            for (const HotkeyRule& rule : user.hotkeys) rules.push_back(&rule);
+            for (const HotkeyRule& rule : config.defaults().hotkeys) rules.push_back(&rule);
+            uint32_t root = addTrie(rules);
+            if (root == HOTKEY_NO_NODE) {
+                error = user.name + ": a hotkey repeats, starts another or overlaps another's chord";
+                return false;
+            }
+            for (const std::string& device : user.devices) devices_.emplace_back(device, root);
+        }
+        if (!config.defaults().hotkeys.empty()) {
+            rules.clear();
+            for (const HotkeyRule& rule : config.defaults().hotkeys) rules.push_back(&rule);
+            defaultRoot_ = addTrie(rules);
+            if (defaultRoot_ == HOTKEY_NO_NODE) {
+                error = "*: a hotkey repeats, starts another or overlaps another's chord";
+                return false;
+            }
+        }
+        index();
+        return true;
+    }
+
+    bool empty() const { return edges_.empty(); }
+
+    // The trie a keyboard's key-downs walk, or HOTKEY_NO_NODE if it has no
+    // hotkeys
+    uint32_t rootOf(const char* deviceId) const {
+        for (const auto& [id, root] : devices_) {
+            if (std::strncmp(id.c_str(), deviceId, DEVICE_ID_MAX) == 0) return root;
+        }
+        return defaultRoot_;
+    }
+
+    // The node reached from node when key (sideless, see keymap.h) goes
+    // down with held keys down, or HOTKEY_NO_NODE
+    uint32_t next(uint32_t node, uint8_t key, const KeySet& held) const {
+        for (uint32_t i = firstByKey_[key]; i < firstByKey_[key + 1]; ++i) {
+            if (byKey_[i].from != node) continue;
+            const Edge& edge = edges_[byKey_[i].edge];
+            uint64_t differ = 0;
+            for (size_t word = 0; word < 4; ++word) {
+                differ |= (held.words[word] & edge.care.words[word]) ^ edge.need.words[word];
+            }
+            if (differ == 0) return edge.to;
+        }
+        return HOTKEY_NO_NODE;
+    }
+
+    // The hotkey a node completes; 0 if more steps follow
+    uint16_t hotkeyAt(uint32_t node) const { return hotkeys_[node]; }
+
+private:
+    struct Edge {
+        KeySet need;
+        KeySet care;                    // need plus Shift, Ctrl, Alt and the Win keys
+        uint32_t from;
+        uint32_t to;
+    };
+
+    // One entry per edge and key that can complete it
+    struct KeyEdge {
+        uint32_t from;                  // Copied from the edge, to skip most edges untouched
+        uint32_t edge;
+    };
+
+    uint32_t addNode(uint16_t hotkey) {
+        hotkeys_.push_back(hotkey);
+        return (uint32_t)hotkeys_.size() - 1;
+    }
+
+    // The keys whose key-down can complete a chord: its ordinary keys, or
+    // its sideless modifiers if it has none
+    static KeySet triggers(const KeySet& need) {
+        bool ordinary = false;
+        for (size_t key = 0; key < KEYMAP_KEYS; ++key) {
+            ordinary = ordinary || (need.test((uint8_t)key) && !isModifierKey((uint8_t)key));
+        }
+        KeySet keys;
+        for (size_t key = 0; key < KEYMAP_KEYS; ++key) {
+            uint8_t vkey = (uint8_t)key;
+            if (need.test(vkey) && isModifierKey(vkey) != ordinary && sidelessKey(vkey) == vkey) keys.set(vkey);
+        }
+        return keys;
+    }
+
+    // Whether one key-down with the same keys held types both edges'
+    // chords: they share a key that completes them and agree on every key
+    // both look at
+    static bool overlaps(const Edge& a, const Edge& b) {
+        KeySet aTriggers = triggers(a.need);
+        KeySet bTriggers = triggers(b.need);
+        uint64_t shared = 0;
+        uint64_t differ = 0;
+        for (size_t word = 0; word < 4; ++word) {
+            shared |= aTriggers.words[word] & bTriggers.words[word];
+            differ |= (a.need.words[word] ^ b.need.words[word]) & a.care.words[word] & b.care.words[word];
+        }
+        return shared != 0 && differ == 0;
+    }
+
+    // Returns the root, or HOTKEY_NO_NODE if a sequence repeats, starts
+    // another or overlaps another where they part
+    uint32_t addTrie(const std::vector<const HotkeyRule*>& rules) {
+        uint32_t root = addNode(0);
+        for (const HotkeyRule* rule : rules) {
+            uint32_t node = root;
+            for (size_t step = 0; step < rule->steps.size(); ++step) {
+                bool last = step + 1 == rule->steps.size();
+                const KeySet& keys = rule->steps[step];
+                auto existing = std::find_if(edges_.begin(), edges_.end(), [&](const Edge& edge) {
+                    return edge.from == node && edge.need == keys;
+                });
+                if (existing != edges_.end()) {
+                    if (last || hotkeys_[existing->to] != 0) return HOTKEY_NO_NODE;
+                    node = existing->to;
+                    continue;
+                }
+                Edge edge;
+                edge.need = keys;
+                edge.care = keys;
+                constexpr uint8_t modifiers[] = { 0x10, 0x11, 0x12, 0x5B, 0x5C };
+                for (uint8_t modifier : modifiers) edge.care.set(modifier);
+                edge.from = node;
+                bool clash = std::any_of(edges_.begin(), edges_.end(), [&](const Edge& other) {
+                    return other.from == node && overlaps(edge, other);
+                });
+                if (clash) return HOTKEY_NO_NODE;
+                edge.to = addNode(last ? rule->id : 0);
+                edges_.push_back(edge);
+                node = edge.to;
+            }
+        }
+        return root;
+    }
+
+    // Lists each edge under the keys that complete it; sided modifiers are
+    // found through their sideless key
+    void index() {
+        std::vector<std::pair<uint8_t, KeyEdge>> entries;
+        for (uint32_t e = 0; e < edges_.size(); ++e) {
+            KeySet keys = triggers(edges_[e].need);
+            for (size_t key = 0; key < KEYMAP_KEYS; ++key) {
+                if (keys.test((uint8_t)key)) entries.push_back({ (uint8_t)key, KeyEdge{ edges_[e].from, e } });
+            }
+        }
+        std::stable_sort(entries.begin(), entries.end(),
+                         [](const auto& a, const auto& b) { return a.first < b.first; });
+        byKey_.clear();
+        size_t next = 0;
+        for (size_t key = 0; key <= KEYMAP_KEYS; ++key) {
+            firstByKey_[key] = (uint32_t)byKey_.size();
+            while (key < KEYMAP_KEYS && next < entries.size() && entries[next].first == key) {
+                byKey_.push_back(entries[next++].second);
+            }
+        }
+    }
+
+    std::vector<uint16_t> hotkeys_;     // Per node
+    std::vector<Edge> edges_;
+    std::vector<KeyEdge> byKey_;        // Grouped by key
+    uint32_t firstByKey_[KEYMAP_KEYS + 1] = {};
+    std::vector<std::pair<std::string, uint32_t>> devices_;
+    uint32_t defaultRoot_ = HOTKEY_NO_NODE;
+};
+
+// Turns the keys that complete a hotkey into hotkey events and drops the
+// ones that complete the earlier steps of a sequence. Needs key releases,
+// so it goes before FilterStage<NoKeyRelease>, and scan codes, so after
+// KeymapStage. Keeps per-device state, so every worker shard needs its own
+// instance; without hotkeys it does nothing.
+class HotkeyStage {
+public:
+    explicit HotkeyStage(const HotkeyTable* table = nullptr) : table_(table) {}
+
+    size_t process(InputEvent* events, size_t count) {
+        if (!table_ || table_->empty()) return count;
+        size_t kept = 0;
+        for (size_t i = 0; i < count; ++i) {
+            InputEvent& event = events[i];
+            if (event.type == DeviceType::Keyboard) {
+                size_t keyboard = keyboards_.find(event.device_id, [this](const char* id) {
+                    KeyboardState fresh = {};
+                    fresh.root = table_->rootOf(id);
+                    fresh.node = fresh.root;
+                    return fresh;
+                });
+                if (!match(keyboards_[keyboard], event)) continue;
+            }
+            if (kept != i) events[kept] = event;
+            ++kept;
+        }
+        return kept;
+    }
+
+private:
+    struct KeyboardState {
+        uint32_t root;                  // HOTKEY_NO_NODE: no hotkeys
+        uint32_t node;                  // Steps typed so far; root if none
+        uint64_t stepTime;              // Of the last step
+        KeySet held;                    // Sided and sideless modifiers both set
+        KeySet swallowed;               // Held keys whose events are dropped
+    };
+
+    // Returns false to drop the event
+    bool match(KeyboardState& keyboard, InputEvent& event) const {
+        auto& key = event.data.keyboard;
+        if (keyboard.root == HOTKEY_NO_NODE || key.vkey < 0 || key.vkey >= (int)KEYMAP_KEYS) return true;
+        uint8_t sided = sidedKey((uint8_t)key.vkey, key.scan);
+        uint8_t sideless = sidelessKey(sided);
+        if (key.up) {
+            keyboard.held.reset(sided);
+            // LShift is 0xA0 and RShift 0xA1, and so on
+            if (sided != sideless && !keyboard.held.test((uint8_t)(sided ^ 1))) keyboard.held.reset(sideless);
+            bool swallowed = keyboard.swallowed.test(sided);
+            keyboard.swallowed.reset(sided);
+            return !swallowed;
+        }
+        if (keyboard.held.test(sided)) return !keyboard.swallowed.test(sided);     // Auto-repeat
+        keyboard.held.set(sided);
+        keyboard.held.set(sideless);
+
+        if (keyboard.node != keyboard.root && event.timestamp - keyboard.stepTime > HOTKEY_STEP_MS) {
+            keyboard.node = keyboard.root;
+        }
+        uint32_t next = table_->next(keyboard.node, sideless, keyboard.held);
+        if (next == HOTKEY_NO_NODE && keyboard.node != keyboard.root && !isModifierKey(sided)) {
+            keyboard.node = keyboard.root;
+            next = table_->next(keyboard.node, sideless, keyboard.held);
+        }
+        if (next == HOTKEY_NO_NODE) return true;
+
+        keyboard.swallowed.set(sided);
+        uint16_t hotkey = table_->hotkeyAt(next);
+        if (hotkey == 0) {
+            keyboard.node = next;
+            keyboard.stepTime = event.timestamp;
+            return false;
+        }
+        keyboard.node = keyboard.root;
+        event.type = DeviceType::Hotkey;
+        std::memset(&event.data, 0, sizeof(event.data));
+        event.data.hotkey.id = hotkey;
+        return true;
+    }
+
+    const HotkeyTable* table_;
+    DeviceTable<KeyboardState> keyboards_;
+};
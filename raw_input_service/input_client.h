@@ -0,0 +1,969 @@
+// input_client.h - Header-only consumer SDK for the Raw Input Service stream
+//
+// Connects over TCP (or AF_UNIX on POSIX), negotiates the protocol with
+// "hello" and optionally a binary, CBOR or compact stream format, and decodes records
+// in place from one reusable receive buffer. Events are handed to the caller as EventView objects whose string
+// fields point into that buffer, so decoding does not allocate per event.
+// Views are only valid for the duration of the callback.
+//
+// Usage:
+//   InputStreamClient client;
+//   if (client.connectTcp("127.0.0.1", 9999) && client.hello()) {
+//       while (client.poll([](const EventView& ev) { ... }) >= 0) {}
+//       client.reconnect();  // resumes after client.lastSeq()
+//   }
+#pragma once
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "compact_codec.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define INPUT_CLIENT_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define INPUT_CLIENT_SSE2 1
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+constexpr int INPUT_CLIENT_PROTOCOL = 1;
+
+enum class EventKind {
+    Keyboard,
+    Mouse,
+    Hello,      // Reply to hello(): protocol + last assigned seq
+    Gap,        // Resume point fell out of server history: seq..gap_to lost
+    Format,     // Reply to setFormat(): later records use the format in text
+    Unknown,
+    End,        // Server shut down cleanly after sending everything up to seq
+    Heartbeat,  // Idle stream is alive; seq is the last event sent. poll() answers it.
+    Credit,     // Reply to grantCredits(): credits left, events held, merged and dropped
+    Cursor,     // A user's virtual cursor moved: device_id is the user, x/y the position
+    Hotkey      // A hotkey was typed on the keyboard in device_id; hotkey is its number
+};
+
+// Stream events, each with a seq of its own; the other kinds are control records
+inline bool isStreamEvent(EventKind kind) {
+    return kind == EventKind::Keyboard || kind == EventKind::Mouse || kind == EventKind::Cursor ||
+           kind == EventKind::Hotkey;
+}
+
+// Non-owning view of one decoded record
+struct EventView {
+    EventKind kind = EventKind::Unknown;
+    std::string_view device_id;
+    int vkey = 0;
+    int scan = 0;           // Keyboard records: scan code (0xE0xx if extended),
+    int ch = 0;             // WM_CHAR value (0: none) and KEY_MOD_* bits
+    int mods = 0;
+    int dx = 0;
+    int dy = 0;
+    int buttons = 0;
+    int x = 0;              // Cursor records only
+    int y = 0;
+    int abs_x = 0;          // 0..65535 over the desktop, for MOUSEEVENTF_ABSOLUTE
+    int abs_y = 0;
+    int hotkey = 0;         // Hotkey records only
+    int flags = 0;          // EVENT_FLAG_*: EVENT_FLAG_SYNTHETIC for macro replays
+    uint64_t timestamp = 0;
+    uint64_t seq = 0;
+    uint64_t gap_to = 0;
+    int protocol = 0;
+    uint64_t credits = 0;   // Credit records only
+    uint64_t held = 0;
+    uint64_t merged = 0;
+    uint64_t dropped = 0;
+    std::string_view text;  // String payload of control records (format name)
+    std::string_view raw;   // The complete record without framing
+    const InputEvent* event = nullptr;  // Decoded event (binary and compact streams only)
+};
+
+// Growable byte buffer that is reused across reads. Consumed bytes are
+// reclaimed by sliding the unread tail to the front only when space runs out.
+class RecvBuffer {
+public:
+    explicit RecvBuffer(size_t capacity = 64 * 1024) : data_(capacity) {}
+
+    char* writePtr(size_t minSpace) {
+        if (data_.size() - end_ < minSpace) {
+            compact();
+            if (data_.size() - end_ < minSpace) {
+                data_.resize(end_ + minSpace);
+            }
+        }
+        return data_.data() + end_;
+    }
+
+    size_t writable() const { return data_.size() - end_; }
+    void commit(size_t n) { end_ += n; }
+    void consume(size_t n) { begin_ += n; if (begin_ == end_) begin_ = end_ = 0; }
+    void clear() { begin_ = end_ = 0; }
+
+    const char* data() const { return data_.data() + begin_; }
+    size_t size() const { return end_ - begin_; }
+
+private:
+    void compact() {
+        if (begin_ == 0) return;
+        std::memmove(data_.data(), data_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+    }
+
+    std::vector<char> data_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+};
+
+inline unsigned lowestSetBit(unsigned mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+// Returns the first '\n' in [p, end), or nullptr. Scans 32 bytes per step with
+// AVX2 and 16 with SSE2, then finishes the tail byte by byte.
+inline const char* findNewline(const char* p, const char* end) {
+#ifdef INPUT_CLIENT_AVX2
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, nl32));
+        if (mask) return p + lowestSetBit(mask);
+        p += 32;
+    }
+#endif
+#ifdef INPUT_CLIENT_SSE2
+    const __m128i nl16 = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl16));
+        if (mask) return p + lowestSetBit(mask);
+        p += 16;
+    }
+#endif
+    for (; p < end; ++p) {
+        if (*p == '\n') return p;
+    }
+    return nullptr;
+}
+
+// Consumes the literal at p if it matches; leaves p untouched otherwise
+template <size_t N>
+inline bool matchLiteral(const char*& p, const char* end, const char (&lit)[N]) {
+    if ((size_t)(end - p) < N - 1 || std::memcmp(p, lit, N - 1) != 0) return false;
+    p += N - 1;
+    return true;
+}
+
+inline bool readUnsigned(const char*& p, const char* end, uint64_t& value) {
+    if (p >= end || *p < '0' || *p > '9') return false;
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (uint64_t)(*p - '0');
+        ++p;
+    }
+    return true;
+}
+
+inline bool readInt(const char*& p, const char* end, int& value) {
+    bool negative = p < end && *p == '-';
+    if (negative) ++p;
+    uint64_t magnitude;
+    if (!readUnsigned(p, end, magnitude)) return false;
+    value = negative ? -(int)magnitude : (int)magnitude;
+    return true;
+}
+
+// ---------------------------------------------------------------- Schema mapping
+//
+// Where each schema field (EVENT_FIELDS, event_schema.h) and each control
+// record key lands in EventView. The JSON, CBOR and binary views below are
+// generated from these tables; a field added to the schema does not compile
+// until EVENT_VIEW_MEMBERS has a member for it.
+
+template <typename T>
+struct ViewMember {
+    using value_type = T;
+    const char* name;
+    T EventView::* member;
+};
+
+template <typename T>
+constexpr ViewMember<T> viewMember(const char* name, T EventView::* member) {
+    return { name, member };
+}
+
+constexpr auto EVENT_VIEW_MEMBERS = std::make_tuple(
+    viewMember("device_id", &EventView::device_id),
+    viewMember("type",      &EventView::kind),
+    viewMember("flags",     &EventView::flags),
+    viewMember("vkey",      &EventView::vkey),
+    viewMember("scan",      &EventView::scan),
+    viewMember("char",      &EventView::ch),
+    viewMember("mods",      &EventView::mods),
+    viewMember("dx",        &EventView::dx),
+    viewMember("dy",        &EventView::dy),
+    viewMember("buttons",   &EventView::buttons),
+    viewMember("x",         &EventView::x),
+    viewMember("y",         &EventView::y),
+    viewMember("abs_x",     &EventView::abs_x),
+    viewMember("abs_y",     &EventView::abs_y),
+    viewMember("hotkey",    &EventView::hotkey),
+    viewMember("timestamp", &EventView::timestamp),
+    viewMember("seq",       &EventView::seq));
+
+// Keys of control records that are not event fields
+constexpr auto CONTROL_VIEW_MEMBERS = std::make_tuple(
+    viewMember("format",   &EventView::text),
+    viewMember("from",     &EventView::seq),
+    viewMember("to",       &EventView::gap_to),
+    viewMember("protocol", &EventView::protocol),
+    viewMember("credits",  &EventView::credits),
+    viewMember("held",     &EventView::held),
+    viewMember("merged",   &EventView::merged),
+    viewMember("dropped",  &EventView::dropped));
+
+template <typename Tuple>
+constexpr size_t memberCount(const Tuple&) { return std::tuple_size<Tuple>::value; }
+
+template <size_t I, typename Tuple>
+using ViewMemberType = typename std::tuple_element_t<I, Tuple>::value_type;
+
+// The EventView member type each wire type decodes to
+template <FieldType Type> struct ViewFieldType { using type = int; };
+template <> struct ViewFieldType<FieldType::Text> { using type = std::string_view; };
+template <> struct ViewFieldType<FieldType::Kind> { using type = EventKind; };
+template <> struct ViewFieldType<FieldType::UInt64> { using type = uint64_t; };
+
+constexpr bool sameKey(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        ++a;
+        ++b;
+    }
+    return *a == *b;
+}
+
+template <size_t... I>
+constexpr bool viewMembersFollowSchema(std::index_sequence<I...>) {
+    using Members = std::remove_const_t<decltype(EVENT_VIEW_MEMBERS)>;
+    return (... && (sameKey(std::get<I>(EVENT_VIEW_MEMBERS).name, EVENT_FIELDS[I].name) &&
+                    std::is_same_v<ViewMemberType<I, Members>, typename ViewFieldType<EVENT_FIELDS[I].type>::type>));
+}
+
+static_assert(memberCount(EVENT_VIEW_MEMBERS) == EVENT_FIELD_COUNT, "EventView needs a member for every schema field");
+static_assert(viewMembersFollowSchema(std::make_index_sequence<EVENT_FIELD_COUNT>()),
+              "EVENT_VIEW_MEMBERS must list the schema's keys in its order, with members of matching types");
+
+constexpr size_t CONTROL_FIELD_COUNT = memberCount(CONTROL_VIEW_MEMBERS);
+
+template <typename Tuple, size_t... I>
+constexpr std::array<const char*, sizeof...(I)> memberNames(const Tuple& members, std::index_sequence<I...>) {
+    return { std::get<I>(members).name... };
+}
+
+constexpr KeyIndex<CONTROL_FIELD_COUNT> CONTROL_FIELD_INDEX =
+    makeKeyIndex(memberNames(CONTROL_VIEW_MEMBERS, std::make_index_sequence<CONTROL_FIELD_COUNT>()));
+static_assert(CONTROL_FIELD_INDEX.salt != KEY_INDEX_NO_SALT, "Control keys must hash apart");
+
+constexpr EventKind eventKindFromType(std::string_view typeStr) {
+    if (typeStr == "keyboard") return EventKind::Keyboard;
+    if (typeStr == "mouse") return EventKind::Mouse;
+    if (typeStr == "hello") return EventKind::Hello;
+    if (typeStr == "gap") return EventKind::Gap;
+    if (typeStr == "format") return EventKind::Format;
+    if (typeStr == "end") return EventKind::End;
+    if (typeStr == "heartbeat") return EventKind::Heartbeat;
+    if (typeStr == "credit") return EventKind::Credit;
+    if (typeStr == "cursor") return EventKind::Cursor;
+    if (typeStr == "hotkey") return EventKind::Hotkey;
+    return EventKind::Unknown;
+}
+
+template <size_t... I>
+constexpr std::array<EventKind, DEVICE_TYPE_COUNT> deviceEventKinds(std::index_sequence<I...>) {
+    return { eventKindFromType(DEVICE_TYPE_NAMES[I])... };
+}
+
+constexpr std::array<EventKind, DEVICE_TYPE_COUNT> DEVICE_EVENT_KINDS =
+    deviceEventKinds(std::make_index_sequence<DEVICE_TYPE_COUNT>());
+
+// A decoded JSON or CBOR value: text or an integer
+struct FieldValue {
+    bool isText;
+    std::string_view text;
+    int64_t number;
+};
+
+inline void setViewMember(std::string_view& member, const FieldValue& value) {
+    if (value.isText) member = value.text;
+}
+inline void setViewMember(EventKind& member, const FieldValue& value) {
+    if (value.isText) member = eventKindFromType(value.text);
+}
+inline void setViewMember(int& member, const FieldValue& value) {
+    if (!value.isText) member = (int)value.number;
+}
+inline void setViewMember(uint64_t& member, const FieldValue& value) {
+    if (!value.isText) member = (uint64_t)value.number;
+}
+
+template <typename Tuple, size_t... I>
+inline void assignMember(const Tuple& members, size_t index, const FieldValue& value, EventView& out,
+                         std::index_sequence<I...>) {
+    (void)((index == I ? (setViewMember(out.*std::get<I>(members).member, value), true) : false) || ...);
+}
+
+// Stores one decoded key/value pair; shared by the JSON and CBOR parsers.
+// Unknown keys and values of the wrong kind are skipped.
+inline void assignField(std::string_view key, const FieldValue& value, EventView& out) {
+    size_t index = EVENT_FIELD_INDEX.find(key);
+    if (index < EVENT_FIELD_COUNT) {
+        assignMember(EVENT_VIEW_MEMBERS, index, value, out, std::make_index_sequence<EVENT_FIELD_COUNT>());
+    } else if ((index = CONTROL_FIELD_INDEX.find(key)) < CONTROL_FIELD_COUNT) {
+        assignMember(CONTROL_VIEW_MEMBERS, index, value, out, std::make_index_sequence<CONTROL_FIELD_COUNT>());
+    }
+}
+
+template <size_t I>
+inline void viewField(const InputEvent& event, EventView& view) {
+    constexpr FieldType type = EVENT_FIELDS[I].type;
+    constexpr size_t offset = EVENT_FIELDS[I].offset;
+    auto& member = view.*std::get<I>(EVENT_VIEW_MEMBERS).member;
+    if constexpr (type == FieldType::Text) {
+        const char* text = reinterpret_cast<const char*>(&event) + offset;
+        member = std::string_view(text, strnlen(text, DEVICE_ID_MAX));
+    } else if constexpr (type == FieldType::Kind) {
+        unsigned kind = (unsigned)loadField<DeviceType>(event, offset);
+        member = kind < DEVICE_TYPE_COUNT ? DEVICE_EVENT_KINDS[kind] : EventKind::Unknown;
+    } else if constexpr (type == FieldType::UInt8) {
+        member = loadField<uint8_t>(event, offset);
+    } else if constexpr (type == FieldType::Int32) {
+        member = loadField<int32_t>(event, offset);
+    } else if constexpr (type == FieldType::UInt16) {
+        member = loadField<uint16_t>(event, offset);
+    } else {
+        member = loadField<uint64_t>(event, offset);
+    }
+}
+
+template <uint8_t Presence, size_t... I>
+inline void viewFields(const InputEvent& event, EventView& view, std::index_sequence<I...>) {
+    ((void)((EVENT_FIELDS[I].presence & Presence) ? (viewField<I>(event, view), 0) : 0), ...);
+}
+
+// Fills a view from a decoded event (binary and compact streams)
+inline void viewEvent(const InputEvent& event, std::string_view raw, EventView& view) {
+    view = EventView();
+    visitPresence(event, [&](auto presence) {
+        viewFields<decltype(presence)::value>(event, view, std::make_index_sequence<EVENT_FIELD_COUNT>());
+    });
+    view.raw = raw;
+    view.event = &event;
+}
+
+// ---------------------------------------------------------------- JSON
+
+inline bool readJsonNumber(const char*& p, const char* end, int& value) { return readInt(p, end, value); }
+inline bool readJsonNumber(const char*& p, const char* end, uint64_t& value) { return readUnsigned(p, end, value); }
+
+// Reads a JSON string without escapes; the view points into the record
+inline bool readPlainString(const char*& p, const char* end, std::string_view& value) {
+    if (p >= end || *p != '"') return false;
+    const char* start = ++p;
+    const char* close = (const char*)std::memchr(p, '"', (size_t)(end - p));
+    if (!close || std::memchr(start, '\\', (size_t)(close - start))) return false;
+    value = std::string_view(start, (size_t)(close - start));
+    p = close + 1;
+    return true;
+}
+
+// Device type K's name in quotes at p
+template <size_t K>
+inline bool matchJsonDeviceType(const char*& p, const char* end, size_t& kind) {
+    constexpr std::string_view name = DEVICE_TYPE_NAMES[K];
+    if ((size_t)(end - p) < name.size() + 2 || p[0] != '"' || p[name.size() + 1] != '"' ||
+        std::string_view(p + 1, name.size()) != name) {
+        return false;
+    }
+    kind = K;
+    p += name.size() + 2;
+    return true;
+}
+
+template <size_t... K>
+inline bool readJsonDeviceType(const char*& p, const char* end, size_t& kind, std::index_sequence<K...>) {
+    return (matchJsonDeviceType<K>(p, end, kind) || ...);
+}
+
+// Field I exactly as encodeEventJson writes it: its key, then its value.
+// Returns the cursor past the value, or nullptr if anything differs.
+template <size_t I>
+inline const char* parseJsonFieldFast(const char* p, const char* end, EventView& out, DeviceType& type) {
+    constexpr auto& json = FieldKey<I>::json;
+    constexpr std::string_view key(json.data() + (I == 0 ? 1 : 0), json.size() - (I == 0 ? 1 : 0));  // No comma before the first key
+    if ((size_t)(end - p) < key.size() || std::string_view(p, key.size()) != key) {
+        return nullptr;
+    }
+    p += key.size();
+
+    auto& member = out.*std::get<I>(EVENT_VIEW_MEMBERS).member;
+    if constexpr (EVENT_FIELDS[I].type == FieldType::Text) {
+        return readPlainString(p, end, member) ? p : nullptr;
+    } else if constexpr (EVENT_FIELDS[I].type == FieldType::Kind) {
+        size_t kind;
+        if (!readJsonDeviceType(p, end, kind, std::make_index_sequence<DEVICE_TYPE_COUNT>())) return nullptr;
+        type = (DeviceType)kind;
+        member = DEVICE_EVENT_KINDS[kind];
+        return p;
+    } else {
+        (void)type;
+        return readJsonNumber(p, end, member) ? p : nullptr;
+    }
+}
+
+template <uint8_t Presence, size_t... I>
+inline const char* parseJsonFieldsFast(const char* p, const char* end, EventView& out, DeviceType& type,
+                                       std::index_sequence<I...>) {
+    bool ok = (((EVENT_FIELDS[I].presence & Presence) ? (p = parseJsonFieldFast<I>(p, end, out, type)) != nullptr
+                                                      : true) && ...);
+    return ok ? p : nullptr;
+}
+
+template <size_t First, size_t... I>
+constexpr std::index_sequence<(First + I)...> offsetSequence(std::index_sequence<I...>) {
+    return {};
+}
+
+// Fast path for the exact key order encodeEventJson writes, generated from
+// the schema. Returns false as soon as anything differs so the caller can
+// fall back to parseEventJson.
+inline bool parseEventJsonFast(std::string_view line, EventView& out) {
+    const char* p = line.data();
+    const char* end = p + line.size();
+
+    out = EventView();
+    out.raw = line;
+    DeviceType type = DeviceType::Unknown;
+    if (!matchLiteral(p, end, "{") || !(p = parseJsonFieldFast<0>(p, end, out, type)) ||
+        !(p = parseJsonFieldFast<1>(p, end, out, type))) {
+        return false;
+    }
+
+    // The device type picks the rest; events with flags (macro replays)
+    // have one more field
+    constexpr auto rest = offsetSequence<2>(std::make_index_sequence<EVENT_FIELD_COUNT - 2>());
+    const char* fields = p;
+    auto parseRest = [&](auto presence) {
+        return parseJsonFieldsFast<decltype(presence)::value>(fields, end, out, type, rest);
+    };
+    p = visitType<0>(type, parseRest);
+    if (!p && !(p = visitType<PRESENT_FLAGGED>(type, parseRest))) return false;
+    return matchLiteral(p, end, "}") && p == end;
+}
+
+// Decoder for one NDJSON record as produced by formatEventJson. Handles any
+// key order; unknown keys are skipped. Returns false on malformed input.
+inline bool parseEventJson(std::string_view line, EventView& out) {
+    out = EventView();
+    out.raw = line;
+
+    size_t i = 0;
+    const size_t n = line.size();
+    auto skipWs = [&]() { while (i < n && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r')) ++i; };
+
+    skipWs();
+    if (i >= n || line[i] != '{') return false;
+    ++i;
+
+    while (true) {
+        skipWs();
+        if (i < n && line[i] == '}') break;
+        if (i >= n || line[i] != '"') return false;
+
+        size_t keyStart = ++i;
+        while (i < n && line[i] != '"') ++i;
+        if (i >= n) return false;
+        std::string_view key = line.substr(keyStart, i - keyStart);
+        ++i;
+
+        skipWs();
+        if (i >= n || line[i] != ':') return false;
+        ++i;
+        skipWs();
+        if (i >= n) return false;
+
+        if (line[i] == '"') {
+            size_t valStart = ++i;
+            while (i < n && line[i] != '"') {
+                if (line[i] == '\\') ++i;  // Skip escaped character
+                ++i;
+            }
+            if (i >= n) return false;
+            std::string_view value = line.substr(valStart, i - valStart);
+            ++i;
+
+            assignField(key, FieldValue{ true, value, 0 }, out);
+        } else {
+            bool negative = false;
+            if (line[i] == '-') { negative = true; ++i; }
+            if (i >= n || line[i] < '0' || line[i] > '9') return false;
+            uint64_t value = 0;
+            while (i < n && line[i] >= '0' && line[i] <= '9') {
+                value = value * 10 + (uint64_t)(line[i] - '0');
+                ++i;
+            }
+            assignField(key, FieldValue{ false, {}, negative ? -(int64_t)value : (int64_t)value }, out);
+        }
+
+        skipWs();
+        if (i < n && line[i] == ',') { ++i; continue; }
+        if (i < n && line[i] == '}') break;
+        return false;
+    }
+    return true;
+}
+
+// Decoder for one CBOR map record (events and control records alike).
+// Returns the bytes used, 0 if the record is not complete yet, or -1 if the
+// data is not something the service sends.
+inline long parseEventCbor(const uint8_t* data, size_t size, EventView& out) {
+    out = EventView();
+    const uint8_t* in = data;
+    const uint8_t* end = data + size;
+
+    // readCborHead only fails on truncation or an unsupported length code
+    auto readHead = [&](uint8_t& major, uint64_t& value) -> int {
+        if (in < end && (*in & 0x1F) > 27) return -1;
+        return readCborHead(in, end, major, value) ? 1 : 0;
+    };
+
+    uint8_t major;
+    uint64_t pairs;
+    int r = readHead(major, pairs);
+    if (r <= 0) return r;
+    if (major != 5) return -1;
+
+    for (uint64_t i = 0; i < pairs; ++i) {
+        uint64_t keyLen;
+        if ((r = readHead(major, keyLen)) <= 0) return r;
+        if (major != 3) return -1;
+        if ((uint64_t)(end - in) < keyLen) return 0;
+        std::string_view key((const char*)in, (size_t)keyLen);
+        in += keyLen;
+
+        uint64_t value;
+        if ((r = readHead(major, value)) <= 0) return r;
+        if (major == 3) {
+            if ((uint64_t)(end - in) < value) return 0;
+            assignField(key, FieldValue{ true, std::string_view((const char*)in, (size_t)value), 0 }, out);
+            in += value;
+        } else if (major == 0) {
+            assignField(key, FieldValue{ false, {}, (int64_t)value }, out);
+        } else if (major == 1) {
+            assignField(key, FieldValue{ false, {}, -1 - (int64_t)value }, out);
+        } else {
+            return -1;
+        }
+    }
+
+    out.raw = std::string_view((const char*)data, (size_t)(in - data));
+    return (long)(in - data);
+}
+
+// Splits buffered bytes into records and decodes each one, trying the
+// fixed-order fast path before the general parser. Returns the number of
+// bytes consumed (everything up to and including the last newline).
+template <typename Handler>
+size_t decodeNdjson(const char* data, size_t size, Handler&& onEvent) {
+    const char* p = data;
+    const char* end = data + size;
+    EventView view;
+    while (const char* nl = findNewline(p, end)) {
+        std::string_view line(p, (size_t)(nl - p));
+        if (!line.empty() && (parseEventJsonFast(line, view) || parseEventJson(line, view))) {
+            onEvent(view);
+        }
+        p = nl + 1;
+    }
+    return (size_t)(p - data);
+}
+
+// Incremental decoder for a stream in any StreamFormat. A Format control
+// record switches the decoder for every byte after it, matching the point
+// where the server switched.
+class StreamDecoder {
+public:
+    void reset() {
+        format_ = StreamFormat::Json;
+        failed_ = false;
+        compact_.reset();
+    }
+
+    StreamFormat format() const { return format_; }
+    bool failed() const { return failed_; }
+
+    // Decodes every complete record and returns the bytes consumed. Views
+    // are only valid for the duration of the callback.
+    template <typename Handler>
+    size_t decode(const char* data, size_t size, Handler&& onEvent) {
+        const char* p = data;
+        const char* end = data + size;
+        EventView view;
+
+        while (p < end && !failed_) {
+            bool decoded = false;
+
+            if (format_ == StreamFormat::Json) {
+                const char* nl = findNewline(p, end);
+                if (!nl) break;
+                std::string_view line(p, (size_t)(nl - p));
+                decoded = !line.empty() && (parseEventJsonFast(line, view) || parseEventJson(line, view));
+                p = nl + 1;
+            } else if (format_ == StreamFormat::Binary) {
+                if ((size_t)(end - p) < FRAME_HEADER_SIZE) break;
+                size_t length = (uint8_t)p[0] | ((size_t)(uint8_t)p[1] << 8);
+                if ((size_t)(end - p) < FRAME_HEADER_SIZE + length) break;
+                const char* payload = p + FRAME_HEADER_SIZE;
+                if ((uint8_t)p[2] == FRAME_EVENT) {
+                    decoded = decodeEventBinary((const uint8_t*)payload, length, scratch_) == length;
+                    if (decoded) viewEvent(scratch_, std::string_view(payload, length), view);
+                } else if ((uint8_t)p[2] == FRAME_CONTROL) {
+                    decoded = parseEventJson(std::string_view(payload, length), view);
+                }
+                p = payload + length;
+            } else if (format_ == StreamFormat::Compact) {
+                CompactRecord record;
+                long used = compact_.decode((const uint8_t*)p, (size_t)(end - p), record);
+                if (used == 0) break;
+                if (used < 0) {
+                    failed_ = true;
+                    break;
+                }
+                if (record.kind == CompactRecord::Event) {
+                    scratch_ = record.event;
+                    viewEvent(scratch_, std::string_view(p, (size_t)used), view);
+                    decoded = true;
+                } else if (record.kind == CompactRecord::Control) {
+                    decoded = parseEventJson(std::string_view(record.text, record.textLength), view);
+                }
+                p += used;
+            } else {
+                long used = parseEventCbor((const uint8_t*)p, (size_t)(end - p), view);
+                if (used == 0) break;
+                if (used < 0) {
+                    failed_ = true;
+                    break;
+                }
+                decoded = true;
+                p += used;
+            }
+
+            if (decoded) {
+                if (view.kind == EventKind::Format && parseStreamFormat(view.text, format_) &&
+                    format_ == StreamFormat::Compact) {
+                    compact_.reset();
+                }
+                onEvent(view);
+            }
+        }
+        return (size_t)(p - data);
+    }
+
+private:
+    StreamFormat format_ = StreamFormat::Json;
+    bool failed_ = false;
+    InputEvent scratch_ = {};
+    CompactDecoder compact_;
+};
+
+class InputStreamClient {
+public:
+#ifdef _WIN32
+    using socket_t = SOCKET;
+    static constexpr socket_t kInvalid = INVALID_SOCKET;
+#else
+    using socket_t = int;
+    static constexpr socket_t kInvalid = -1;
+#endif
+
+    InputStreamClient() {
+#ifdef _WIN32
+        WSADATA wsaData;
+        wsaReady_ = WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+#endif
+    }
+
+    ~InputStreamClient() {
+        close();
+#ifdef _WIN32
+        if (wsaReady_) WSACleanup();
+#endif
+    }
+
+    InputStreamClient(const InputStreamClient&) = delete;
+    InputStreamClient& operator=(const InputStreamClient&) = delete;
+
+    bool connectTcp(const std::string& host, uint16_t port) {
+        close();
+        host_ = host;
+        port_ = port;
+        unixPath_.clear();
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        addrinfo* result = nullptr;
+        char portStr[8];
+        std::snprintf(portStr, sizeof(portStr), "%u", (unsigned)port);
+        if (getaddrinfo(host.c_str(), portStr, &hints, &result) != 0) {
+            return false;
+        }
+
+        for (addrinfo* ai = result; ai; ai = ai->ai_next) {
+            socket_t s = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (s == kInvalid) continue;
+            if (::connect(s, ai->ai_addr, (int)ai->ai_addrlen) == 0) {
+                sock_ = s;
+                break;
+            }
+            closeSocket(s);
+        }
+        freeaddrinfo(result);
+
+        if (sock_ == kInvalid) return false;
+
+        // Events are tiny; don't let Nagle hold back our commands
+        int nodelay = 1;
+        setsockopt(sock_, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+        buffer_.clear();
+        decoder_.reset();
+        return true;
+    }
+
+#ifndef _WIN32
+    bool connectUnix(const std::string& path) {
+        close();
+        unixPath_ = path;
+        host_.clear();
+
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) return false;
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        socket_t s = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (s == kInvalid) return false;
+        if (::connect(s, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            closeSocket(s);
+            return false;
+        }
+        sock_ = s;
+        buffer_.clear();
+        decoder_.reset();
+        return true;
+    }
+#endif
+
+    // Announce our protocol version. The server replies with a Hello record
+    // carrying its version and last sequence number; poll() records both.
+    bool hello() {
+        char cmd[32];
+        int len = std::snprintf(cmd, sizeof(cmd), "hello %d\n", INPUT_CLIENT_PROTOCOL);
+        return sendAll(cmd, (size_t)len);
+    }
+
+    // Switch the stream to another encoding. Records already in flight stay
+    // in the old format; the decoder switches at the server's reply.
+    bool setFormat(StreamFormat format) {
+        char cmd[32];
+        int len = std::snprintf(cmd, sizeof(cmd), "format %s\n", STREAM_FORMAT_NAMES[(int)format]);
+        if (!sendAll(cmd, (size_t)len)) return false;
+        requestedFormat_ = format;
+        return true;
+    }
+
+    // Record the encoding reconnect() asks for without asking now, for a
+    // client that may not be connected yet
+    void preferFormat(StreamFormat format) { requestedFormat_ = format; }
+
+    // Allow the server to send count more events. The first grant turns on
+    // credit flow control for this connection: once the credit is used up,
+    // the server holds events, merging mouse motion, until the next grant.
+    // Each grant is answered with a Credit record. A reconnected stream is
+    // unmetered until granted again.
+    bool grantCredits(uint64_t count) {
+        char cmd[48];
+        int len = std::snprintf(cmd, sizeof(cmd), "credit %llu\n", (unsigned long long)count);
+        return sendAll(cmd, (size_t)len);
+    }
+
+    // Ask the server to replay everything after the last event we saw
+    bool resume() { return resumeFrom(lastSeq_); }
+
+    bool resumeFrom(uint64_t afterSeq) {
+        char cmd[48];
+        int len = std::snprintf(cmd, sizeof(cmd), "resume %llu\n", (unsigned long long)afterSeq);
+        return sendAll(cmd, (size_t)len);
+    }
+
+    // Re-establish the previous connection and pick up where we left off
+    bool reconnect() {
+        bool ok = false;
+#ifndef _WIN32
+        if (!unixPath_.empty()) ok = connectUnix(unixPath_);
+        else
+#endif
+        ok = connectTcp(host_, port_);
+        if (!ok) return false;
+        if (!hello()) return false;
+        if (requestedFormat_ != StreamFormat::Json && !setFormat(requestedFormat_)) return false;
+        return lastSeq_ == 0 || resume();
+    }
+
+    bool setReceiveTimeout(int milliseconds) {
+#ifdef _WIN32
+        DWORD tv = (DWORD)milliseconds;
+#else
+        timeval tv;
+        tv.tv_sec = milliseconds / 1000;
+        tv.tv_usec = (milliseconds % 1000) * 1000;
+#endif
+        return setsockopt(sock_, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv)) == 0;
+    }
+
+    // Reads once and dispatches every complete record. Returns the number of
+    // records delivered, 0 on timeout, or -1 once the connection is gone.
+    template <typename Handler>
+    int poll(Handler&& onEvent) {
+        if (sock_ == kInvalid) return -1;
+
+        char* dst = buffer_.writePtr(kMinRead);
+        int received = (int)::recv(sock_, dst, (int)buffer_.writable(), 0);
+        if (received == 0) {
+            close();
+            return -1;
+        }
+        if (received < 0) {
+            if (isTimeout()) return 0;
+            close();
+            return -1;
+        }
+        buffer_.commit((size_t)received);
+
+        int delivered = 0;
+        size_t used = decoder_.decode(buffer_.data(), buffer_.size(), [&](const EventView& ev) {
+            if (ev.kind == EventKind::Hello) {
+                serverProtocol_ = ev.protocol;
+                if (lastSeq_ == 0) lastSeq_ = ev.seq;
+            } else if (ev.kind == EventKind::Heartbeat) {
+                // Servers may evict clients that stop answering (--pong-timeout-ms)
+                sendAll("pong\n", 5);
+            } else if (ev.seq > lastSeq_ && isStreamEvent(ev.kind)) {
+                lastSeq_ = ev.seq;
+            }
+            onEvent(ev);
+            ++delivered;
+        });
+        buffer_.consume(used);
+        if (decoder_.failed()) {
+            close();
+            return -1;
+        }
+        return delivered;
+    }
+
+    void close() {
+        if (sock_ != kInvalid) {
+            closeSocket(sock_);
+            sock_ = kInvalid;
+        }
+    }
+
+    bool connected() const { return sock_ != kInvalid; }
+    StreamFormat format() const { return decoder_.format(); }
+    uint64_t lastSeq() const { return lastSeq_; }
+    int serverProtocol() const { return serverProtocol_; }
+    socket_t nativeHandle() const { return sock_; }
+
+private:
+    static constexpr size_t kMinRead = 16 * 1024;
+
+    static void closeSocket(socket_t s) {
+#ifdef _WIN32
+        closesocket(s);
+#else
+        ::close(s);
+#endif
+    }
+
+    static bool isTimeout() {
+#ifdef _WIN32
+        return WSAGetLastError() == WSAETIMEDOUT;
+#else
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+    }
+
+    bool sendAll(const char* data, size_t len) {
+        while (len > 0) {
+#ifdef MSG_NOSIGNAL
+            int sent = (int)::send(sock_, data, (int)len, MSG_NOSIGNAL);
+#else
+            int sent = (int)::send(sock_, data, (int)len, 0);
+#endif
+            if (sent <= 0) return false;
+            data += sent;
+            len -= (size_t)sent;
+        }
+        return true;
+    }
+
+    socket_t sock_ = kInvalid;
+    RecvBuffer buffer_;
+    StreamDecoder decoder_;
+    StreamFormat requestedFormat_ = StreamFormat::Json;
+    std::string host_;
+    uint16_t port_ = 0;
+    std::string unixPath_;
+    uint64_t lastSeq_ = 0;
+    int serverProtocol_ = 0;
+#ifdef _WIN32
+    bool wsaReady_ = false;
+#endif
+};
@@ -0,0 +1,195 @@
+// inputstream.cpp - libinputstream: C ABI over the header-only client SDK
+#define INPUTSTREAM_BUILD
+#include "inputstream.h"
+#include "input_client.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+
+constexpr size_t QUEUE_CAPACITY = 16384;       // Decoded events held for the caller
+constexpr int RECEIVE_TIMEOUT_MS = 200;        // Decoder thread checks for close this often
+constexpr int RECONNECT_DELAY_MS = 1000;
+
+struct is_client {
+    InputStreamClient stream;
+    std::thread decoder;
+    std::atomic<bool> running{true};
+
+    // Ring buffer of decoded events, guarded by mutex
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::vector<is_event> ring = std::vector<is_event>(QUEUE_CAPACITY);
+    size_t head = 0;
+    size_t count = 0;
+    uint64_t dropped = 0;
+    std::set<std::string, std::less<>> subscriptions;
+};
+
+static void fillEvent(const EventView& view, is_event& out) {
+    out.seq = view.seq;
+    out.timestamp = view.timestamp;
+    out.gap_to = view.gap_to;
+    out.kind = (int32_t)view.kind;
+    out.vkey = view.vkey;
+    out.dx = view.dx;
+    out.dy = view.dy;
+    out.buttons = view.buttons;
+    out.x = view.x;
+    out.y = view.y;
+    out.abs_x = view.abs_x;
+    out.abs_y = view.abs_y;
+    out.scan = view.scan;
+    out.ch = view.ch;
+    out.mods = view.mods;
+    out.hotkey = view.hotkey;
+    out.flags = view.flags;
+    size_t len = std::min(view.device_id.size(), (size_t)IS_DEVICE_ID_MAX - 1);
+    std::memcpy(out.device_id, view.device_id.data(), len);
+    out.device_id[len] = '\0';
+}
+
+// Caller must hold client->mutex
+static void pushEvent(is_client* client, const EventView& view) {
+    size_t tail = (client->head + client->count) % QUEUE_CAPACITY;
+    if (client->count == QUEUE_CAPACITY) {
+        // Caller fell behind: overwrite the oldest event
+        client->head = (client->head + 1) % QUEUE_CAPACITY;
+        client->dropped++;
+    } else {
+        client->count++;
+    }
+    fillEvent(view, client->ring[tail]);
+}
+
+static void decoderLoop(is_client* client) {
+    while (client->running) {
+        int result = client->stream.poll([client](const EventView& view) {
+            if (view.kind != EventKind::Keyboard && view.kind != EventKind::Mouse &&
+                view.kind != EventKind::Cursor && view.kind != EventKind::Hotkey &&
+                view.kind != EventKind::Gap) {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(client->mutex);
+            if (view.kind != EventKind::Gap && !client->subscriptions.empty() &&
+                client->subscriptions.find(view.device_id) == client->subscriptions.end()) {
+                return;
+            }
+            pushEvent(client, view);
+        });
+
+        if (result > 0) {
+            client->ready.notify_one();
+            continue;
+        }
+        if (result == 0) {
+            continue; // Receive timeout
+        }
+
+        // Disconnected: retry until closed, resuming after the last seq seen
+        while (client->running) {
+            for (int waited = 0; waited < RECONNECT_DELAY_MS && client->running; waited += RECEIVE_TIMEOUT_MS) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(RECEIVE_TIMEOUT_MS));
+            }
+            if (client->running && client->stream.reconnect()) {
+                client->stream.setReceiveTimeout(RECEIVE_TIMEOUT_MS);
+                break;
+            }
+        }
+    }
+}
+
+extern "C" {
+
+IS_API int is_abi_version(void) {
+    return IS_ABI_VERSION;
+}
+
+IS_API is_client* is_connect(const char* host, uint16_t port) {
+    if (!host) return nullptr;
+
+    is_client* client = new is_client();
+    // Binary frames decode without any text parsing on our side
+    if (!client->stream.connectTcp(host, port) || !client->stream.hello() ||
+        !client->stream.setFormat(StreamFormat::Binary)) {
+        delete client;
+        return nullptr;
+    }
+    client->stream.setReceiveTimeout(RECEIVE_TIMEOUT_MS);
+    client->decoder = std::thread(decoderLoop, client);
+    return client;
+}
+
+IS_API int is_poll_batch(is_client* client, is_event* out, size_t event_size, int max_events, int timeout_ms) {
+    if (!client || !out || event_size == 0 || max_events <= 0) return -1;
+
+    std::unique_lock<std::mutex> lock(client->mutex);
+    auto hasData = [client] { return client->count > 0 || !client->running; };
+    if (timeout_ms < 0) {
+        client->ready.wait(lock, hasData);
+    } else if (timeout_ms > 0) {
+        client->ready.wait_for(lock, std::chrono::milliseconds(timeout_ms), hasData);
+    }
+
+    if (client->count == 0) {
+        return client->running ? 0 : -1;
+    }
+
+    size_t n = std::min(client->count, (size_t)max_events);
+    if (event_size == sizeof(is_event)) {
+        // Copy out in at most two contiguous runs of the ring
+        size_t first = std::min(n, QUEUE_CAPACITY - client->head);
+        std::memcpy(out, &client->ring[client->head], first * sizeof(is_event));
+        if (n > first) {
+            std::memcpy(out + first, &client->ring[0], (n - first) * sizeof(is_event));
+        }
+    } else {
+        // A caller built against another version: one record at a time
+        size_t copied = std::min(event_size, sizeof(is_event));
+        char* record = reinterpret_cast<char*>(out);
+        for (size_t i = 0; i < n; ++i, record += event_size) {
+            std::memcpy(record, &client->ring[(client->head + i) % QUEUE_CAPACITY], copied);
+            if (event_size > copied) std::memset(record + copied, 0, event_size - copied);
+        }
+    }
+    client->head = (client->head + n) % QUEUE_CAPACITY;
+    client->count -= n;
+    return (int)n;
+}
+
+IS_API int is_subscribe(is_client* client, const char* device_id) {
+    if (!client || !device_id) return -1;
+    std::lock_guard<std::mutex> lock(client->mutex);
+    client->subscriptions.insert(device_id);
+    return 0;
+}
+
+IS_API int is_unsubscribe(is_client* client, const char* device_id) {
+    if (!client || !device_id) return -1;
+    std::lock_guard<std::mutex> lock(client->mutex);
+    client->subscriptions.erase(std::string(device_id));
+    return 0;
+}
+
+IS_API uint64_t is_dropped(is_client* client) {
+    if (!client) return 0;
+    std::lock_guard<std::mutex> lock(client->mutex);
+    return client->dropped;
+}
+
+IS_API void is_close(is_client* client) {
+    if (!client) return;
+    client->running = false;
+    client->ready.notify_all();
+    if (client->decoder.joinable()) {
+        client->decoder.join();
+    }
+    client->stream.close();
+    delete client;
+}
+
+} // extern "C"
@@ -0,0 +1,103 @@
+/* inputstream.h - Stable C ABI for consuming the Raw Input Service stream
+ *
+ * libinputstream wraps input_client.h for FFI callers (Python ctypes, Node
+ * ffi). A native thread owns the connection and decodes records into a
+ * bounded queue; is_poll_batch() copies decoded events into a caller-provided
+ * array. All structs are plain C and only ever grow at the end. Callers pass
+ * sizeof(is_event) as they were built with, so a newer library fills the
+ * fields they know of, and check is_abi_version() is at least the version
+ * whose fields they use.
+ */
+#ifndef INPUTSTREAM_H
+#define INPUTSTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#  ifdef INPUTSTREAM_BUILD
+#    define IS_API __declspec(dllexport)
+#  else
+#    define IS_API __declspec(dllimport)
+#  endif
+#else
+#  define IS_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IS_ABI_VERSION 7
+#define IS_DEVICE_ID_MAX 48
+
+/* is_event.kind */
+#define IS_KIND_KEYBOARD 0
+#define IS_KIND_MOUSE    1
+#define IS_KIND_GAP      3   /* seq..gap_to were lost while disconnected */
+#define IS_KIND_CURSOR   9   /* A user's virtual cursor: device_id is the user, x/y the position */
+#define IS_KIND_HOTKEY   10  /* A hotkey was typed: device_id is the keyboard, hotkey its number */
+
+/* is_event.mods */
+#define IS_MOD_SHIFT 0x01
+#define IS_MOD_CTRL  0x02
+#define IS_MOD_ALT   0x04
+#define IS_MOD_WIN   0x08
+#define IS_MOD_CAPS  0x10   /* Caps Lock is on */
+#define IS_MOD_ALTGR 0x20   /* Set instead of Ctrl and Alt */
+
+/* is_event.flags */
+#define IS_FLAG_SYNTHETIC 0x01  /* Replayed by a macro, not typed */
+
+typedef struct is_event {
+    uint64_t seq;
+    uint64_t timestamp;
+    uint64_t gap_to;
+    int32_t  kind;
+    int32_t  vkey;
+    int32_t  dx;
+    int32_t  dy;
+    int32_t  buttons;
+    char     device_id[IS_DEVICE_ID_MAX];   /* NUL-terminated */
+    int32_t  x;                             /* Cursor events; since ABI 2 */
+    int32_t  y;
+    int32_t  abs_x;                         /* 0..65535 over the desktop; since ABI 3 */
+    int32_t  abs_y;
+    int32_t  scan;                          /* Keyboard events; since ABI 4. Scan code, 0xE0xx if extended */
+    int32_t  ch;                            /* WM_CHAR value, 0 if none */
+    int32_t  mods;                          /* IS_MOD_* */
+    int32_t  hotkey;                        /* Hotkey events; since ABI 5 */
+    int32_t  flags;                         /* IS_FLAG_*; since ABI 6 */
+} is_event;
+
+typedef struct is_client is_client;
+
+IS_API int is_abi_version(void);
+
+/* Connects, negotiates the protocol and starts the decoder thread.
+ * On disconnect the thread reconnects and resumes by sequence number.
+ * Returns NULL if the first connection attempt fails. */
+IS_API is_client* is_connect(const char* host, uint16_t port);
+
+/* Copies up to max_events decoded events into out, an array of event_size
+ * byte records (the caller's sizeof(is_event); since ABI 7). Fields past
+ * event_size are left out, and bytes past the library's is_event are zeroed.
+ * Waits up to timeout_ms for the first event (0 = don't wait, -1 = forever).
+ * Returns the number copied, 0 on timeout, or -1 once the client is closed. */
+IS_API int is_poll_batch(is_client* client, is_event* out, size_t event_size, int max_events, int timeout_ms);
+
+/* Restricts delivery to the given device IDs. With no subscriptions every
+ * device is delivered. Filtering happens on the decoder thread. */
+IS_API int is_subscribe(is_client* client, const char* device_id);
+IS_API int is_unsubscribe(is_client* client, const char* device_id);
+
+/* Events discarded because the caller fell more than the queue size behind */
+IS_API uint64_t is_dropped(is_client* client);
+
+IS_API void is_close(is_client* client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INPUTSTREAM_H */
@@ -0,0 +1,525 @@
+// keymap.h - Keyboard layouts: keys and modifiers to WM_CHAR values
+//
+// A KeyLayout maps a virtual key, with the modifiers held on its keyboard,
+// to the UTF-16 unit a window would receive in WM_CHAR, and a virtual key
+// to its scan code. Consumers can then post WM_KEYDOWN/WM_CHAR/WM_KEYUP
+// without asking Windows (MapVirtualKey, ToUnicode) on every keystroke.
+//
+// Layouts are written like Windows .klc files, one row per physical key:
+// its scan code, its virtual key, whether Caps Lock shifts it, and its
+// character at each shift level (none, Shift, AltGr, Shift+AltGr). The
+// built-in US, UK, German and French layouts are compiled from those rows
+// into 256-entry tables at compile time; the service can also fill a table
+// from the host's layout at startup. Dead keys give no character.
+//
+// KeymapStage tracks each keyboard's modifiers from its presses and
+// releases and fills in scan, char and mods on every key event. The
+// capture keeps releases for it; NoKeyRelease drops them once the stages
+// that need them have run, so clients still only see presses.
+//
+// keyName()/keyFromName() give every virtual key a short name (the US
+// legend for character keys), for config files and logs.
+//
+// Portable; importing the host layout lives in the service.
+#pragma once
+#include "device_table.h"
+#include "event_types.h"
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+constexpr size_t KEYMAP_KEYS = 256;
+constexpr size_t KEYMAP_LEVELS = 4;             // None, Shift, AltGr, Shift+AltGr
+constexpr uint16_t KEYMAP_EXTENDED = 0xE000;    // Scan code prefix of extended keys
+
+// One physical key of a layout
+struct KeyRow {
+    uint16_t scan;                      // Set 1 make code, KEYMAP_EXTENDED | code if extended
+    uint8_t vkey;
+    bool caps;                          // Caps Lock acts as Shift
+    char16_t chars[KEYMAP_LEVELS];      // 0: no character
+};
+
+struct KeyLayout {
+    const char* name = "";
+    bool altGr = false;                 // Right Alt is AltGr
+    uint16_t chars[KEYMAP_LEVELS][KEYMAP_KEYS] = {};
+    uint16_t scans[KEYMAP_KEYS] = {};
+    bool caps[KEYMAP_KEYS] = {};
+
+    constexpr void add(const KeyRow& row) {
+        for (size_t level = 0; level < KEYMAP_LEVELS; ++level) chars[level][row.vkey] = row.chars[level];
+        scans[row.vkey] = row.scan;
+        caps[row.vkey] = row.caps;
+    }
+
+    // WM_CHAR value for vkey with mods (KEY_MOD_*), or 0. Ctrl gives the
+    // control characters of letters, Backspace and Enter; Alt and Win give
+    // none (Alt would be WM_SYSCHAR).
+    uint16_t translate(uint8_t vkey, uint16_t mods) const {
+        size_t shift = (mods & KEY_MOD_SHIFT) ? 1 : 0;
+        if (caps[vkey] && (mods & KEY_MOD_CAPS)) shift ^= 1;
+        if (mods & KEY_MOD_ALTGR) return chars[2 + shift][vkey];
+        if (mods & (KEY_MOD_ALT | KEY_MOD_WIN)) return 0;
+        if (mods & KEY_MOD_CTRL) {
+            if (vkey >= 'A' && vkey <= 'Z') return (uint16_t)(vkey - 'A' + 1);
+            return vkey == 0x08 ? 0x7F : vkey == 0x0D ? '\n' : 0;
+        }
+        return chars[shift][vkey];
+    }
+};
+
+// Keys every layout shares; layout rows may override them
+constexpr KeyRow KEYMAP_COMMON_ROWS[] = {
+    { 0x01, 0x1B, false, { 0x1B, 0x1B } },          // Esc
+    { 0x0E, 0x08, false, { 0x08, 0x08 } },          // Backspace
+    { 0x0F, 0x09, false, { u'\t', u'\t' } },
+    { 0x1C, 0x0D, false, { u'\r', u'\r' } },        // Enter
+    { 0x39, 0x20, false, { u' ', u' ', u' ', u' ' } },
+    { 0x2A, 0x10, false, {} },                      // Shift, Ctrl, Alt as raw input reports them
+    { 0x1D, 0x11, false, {} },
+    { 0x38, 0x12, false, {} },
+    { 0x2A, 0xA0, false, {} },                      // Left and right Shift, Ctrl, Alt
+    { 0x36, 0xA1, false, {} },
+    { 0x1D, 0xA2, false, {} },
+    { 0xE01D, 0xA3, false, {} },
+    { 0x38, 0xA4, false, {} },
+    { 0xE038, 0xA5, false, {} },
+    { 0xE05B, 0x5B, false, {} },                    // Win, Apps
+    { 0xE05C, 0x5C, false, {} },
+    { 0xE05D, 0x5D, false, {} },
+    { 0x3A, 0x14, false, {} },                      // Caps Lock, Num Lock, Scroll Lock, Print Screen
+    { 0xE045, 0x90, false, {} },
+    { 0x46, 0x91, false, {} },
+    { 0xE037, 0x2C, false, {} },
+    { 0xE052, 0x2D, false, {} },                    // Insert, Delete, Home, End, Page Up, Page Down
+    { 0xE053, 0x2E, false, {} },
+    { 0xE047, 0x24, false, {} },
+    { 0xE04F, 0x23, false, {} },
+    { 0xE049, 0x21, false, {} },
+    { 0xE051, 0x22, false, {} },
+    { 0xE04B, 0x25, false, {} },                    // Arrows
+    { 0xE048, 0x26, false, {} },
+    { 0xE04D, 0x27, false, {} },
+    { 0xE050, 0x28, false, {} },
+    { 0x3B, 0x70, false, {} },                      // F1-F12
+    { 0x3C, 0x71, false, {} },
+    { 0x3D, 0x72, false, {} },
+    { 0x3E, 0x73, false, {} },
+    { 0x3F, 0x74, false, {} },
+    { 0x40, 0x75, false, {} },
+    { 0x41, 0x76, false, {} },
+    { 0x42, 0x77, false, {} },
+    { 0x43, 0x78, false, {} },
+    { 0x44, 0x79, false, {} },
+    { 0x57, 0x7A, false, {} },
+    { 0x58, 0x7B, false, {} },
+    { 0x52, 0x60, false, { u'0', u'0' } },          // Numpad, with Num Lock on
+    { 0x4F, 0x61, false, { u'1', u'1' } },
+    { 0x50, 0x62, false, { u'2', u'2' } },
+    { 0x51, 0x63, false, { u'3', u'3' } },
+    { 0x4B, 0x64, false, { u'4', u'4' } },
+    { 0x4C, 0x65, false, { u'5', u'5' } },
+    { 0x4D, 0x66, false, { u'6', u'6' } },
+    { 0x47, 0x67, false, { u'7', u'7' } },
+    { 0x48, 0x68, false, { u'8', u'8' } },
+    { 0x49, 0x69, false, { u'9', u'9' } },
+    { 0x37, 0x6A, false, { u'*', u'*' } },
+    { 0x4E, 0x6B, false, { u'+', u'+' } },
+    { 0x4A, 0x6D, false, { u'-', u'-' } },
+    { 0x53, 0x6E, false, { u'.', u'.' } },
+    { 0xE035, 0x6F, false, { u'/', u'/' } },
+};
+
+// A letter key: lower case, upper case with Shift or Caps Lock
+constexpr KeyRow keyLetter(uint16_t scan, char letter, char16_t altGr = 0, char16_t shiftAltGr = 0) {
+    return { scan, (uint8_t)letter, true, { (char16_t)(letter + 32), (char16_t)letter, altGr, shiftAltGr } };
+}
+
+constexpr KeyRow KEYMAP_US_ROWS[] = {
+    { 0x29, 0xC0, false, { u'`', u'~' } },
+    { 0x02, '1', false, { u'1', u'!' } },
+    { 0x03, '2', false, { u'2', u'@' } },
+    { 0x04, '3', false, { u'3', u'#' } },
+    { 0x05, '4', false, { u'4', u'$' } },
+    { 0x06, '5', false, { u'5', u'%' } },
+    { 0x07, '6', false, { u'6', u'^' } },
+    { 0x08, '7', false, { u'7', u'&' } },
+    { 0x09, '8', false, { u'8', u'*' } },
+    { 0x0A, '9', false, { u'9', u'(' } },
+    { 0x0B, '0', false, { u'0', u')' } },
+    { 0x0C, 0xBD, false, { u'-', u'_' } },
+    { 0x0D, 0xBB, false, { u'=', u'+' } },
+    keyLetter(0x10, 'Q'), keyLetter(0x11, 'W'), keyLetter(0x12, 'E'), keyLetter(0x13, 'R'),
+    keyLetter(0x14, 'T'), keyLetter(0x15, 'Y'), keyLetter(0x16, 'U'), keyLetter(0x17, 'I'),
+    keyLetter(0x18, 'O'), keyLetter(0x19, 'P'),
+    { 0x1A, 0xDB, false, { u'[', u'{' } },
+    { 0x1B, 0xDD, false, { u']', u'}' } },
+    { 0x2B, 0xDC, false, { u'\\', u'|' } },
+    keyLetter(0x1E, 'A'), keyLetter(0x1F, 'S'), keyLetter(0x20, 'D'), keyLetter(0x21, 'F'),
+    keyLetter(0x22, 'G'), keyLetter(0x23, 'H'), keyLetter(0x24, 'J'), keyLetter(0x25, 'K'),
+    keyLetter(0x26, 'L'),
+    { 0x27, 0xBA, false, { u';', u':' } },
+    { 0x28, 0xDE, false, { u'\'', u'"' } },
+    { 0x56, 0xE2, false, { u'\\', u'|' } },
+    keyLetter(0x2C, 'Z'), keyLetter(0x2D, 'X'), keyLetter(0x2E, 'C'), keyLetter(0x2F, 'V'),
+    keyLetter(0x30, 'B'), keyLetter(0x31, 'N'), keyLetter(0x32, 'M'),
+    { 0x33, 0xBC, false, { u',', u'<' } },
+    { 0x34, 0xBE, false, { u'.', u'>' } },
+    { 0x35, 0xBF, false, { u'/', u'?' } },
+};
+
+constexpr KeyRow KEYMAP_UK_ROWS[] = {
+    { 0x29, 0xDF, false, { u'`', u'\u00AC', u'\u00A6' } },  // ` not-sign broken-bar
+    { 0x02, '1', false, { u'1', u'!' } },
+    { 0x03, '2', false, { u'2', u'"' } },
+    { 0x04, '3', false, { u'3', u'\u00A3' } },              // Pound
+    { 0x05, '4', false, { u'4', u'$', u'\u20AC' } },        // Euro
+    { 0x06, '5', false, { u'5', u'%' } },
+    { 0x07, '6', false, { u'6', u'^' } },
+    { 0x08, '7', false, { u'7', u'&' } },
+    { 0x09, '8', false, { u'8', u'*' } },
+    { 0x0A, '9', false, { u'9', u'(' } },
+    { 0x0B, '0', false, { u'0', u')' } },
+    { 0x0C, 0xBD, false, { u'-', u'_' } },
+    { 0x0D, 0xBB, false, { u'=', u'+' } },
+    keyLetter(0x10, 'Q'), keyLetter(0x11, 'W'), keyLetter(0x12, 'E', u'\u00E9', u'\u00C9'),
+    keyLetter(0x13, 'R'), keyLetter(0x14, 'T'), keyLetter(0x15, 'Y'),
+    keyLetter(0x16, 'U', u'\u00FA', u'\u00DA'), keyLetter(0x17, 'I', u'\u00ED', u'\u00CD'),
+    keyLetter(0x18, 'O', u'\u00F3', u'\u00D3'), keyLetter(0x19, 'P'),
+    { 0x1A, 0xDB, false, { u'[', u'{' } },
+    { 0x1B, 0xDD, false, { u']', u'}' } },
+    keyLetter(0x1E, 'A', u'\u00E1', u'\u00C1'), keyLetter(0x1F, 'S'), keyLetter(0x20, 'D'),
+    keyLetter(0x21, 'F'), keyLetter(0x22, 'G'), keyLetter(0x23, 'H'), keyLetter(0x24, 'J'),
+    keyLetter(0x25, 'K'), keyLetter(0x26, 'L'),
+    { 0x27, 0xBA, false, { u';', u':' } },
+    { 0x28, 0xC0, false, { u'\'', u'@' } },
+    { 0x2B, 0xDE, false, { u'#', u'~' } },
+    { 0x56, 0xDC, false, { u'\\', u'|' } },
+    keyLetter(0x2C, 'Z'), keyLetter(0x2D, 'X'), keyLetter(0x2E, 'C'), keyLetter(0x2F, 'V'),
+    keyLetter(0x30, 'B'), keyLetter(0x31, 'N'), keyLetter(0x32, 'M'),
+    { 0x33, 0xBC, false, { u',', u'<' } },
+    { 0x34, 0xBE, false, { u'.', u'>' } },
+    { 0x35, 0xBF, false, { u'/', u'?' } },
+};
+
+constexpr KeyRow KEYMAP_DE_ROWS[] = {
+    { 0x29, 0xDC, false, { 0, u'\u00B0' } },                // Dead circumflex, degree
+    { 0x02, '1', false, { u'1', u'!' } },
+    { 0x03, '2', false, { u'2', u'"', u'\u00B2' } },
+    { 0x04, '3', false, { u'3', u'\u00A7', u'\u00B3' } },   // Section sign
+    { 0x05, '4', false, { u'4', u'$' } },
+    { 0x06, '5', false, { u'5', u'%' } },
+    { 0x07, '6', false, { u'6', u'&' } },
+    { 0x08, '7', false, { u'7', u'/', u'{' } },
+    { 0x09, '8', false, { u'8', u'(', u'[' } },
+    { 0x0A, '9', false, { u'9', u')', u']' } },
+    { 0x0B, '0', false, { u'0', u'=', u'}' } },
+    { 0x0C, 0xDB, false, { u'\u00DF', u'?', u'\\' } },      // Sharp s
+    { 0x0D, 0xDD, false, {} },                              // Dead acute and grave
+    keyLetter(0x10, 'Q', u'@'), keyLetter(0x11, 'W'), keyLetter(0x12, 'E', u'\u20AC'),
+    keyLetter(0x13, 'R'), keyLetter(0x14, 'T'), keyLetter(0x15, 'Z'), keyLetter(0x16, 'U'),
+    keyLetter(0x17, 'I'), keyLetter(0x18, 'O'), keyLetter(0x19, 'P'),
+    { 0x1A, 0xBA, true, { u'\u00FC', u'\u00DC' } },         // u umlaut
+    { 0x1B, 0xBB, false, { u'+', u'*', u'~' } },
+    keyLetter(0x1E, 'A'), keyLetter(0x1F, 'S'), keyLetter(0x20, 'D'), keyLetter(0x21, 'F'),
+    keyLetter(0x22, 'G'), keyLetter(0x23, 'H'), keyLetter(0x24, 'J'), keyLetter(0x25, 'K'),
+    keyLetter(0x26, 'L'),
+    { 0x27, 0xC0, true, { u'\u00F6', u'\u00D6' } },         // o umlaut
+    { 0x28, 0xDE, true, { u'\u00E4', u'\u00C4' } },         // a umlaut
+    { 0x2B, 0xBF, false, { u'#', u'\'' } },
+    { 0x56, 0xE2, false, { u'<', u'>', u'|' } },
+    keyLetter(0x2C, 'Y'), keyLetter(0x2D, 'X'), keyLetter(0x2E, 'C'), keyLetter(0x2F, 'V'),
+    keyLetter(0x30, 'B'), keyLetter(0x31, 'N'), keyLetter(0x32, 'M', u'\u00B5'),
+    { 0x33, 0xBC, false, { u',', u';' } },
+    { 0x34, 0xBE, false, { u'.', u':' } },
+    { 0x35, 0xBD, false, { u'-', u'_' } },
+    { 0x53, 0x6E, false, { u',', u',' } },                  // Numpad decimal
+};
+
+constexpr KeyRow KEYMAP_FR_ROWS[] = {
+    { 0x29, 0xDE, false, { u'\u00B2' } },                   // Superscript two
+    { 0x02, '1', false, { u'&', u'1' } },
+    { 0x03, '2', false, { u'\u00E9', u'2' } },              // e acute; AltGr is a dead tilde
+    { 0x04, '3', false, { u'"', u'3', u'#' } },
+    { 0x05, '4', false, { u'\'', u'4', u'{' } },
+    { 0x06, '5', false, { u'(', u'5', u'[' } },
+    { 0x07, '6', false, { u'-', u'6', u'|' } },
+    { 0x08, '7', false, { u'\u00E8', u'7' } },              // e grave; AltGr is a dead grave
+    { 0x09, '8', false, { u'_', u'8', u'\\' } },
+    { 0x0A, '9', false, { u'\u00E7', u'9', u'^' } },        // c cedilla
+    { 0x0B, '0', false, { u'\u00E0', u'0', u'@' } },        // a grave
+    { 0x0C, 0xDB, false, { u')', u'\u00B0', u']' } },
+    { 0x0D, 0xBB, false, { u'=', u'+', u'}' } },
+    keyLetter(0x10, 'A'), keyLetter(0x11, 'Z'), keyLetter(0x12, 'E', u'\u20AC'),
+    keyLetter(0x13, 'R'), keyLetter(0x14, 'T'), keyLetter(0x15, 'Y'), keyLetter(0x16, 'U'),
+    keyLetter(0x17, 'I'), keyLetter(0x18, 'O'), keyLetter(0x19, 'P'),
+    { 0x1A, 0xDD, false, {} },                              // Dead circumflex and diaeresis
+    { 0x1B, 0xBA, false, { u'$', u'\u00A3', u'\u00A4' } },
+    keyLetter(0x1E, 'Q'), keyLetter(0x1F, 'S'), keyLetter(0x20, 'D'), keyLetter(0x21, 'F'),
+    keyLetter(0x22, 'G'), keyLetter(0x23, 'H'), keyLetter(0x24, 'J'), keyLetter(0x25, 'K'),
+    keyLetter(0x26, 'L'), keyLetter(0x27, 'M'),
+    { 0x28, 0xC0, false, { u'\u00F9', u'%' } },             // u grave
+    { 0x2B, 0xDC, false, { u'*', u'\u00B5' } },
+    { 0x56, 0xE2, false, { u'<', u'>' } },
+    keyLetter(0x2C, 'W'), keyLetter(0x2D, 'X'), keyLetter(0x2E, 'C'), keyLetter(0x2F, 'V'),
+    keyLetter(0x30, 'B'), keyLetter(0x31, 'N'),
+    { 0x32, 0xBC, false, { u',', u'?' } },
+    { 0x33, 0xBE, false, { u';', u'.' } },
+    { 0x34, 0xBF, false, { u':', u'/' } },
+    { 0x35, 0xDF, false, { u'!', u'\u00A7' } },
+};
+
+template <size_t N>
+constexpr KeyLayout buildKeyLayout(const char* name, bool altGr, const KeyRow (&rows)[N]) {
+    KeyLayout layout;
+    layout.name = name;
+    layout.altGr = altGr;
+    for (const KeyRow& row : KEYMAP_COMMON_ROWS) layout.add(row);
+    for (const KeyRow& row : rows) layout.add(row);
+    return layout;
+}
+
+constexpr KeyLayout KEYMAP_US = buildKeyLayout("us", false, KEYMAP_US_ROWS);
+constexpr KeyLayout KEYMAP_UK = buildKeyLayout("uk", true, KEYMAP_UK_ROWS);
+constexpr KeyLayout KEYMAP_DE = buildKeyLayout("de", true, KEYMAP_DE_ROWS);
+constexpr KeyLayout KEYMAP_FR = buildKeyLayout("fr", true, KEYMAP_FR_ROWS);
+
+// A built-in layout by name, or null
+inline const KeyLayout* builtinKeyLayout(std::string_view name) {
+    for (const KeyLayout* layout : { &KEYMAP_US, &KEYMAP_UK, &KEYMAP_DE, &KEYMAP_FR }) {
+        if (name == layout->name) return layout;
+    }
+    return nullptr;
+}
+
+// ---------------------------------------------------------------- Names
+
+constexpr std::pair<uint8_t, const char*> KEYMAP_NAMED_KEYS[] = {
+    { 0x08, "Backspace" }, { 0x09, "Tab" }, { 0x0D, "Enter" }, { 0x10, "Shift" }, { 0x11, "Ctrl" },
+    { 0x12, "Alt" }, { 0x13, "Pause" }, { 0x14, "CapsLock" }, { 0x1B, "Esc" }, { 0x20, "Space" },
+    { 0x21, "PageUp" }, { 0x22, "PageDown" }, { 0x23, "End" }, { 0x24, "Home" }, { 0x25, "Left" },
+    { 0x26, "Up" }, { 0x27, "Right" }, { 0x28, "Down" }, { 0x2C, "PrintScreen" }, { 0x2D, "Insert" },
+    { 0x2E, "Delete" }, { 0x5B, "LWin" }, { 0x5C, "RWin" }, { 0x5D, "Apps" }, { 0x6A, "NumMultiply" },
+    { 0x6B, "NumAdd" }, { 0x6D, "NumSubtract" }, { 0x6E, "NumDecimal" }, { 0x6F, "NumDivide" },
+    { 0x90, "NumLock" }, { 0x91, "ScrollLock" }, { 0xA0, "LShift" }, { 0xA1, "RShift" },
+    { 0xA2, "LCtrl" }, { 0xA3, "RCtrl" }, { 0xA4, "LAlt" }, { 0xA5, "RAlt" }, { 0xBA, ";" },
+    { 0xBB, "=" }, { 0xBC, "," }, { 0xBD, "-" }, { 0xBE, "." }, { 0xBF, "/" }, { 0xC0, "`" },
+    { 0xDB, "[" }, { 0xDC, "\\" }, { 0xDD, "]" }, { 0xDE, "'" }, { 0xDF, "OEM8" }, { 0xE2, "OEM102" },
+};
+
+struct KeyNames {
+    char names[KEYMAP_KEYS][12] = {};
+
+    constexpr KeyNames() {
+        for (size_t vkey = 0; vkey < KEYMAP_KEYS; ++vkey) {
+            // Unnamed keys are hex, as in remap files
+            const char* hex = "0123456789ABCDEF";
+            names[vkey][0] = '0';
+            names[vkey][1] = 'x';
+            names[vkey][2] = hex[vkey >> 4];
+            names[vkey][3] = hex[vkey & 15];
+        }
+        for (char c = '0'; c <= '9'; ++c) setName((uint8_t)c, { c });
+        for (char c = 'A'; c <= 'Z'; ++c) setName((uint8_t)c, { c });
+        for (int n = 0; n <= 9; ++n) setName((uint8_t)(0x60 + n), { 'N', 'u', 'm', (char)('0' + n) });
+        for (int n = 1; n <= 24; ++n) {
+            if (n < 10) setName((uint8_t)(0x6F + n), { 'F', (char)('0' + n) });
+            else setName((uint8_t)(0x6F + n), { 'F', (char)('0' + n / 10), (char)('0' + n % 10) });
+        }
+        for (const auto& [vkey, name] : KEYMAP_NAMED_KEYS) {
+            size_t i = 0;
+            for (; name[i]; ++i) names[vkey][i] = name[i];
+            names[vkey][i] = '\0';
+        }
+    }
+
+    constexpr void setName(uint8_t vkey, std::initializer_list<char> name) {
+        size_t i = 0;
+        for (char c : name) names[vkey][i++] = c;
+        names[vkey][i] = '\0';
+    }
+};
+
+constexpr KeyNames KEYMAP_NAMES;
+
+inline const char* keyName(uint8_t vkey) {
+    return KEYMAP_NAMES.names[vkey];
+}
+
+// Virtual key for a name from keyName(), in any case, or -1
+inline int keyFromName(std::string_view name) {
+    for (size_t vkey = 0; vkey < KEYMAP_KEYS; ++vkey) {
+        const char* candidate = KEYMAP_NAMES.names[vkey];
+        size_t i = 0;
+        for (; i < name.size() && candidate[i]; ++i) {
+            char a = name[i], b = candidate[i];
+            if (a >= 'a' && a <= 'z') a = (char)(a - 32);
+            if (b >= 'a' && b <= 'z') b = (char)(b - 32);
+            if (a != b) break;
+        }
+        if (i == name.size() && !candidate[i]) return (int)vkey;
+    }
+    return -1;
+}
+
+// Raw input reports Shift, Ctrl and Alt without a side: the scan code or
+// its extended prefix tells which. Returns the sided key (LShift..RAlt)
+// for those and vkey for every other key.
+inline uint8_t sidedKey(uint8_t vkey, uint16_t scan) {
+    bool extended = (scan & 0xFF00) == KEYMAP_EXTENDED;
+    switch (vkey) {
+    case 0x10: return (scan & 0xFF) == 0x36 ? 0xA1 : 0xA0;
+    case 0x11: return extended ? 0xA3 : 0xA2;
+    case 0x12: return extended ? 0xA5 : 0xA4;
+    default: return vkey;
+    }
+}
+
+// Shift, Ctrl or Alt for a sided key; other keys are returned as they are
+inline uint8_t sidelessKey(uint8_t vkey) {
+    return vkey >= 0xA0 && vkey <= 0xA5 ? (uint8_t)(0x10 + (vkey - 0xA0) / 2) : vkey;
+}
+
+// ---------------------------------------------------------------- Stage
+
+// Which layout each keyboard types in: one default and per-device choices.
+// Filled at startup, read-only afterwards.
+class KeyLayouts {
+public:
+    explicit KeyLayouts(const KeyLayout* fallback = &KEYMAP_US) : default_(fallback) {}
+
+    void setDefault(const KeyLayout* layout) { default_ = layout; }
+    // Caps Lock as keyboards start; the host's at startup
+    void setCapsLock(bool on) { capsLock_ = on; }
+    void assign(const std::string& deviceId, const KeyLayout* layout) { devices_.emplace_back(deviceId, layout); }
+
+    const KeyLayout* find(const char* deviceId) const {
+        for (const auto& [id, layout] : devices_) {
+            if (std::strncmp(id.c_str(), deviceId, DEVICE_ID_MAX) == 0) return layout;
+        }
+        return default_;
+    }
+
+    const KeyLayout* defaultLayout() const { return default_; }
+    size_t assigned() const { return devices_.size(); }
+    bool capsLock() const { return capsLock_; }
+
+private:
+    const KeyLayout* default_;
+    bool capsLock_ = false;
+    std::vector<std::pair<std::string, const KeyLayout*>> devices_;
+};
+
+// Fills in scan, char and mods of key events from each keyboard's layout
+// and modifiers. A key without a scan code (remapped, or from a source
+// that has none) gets the layout's. Caps Lock is tracked per keyboard and
+// starts as KeyLayouts says. Keeps per-device state, so every worker shard needs its own
+// instance; without layouts it does nothing.
+class KeymapStage {
+public:
+    explicit KeymapStage(const KeyLayouts* layouts = nullptr) : layouts_(layouts) {}
+
+    size_t process(InputEvent* events, size_t count) {
+        if (!layouts_) return count;
+        for (size_t i = 0; i < count; ++i) {
+            InputEvent& event = events[i];
+            if (event.type != DeviceType::Keyboard) continue;
+            size_t keyboard = keyboards_.find(event.device_id, [this](const char* id) {
+                KeyboardState fresh = {};
+                fresh.layout = layouts_->find(id);
+                fresh.capsLock = layouts_->capsLock();
+                fresh.mods = modifiers(fresh);
+                return fresh;
+            });
+            translate(keyboards_[keyboard], event);
+        }
+        return count;
+    }
+
+private:
+    // Held keys, one bit each
+    static constexpr uint16_t HELD_LSHIFT = 1 << 0;
+    static constexpr uint16_t HELD_RSHIFT = 1 << 1;
+    static constexpr uint16_t HELD_LCTRL = 1 << 2;
+    static constexpr uint16_t HELD_RCTRL = 1 << 3;
+    static constexpr uint16_t HELD_LALT = 1 << 4;
+    static constexpr uint16_t HELD_RALT = 1 << 5;
+    static constexpr uint16_t HELD_LWIN = 1 << 6;
+    static constexpr uint16_t HELD_RWIN = 1 << 7;
+    static constexpr uint16_t HELD_CAPS = 1 << 8;
+
+    struct KeyboardState {
+        const KeyLayout* layout;
+        uint16_t held;                  // HELD_* bits
+        bool capsLock;
+        uint16_t mods;                  // KEY_MOD_* for held and capsLock
+    };
+
+    static uint16_t heldBit(uint8_t vkey, uint16_t scan) {
+        switch (sidedKey(vkey, scan)) {
+        case 0xA0: return HELD_LSHIFT;
+        case 0xA1: return HELD_RSHIFT;
+        case 0xA2: return HELD_LCTRL;
+        case 0xA3: return HELD_RCTRL;
+        case 0xA4: return HELD_LALT;
+        case 0xA5: return HELD_RALT;
+        case 0x5B: return HELD_LWIN;
+        case 0x5C: return HELD_RWIN;
+        case 0x14: return HELD_CAPS;
+        default: return 0;
+        }
+    }
+
+    // AltGr (Right Alt, or Ctrl+Alt as Windows treats it) replaces Ctrl and
+    // Alt on layouts that have it
+    static uint16_t modifiers(const KeyboardState& keyboard) {
+        uint16_t held = keyboard.held;
+        bool ctrl = held & (HELD_LCTRL | HELD_RCTRL);
+        bool alt = held & (HELD_LALT | HELD_RALT);
+        uint16_t mods = 0;
+        if (held & (HELD_LSHIFT | HELD_RSHIFT)) mods |= KEY_MOD_SHIFT;
+        if (held & (HELD_LWIN | HELD_RWIN)) mods |= KEY_MOD_WIN;
+        if (keyboard.capsLock) mods |= KEY_MOD_CAPS;
+        if (keyboard.layout->altGr && ((held & HELD_RALT) || (ctrl && alt))) {
+            mods |= KEY_MOD_ALTGR;
+        } else {
+            if (ctrl) mods |= KEY_MOD_CTRL;
+            if (alt) mods |= KEY_MOD_ALT;
+        }
+        return mods;
+    }
+
+    static void translate(KeyboardState& keyboard, InputEvent& event) {
+        auto& key = event.data.keyboard;
+        if (key.vkey < 0 || key.vkey >= (int)KEYMAP_KEYS) return;
+        uint8_t vkey = (uint8_t)key.vkey;
+        if (key.scan == 0) key.scan = keyboard.layout->scans[vkey];
+        uint16_t bit = heldBit(vkey, key.scan);
+        if (bit) {
+            if (key.up) {
+                keyboard.held &= (uint16_t)~bit;
+            } else {
+                // Caps Lock toggles on the press, not on auto-repeat
+                if (bit == HELD_CAPS && !(keyboard.held & HELD_CAPS)) keyboard.capsLock = !keyboard.capsLock;
+                keyboard.held |= bit;
+            }
+            keyboard.mods = modifiers(keyboard);
+        }
+        key.mods = keyboard.mods;
+        key.ch = key.up ? 0 : keyboard.layout->translate(vkey, key.mods);
+    }
+
+    const KeyLayouts* layouts_;
+    DeviceTable<KeyboardState> keyboards_;
+};
+
+// Drops key releases; they only feed stages that track held keys
+struct NoKeyRelease {
+    bool operator()(const InputEvent& event) const {
+        return event.type != DeviceType::Keyboard || !event.data.keyboard.up;
+    }
+};
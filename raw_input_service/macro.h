@@ -0,0 +1,581 @@
+// macro.h - Per-user macros, recorded at capture and replayed on a timer thread
+//
+// A macro file (--macros) gives the users of the users file (user_rules.h)
+// hotkeys (hotkey.h) for their macros, one rule per line:
+//
+//     user_1   record  1  100          # hotkey 100 starts and stops recording macro 1
+//     user_1   play    1  101          # hotkey 101 replays macro 1
+//     *        record  9  200
+//     *        play    9  201
+//
+// Macros and hotkeys are numbers from 1 to 65535. "*" rules are every
+// user's, and also those of devices that belong to no user; such a device
+// records and replays macros of its own. The hotkeys named here are the
+// service's: their events are dropped rather than published.
+//
+// Recording takes the key and mouse events of all the user's devices as
+// the stages before MacroStage left them (remapped, with characters), and
+// stops at the user's next record hotkey; recording a macro again replaces
+// it. Releases of keys pressed before the recording started are left out,
+// and so are the modifier presses at its end, which are usually the start
+// of the hotkey that stopped it. A play hotkey replays its macro, or stops
+// the user's replay if one is running.
+//
+// Macros are kept in a compact format: one record per event, with the time
+// since the previous event in microseconds.
+//
+//   header varint: (device index << 2) | kind
+//   KIND_KEY_DOWN, KIND_KEY_UP   varint delta, varint vkey, varint scan,
+//                                varint char, varint mods
+//   KIND_MOUSE                   varint delta, zigzag dx, zigzag dy, varint buttons
+//   KIND_DEVICE                  varint length, device ID bytes (defines the next index)
+//
+// A mouse record is typically 5 bytes. Events are stamped when MacroStage
+// sees their batch: a macro keeps the gaps between capture batches to the
+// microsecond, and events that were read together stay together.
+//
+// MacroPlayer replays on a thread of its own. It sleeps until shortly
+// before an event is due and spins the rest (MACRO_SPIN_US), and every
+// event's time counts from the start of the replay, so replays do not
+// drift. Replayed events keep the device ID they were recorded from and
+// carry EVENT_FLAG_SYNTHETIC. They go to a sink, not back into capture:
+// the service runs them through the stages after MacroStage on the player
+// thread, so real input never waits behind a replay.
+//
+// Portable; the service only supplies the sink.
+#pragma once
+#include "compact_codec.h"
+#include "hotkey.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+constexpr size_t MACRO_BYTES_MAX = 4u << 20;    // A recording stops at this size
+constexpr uint64_t MACRO_SPIN_US = 2000;        // Spun rather than slept before an event is due; covers a 1 ms timer period
+constexpr unsigned MACRO_KIND_KEY_DOWN = 0;
+constexpr unsigned MACRO_KIND_KEY_UP = 1;
+constexpr unsigned MACRO_KIND_MOUSE = 2;
+constexpr unsigned MACRO_KIND_DEVICE = 3;
+constexpr unsigned MACRO_KIND_BITS = 2;
+
+// Microseconds on the steady clock
+inline uint64_t macroClockUs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Macro {
+    std::string bytes;                  // Records in the format above
+    uint32_t events = 0;
+    uint64_t durationUs = 0;            // From the first event to the last
+};
+
+// Encodes one recording
+class MacroWriter {
+public:
+    // False once the macro is full; the event is then not in it
+    bool append(const InputEvent& event, uint64_t timeUs) {
+        bool key = event.type == DeviceType::Keyboard;
+        const auto& keyboard = event.data.keyboard;
+        bool tracked = key && keyboard.vkey >= 0 && keyboard.vkey < (int)KEYMAP_KEYS;
+        if (tracked && keyboard.up && !pressed_.test((uint8_t)keyboard.vkey)) return true;
+
+        // The first event starts the macro; the wait before it is not kept
+        if (macro_.events == 0) prevUs_ = timeUs;
+        uint64_t delta = timeUs > prevUs_ ? timeUs - prevUs_ : 0;
+        char buffer[8 + DEVICE_ID_MAX + 5 * 10];
+        char* p = buffer;
+        uint64_t index = deviceIndex(event, p);
+        if (key) {
+            p = putVarint(p, (index << MACRO_KIND_BITS) | (keyboard.up ? MACRO_KIND_KEY_UP : MACRO_KIND_KEY_DOWN));
+            p = putVarint(p, delta);
+            p = putVarint(p, (uint32_t)keyboard.vkey);
+            p = putVarint(p, keyboard.scan);
+            p = putVarint(p, keyboard.ch);
+            p = putVarint(p, keyboard.mods);
+        } else {
+            p = putVarint(p, (index << MACRO_KIND_BITS) | MACRO_KIND_MOUSE);
+            p = putVarint(p, delta);
+            p = putVarint(p, zigzagEncode(event.data.mouse.dx));
+            p = putVarint(p, zigzagEncode(event.data.mouse.dy));
+            p = putVarint(p, (uint32_t)event.data.mouse.buttons);
+        }
+        if (macro_.bytes.size() + (size_t)(p - buffer) > MACRO_BYTES_MAX) return false;
+        macro_.bytes.append(buffer, (size_t)(p - buffer));
+        macro_.events++;
+        macro_.durationUs += delta;
+        prevUs_ = timeUs;
+
+        if (tracked) {
+            if (keyboard.up) pressed_.reset((uint8_t)keyboard.vkey);
+            else pressed_.set((uint8_t)keyboard.vkey);
+        }
+        // A trailing run of modifier presses is cut off at the end
+        if (!(tracked && !keyboard.up && isModifierKey((uint8_t)keyboard.vkey))) {
+            keptBytes_ = macro_.bytes.size();
+            keptEvents_ = macro_.events;
+            keptUs_ = macro_.durationUs;
+        }
+        return true;
+    }
+
+    // The recording without its trailing modifier presses; the writer is
+    // empty again afterwards
+    Macro finish() {
+        Macro macro = std::move(macro_);
+        macro.bytes.resize(keptBytes_);
+        macro.events = keptEvents_;
+        macro.durationUs = keptUs_;
+        *this = MacroWriter();
+        return macro;
+    }
+
+private:
+    struct DeviceId { char id[DEVICE_ID_MAX]; };
+
+    // Returns the device's table index, defining it first if it is new
+    uint64_t deviceIndex(const InputEvent& event, char*& out) {
+        if (last_ < devices_.size() && std::strncmp(devices_[last_].id, event.device_id, DEVICE_ID_MAX) == 0) {
+            return last_;
+        }
+        for (last_ = 0; last_ < devices_.size(); ++last_) {
+            if (std::strncmp(devices_[last_].id, event.device_id, DEVICE_ID_MAX) == 0) return last_;
+        }
+        DeviceId entry = {};
+        size_t len = strnlen(event.device_id, DEVICE_ID_MAX - 1);
+        std::memcpy(entry.id, event.device_id, len);
+        devices_.push_back(entry);
+        out = putVarint(out, ((uint64_t)last_ << MACRO_KIND_BITS) | MACRO_KIND_DEVICE);
+        out = putVarint(out, len);
+        std::memcpy(out, event.device_id, len);
+        out += len;
+        return last_;
+    }
+
+    Macro macro_;
+    size_t keptBytes_ = 0;              // macro_ up to its last event that is not a modifier press
+    uint32_t keptEvents_ = 0;
+    uint64_t keptUs_ = 0;
+    uint64_t prevUs_ = 0;
+    std::vector<DeviceId> devices_;
+    size_t last_ = 0;
+    KeySet pressed_;                    // Keys whose press is in the macro and release is not
+};
+
+// Decodes a macro one event at a time
+class MacroReader {
+public:
+    explicit MacroReader(std::shared_ptr<const Macro> macro) : macro_(std::move(macro)) {}
+
+    // The next event and the time since the previous one; false at the end
+    // or on a malformed record
+    bool next(InputEvent& event, uint64_t& deltaUs) {
+        const uint8_t* begin = reinterpret_cast<const uint8_t*>(macro_->bytes.data());
+        const uint8_t* in = begin + offset_;
+        const uint8_t* end = begin + macro_->bytes.size();
+        uint64_t header;
+        while (readVarint(in, end, header) > 0) {
+            unsigned kind = (unsigned)(header & ((1u << MACRO_KIND_BITS) - 1));
+            uint64_t index = header >> MACRO_KIND_BITS;
+            if (kind == MACRO_KIND_DEVICE) {
+                uint64_t length;
+                if (readVarint(in, end, length) <= 0 || length >= DEVICE_ID_MAX || (uint64_t)(end - in) < length ||
+                    index != devices_.size()) {
+                    break;
+                }
+                DeviceId entry = {};
+                std::memcpy(entry.id, in, (size_t)length);
+                devices_.push_back(entry);
+                in += length;
+                continue;
+            }
+            uint64_t a, b, c, d = 0;
+            if (index >= devices_.size() || readVarint(in, end, deltaUs) <= 0 || readVarint(in, end, a) <= 0 ||
+                readVarint(in, end, b) <= 0 || readVarint(in, end, c) <= 0 ||
+                (kind != MACRO_KIND_MOUSE && readVarint(in, end, d) <= 0)) {
+                break;
+            }
+            event = InputEvent();
+            std::memcpy(event.device_id, devices_[index].id, DEVICE_ID_MAX);
+            if (kind == MACRO_KIND_MOUSE) {
+                event.type = DeviceType::Mouse;
+                event.data.mouse.dx = (int)zigzagDecode(a);
+                event.data.mouse.dy = (int)zigzagDecode(b);
+                event.data.mouse.buttons = (int)c;
+            } else {
+                event.type = DeviceType::Keyboard;
+                event.data.keyboard.vkey = (int)a;
+                event.data.keyboard.scan = (uint16_t)b;
+                event.data.keyboard.ch = (uint16_t)c;
+                event.data.keyboard.mods = (uint16_t)d;
+                event.data.keyboard.up = kind == MACRO_KIND_KEY_UP ? 1 : 0;
+            }
+            offset_ = (size_t)(in - begin);
+            return true;
+        }
+        offset_ = macro_->bytes.size();
+        return false;
+    }
+
+private:
+    struct DeviceId { char id[DEVICE_ID_MAX]; };
+
+    std::shared_ptr<const Macro> macro_;
+    size_t offset_ = 0;
+    std::vector<DeviceId> devices_;
+};
+
+// Replays macros on a thread of its own, at most one per owner at a time.
+// Every batch of events that falls due together goes to sink(events,
+// count) on that thread, with timestamps for the sink to set.
+class MacroPlayer {
+public:
+    using Sink = std::function<void(InputEvent*, size_t)>;
+
+    MacroPlayer() = default;
+    ~MacroPlayer() { stop(); }
+
+    MacroPlayer(const MacroPlayer&) = delete;
+    MacroPlayer& operator=(const MacroPlayer&) = delete;
+
+    void start(Sink sink) {
+        sink_ = std::move(sink);
+        running_ = true;
+        thread_ = std::thread(&MacroPlayer::run, this);
+    }
+
+    // Abandons the replays still running
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = false;
+            replays_.clear();
+        }
+        wake_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    // Starts replaying macro for owner now, or stops the replay owner has
+    // running. Returns true if a replay started.
+    bool toggle(size_t owner, std::shared_ptr<const Macro> macro) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = replays_.begin(); it != replays_.end(); ++it) {
+            if (it->owner == owner) {
+                replays_.erase(it);
+                return false;
+            }
+        }
+        Replay replay{ owner, MacroReader(std::move(macro)), macroClockUs(), InputEvent() };
+        if (!running_ || !replay.advance()) return false;
+        replays_.push_back(std::move(replay));
+        wake_.notify_one();
+        return true;
+    }
+
+    size_t playing() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return replays_.size();
+    }
+
+private:
+    struct Replay {
+        size_t owner;
+        MacroReader reader;
+        uint64_t dueUs;                 // When event is due
+        InputEvent event;               // The next to send
+
+        bool advance() {
+            uint64_t delta;
+            if (!reader.next(event, delta)) return false;
+            dueUs += delta;
+            event.flags |= EVENT_FLAG_SYNTHETIC;
+            return true;
+        }
+    };
+
+    void run() {
+        std::vector<InputEvent> batch;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (running_) {
+            if (replays_.empty()) {
+                wake_.wait(lock);
+                continue;
+            }
+            uint64_t due = UINT64_MAX;
+            for (const Replay& replay : replays_) due = std::min(due, replay.dueUs);
+            uint64_t now = macroClockUs();
+            if (due > now + MACRO_SPIN_US) {
+                wake_.wait_for(lock, std::chrono::microseconds(due - now - MACRO_SPIN_US));
+                continue;
+            }
+            if (due > now) {
+                // Yielding keeps the spin from starving capture on a busy core
+                lock.unlock();
+                while (macroClockUs() < due) std::this_thread::yield();
+                lock.lock();
+                continue;
+            }
+            // Everything due by now leaves in one batch, each replay's in order
+            batch.clear();
+            for (size_t i = 0; i < replays_.size();) {
+                Replay& replay = replays_[i];
+                bool more = true;
+                while (more && replay.dueUs <= now) {
+                    batch.push_back(replay.event);
+                    more = replay.advance();
+                }
+                if (more) {
+                    ++i;
+                } else {
+                    replays_.erase(replays_.begin() + (std::ptrdiff_t)i);
+                }
+            }
+            lock.unlock();
+            sink_(batch.data(), batch.size());
+            lock.lock();
+        }
+    }
+
+    Sink sink_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::vector<Replay> replays_;
+    bool running_ = false;
+    std::thread thread_;
+};
+
+struct MacroBinding {
+    uint16_t hotkey = 0;
+    uint16_t macro = 0;
+    bool record = false;                // Otherwise play
+};
+
+struct MacroUser {
+    std::string name;
+    std::vector<std::string> devices;
+    std::vector<MacroBinding> bindings;
+};
+
+class MacroConfig : public UserRules<MacroConfig, MacroUser> {
+private:
+    friend class UserRules<MacroConfig, MacroUser>;
+
+    static bool parseNumber(std::istringstream& fields, uint16_t& number) {
+        std::string text;
+        if (!(fields >> text)) return false;
+        char* end = nullptr;
+        unsigned long value = std::strtoul(text.c_str(), &end, 10);
+        if (*end || value == 0 || value > UINT16_MAX) return false;
+        number = (uint16_t)value;
+        return true;
+    }
+
+    bool parseRule(MacroUser& user, const std::string& directive, std::istringstream& fields) {
+        std::string extra;
+        if (directive == "record" || directive == "play") {
+            MacroBinding binding;
+            binding.record = directive == "record";
+            if (!parseNumber(fields, binding.macro) || !parseNumber(fields, binding.hotkey) || fields >> extra) {
+                return false;
+            }
+            for (const MacroBinding& other : user.bindings) {
+                if (other.hotkey == binding.hotkey) return false;
+            }
+            user.bindings.push_back(binding);
+            return true;
+        }
+        return false;
+    }
+};
+
+// Every user's recordings, macros and replays. Shared by all worker shards.
+class MacroEngine {
+public:
+    // Call before process() and start()
+    void configure(const MacroConfig& config) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        owners_.clear();
+        devices_.clear();
+        defaults_ = config.defaults().bindings;
+        for (const MacroUser& user : config.users()) {
+            Owner owner;
+            owner.name = user.name;
+            owner.bindings = user.bindings;
+            owner.bindings.insert(owner.bindings.end(), defaults_.begin(), defaults_.end());
+            size_t index = owners_.size();
+            for (const std::string& id : user.devices) {
+                devices_.find(id.c_str(), [index](const char*) { return index; });
+            }
+            owners_.push_back(std::move(owner));
+        }
+    }
+
+    // Replays go to sink from now on
+    void start(MacroPlayer::Sink sink) { player_.start(std::move(sink)); }
+    void stop() { player_.stop(); }
+
+    size_t users() const { return owners_.size(); }
+    size_t playing() const { return player_.playing(); }
+
+    // Acts on the batch's macro hotkeys, which it drops, and records the
+    // events of devices whose user is recording
+    size_t process(InputEvent* events, size_t count) {
+        if (recording_.load(std::memory_order_relaxed) == 0) {
+            size_t i = 0;
+            while (i < count && events[i].type != DeviceType::Hotkey) ++i;
+            if (i == count) return count;
+        }
+        uint64_t now = macroClockUs();
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t kept = 0;
+        for (size_t i = 0; i < count; ++i) {
+            InputEvent& event = events[i];
+            if (event.type == DeviceType::Keyboard || event.type == DeviceType::Mouse ||
+                event.type == DeviceType::Hotkey) {
+                size_t device = devices_.find(event.device_id, [this](const char*) { return ownerOfNew(); });
+                size_t owner = devices_[device];
+                if (owner != SIZE_MAX) {
+                    if (event.type == DeviceType::Hotkey) {
+                        if (act(owner, event.data.hotkey.id)) continue;
+                    } else if (owners_[owner].recording) {
+                        record(owners_[owner], event, now);
+                    }
+                }
+            }
+            if (kept != i) events[kept] = event;
+            ++kept;
+        }
+        return kept;
+    }
+
+    // Appends every user's macros, for a hand-off (handoff.h). Recordings
+    // in progress and the macros of devices of no user are left out.
+    void save(std::string& out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        char buffer[30];
+        size_t named = 0;
+        for (const Owner& owner : owners_) named += owner.name.empty() ? 0 : 1;
+        out.append(buffer, (size_t)(putVarint(buffer, named) - buffer));
+        for (const Owner& owner : owners_) {
+            if (owner.name.empty()) continue;
+            putBytes(out, owner.name.data(), owner.name.size());
+            out.append(buffer, (size_t)(putVarint(buffer, owner.macros.size()) - buffer));
+            for (const auto& [number, macro] : owner.macros) {
+                char* p = putVarint(buffer, number);
+                p = putVarint(p, macro->events);
+                p = putVarint(p, macro->durationUs);
+                out.append(buffer, (size_t)(p - buffer));
+                putBytes(out, macro->bytes.data(), macro->bytes.size());
+            }
+        }
+    }
+
+    // Gives the users save() wrote their macros back. Returns false if the
+    // saved state is malformed.
+    bool restore(const uint8_t*& in, const uint8_t* end) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t owners;
+        if (readVarint(in, end, owners) <= 0) return false;
+        for (uint64_t i = 0; i < owners; ++i) {
+            std::string name;
+            uint64_t count;
+            if (!readBytes(in, end, DEVICE_ID_MAX - 1, name) || readVarint(in, end, count) <= 0) return false;
+            auto owner = std::find_if(owners_.begin(), owners_.end(), [&](const Owner& o) { return o.name == name; });
+            for (uint64_t j = 0; j < count; ++j) {
+                uint64_t number, events, durationUs;
+                Macro macro;
+                if (readVarint(in, end, number) <= 0 || readVarint(in, end, events) <= 0 ||
+                    readVarint(in, end, durationUs) <= 0 || !readBytes(in, end, MACRO_BYTES_MAX, macro.bytes) ||
+                    number == 0 || number > UINT16_MAX || events > UINT32_MAX) {
+                    return false;
+                }
+                if (owner == owners_.end()) continue;
+                macro.events = (uint32_t)events;
+                macro.durationUs = durationUs;
+                owner->macros.emplace_back((uint16_t)number, std::make_shared<const Macro>(std::move(macro)));
+            }
+        }
+        return true;
+    }
+
+private:
+    struct Owner {
+        std::string name;                       // Empty for a device of no user
+        std::vector<MacroBinding> bindings;     // Own first, then the "*" ones
+        std::vector<std::pair<uint16_t, std::shared_ptr<const Macro>>> macros;
+        uint16_t recording = 0;                 // The macro being recorded; 0 if none
+        MacroWriter writer;
+    };
+
+    // A device that belongs to no user gets an owner of its own if there
+    // are "*" rules; SIZE_MAX: no macros
+    size_t ownerOfNew() {
+        if (defaults_.empty()) return SIZE_MAX;
+        owners_.push_back(Owner());
+        owners_.back().bindings = defaults_;
+        return owners_.size() - 1;
+    }
+
+    // Returns false if hotkey is not one of the owner's
+    bool act(size_t index, uint16_t hotkey) {
+        Owner& owner = owners_[index];
+        auto binding = std::find_if(owner.bindings.begin(), owner.bindings.end(),
+                                    [hotkey](const MacroBinding& b) { return b.hotkey == hotkey; });
+        if (binding == owner.bindings.end()) return false;
+        if (binding->record) {
+            if (owner.recording) {
+                finishRecording(owner);
+            } else {
+                owner.recording = binding->macro;
+                recording_++;
+            }
+        } else {
+            for (const auto& [number, macro] : owner.macros) {
+                if (number == binding->macro) player_.toggle(index, macro);
+            }
+        }
+        return true;
+    }
+
+    void record(Owner& owner, const InputEvent& event, uint64_t now) {
+        if (!owner.writer.append(event, now)) finishRecording(owner);
+    }
+
+    // Keeps what was recorded; an empty recording deletes the macro
+    void finishRecording(Owner& owner) {
+        auto macro = std::make_shared<const Macro>(owner.writer.finish());
+        auto& macros = owner.macros;
+        macros.erase(std::remove_if(macros.begin(), macros.end(),
+                                    [&](const auto& entry) { return entry.first == owner.recording; }),
+                     macros.end());
+        if (macro->events > 0) macros.emplace_back(owner.recording, std::move(macro));
+        owner.recording = 0;
+        recording_--;
+    }
+
+    std::mutex mutex_;
+    std::vector<Owner> owners_;
+    DeviceTable<size_t> devices_;               // Owner of each device; SIZE_MAX: no macros
+    std::vector<MacroBinding> defaults_;
+    std::atomic<int> recording_{ 0 };           // Owners recording; read without the lock to skip idle batches
+    MacroPlayer player_;
+};
+
+// Hands batches to a MacroEngine. Goes after HotkeyStage, whose hotkey
+// events it acts on, and before the stages replayed events go through.
+// Without macros it does nothing.
+class MacroStage {
+public:
+    explicit MacroStage(MacroEngine* engine = nullptr) : engine_(engine) {}
+
+    size_t process(InputEvent* events, size_t count) {
+        return engine_ ? engine_->process(events, count) : count;
+    }
+
+private:
+    MacroEngine* engine_;
+};
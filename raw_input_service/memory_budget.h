@@ -0,0 +1,96 @@
+// memory_budget.h - Service-wide ceiling on stream buffer memory
+//
+// Every stream buffer that grows with traffic or with clients is charged to
+// one budget (--memory-budget-mb):
+//
+//   history   events kept for "resume" (fixed size)
+//   pending   events published but not taken by the sender yet
+//   backlog   per client, encoded bytes its socket has not taken
+//   held      per client, events waiting for credit (credit_queue.h)
+//
+// The history and the publish queue get fixed shares. Clients split the
+// rest evenly, so each client's limit shrinks as clients join, and a client
+// is only accepted while every client can still get CLIENT_MEMORY_MIN.
+// The owner reports usage as it goes; the counters can be read from any
+// thread.
+#pragma once
+#include "event_types.h"
+#include <algorithm>
+#include <atomic>
+
+constexpr size_t MEMORY_BUDGET_DEFAULT = 64 << 20;  // --memory-budget-mb default
+constexpr size_t CLIENT_BACKLOG_MAX = 4 << 20;      // Per-client limit however large the budget
+constexpr size_t CLIENT_MEMORY_MIN = 64 << 10;      // Smallest per-client limit a client is accepted with
+constexpr size_t PENDING_SHARE = 8;                 // The publish queue gets 1/PENDING_SHARE of the budget
+
+enum class MemoryUse {
+    History,
+    Pending,
+    Backlog,
+    Held
+};
+constexpr size_t MEMORY_USE_COUNT = 4;
+
+class MemoryBudget {
+public:
+    MemoryBudget(size_t limit, size_t historyBytes) : limit_(limit), historyBytes_(historyBytes) {}
+
+    // Call before any client connects
+    void setLimit(size_t limit) { limit_ = limit; }
+    size_t limit() const { return limit_; }
+
+    size_t pendingLimit() const { return limit_ / PENDING_SHARE; }
+
+    // How many of count new events fit next to queued ones in the publish
+    // queue; the rest are counted as dropped
+    size_t admitPending(size_t queued, size_t count) {
+        size_t room = pendingLimit() / sizeof(InputEvent);
+        size_t taken = queued < room ? std::min(count, room - queued) : 0;
+        if (taken < count) {
+            countDropped(count - taken);
+        }
+        return taken;
+    }
+
+    // Bytes each client may use with clients connected
+    size_t clientLimit(size_t clients) const {
+        size_t fixed = historyBytes_ + pendingLimit();
+        size_t shared = limit_ > fixed ? limit_ - fixed : 0;
+        return std::min(CLIENT_BACKLOG_MAX, shared / std::max<size_t>(clients, 1));
+    }
+    bool admits(size_t clients) const { return clientLimit(clients) >= CLIENT_MEMORY_MIN; }
+
+    // Events a credit client may hold: half of its share, the rest is for
+    // its unsent bytes and the motion events CreditQueue may hold past the
+    // limit, one per device and flags
+    size_t holdLimit(size_t clientLimit) const { return clientLimit / 2 / sizeof(InputEvent); }
+
+    void report(MemoryUse use, size_t bytes) {
+        used_[(int)use].store(bytes, std::memory_order_relaxed);
+        size_t total = used();
+        size_t peak = peak_.load(std::memory_order_relaxed);
+        while (total > peak && !peak_.compare_exchange_weak(peak, total, std::memory_order_relaxed)) {}
+    }
+    void reportClients(size_t clients) { clients_.store(clients, std::memory_order_relaxed); }
+    void countDropped(size_t events) { dropped_.fetch_add(events, std::memory_order_relaxed); }
+
+    size_t used(MemoryUse use) const { return used_[(int)use].load(std::memory_order_relaxed); }
+    size_t used() const {
+        size_t total = 0;
+        for (const auto& use : used_) {
+            total += use.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+    size_t peak() const { return peak_.load(std::memory_order_relaxed); }
+    size_t clients() const { return clients_.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }   // Published events refused for lack of room
+
+private:
+    size_t limit_;
+    size_t historyBytes_;
+    std::atomic<size_t> used_[MEMORY_USE_COUNT] = {};
+    std::atomic<size_t> peak_ = 0;
+    std::atomic<size_t> clients_ = 0;
+    std::atomic<uint64_t> dropped_ = 0;
+};
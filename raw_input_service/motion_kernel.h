@@ -0,0 +1,133 @@
+// motion_kernel.h - Fixed-point scaling of batched mouse deltas
+//
+// scaleMotion() scales one axis of one device's motion, laid out as a plain
+// int32 array, by a 16.16 factor and carries the sub-pixel remainder from
+// each delta into the next:
+//
+//     fixed = clamp(delta) * factor + carry
+//     delta = floor(fixed), carry = fixed - delta      (carry stays in [0, 1))
+//
+// The carry makes every delta depend on the one before, so the vector paths
+// use the equivalent prefix form instead: with P[i] the running sum of the
+// carry and the scaled deltas up to i, delta[i] = floor(P[i]) - floor(P[i-1]).
+// The running sum is a scan, the floors are independent, and the results
+// match scaleMotionScalar() bit for bit.
+//
+// The AVX2 path does 4 deltas per step and the SSE4.1 path 2; which one is
+// compiled in depends on the target (-mavx2, /arch:AVX2). Without either,
+// or for the tail, the scalar loop runs.
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MOTION_KERNEL_AVX2 1
+#elif defined(__SSE4_1__) || defined(__AVX__)
+#include <smmintrin.h>
+#define MOTION_KERNEL_SSE41 1
+#endif
+
+constexpr int MOTION_SCALE_BITS = 16;
+constexpr int32_t MOTION_SCALE_ONE = 1 << MOTION_SCALE_BITS;
+constexpr int32_t MOTION_DELTA_MAX = 32767;     // Raw deltas are clamped to +/- this before scaling
+constexpr size_t MOTION_BLOCK = 4096;           // Deltas per running sum, far below int64 overflow
+
+// Adding this before a logical shift floors negative sums as well
+constexpr int64_t MOTION_FLOOR_BIAS = (int64_t)1 << 62;
+
+// The reference; factor is 16.16 fixed point, at most 64 in magnitude
+inline void scaleMotionScalar(int32_t* deltas, size_t count, int32_t factor, int32_t& carry) {
+    for (size_t i = 0; i < count; ++i) {
+        int64_t fixed = (int64_t)std::clamp(deltas[i], -MOTION_DELTA_MAX, MOTION_DELTA_MAX) * factor + carry;
+        int64_t whole = fixed >> MOTION_SCALE_BITS;
+        carry = (int32_t)(fixed - (whole << MOTION_SCALE_BITS));
+        deltas[i] = (int32_t)whole;
+    }
+}
+
+#ifdef MOTION_KERNEL_AVX2
+// Scales whole steps of 4 and returns how many deltas it did
+inline size_t scaleMotionAvx2(int32_t* deltas, size_t count, int32_t factor, int32_t& carry) {
+    const __m128i low = _mm_set1_epi32(-MOTION_DELTA_MAX);
+    const __m128i high = _mm_set1_epi32(MOTION_DELTA_MAX);
+    const __m256i scale = _mm256_set1_epi64x(factor);
+    const __m256i bias = _mm256_set1_epi64x(MOTION_FLOOR_BIAS);
+    const __m256i biasWhole = _mm256_set1_epi64x(MOTION_FLOOR_BIAS >> MOTION_SCALE_BITS);
+    const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum = _mm256_set1_epi64x(carry);        // P before this step, in every lane
+    __m256i lastWhole = zero;                       // floor of it; the carry is under one pixel
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i raw = _mm_min_epi32(_mm_max_epi32(_mm_loadu_si128((const __m128i*)(deltas + i)), low), high);
+        __m256i scan = _mm256_mul_epi32(_mm256_cvtepi32_epi64(raw), scale);
+        scan = _mm256_add_epi64(scan, _mm256_blend_epi32(_mm256_permute4x64_epi64(scan, 0x90), zero, 0x03));
+        scan = _mm256_add_epi64(scan, _mm256_blend_epi32(_mm256_permute4x64_epi64(scan, 0x40), zero, 0x0F));
+        __m256i running = _mm256_add_epi64(scan, sum);
+        // Only this add is carried to the next step
+        sum = _mm256_add_epi64(sum, _mm256_permute4x64_epi64(scan, 0xFF));
+
+        __m256i whole = _mm256_sub_epi64(
+            _mm256_srli_epi64(_mm256_add_epi64(running, bias), MOTION_SCALE_BITS), biasWhole);
+        __m256i previous = _mm256_blend_epi32(_mm256_permute4x64_epi64(whole, 0x90), lastWhole, 0x03);
+        lastWhole = _mm256_permute4x64_epi64(whole, 0xFF);
+        __m256i out = _mm256_permutevar8x32_epi32(_mm256_sub_epi64(whole, previous), pack);
+        _mm_storeu_si128((__m128i*)(deltas + i), _mm256_castsi256_si128(out));
+    }
+    int64_t total;
+    _mm_storel_epi64((__m128i*)&total, _mm256_castsi256_si128(sum));
+    carry = (int32_t)(total & (MOTION_SCALE_ONE - 1));
+    return i;
+}
+#endif
+
+#ifdef MOTION_KERNEL_SSE41
+// Scales whole steps of 2 and returns how many deltas it did
+inline size_t scaleMotionSse41(int32_t* deltas, size_t count, int32_t factor, int32_t& carry) {
+    const __m128i low = _mm_set1_epi32(-MOTION_DELTA_MAX);
+    const __m128i high = _mm_set1_epi32(MOTION_DELTA_MAX);
+    const __m128i scale = _mm_set1_epi64x(factor);
+    const __m128i bias = _mm_set1_epi64x(MOTION_FLOOR_BIAS);
+    const __m128i biasWhole = _mm_set1_epi64x(MOTION_FLOOR_BIAS >> MOTION_SCALE_BITS);
+    __m128i sum = _mm_set1_epi64x(carry);
+    __m128i lastWhole = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128i raw = _mm_min_epi32(_mm_max_epi32(_mm_loadl_epi64((const __m128i*)(deltas + i)), low), high);
+        __m128i scan = _mm_mul_epi32(_mm_cvtepi32_epi64(raw), scale);
+        scan = _mm_add_epi64(scan, _mm_slli_si128(scan, 8));
+        __m128i running = _mm_add_epi64(scan, sum);
+        sum = _mm_add_epi64(sum, _mm_shuffle_epi32(scan, 0xEE));
+
+        __m128i whole = _mm_sub_epi64(_mm_srli_epi64(_mm_add_epi64(running, bias), MOTION_SCALE_BITS), biasWhole);
+        __m128i previous = _mm_alignr_epi8(whole, lastWhole, 8);
+        lastWhole = whole;
+        _mm_storel_epi64((__m128i*)(deltas + i), _mm_shuffle_epi32(_mm_sub_epi64(whole, previous), 0x08));
+    }
+    int64_t total;
+    _mm_storel_epi64((__m128i*)&total, sum);
+    carry = (int32_t)(total & (MOTION_SCALE_ONE - 1));
+    return i;
+}
+#endif
+
+// Scales count deltas in place; carry is the axis' remainder in 1/65536 px
+// and must be in [0, MOTION_SCALE_ONE)
+inline void scaleMotion(int32_t* deltas, size_t count, int32_t factor, int32_t& carry) {
+    size_t done = 0;
+#if defined(MOTION_KERNEL_AVX2) || defined(MOTION_KERNEL_SSE41)
+    while (done < count) {
+        size_t block = std::min(count - done, MOTION_BLOCK);
+#ifdef MOTION_KERNEL_AVX2
+        size_t scaled = scaleMotionAvx2(deltas + done, block, factor, carry);
+#else
+        size_t scaled = scaleMotionSse41(deltas + done, block, factor, carry);
+#endif
+        done += scaled;
+        if (scaled < block) break;
+    }
+#endif
+    scaleMotionScalar(deltas + done, count - done, factor, carry);
+}
@@ -0,0 +1,227 @@
+// pipeline.h - Composable processing stages over batches of InputEvent
+//
+// A stage is any type with
+//
+//     size_t process(InputEvent* events, size_t count);
+//
+// that works on the batch in place and returns how many events remain
+// (filters and coalescers compact the batch towards the front). Pipeline<>
+// chains stages at compile time, so the whole chain inlines into one loop
+// per stage with no indirect calls. RuntimePipeline chains type-erased
+// stages chosen at startup, at the cost of one virtual call per stage per
+// batch.
+#pragma once
+#include "event_types.h"
+#include <memory>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Non-owning view of a batch
+struct EventSpan {
+    InputEvent* data;
+    size_t size;
+
+    InputEvent* begin() const { return data; }
+    InputEvent* end() const { return data + size; }
+    bool empty() const { return size == 0; }
+};
+
+// ---------------------------------------------------------------- Stages
+
+// Keeps the events for which keep(event) is true, in order
+template <typename Predicate>
+class FilterStage {
+public:
+    explicit FilterStage(Predicate keep = Predicate()) : keep_(std::move(keep)) {}
+
+    size_t process(InputEvent* events, size_t count) {
+        size_t kept = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (keep_(events[i])) {
+                if (kept != i) events[kept] = events[i];
+                ++kept;
+            }
+        }
+        return kept;
+    }
+
+private:
+    Predicate keep_;
+};
+
+// Applies fn(event) to every event in place
+template <typename Fn>
+class TransformStage {
+public:
+    explicit TransformStage(Fn fn = Fn()) : fn_(std::move(fn)) {}
+
+    size_t process(InputEvent* events, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            fn_(events[i]);
+        }
+        return count;
+    }
+
+private:
+    Fn fn_;
+};
+
+// Merges runs of adjacent pure-motion mouse events (no button flags) from
+// the same device and with the same event flags into one, summing dx/dy and
+// keeping the last timestamp.
+// Only adjacent events merge, so ordering between devices is unchanged.
+class CoalesceStage {
+public:
+    size_t process(InputEvent* events, size_t count) {
+        if (count == 0) return 0;
+        size_t out = 0;
+        for (size_t i = 1; i < count; ++i) {
+            InputEvent& last = events[out];
+            const InputEvent& next = events[i];
+            if (isMotion(last) && isMotion(next) && last.flags == next.flags &&
+                std::strncmp(last.device_id, next.device_id, DEVICE_ID_MAX) == 0) {
+                last.data.mouse.dx += next.data.mouse.dx;
+                last.data.mouse.dy += next.data.mouse.dy;
+                last.timestamp = next.timestamp;
+            } else {
+                events[++out] = next;
+            }
+        }
+        return out + 1;
+    }
+
+private:
+    static bool isMotion(const InputEvent& event) {
+        return event.type == DeviceType::Mouse && event.data.mouse.buttons == 0;
+    }
+};
+
+// Offers every event to route(event). Returning false means the router took
+// the event elsewhere and it leaves this pipeline; true passes it on.
+template <typename Router>
+class RouteStage {
+public:
+    explicit RouteStage(Router route = Router()) : route_(std::move(route)) {}
+
+    size_t process(InputEvent* events, size_t count) {
+        size_t kept = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (route_(static_cast<const InputEvent&>(events[i]))) {
+                if (kept != i) events[kept] = events[i];
+                ++kept;
+            }
+        }
+        return kept;
+    }
+
+private:
+    Router route_;
+};
+
+// Shows the whole batch to record(span) without changing it (journals, metrics)
+template <typename Recorder>
+class RecordStage {
+public:
+    explicit RecordStage(Recorder record = Recorder()) : record_(std::move(record)) {}
+
+    size_t process(InputEvent* events, size_t count) {
+        if (count > 0) record_(EventSpan{ events, count });
+        return count;
+    }
+
+private:
+    Recorder record_;
+};
+
+// Terminal stage: hands the batch to publish(span) and consumes it
+template <typename Publisher>
+class PublishStage {
+public:
+    explicit PublishStage(Publisher publish = Publisher()) : publish_(std::move(publish)) {}
+
+    size_t process(InputEvent* events, size_t count) {
+        if (count > 0) publish_(EventSpan{ events, count });
+        return 0;
+    }
+
+private:
+    Publisher publish_;
+};
+
+// ---------------------------------------------------------------- Compile-time chain
+
+template <typename... Stages>
+class Pipeline {
+public:
+    Pipeline() = default;
+    explicit Pipeline(Stages... stages) : stages_(std::move(stages)...) {}
+
+    // Runs every stage in order; returns the events left after the last one
+    size_t process(InputEvent* events, size_t count) {
+        return run(events, count, std::index_sequence_for<Stages...>());
+    }
+
+    size_t run(EventSpan batch) { return process(batch.data, batch.size); }
+
+    template <size_t I>
+    auto& stage() { return std::get<I>(stages_); }
+
+private:
+    template <size_t... I>
+    size_t run(InputEvent* events, size_t count, std::index_sequence<I...>) {
+        // Left-to-right fold; later stages are skipped once the batch is empty
+        ((count = count ? std::get<I>(stages_).process(events, count) : 0), ...);
+        return count;
+    }
+
+    std::tuple<Stages...> stages_;
+};
+
+template <typename... Stages>
+Pipeline<Stages...> makePipeline(Stages... stages) {
+    return Pipeline<Stages...>(std::move(stages)...);
+}
+
+// ---------------------------------------------------------------- Runtime chain
+
+class BatchStage {
+public:
+    virtual ~BatchStage() = default;
+    virtual size_t process(InputEvent* events, size_t count) = 0;
+};
+
+template <typename Stage>
+class BatchStageAdapter : public BatchStage {
+public:
+    explicit BatchStageAdapter(Stage stage) : stage_(std::move(stage)) {}
+    size_t process(InputEvent* events, size_t count) override { return stage_.process(events, count); }
+
+private:
+    Stage stage_;
+};
+
+// Stages picked at startup. Wrap hot sequences in a Pipeline<> first so
+// they cost one virtual call together.
+class RuntimePipeline {
+public:
+    template <typename Stage>
+    RuntimePipeline& add(Stage stage) {
+        stages_.push_back(std::make_unique<BatchStageAdapter<Stage>>(std::move(stage)));
+        return *this;
+    }
+
+    size_t process(InputEvent* events, size_t count) {
+        for (const auto& stage : stages_) {
+            if (count == 0) break;
+            count = stage->process(events, count);
+        }
+        return count;
+    }
+
+    size_t run(EventSpan batch) { return process(batch.data, batch.size); }
+    size_t stageCount() const { return stages_.size(); }
+
+private:
+    std::vector<std::unique_ptr<BatchStage>> stages_;
+};
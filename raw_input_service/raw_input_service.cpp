@@ -2,98 +2,334 @@
 #include "common.h"
 #include "device_detector.h"
 #include "socket_server.h"
+#include "relay.h"
+#include "handoff.h"
+#include "remap.h"
+#include "cursor.h"
+#include "keymap.h"
+#include "hotkey.h"
+#include "macro.h"
+#include "user_rules.h"
+#include "sharded_pipeline.h"
+#include <shellapi.h>
+#include <mmsystem.h>
+#include <memory>
+
+#pragma comment(lib, "shell32.lib")
+#pragma comment(lib, "winmm.lib")
 
 // Window class name
 const wchar_t* WINDOW_CLASS = L"RawInputServiceClass";
 
 // Global flag for clean shutdown
 std::atomic<bool> g_running(true);
+std::atomic<bool> g_stopped(false);
+DWORD g_mainThreadId = 0;
+
+// After --takeover, our copies of the raw input the old process already
+// published are skipped, up to its cut (handoff.h)
+bool g_skipTakenOverInput = false;
+CaptureCut g_takeoverCut;
+
+// Message time of the last raw input published and how many had that time,
+// for the cut handed to a successor
+CaptureCut g_lastInput;
+
+// Hand-off requests stop and restart capture on the main thread
+HWND g_hwnd = nullptr;
+constexpr UINT WM_HANDOFF_FREEZE = WM_APP + 1;
+constexpr UINT WM_HANDOFF_RESUME = WM_APP + 2;
+constexpr UINT HANDOFF_FREEZE_TIMEOUT_MS = 5000;
+CaptureCut g_freezeCut;                 // Written by the freeze, read by the hand-off thread after it
+bool g_captureFrozen = false;           // Main thread only
+bool g_macrosStarted = false;
+bool g_macrosFrozen = false;
+
+// Command line options
+struct ServiceOptions {
+    int port = TCP_PORT;
+    std::vector<std::string> relays;    // "host:port[,prefix]" per upstream
+    bool takeover = false;              // Take clients over from a running instance
+    int drainMs = SHUTDOWN_DRAIN_MS;    // Time to flush clients on shutdown
+    bool coalesce = false;              // Merge back-to-back mouse motion per batch
+    int workers = 0;                    // Pipeline worker threads; 0 runs stages on the capture thread
+    ClientTimeouts timeouts;            // Heartbeats and dead-client eviction
+    size_t memoryBudget = MEMORY_BUDGET_DEFAULT;    // Ceiling on stream buffers, in bytes
+    std::string remapPath;              // Key remaps and mouse scaling (remap.h); reloaded on change
+    std::string usersPath;              // Users and their devices (user_rules.h)
+    std::string cursorsPath;            // Per-user virtual cursors (cursor.h)
+    std::vector<std::string> keyboardLayouts;   // "[device=]name" per --keyboard-layout (keymap.h)
+    std::string hotkeysPath;            // Per-user hotkeys and sequences (hotkey.h)
+    std::string macrosPath;             // Per-user macro recording and replay (macro.h)
+};
+
+// Events read since the last flush; WM_INPUT messages that arrive back to
+// back go through the pipeline together
+std::vector<InputEvent> g_captureBatch;
+RuntimePipeline g_pipeline;
+
+// Current --remap table, swapped in place when the file changes
+RemapSource g_remap;
+constexpr UINT_PTR REMAP_TIMER_ID = 1;
+constexpr UINT REMAP_POLL_MS = 1000;
+std::atomic<bool> g_remapCheckQueued(false);
+
+// Virtual cursors from --cursors, shared by all worker shards
+CursorEngine g_cursors;
+
+// The layout each keyboard types in; read-only once the pipeline runs
+KeyLayout g_hostLayout;
+KeyLayouts g_keyLayouts;
+
+// Hotkeys from --hotkeys; read-only once the pipeline runs
+HotkeyTable g_hotkeys;
+
+// Macros from --macros. Replays go through g_macroPipeline, the stages
+// after MacroStage, on the player's thread.
+MacroEngine g_macros;
+RuntimePipeline g_macroPipeline;
+
+// Drops mouse events that carry neither movement nor button changes
+struct NonEmptyEvent {
+    bool operator()(const InputEvent& event) const {
+        return event.type != DeviceType::Mouse || event.data.mouse.dx != 0 ||
+               event.data.mouse.dy != 0 || event.data.mouse.buttons != 0;
+    }
+};
 
-// Process raw input data
-void processRawInput(LPARAM lParam) {
-    UINT dwSize = 0;
-    
-    // Get required buffer size
-    if (GetRawInputData((HRAWINPUT)lParam, RID_INPUT, nullptr, &dwSize, sizeof(RAWINPUTHEADER)) != 0) {
+struct PublishToServer {
+    void operator()(EventSpan batch) const {
+        SocketServer::instance().publishBatch(batch.data, batch.size);
+    }
+};
+
+using CaptureShards = ShardedPipeline<RuntimePipeline>;
+std::unique_ptr<CaptureShards> g_shards;
+
+// Stage chains are fixed at compile time; options only pick which one runs
+// Remapping passes batches through untouched without --remap
+const RemapSource* remapSource(const ServiceOptions& options) {
+    return options.remapPath.empty() ? nullptr : &g_remap;
+}
+
+// Cursor events are published as the stage sees motion, ahead of the batch
+CursorEngine* cursorEngine(const ServiceOptions& options) {
+    return options.cursorsPath.empty() ? nullptr : &g_cursors;
+}
+
+const HotkeyTable* hotkeyTable(const ServiceOptions& options) {
+    return options.hotkeysPath.empty() ? nullptr : &g_hotkeys;
+}
+
+MacroEngine* macroEngine(const ServiceOptions& options) {
+    return options.macrosPath.empty() ? nullptr : &g_macros;
+}
+
+// Key releases go through the stages up to the cursors, for held-key state
+void addProcessingStages(RuntimePipeline& pipeline, const ServiceOptions& options) {
+    RemapStage remap(remapSource(options));
+    KeymapStage keymap(&g_keyLayouts);
+    HotkeyStage hotkeys(hotkeyTable(options));
+    MacroStage macros(macroEngine(options));
+    CursorStage<PublishToServer> cursors(cursorEngine(options));
+    if (options.coalesce) {
+        pipeline.add(makePipeline(FilterStage<NonEmptyEvent>(), remap, keymap, hotkeys, macros, cursors,
+                                  FilterStage<NoKeyRelease>(), CoalesceStage()));
+    } else {
+        pipeline.add(makePipeline(FilterStage<NonEmptyEvent>(), remap, keymap, hotkeys, macros, cursors,
+                                  FilterStage<NoKeyRelease>()));
+    }
+}
+
+void buildPipeline(const ServiceOptions& options) {
+    if (options.workers > 0) {
+        // Capture only splits batches by device; workers run the stages
+        g_shards = std::make_unique<CaptureShards>(options.workers,
+            [&options](RuntimePipeline& pipeline) { addProcessingStages(pipeline, options); },
+            PublishToServer());
+        g_pipeline.add(ShardStage<CaptureShards>{ g_shards.get() });
+        LOG("Processing on " + std::to_string(options.workers) + " worker threads");
+    } else if (options.coalesce) {
+        g_pipeline.add(makePipeline(FilterStage<NonEmptyEvent>(), RemapStage(remapSource(options)),
+                                    KeymapStage(&g_keyLayouts), HotkeyStage(hotkeyTable(options)),
+                                    MacroStage(macroEngine(options)), CursorStage<PublishToServer>(cursorEngine(options)),
+                                    FilterStage<NoKeyRelease>(), CoalesceStage(), PublishStage<PublishToServer>()));
+    } else {
+        g_pipeline.add(makePipeline(FilterStage<NonEmptyEvent>(), RemapStage(remapSource(options)),
+                                    KeymapStage(&g_keyLayouts), HotkeyStage(hotkeyTable(options)),
+                                    MacroStage(macroEngine(options)), CursorStage<PublishToServer>(cursorEngine(options)),
+                                    FilterStage<NoKeyRelease>(), PublishStage<PublishToServer>()));
+    }
+
+    // Replayed events were remapped and matched against hotkeys when they
+    // were recorded, so they join after MacroStage
+    if (options.macrosPath.empty()) {
         return;
     }
+    if (options.coalesce) {
+        g_macroPipeline.add(makePipeline(CursorStage<PublishToServer>(cursorEngine(options)), FilterStage<NoKeyRelease>(),
+                                         CoalesceStage(), PublishStage<PublishToServer>()));
+    } else {
+        g_macroPipeline.add(makePipeline(CursorStage<PublishToServer>(cursorEngine(options)), FilterStage<NoKeyRelease>(),
+                                         PublishStage<PublishToServer>()));
+    }
+}
+
+// Player thread: stamps a batch of replayed events with the capture clock
+// and sends it on
+void injectMacroEvents(InputEvent* events, size_t count) {
+    uint64_t now = GetTickCount64();
+    for (size_t i = 0; i < count; ++i) {
+        events[i].timestamp = now;
+    }
+    g_macroPipeline.process(events, count);
+}
 
-    std::vector<BYTE> buffer(dwSize);
-    if (GetRawInputData((HRAWINPUT)lParam, RID_INPUT, buffer.data(), &dwSize, sizeof(RAWINPUTHEADER)) != dwSize) {
+// The character ToUnicodeEx gives for vkey at a shift level (KeyRow
+// order); 0 for none, a dead key or a control character
+uint16_t hostKeyChar(UINT vkey, UINT scan, size_t level, bool capsLock, HKL hkl) {
+    BYTE state[256] = {};
+    if (level & 1) state[VK_SHIFT] = 0x80;
+    if (level & 2) state[VK_CONTROL] = state[VK_MENU] = 0x80;
+    if (capsLock) state[VK_CAPITAL] = 0x01;
+    WCHAR buffer[4];
+    // Flag 4 leaves the thread's dead key state alone
+    int n = ToUnicodeEx(vkey, scan & 0xFF, state, buffer, 4, 4, hkl);
+    return n == 1 && (level < 2 || buffer[0] >= 0x20) ? (uint16_t)buffer[0] : 0;
+}
+
+// Builds a KeyLayout from the input language of the service's thread, the
+// user's default; about 1300 ToUnicodeEx calls, once at startup
+void importHostKeyLayout(KeyLayout& layout) {
+    HKL hkl = GetKeyboardLayout(0);
+    layout = KeyLayout();
+    layout.name = "host";
+    for (UINT vkey = 1; vkey < KEYMAP_KEYS; ++vkey) {
+        UINT scan = MapVirtualKeyExW(vkey, MAPVK_VK_TO_VSC_EX, hkl);
+        layout.scans[vkey] = (uint16_t)scan;
+        for (size_t level = 0; level < KEYMAP_LEVELS; ++level) {
+            layout.chars[level][vkey] = hostKeyChar(vkey, scan, level, false, hkl);
+        }
+        uint16_t capsChar = hostKeyChar(vkey, scan, 0, true, hkl);
+        layout.caps[vkey] = capsChar != layout.chars[0][vkey] && capsChar == layout.chars[1][vkey];
+        layout.altGr = layout.altGr || layout.chars[2][vkey] || layout.chars[3][vkey];
+    }
+}
+
+// Applies --keyboard-layout; keyboards type in the host's layout by default
+bool configureKeyLayouts(const ServiceOptions& options) {
+    importHostKeyLayout(g_hostLayout);
+    g_keyLayouts.setDefault(&g_hostLayout);
+    // Caps Lock is one light for every keyboard; each starts from it
+    g_keyLayouts.setCapsLock((GetKeyState(VK_CAPITAL) & 1) != 0);
+    for (const std::string& spec : options.keyboardLayouts) {
+        size_t equals = spec.rfind('=');
+        std::string name = equals == std::string::npos ? spec : spec.substr(equals + 1);
+        const KeyLayout* layout = name == "host" ? &g_hostLayout : builtinKeyLayout(name);
+        if (!layout || equals == 0 || (equals != std::string::npos && equals >= DEVICE_ID_MAX)) {
+            LOG("Unknown keyboard layout or device: " + spec + " (layouts: us, uk, de, fr, host)");
+            return false;
+        }
+        if (equals == std::string::npos) {
+            g_keyLayouts.setDefault(layout);
+        } else {
+            g_keyLayouts.assign(spec.substr(0, equals), layout);
+        }
+    }
+    LOG(std::string("Keyboard layout ") + g_keyLayouts.defaultLayout()->name +
+        (g_hostLayout.altGr ? " (host has AltGr)" : "") + ", " + std::to_string(g_keyLayouts.assigned()) +
+        " per-device layouts, Caps Lock " + (g_keyLayouts.capsLock() ? "on" : "off"));
+    return true;
+}
+
+// Checks the remap file for changes off the capture thread; a bad edit is
+// logged and the previous table stays
+void requestRemapCheck() {
+    if (g_remapCheckQueued.exchange(true)) {
         return;
     }
+    bool queued = TaskPool::instance().submit([] {
+        bool reloaded = false;
+        std::string error;
+        if (!g_remap.reloadIfChanged(reloaded, error)) {
+            LOG("Remap file not reloaded, keeping the previous rules: " + error);
+        } else if (reloaded) {
+            LOG("Remap file reloaded (" + std::to_string(g_remap.current()->size()) + " device entries)");
+        }
+        g_remapCheckQueued = false;
+    });
+    if (!queued) {
+        g_remapCheckQueued = false;
+    }
+}
 
-    RAWINPUT* raw = reinterpret_cast<RAWINPUT*>(buffer.data());
-    
-    InputEvent event = {};
-    event.device_id = deviceHandleToId(raw->header.hDevice);
+// Processes whatever the workers still hold and joins them
+void stopWorkers() {
+    if (g_shards) {
+        g_shards->stop();
+    }
+}
+
+void flushCapture() {
+    if (g_captureBatch.empty()) return;
+    g_pipeline.process(g_captureBatch.data(), g_captureBatch.size());
+    g_captureBatch.clear();
+}
+
+// Read one raw input message into an event; false if there is nothing to send
+bool readRawInput(LPARAM lParam, InputEvent& event) {
+    // Keyboard and mouse input always fits in one RAWINPUT
+    RAWINPUT raw;
+    UINT dwSize = sizeof(raw);
+    if (GetRawInputData((HRAWINPUT)lParam, RID_INPUT, &raw, &dwSize, sizeof(RAWINPUTHEADER)) == (UINT)-1) {
+        return false;
+    }
+
+    event = {};
+    deviceHandleToId(raw.header.hDevice, event);
     event.timestamp = GetTickCount64();
 
     // Check if device is known, if not add it
-    DeviceInfo* deviceInfo = DeviceDetector::instance().getDevice(raw->header.hDevice);
+    bool knownDevice = DeviceDetector::instance().getDevice(raw.header.hDevice) != nullptr;
     
-    if (raw->header.dwType == RIM_TYPEKEYBOARD) {
+    if (raw.header.dwType == RIM_TYPEKEYBOARD) {
         event.type = DeviceType::Keyboard;
-        event.data.keyboard.vkey = raw->data.keyboard.VKey;
-        
-        // Only send key down events (not key up) to reduce noise
-        // Remove this check if you want both key down and key up
-        if (raw->data.keyboard.Flags & RI_KEY_BREAK) {
-            return; // Key up event, skip
-        }
+        event.data.keyboard.vkey = raw.data.keyboard.VKey;
+        event.data.keyboard.scan = (uint16_t)(raw.data.keyboard.MakeCode |
+                                              ((raw.data.keyboard.Flags & RI_KEY_E0) ? KEYMAP_EXTENDED : 0));
+
+        // Releases only feed the held-key state in the stages (keymap.h);
+        // clients get key presses
+        event.data.keyboard.up = (raw.data.keyboard.Flags & RI_KEY_BREAK) ? 1 : 0;
 
-        if (!deviceInfo) {
-            DeviceDetector::instance().addDevice(raw->header.hDevice, DeviceType::Keyboard);
+        if (!knownDevice) {
+            DeviceDetector::instance().addDevice(raw.header.hDevice, DeviceType::Keyboard);
         }
     }
-    else if (raw->header.dwType == RIM_TYPEMOUSE) {
+    else if (raw.header.dwType == RIM_TYPEMOUSE) {
         event.type = DeviceType::Mouse;
-        event.data.mouse.dx = raw->data.mouse.lLastX;
-        event.data.mouse.dy = raw->data.mouse.lLastY;
-        event.data.mouse.buttons = raw->data.mouse.usButtonFlags;
+        event.data.mouse.dx = raw.data.mouse.lLastX;
+        event.data.mouse.dy = raw.data.mouse.lLastY;
+        event.data.mouse.buttons = raw.data.mouse.usButtonFlags;
 
-        // Skip events with no movement and no button changes
-        if (event.data.mouse.dx == 0 && event.data.mouse.dy == 0 && event.data.mouse.buttons == 0) {
-            return;
-        }
-
-        if (!deviceInfo) {
-            DeviceDetector::instance().addDevice(raw->header.hDevice, DeviceType::Mouse);
+        if (!knownDevice) {
+            DeviceDetector::instance().addDevice(raw.header.hDevice, DeviceType::Mouse);
         }
     }
     else {
-        return; // Unknown device type
+        return false; // Unknown device type
     }
-
-    // Format and broadcast the event
-    std::string json = formatEventJson(event);
-    SocketServer::instance().broadcast(json);
+    return true;
 }
 
-// Window procedure
-LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
-    switch (uMsg) {
-        case WM_INPUT:
-            processRawInput(lParam);
-            return 0;
-
-        case WM_INPUT_DEVICE_CHANGE:
-            // Device added or removed
-            if (wParam == GIDC_ARRIVAL) {
-                LOG("Device arrival detected");
-                DeviceDetector::instance().enumerateDevices();
-            } else if (wParam == GIDC_REMOVAL) {
-                LOG("Device removal detected");
-                DeviceDetector::instance().enumerateDevices();
-            }
-            return 0;
-
-        case WM_DESTROY:
-            PostQuitMessage(0);
-            return 0;
-
-        default:
-            return DefWindowProc(hwnd, uMsg, wParam, lParam);
+// Queue one raw input message; flush once no more raw input is waiting
+void processRawInput(LPARAM lParam) {
+    InputEvent event;
+    if (readRawInput(lParam, event)) {
+        g_captureBatch.push_back(event);
+    }
+    if (g_captureBatch.size() >= CAPTURE_BATCH_MAX || !(HIWORD(GetQueueStatus(QS_RAWINPUT)) & QS_RAWINPUT)) {
+        flushCapture();
     }
 }
 
@@ -122,6 +358,166 @@ bool registerRawInput(HWND hwnd) {
     return true;
 }
 
+// Stop capture and publish input that was already queued for us
+void unregisterRawInput() {
+    RAWINPUTDEVICE rid[2] = {};
+    rid[0].usUsagePage = 0x01;
+    rid[0].usUsage = 0x06;
+    rid[0].dwFlags = RIDEV_REMOVE;
+    rid[1].usUsagePage = 0x01;
+    rid[1].usUsage = 0x02;
+    rid[1].dwFlags = RIDEV_REMOVE;
+    if (!RegisterRawInputDevices(rid, 2, sizeof(RAWINPUTDEVICE))) {
+        LOG("Failed to unregister raw input devices: " + std::to_string(GetLastError()));
+    }
+
+    MSG msg;
+    while (PeekMessageW(&msg, nullptr, WM_INPUT, WM_INPUT, PM_REMOVE)) {
+        DispatchMessage(&msg);
+    }
+    flushCapture();
+}
+
+// Skips the raw input the process we took over from already published:
+// everything older than its cut, then as many with the cut's time as it
+// had. Both processes get the same input in the same order.
+bool takenOverInput(DWORD time) {
+    LONG age = (LONG)(g_takeoverCut.tick - time);
+    if (age > 0 || (age == 0 && g_takeoverCut.count > 0)) {
+        if (age == 0) g_takeoverCut.count--;
+        return true;
+    }
+    g_skipTakenOverInput = false;
+    return false;
+}
+
+// Hand-off, on the main thread. The new process registered for raw input
+// at registeredTick, so once the tick moves past it, every later input is
+// in its queue too and ours can stop. What we already received is
+// published, and the workers and the macro player are left with nothing.
+void freezeCapture(DWORD registeredTick) {
+    while ((LONG)(GetTickCount() - registeredTick) <= 0) {
+        Sleep(1);
+    }
+    unregisterRawInput();
+    g_captureFrozen = true;
+    if (g_shards) {
+        g_shards->drain();
+    }
+    if (g_macrosStarted) {
+        g_macros.stop();
+        g_macrosFrozen = true;
+    }
+
+    g_freezeCut = g_lastInput;
+    if (g_freezeCut.count == 0 || (LONG)(g_freezeCut.tick - registeredTick) <= 0) {
+        // Nothing arrived after the registration; the new process skips
+        // everything up to it
+        g_freezeCut.tick = registeredTick;
+        g_freezeCut.count = UINT32_MAX;
+    }
+}
+
+// Undoes freezeCapture after a failed hand-off
+void resumeCapture() {
+    if (g_captureFrozen && g_running) {
+        registerRawInput(g_hwnd);
+    }
+    if (g_macrosFrozen && g_running) {
+        g_macros.start(injectMacroEvents);
+    }
+    g_captureFrozen = false;
+    g_macrosFrozen = false;
+}
+
+// Stage state that a hand-off carries: the cursor positions and recorded
+// macros. The rest is per worker shard and starts over in the new process
+// (handoff.h).
+void saveStageState(std::string& stages) {
+    g_cursors.save(stages);
+    g_macros.save(stages);
+    if (stages.size() > HANDOFF_MAX_STAGE_BYTES) {
+        LOG("Stage state of " + std::to_string(stages.size()) + " bytes is too large to hand off");
+        stages.clear();
+    }
+}
+
+bool restoreStageState(const std::string& stages) {
+    const uint8_t* in = (const uint8_t*)stages.data();
+    const uint8_t* end = in + stages.size();
+    return stages.empty() || (g_cursors.restore(in, end) && g_macros.restore(in, end) && in == end);
+}
+
+// CaptureControl for the hand-off thread, which waits for the main thread
+bool handoffFreeze(DWORD registeredTick, CaptureCut& cut, std::string& stages) {
+    DWORD_PTR frozen = 0;
+    if (!g_running || !SendMessageTimeoutW(g_hwnd, WM_HANDOFF_FREEZE, registeredTick, 0, SMTO_ABORTIFHUNG,
+                                           HANDOFF_FREEZE_TIMEOUT_MS, &frozen) || !frozen) {
+        return false;
+    }
+    cut = g_freezeCut;
+    saveStageState(stages);
+    return true;
+}
+
+void handoffResume() {
+    if (!g_running) return;
+    DWORD_PTR unused;
+    SendMessageTimeoutW(g_hwnd, WM_HANDOFF_RESUME, 0, 0, SMTO_ABORTIFHUNG, HANDOFF_FREEZE_TIMEOUT_MS, &unused);
+}
+
+// Window procedure
+LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
+    switch (uMsg) {
+        case WM_INPUT: {
+            DWORD time = (DWORD)GetMessageTime();
+            if (g_skipTakenOverInput && takenOverInput(time)) {
+                return 0;
+            }
+            if (time == g_lastInput.tick) {
+                g_lastInput.count++;
+            } else {
+                g_lastInput.tick = time;
+                g_lastInput.count = 1;
+            }
+            processRawInput(lParam);
+            return 0;
+        }
+
+        case WM_HANDOFF_FREEZE:
+            freezeCapture((DWORD)wParam);
+            return 1;
+
+        case WM_HANDOFF_RESUME:
+            resumeCapture();
+            return 0;
+
+        case WM_TIMER:
+            if (wParam == REMAP_TIMER_ID) {
+                requestRemapCheck();
+            }
+            return 0;
+
+        case WM_INPUT_DEVICE_CHANGE:
+            // Device added or removed; rescan off the capture thread
+            if (wParam == GIDC_ARRIVAL) {
+                LOG("Device arrival detected");
+                DeviceDetector::instance().requestRescan();
+            } else if (wParam == GIDC_REMOVAL) {
+                LOG("Device removal detected");
+                DeviceDetector::instance().requestRescan();
+            }
+            return 0;
+
+        case WM_DESTROY:
+            PostQuitMessage(0);
+            return 0;
+
+        default:
+            return DefWindowProc(hwnd, uMsg, wParam, lParam);
+    }
+}
+
 // Create hidden window for receiving messages
 HWND createHiddenWindow(HINSTANCE hInstance) {
     WNDCLASSEXW wc = {};
@@ -159,13 +555,113 @@ BOOL WINAPI ConsoleHandler(DWORD signal) {
     if (signal == CTRL_C_EVENT || signal == CTRL_BREAK_EVENT || signal == CTRL_CLOSE_EVENT) {
         LOG("Shutdown signal received");
         g_running = false;
-        PostQuitMessage(0);
+        // This runs on its own thread; wake the message loop
+        PostThreadMessageW(g_mainThreadId, WM_QUIT, 0, 0);
+        if (signal == CTRL_CLOSE_EVENT) {
+            // The process is killed once we return; give the drain a chance
+            while (!g_stopped) {
+                Sleep(50);
+            }
+        }
         return TRUE;
     }
     return FALSE;
 }
 
 
+std::string narrow(const wchar_t* text) {
+    int len = WideCharToMultiByte(CP_UTF8, 0, text, -1, nullptr, 0, nullptr, nullptr);
+    std::string result(len > 0 ? len - 1 : 0, '\0');
+    if (len > 1) {
+        WideCharToMultiByte(CP_UTF8, 0, text, -1, &result[0], len, nullptr, nullptr);
+    }
+    return result;
+}
+
+// Reads the process command line, so it works for both entry points
+bool parseCommandLine(ServiceOptions& options) {
+    int argc = 0;
+    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    if (!argv) return false;
+
+    bool ok = true;
+    for (int i = 1; i < argc && ok; ++i) {
+        std::string arg = narrow(argv[i]);
+        bool hasValue = i + 1 < argc;
+        if (arg == "--port" && hasValue) {
+            options.port = atoi(narrow(argv[++i]).c_str());
+            ok = options.port > 0 && options.port <= 65535;
+        } else if (arg == "--relay" && hasValue) {
+            options.relays.push_back(narrow(argv[++i]));
+        } else if (arg == "--drain-ms" && hasValue) {
+            options.drainMs = atoi(narrow(argv[++i]).c_str());
+            ok = options.drainMs >= 0;
+        } else if (arg == "--workers" && hasValue) {
+            options.workers = atoi(narrow(argv[++i]).c_str());
+            ok = options.workers >= 0 && options.workers <= 64;
+        } else if (arg == "--heartbeat-ms" && hasValue) {
+            int ms = atoi(narrow(argv[++i]).c_str());
+            ok = ms >= 0;
+            options.timeouts.heartbeatMs = (uint64_t)ms;
+        } else if (arg == "--write-timeout-ms" && hasValue) {
+            int ms = atoi(narrow(argv[++i]).c_str());
+            ok = ms >= 0;
+            options.timeouts.writeTimeoutMs = (uint64_t)ms;
+        } else if (arg == "--pong-timeout-ms" && hasValue) {
+            int ms = atoi(narrow(argv[++i]).c_str());
+            ok = ms >= 0;
+            options.timeouts.pongTimeoutMs = (uint64_t)ms;
+        } else if (arg == "--memory-budget-mb" && hasValue) {
+            int mb = atoi(narrow(argv[++i]).c_str());
+            ok = mb > 0 && mb <= 65536;
+            options.memoryBudget = (size_t)mb << 20;
+        } else if (arg == "--remap" && hasValue) {
+            options.remapPath = narrow(argv[++i]);
+        } else if (arg == "--users" && hasValue) {
+            options.usersPath = narrow(argv[++i]);
+        } else if (arg == "--cursors" && hasValue) {
+            options.cursorsPath = narrow(argv[++i]);
+        } else if (arg == "--keyboard-layout" && hasValue) {
+            options.keyboardLayouts.push_back(narrow(argv[++i]));
+        } else if (arg == "--hotkeys" && hasValue) {
+            options.hotkeysPath = narrow(argv[++i]);
+        } else if (arg == "--macros" && hasValue) {
+            options.macrosPath = narrow(argv[++i]);
+        } else if (arg == "--coalesce") {
+            options.coalesce = true;
+        } else if (arg == "--takeover") {
+            options.takeover = true;
+        } else {
+            LOG("Unknown or incomplete argument: " + arg);
+            ok = false;
+        }
+    }
+    LocalFree(argv);
+
+    // Clients need heartbeats to have something to answer
+    const ClientTimeouts& timeouts = options.timeouts;
+    if (ok && timeouts.pongTimeoutMs && (!timeouts.heartbeatMs || timeouts.pongTimeoutMs <= timeouts.heartbeatMs)) {
+        LOG("--pong-timeout-ms must be longer than --heartbeat-ms");
+        ok = false;
+    }
+    // Cursors belong to users; hotkeys and macros may have only "*" rules
+    if (ok && !options.cursorsPath.empty() && options.usersPath.empty()) {
+        LOG("--cursors needs --users");
+        ok = false;
+    }
+    // Macros are recorded and replayed by hotkey
+    if (ok && !options.macrosPath.empty() && options.hotkeysPath.empty()) {
+        LOG("--macros needs --hotkeys");
+        ok = false;
+    }
+    MemoryBudget budget(options.memoryBudget, HISTORY_SIZE * sizeof(InputEvent));
+    if (ok && !budget.admits(1)) {
+        LOG("--memory-budget-mb leaves no room for a client");
+        ok = false;
+    }
+    return ok;
+}
+
 // Entry point - supports both console and Windows subsystem
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCmdShow) {
     (void)hPrevInstance;
@@ -174,16 +670,77 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
 
     // Initialize logger
     Logger::instance().init("raw_input_service.log");
+    TaskPool::instance().start();
     LOG("=== Raw Input Service Starting ===");
 
     // Set console handler if running with console
+    g_mainThreadId = GetCurrentThreadId();
     SetConsoleCtrlHandler(ConsoleHandler, TRUE);
 
-    // Start TCP server
-    if (!SocketServer::instance().start(TCP_PORT)) {
-        LOG("Failed to start TCP server");
+    ServiceOptions options;
+    if (!parseCommandLine(options)) {
+        LOG("Usage: raw_input_service [--port N] [--relay host:port[,prefix]]... [--takeover] [--drain-ms N] [--coalesce] [--workers N] "
+            "[--heartbeat-ms N] [--write-timeout-ms N] [--pong-timeout-ms N] [--memory-budget-mb N] [--remap file] "
+            "[--users file] [--cursors file] [--keyboard-layout [device=]name]... [--hotkeys file] [--macros file]");
         return 1;
     }
+    if (!options.remapPath.empty()) {
+        std::string error;
+        if (!g_remap.load(options.remapPath, error)) {
+            LOG("Invalid remap file: " + error);
+            return 1;
+        }
+        LOG("Remapping with " + options.remapPath + " (" + std::to_string(g_remap.current()->size()) +
+            " device entries)");
+    }
+    if (!configureKeyLayouts(options)) {
+        return 1;
+    }
+    UserDevices users;
+    if (!options.usersPath.empty()) {
+        std::string error;
+        if (!UserDevices::load(options.usersPath, users, error)) {
+            LOG("Invalid users file: " + error);
+            return 1;
+        }
+        LOG(std::to_string(users.users().size()) + " users from " + options.usersPath);
+    }
+    if (!options.cursorsPath.empty()) {
+        CursorConfig config;
+        std::string error;
+        if (!CursorConfig::load(options.cursorsPath, users, config, error)) {
+            LOG("Invalid cursor file: " + error);
+            return 1;
+        }
+        CursorScreen desktop;
+        desktop.left = GetSystemMetrics(SM_XVIRTUALSCREEN);
+        desktop.top = GetSystemMetrics(SM_YVIRTUALSCREEN);
+        desktop.width = GetSystemMetrics(SM_CXVIRTUALSCREEN);
+        desktop.height = GetSystemMetrics(SM_CYVIRTUALSCREEN);
+        g_cursors.configure(config, desktop);
+        LOG("Virtual cursors for " + std::to_string(g_cursors.users()) + " users from " + options.cursorsPath);
+    }
+    if (!options.hotkeysPath.empty()) {
+        HotkeyConfig config;
+        std::string error;
+        if (!HotkeyConfig::load(options.hotkeysPath, users, config, error) || !g_hotkeys.build(config, error)) {
+            LOG("Invalid hotkey file: " + error);
+            return 1;
+        }
+        LOG("Hotkeys for " + std::to_string(config.users().size()) + " users from " + options.hotkeysPath);
+    }
+    if (!options.macrosPath.empty()) {
+        MacroConfig config;
+        std::string error;
+        if (!MacroConfig::load(options.macrosPath, users, config, error)) {
+            LOG("Invalid macro file: " + error);
+            return 1;
+        }
+        g_macros.configure(config);
+        LOG("Macros for " + std::to_string(g_macros.users()) + " users from " + options.macrosPath);
+    }
+    buildPipeline(options);
+    g_captureBatch.reserve(CAPTURE_BATCH_MAX);
 
     // Enumerate existing devices
     DeviceDetector::instance().enumerateDevices();
@@ -192,19 +749,78 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
     HWND hwnd = createHiddenWindow(hInstance);
     if (!hwnd) {
         LOG("Failed to create hidden window");
-        SocketServer::instance().stop();
         return 1;
     }
+    g_hwnd = hwnd;
 
-    // Register for raw input
+    if (!options.remapPath.empty()) {
+        SetTimer(hwnd, REMAP_TIMER_ID, REMAP_POLL_MS, nullptr);
+    }
+
+    // Register for raw input before taking over, so input arriving during
+    // the hand-off waits in our message queue
     if (!registerRawInput(hwnd)) {
         LOG("Failed to register raw input");
         DestroyWindow(hwnd);
-        SocketServer::instance().stop();
         return 1;
     }
 
-    LOG("Service running. Listening on port " + std::to_string(TCP_PORT));
+    // Take the clients over from a running instance, or start fresh
+    SocketServer& server = SocketServer::instance();
+    server.setTimeouts(options.timeouts);
+    server.setMemoryBudget(options.memoryBudget);
+    const MemoryBudget& budget = server.memoryBudget();
+    LOG("Memory budget " + std::to_string(budget.limit() >> 20) + " MB: " +
+        std::to_string(budget.clientLimit(1) >> 10) + " KB for one client, " +
+        std::to_string(budget.clientLimit(MAX_CLIENTS) >> 10) + " KB each with " + std::to_string(MAX_CLIENTS));
+    std::string stages;
+    bool tookOver = options.takeover && takeOver(options.port, GetTickCount(), g_takeoverCut, stages);
+    g_skipTakenOverInput = tookOver;
+    if (tookOver) {
+        if (!restoreStageState(stages)) {
+            LOG("Invalid stage state in the hand-off; cursors and macros may start over");
+        }
+        LOG("Held modifiers, hotkey sequences and recordings in progress and motion remainders start over; "
+            "Caps Lock starts from the host's");
+    }
+    if (!tookOver && !SocketServer::instance().start(options.port)) {
+        LOG("Failed to start TCP server");
+        DestroyWindow(hwnd);
+        return 1;
+    }
+
+    // Republish upstream services alongside our own devices
+    std::vector<std::unique_ptr<UpstreamRelay>> relays;
+    for (const std::string& spec : options.relays) {
+        std::string host, prefix;
+        uint16_t port = 0;
+        if (!UpstreamRelay::parseSpec(spec, host, port, prefix)) {
+            LOG("Invalid relay address: " + spec);
+            relays.clear();
+            SocketServer::instance().stop();
+            DestroyWindow(hwnd);
+            return 1;
+        }
+        relays.push_back(std::make_unique<UpstreamRelay>(
+            host, port, prefix, [](std::vector<InputEvent>& batch) { SocketServer::instance().publishBatch(batch); },
+            [](const std::string& message) { LOG(message); }));
+        relays.back()->start();
+    }
+
+    // Replays sleep on a 1 ms timer period and spin the rest (macro.h)
+    if (!options.macrosPath.empty()) {
+        timeBeginPeriod(1);
+        g_macros.start(injectMacroEvents);
+        g_macrosStarted = true;
+    }
+
+    // Every event source runs by now, so a hand-off can stop them all
+    CaptureControl capture;
+    capture.freeze = handoffFreeze;
+    capture.resume = handoffResume;
+    HandoffServer::instance().start(options.port, g_mainThreadId, capture);
+
+    LOG("Service running. Listening on port " + std::to_string(options.port));
     LOG("Press Ctrl+C to stop");
 
     // Message loop
@@ -214,13 +830,26 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
         DispatchMessage(&msg);
     }
 
-    // Cleanup
+    // Cleanup: stop every event source first, then drain the server. A
+    // hand-off in progress gives up once this thread stops answering.
     LOG("Shutting down...");
-    SocketServer::instance().stop();
+    HandoffServer::instance().stop();
+    if (!g_captureFrozen) {
+        unregisterRawInput();
+    }
+    stopWorkers();
+    if (!options.macrosPath.empty()) {
+        g_macros.stop();
+        timeEndPeriod(1);
+    }
+    relays.clear();
+    SocketServer::instance().stop(options.drainMs);
     DestroyWindow(hwnd);
     UnregisterClassW(WINDOW_CLASS, hInstance);
+    TaskPool::instance().stop();
     
     LOG("=== Raw Input Service Stopped ===");
+    g_stopped = true;
     return 0;
 }
 
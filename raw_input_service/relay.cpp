@@ -0,0 +1,125 @@
+// relay.cpp - Upstream relay implementation
+#include "relay.h"
+#include "input_client.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+constexpr int RELAY_RECEIVE_TIMEOUT_MS = 200;  // Relay thread checks for stop this often
+constexpr int RELAY_RECONNECT_DELAY_MS = 1000;
+constexpr size_t RELAY_PREFIX_MAX = 24;        // Leaves room for the upstream's own ID
+
+UpstreamRelay::UpstreamRelay(const std::string& host, uint16_t port, const std::string& prefix, Publish publish,
+                             Log log)
+    : host_(host), port_(port), prefix_(prefix), publish_(std::move(publish)), log_(std::move(log)), running_(false) {
+    if (prefix_.size() > RELAY_PREFIX_MAX) {
+        log_("Relay prefix too long, truncating: " + prefix_);
+        prefix_.resize(RELAY_PREFIX_MAX);
+    }
+}
+
+bool UpstreamRelay::parseSpec(const std::string& spec, std::string& host, uint16_t& port, std::string& prefix) {
+    std::string address = spec;
+    prefix.clear();
+    size_t comma = spec.find(',');
+    if (comma != std::string::npos) {
+        address = spec.substr(0, comma);
+        prefix = spec.substr(comma + 1);
+    }
+
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+        return false;
+    }
+    int value = atoi(address.c_str() + colon + 1);
+    if (value <= 0 || value > 65535) {
+        return false;
+    }
+    host = address.substr(0, colon);
+    port = (uint16_t)value;
+    if (prefix.empty()) {
+        prefix = address + "/";
+    }
+    return true;
+}
+
+void UpstreamRelay::start() {
+    if (running_) return;
+    running_ = true;
+    thread_ = std::thread(&UpstreamRelay::relayLoop, this);
+    log_("Relaying " + host_ + ":" + std::to_string(port_) + " as " + prefix_ + "*");
+}
+
+void UpstreamRelay::stop() {
+    if (!running_) return;
+    running_ = false;
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void UpstreamRelay::relayLoop() {
+    // Recorded before the first connect so that reconnect() asks for it
+    // even when the upstream was down at start
+    InputStreamClient upstream;
+    upstream.preferFormat(StreamFormat::Compact);
+    bool connected = upstream.connectTcp(host_, port_) && upstream.hello() &&
+                     upstream.setFormat(StreamFormat::Compact) &&
+                     upstream.setReceiveTimeout(RELAY_RECEIVE_TIMEOUT_MS);
+
+    // Reused across reads; publish_ empties it
+    std::vector<InputEvent> batch;
+    const size_t prefixLen = prefix_.size();
+    bool truncated = false;
+    bool warned = false;
+
+    while (running_) {
+        if (!connected) {
+            for (int waited = 0; waited < RELAY_RECONNECT_DELAY_MS && running_; waited += RELAY_RECEIVE_TIMEOUT_MS) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(RELAY_RECEIVE_TIMEOUT_MS));
+            }
+            // Resumes after the last upstream seq we republished
+            connected = running_ && upstream.reconnect() &&
+                        upstream.setReceiveTimeout(RELAY_RECEIVE_TIMEOUT_MS);
+            if (connected) {
+                log_("Relay reconnected to " + host_ + ":" + std::to_string(port_));
+            }
+            continue;
+        }
+
+        // Everything decoded from one read goes out as one batch
+        int result = upstream.poll([&](const EventView& view) {
+            if (view.kind == EventKind::Gap) {
+                log_("Relay missed upstream events " + std::to_string(view.seq) + "-" + std::to_string(view.gap_to));
+                return;
+            }
+            if (!view.event) {
+                return; // Control record
+            }
+
+            batch.push_back(*view.event);
+            InputEvent& event = batch.back();
+            size_t idLen = strnlen(event.device_id, DEVICE_ID_MAX - 1);
+            if (prefixLen + idLen > DEVICE_ID_MAX - 1) {
+                idLen = DEVICE_ID_MAX - 1 - prefixLen;
+                truncated = true;
+            }
+            std::memmove(event.device_id + prefixLen, event.device_id, idLen);
+            std::memcpy(event.device_id, prefix_.data(), prefixLen);
+            event.device_id[prefixLen + idLen] = '\0';
+        });
+
+        publish_(batch);
+
+        if (truncated && !warned) {
+            log_("Relay truncated an upstream device ID; use a shorter prefix");
+            warned = true;
+        }
+        if (result < 0) {
+            log_("Relay lost connection to " + host_ + ":" + std::to_string(port_));
+            connected = false;
+        }
+    }
+    upstream.close();
+}
@@ -0,0 +1,43 @@
+// relay.h - Republishes another service's event stream through this one
+//
+// Portable: the service passes its SocketServer's publishBatch and its log,
+// and tests run a relay against a loopback upstream.
+#pragma once
+#include "event_types.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+class UpstreamRelay {
+public:
+    using Publish = std::function<void(std::vector<InputEvent>& batch)>;   // Takes the events, leaves batch empty
+    using Log = std::function<void(const std::string& message)>;
+
+    // Device IDs from upstream are rewritten to prefix + ID so they stay
+    // unique next to local devices and other relays
+    UpstreamRelay(const std::string& host, uint16_t port, const std::string& prefix, Publish publish, Log log);
+    ~UpstreamRelay() { stop(); }
+
+    UpstreamRelay(const UpstreamRelay&) = delete;
+    UpstreamRelay& operator=(const UpstreamRelay&) = delete;
+
+    void start();
+    void stop();
+
+    // Parses "host:port[,prefix]". The prefix defaults to "host:port/".
+    static bool parseSpec(const std::string& spec, std::string& host, uint16_t& port, std::string& prefix);
+
+private:
+    void relayLoop();
+
+    std::string host_;
+    uint16_t port_;
+    std::string prefix_;
+    Publish publish_;
+    Log log_;
+    std::atomic<bool> running_;
+    std::thread thread_;
+};
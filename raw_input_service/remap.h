@@ -0,0 +1,303 @@
+// remap.h - Per-device key remapping and mouse axis scaling
+//
+// A remap file (--remap) holds one rule per line:
+//
+//     # Caps Lock sends Left Ctrl on one keyboard only
+//     0x1A2B3C key 0x14 0xA2
+//     0x1A2B3C key 0x2D off          # Insert does nothing
+//     0x4D5E6F scale 1.5 -1          # Faster, vertical axis inverted
+//     *        scale 0.8             # Every other mouse, both axes
+//
+// Device IDs are the device_id the stream reports; "*" applies to devices
+// without rules of their own. Keys are virtual-key codes (0-255, decimal or
+// 0x hex). Scale factors become 16.16 fixed point.
+//
+// The rules compile into a RemapTable with a 256-entry key table and the
+// fixed-point factors per device. RemapSource publishes the current table
+// behind an atomic shared_ptr, so a reload swaps it between two batches and
+// RemapStage pays one atomic load per batch and one table lookup per key.
+// Scaled motion keeps its sub-pixel remainder per device, so slow movement
+// still adds up instead of rounding away; the scaling itself is
+// motion_kernel.h.
+//
+// Portable; only the reload trigger lives in the service.
+#pragma once
+#include "device_table.h"
+#include "event_types.h"
+#include "motion_kernel.h"
+#include "user_rules.h"
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+constexpr int REMAP_SCALE_BITS = MOTION_SCALE_BITS;
+constexpr int32_t REMAP_SCALE_ONE = MOTION_SCALE_ONE;
+constexpr double REMAP_SCALE_MAX = 64.0;        // Larger factors are rejected
+constexpr size_t REMAP_KEYS = 256;
+constexpr uint8_t REMAP_KEY_OFF = 0;            // Key table entry that drops the key
+
+struct DeviceRemap {
+    char deviceId[DEVICE_ID_MAX];       // "*" for the default entry
+    uint8_t keys[REMAP_KEYS];           // vkey -> vkey, REMAP_KEY_OFF to drop
+    int32_t scaleX;                     // 16.16 fixed point; negative inverts
+    int32_t scaleY;
+    bool identityKeys;                  // Lets keyboard events skip the table
+};
+
+class RemapTable {
+public:
+    // Parses a remap file's text. On failure, error names the line.
+    static bool parse(const std::string& text, RemapTable& table, std::string& error) {
+        bool parsed = parseRuleLines(text, error, [&](const std::string& device, const std::string& directive,
+                                                      std::istringstream& fields) {
+            return table.parseRule(table.entry(device.c_str()), directive, fields);
+        });
+        if (!parsed) return false;
+        for (DeviceRemap& remap : table.devices_) {
+            remap.identityKeys = true;
+            for (size_t key = 0; key < REMAP_KEYS; ++key) {
+                remap.identityKeys = remap.identityKeys && remap.keys[key] == key;
+            }
+        }
+        return true;
+    }
+
+    // The device's rules, the default rules, or null
+    const DeviceRemap* find(const char* deviceId) const {
+        for (const DeviceRemap& remap : devices_) {
+            if (std::strncmp(remap.deviceId, deviceId, DEVICE_ID_MAX) == 0) return &remap;
+        }
+        return defaultIndex_ < devices_.size() ? &devices_[defaultIndex_] : nullptr;
+    }
+
+    size_t size() const { return devices_.size(); }
+
+private:
+    DeviceRemap& entry(const char* deviceId) {
+        for (DeviceRemap& remap : devices_) {
+            if (std::strncmp(remap.deviceId, deviceId, DEVICE_ID_MAX) == 0) return remap;
+        }
+        DeviceRemap remap = {};
+        std::strncpy(remap.deviceId, deviceId, DEVICE_ID_MAX - 1);
+        for (size_t key = 0; key < REMAP_KEYS; ++key) {
+            remap.keys[key] = (uint8_t)key;
+        }
+        remap.scaleX = remap.scaleY = REMAP_SCALE_ONE;
+        if (std::strcmp(deviceId, "*") == 0) {
+            defaultIndex_ = devices_.size();
+        }
+        devices_.push_back(remap);
+        return devices_.back();
+    }
+
+    static bool parseKey(const std::string& text, uint8_t& key) {
+        char* end = nullptr;
+        unsigned long value = std::strtoul(text.c_str(), &end, 0);
+        if (text.empty() || *end || value == REMAP_KEY_OFF || value >= REMAP_KEYS) return false;
+        key = (uint8_t)value;
+        return true;
+    }
+
+    static bool parseScale(const std::string& text, int32_t& scale) {
+        char* end = nullptr;
+        double value = std::strtod(text.c_str(), &end);
+        if (text.empty() || *end || !(std::fabs(value) <= REMAP_SCALE_MAX)) return false;
+        scale = (int32_t)std::lround(value * REMAP_SCALE_ONE);
+        return true;
+    }
+
+    bool parseRule(DeviceRemap& remap, const std::string& directive, std::istringstream& fields) {
+        std::string a, b, extra;
+        fields >> a >> b;
+        if (fields >> extra) return false;
+        if (directive == "key") {
+            uint8_t from, to = REMAP_KEY_OFF;
+            if (!parseKey(a, from) || (b != "off" && !parseKey(b, to))) return false;
+            remap.keys[from] = to;
+            return true;
+        }
+        if (directive == "scale") {
+            if (!parseScale(a, remap.scaleX)) return false;
+            return b.empty() ? (remap.scaleY = remap.scaleX, true) : parseScale(b, remap.scaleY);
+        }
+        return false;
+    }
+
+    std::vector<DeviceRemap> devices_;
+    size_t defaultIndex_ = SIZE_MAX;
+};
+
+// The current table of a remap file. load() and reloadIfChanged() may run
+// on any thread; the swap is atomic and stages keep an old table alive for
+// as long as they use it.
+class RemapSource {
+public:
+    std::shared_ptr<const RemapTable> current() const { return table_.load(std::memory_order_acquire); }
+
+    // Reads and compiles path; keeps the current table on failure
+    bool load(const std::string& path, std::string& error) {
+        std::error_code ec;
+        auto written = std::filesystem::last_write_time(path, ec);
+        std::string text;
+        if (ec) {
+            error = "cannot read " + path;
+            return false;
+        }
+        if (!readRuleFile(path, text, error)) return false;
+        auto table = std::make_shared<RemapTable>();
+        if (!RemapTable::parse(text, *table, error)) {
+            return false;
+        }
+        table_.store(std::move(table), std::memory_order_release);
+        std::lock_guard<std::mutex> lock(mutex_);
+        path_ = path;
+        written_ = written;
+        return true;
+    }
+
+    // Loads the file again if it changed since the last load. Returns
+    // false only for a change that failed to load.
+    bool reloadIfChanged(bool& reloaded, std::string& error) {
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            path = path_;
+            std::error_code ec;
+            reloaded = false;
+            if (path.empty() || std::filesystem::last_write_time(path, ec) == written_ || ec) {
+                return true;
+            }
+        }
+        reloaded = load(path, error);
+        if (!reloaded) {
+            // Report a bad edit once, not on every check
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::error_code ec;
+            written_ = std::filesystem::last_write_time(path, ec);
+        }
+        return reloaded;
+    }
+
+private:
+    std::atomic<std::shared_ptr<const RemapTable>> table_;
+    std::mutex mutex_;
+    std::string path_;                  // Guarded by mutex_
+    std::filesystem::file_time_type written_;   // Guarded by mutex_
+};
+
+// Applies a RemapSource's current table: remaps or drops keys and scales
+// mouse motion. Without a source, or while the table is empty, it passes
+// batches through untouched. Keeps per-device remainders, so every worker
+// shard needs its own instance.
+//
+// Motion is scaled in three passes: gather each device's deltas into
+// arrays, scale every array with motion_kernel.h, scatter them back.
+// Devices interleave at high report rates, and the gather lets the kernel
+// see all of a device's motion in the batch at once.
+class RemapStage {
+public:
+    explicit RemapStage(const RemapSource* source = nullptr) : source_(source) {}
+
+    size_t process(InputEvent* events, size_t count) {
+        if (!source_) return count;
+        std::shared_ptr<const RemapTable> table = source_->current();
+        if (!table || table->size() == 0) return count;
+        if (table != table_) {
+            // Reloaded: look every known device up in the new table
+            table_ = std::move(table);
+            for (size_t device = 0; device < devices_.size(); ++device) {
+                devices_[device].remap = table_->find(devices_.id(device));
+            }
+        }
+
+        keep_.assign(count, 1);
+        for (size_t i = 0; i < count; ++i) {
+            InputEvent& event = events[i];
+            size_t device = devices_.find(event.device_id, [this](const char* id) {
+                DeviceState fresh = {};
+                fresh.remap = table_->find(id);
+                fresh.carryX = fresh.carryY = REMAP_SCALE_ONE / 2;
+                return fresh;
+            });
+            gather(device, event, i);
+        }
+        for (size_t index : active_) {
+            scatter(devices_[index], events);
+        }
+        active_.clear();
+
+        size_t kept = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (!keep_[i]) continue;
+            if (kept != i) events[kept] = events[i];
+            ++kept;
+        }
+        return kept;
+    }
+
+private:
+    // A device's rules, its remainders, and the motion gathered from this
+    // batch
+    struct DeviceState {
+        const DeviceRemap* remap;       // In table_; null without rules
+        int32_t carryX;                 // Sub-pixel motion carried over, in 1/65536 px;
+        int32_t carryY;                 // starts at half a pixel to round to nearest
+        std::vector<int32_t> dx;
+        std::vector<int32_t> dy;
+        std::vector<uint32_t> events;   // Batch index of each delta
+    };
+
+    // Remaps a key now, or queues a mouse event's motion for scaling
+    void gather(size_t index, InputEvent& event, size_t i) {
+        DeviceState& device = devices_[index];
+        if (!device.remap) return;
+        const DeviceRemap& remap = *device.remap;
+        if (event.type == DeviceType::Keyboard) {
+            int vkey = event.data.keyboard.vkey;
+            if (remap.identityKeys || vkey < 0 || vkey >= (int)REMAP_KEYS) return;
+            event.data.keyboard.vkey = remap.keys[vkey];
+            keep_[i] = event.data.keyboard.vkey != REMAP_KEY_OFF;
+            // The physical key's scan code no longer fits; KeymapStage fills in the new one
+            if (remap.keys[vkey] != vkey) event.data.keyboard.scan = 0;
+            return;
+        }
+        if (event.type != DeviceType::Mouse ||
+            (remap.scaleX == REMAP_SCALE_ONE && remap.scaleY == REMAP_SCALE_ONE)) {
+            return;
+        }
+        if (device.events.empty()) active_.push_back(index);
+        device.dx.push_back(event.data.mouse.dx);
+        device.dy.push_back(event.data.mouse.dy);
+        device.events.push_back((uint32_t)i);
+    }
+
+    void scatter(DeviceState& device, InputEvent* events) {
+        size_t count = device.events.size();
+        scaleMotion(device.dx.data(), count, device.remap->scaleX, device.carryX);
+        scaleMotion(device.dy.data(), count, device.remap->scaleY, device.carryY);
+        for (size_t j = 0; j < count; ++j) {
+            size_t i = device.events[j];
+            InputEvent& event = events[i];
+            event.data.mouse.dx = device.dx[j];
+            event.data.mouse.dy = device.dy[j];
+            // Motion that rounds to nothing stays in the remainder
+            keep_[i] = device.dx[j] != 0 || device.dy[j] != 0 || event.data.mouse.buttons != 0;
+        }
+        device.dx.clear();
+        device.dy.clear();
+        device.events.clear();
+    }
+
+    const RemapSource* source_;
+    std::shared_ptr<const RemapTable> table_;   // The table devices_ point into
+    DeviceTable<DeviceState> devices_;
+    std::vector<size_t> active_;        // devices_ with motion gathered this batch
+    std::vector<uint8_t> keep_;         // Per batch event; cleared for dropped events
+};
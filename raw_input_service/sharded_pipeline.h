@@ -0,0 +1,155 @@
+// sharded_pipeline.h - Runs a stage pipeline on N worker threads, sharded by device
+//
+// The capture thread splits each batch by a hash of the device ID into one
+// queue per worker. Every worker owns its own pipeline instance (stages may
+// keep per-device state) and runs it on whatever its queue holds. All
+// events of a device go through the same worker in capture order, so
+// per-device ordering is preserved. Events from different devices may
+// interleave differently than they were captured.
+//
+// Each worker's output goes to the merge sink one batch at a time, under
+// a lock, so the sink (the publisher) never sees concurrent calls.
+#pragma once
+#include "pipeline.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+template <typename WorkerPipeline>
+class ShardedPipeline {
+public:
+    using Factory = std::function<void(WorkerPipeline&)>;   // Sets up one worker's stages
+    using Sink = std::function<void(EventSpan)>;
+
+    ShardedPipeline(size_t workerCount, const Factory& setup, Sink merge)
+        : merge_(std::move(merge)), workers_(workerCount ? workerCount : 1) {
+        for (Worker& worker : workers_) {
+            setup(worker.pipeline);
+            worker.thread = std::thread(&ShardedPipeline::workerLoop, this, std::ref(worker));
+        }
+    }
+
+    ~ShardedPipeline() { stop(); }
+
+    ShardedPipeline(const ShardedPipeline&) = delete;
+    ShardedPipeline& operator=(const ShardedPipeline&) = delete;
+
+    size_t workerCount() const { return workers_.size(); }
+
+    // Capture thread: split the batch onto the worker queues. Events are
+    // copied once into each queue; nothing is processed here.
+    void submit(const InputEvent* events, size_t count) {
+        if (count == 0) return;
+
+        for (auto& shard : staging_) shard.clear();
+        staging_.resize(workers_.size());
+
+        // Runs of one device are common, so remember the last hash
+        const char* lastId = nullptr;
+        size_t lastShard = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const InputEvent& event = events[i];
+            if (!lastId || std::strncmp(lastId, event.device_id, DEVICE_ID_MAX) != 0) {
+                lastId = event.device_id;
+                lastShard = (size_t)(hashDeviceId(event.device_id) % workers_.size());
+            }
+            staging_[lastShard].push_back(event);
+        }
+
+        for (size_t w = 0; w < workers_.size(); ++w) {
+            if (staging_[w].empty()) continue;
+            Worker& worker = workers_[w];
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                if (worker.queue.empty()) {
+                    worker.queue.swap(staging_[w]);
+                } else {
+                    worker.queue.insert(worker.queue.end(), staging_[w].begin(), staging_[w].end());
+                }
+            }
+            worker.ready.notify_one();
+        }
+    }
+
+    // Stage interface, so a sharded pipeline can end a RuntimePipeline
+    size_t process(InputEvent* events, size_t count) {
+        submit(events, count);
+        return 0;
+    }
+
+    // Returns once every event submitted so far went through its worker
+    // and out to the merge sink. Workers keep running.
+    void drain() {
+        for (Worker& worker : workers_) {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.idle.wait(lock, [&worker] { return worker.queue.empty() && !worker.busy; });
+        }
+    }
+
+    // Processes everything already queued, then joins the workers
+    void stop() {
+        for (Worker& worker : workers_) {
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                worker.stopping = true;
+            }
+            worker.ready.notify_one();
+        }
+        for (Worker& worker : workers_) {
+            if (worker.thread.joinable()) {
+                worker.thread.join();
+            }
+        }
+    }
+
+private:
+    struct Worker {
+        WorkerPipeline pipeline;
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::condition_variable idle;   // The worker finished a batch and found its queue empty
+        std::vector<InputEvent> queue;  // Guarded by mutex
+        bool busy = false;              // Guarded by mutex; a batch is out of the queue, not yet merged
+        bool stopping = false;          // Guarded by mutex
+        std::thread thread;
+    };
+
+    void workerLoop(Worker& worker) {
+        std::vector<InputEvent> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(worker.mutex);
+                worker.busy = false;
+                if (worker.queue.empty()) {
+                    worker.idle.notify_all();
+                }
+                worker.ready.wait(lock, [&worker] { return !worker.queue.empty() || worker.stopping; });
+                if (worker.queue.empty()) {
+                    break; // Stopping and drained
+                }
+                batch.swap(worker.queue);
+                worker.busy = true;
+            }
+
+            size_t kept = worker.pipeline.process(batch.data(), batch.size());
+            if (kept > 0) {
+                std::lock_guard<std::mutex> lock(mergeMutex_);
+                merge_(EventSpan{ batch.data(), kept });
+            }
+            batch.clear();
+        }
+    }
+
+    Sink merge_;
+    std::mutex mergeMutex_;
+    std::vector<Worker> workers_;
+    std::vector<std::vector<InputEvent>> staging_;   // Capture thread only
+};
+
+// Adapts a ShardedPipeline owned elsewhere into a (movable) stage
+template <typename Sharded>
+struct ShardStage {
+    Sharded* shards;
+    size_t process(InputEvent* events, size_t count) { return shards->process(events, count); }
+};
@@ -0,0 +1,563 @@
+// simulation.cpp - Deterministic simulation implementation
+#include "simulation.h"
+#include <algorithm>
+
+// ---------------------------------------------------------------- SimClock
+
+size_t SimClock::runUntil(uint64_t timeMs) {
+    size_t ran = 0;
+    while (true) {
+        int64_t wait = wheel_.timeUntilNext();
+        if (wait < 0 || wheel_.now() + (uint64_t)wait > timeMs) {
+            break;
+        }
+        std::vector<Callback> due;
+        due.swap(due_);
+        wheel_.advance(wheel_.now() + (uint64_t)wait, due);
+        now_ = wheel_.now();
+        for (Callback& callback : due) {
+            callback();
+        }
+        ran += due.size();
+        due.clear();
+        due_.swap(due);
+    }
+    if (timeMs > now_) {
+        wheel_.advance(timeMs, due_);   // Nothing is due before timeMs
+        now_ = timeMs;
+    }
+    return ran;
+}
+
+// ---------------------------------------------------------------- SimLink
+
+SimLink::SimLink(SimClock& clock, const SimLinkSpec& spec, Receiver receiver)
+    : clock_(clock), spec_(spec), receiver_(std::move(receiver)), written_(0), busyUntilUs_(0), inFlightHead_(0),
+      delivered_(0), deliveryScheduled_(false), open_(true) {}
+
+void SimLink::stall(uint64_t fromMs, uint64_t durationMs) {
+    // Ends far enough out to never come, yet leave room for arithmetic on it
+    constexpr uint64_t FOREVER_MS = UINT64_MAX / 4000;
+    uint64_t endMs = durationMs >= FOREVER_MS - std::min(fromMs, FOREVER_MS) ? FOREVER_MS : fromMs + durationMs;
+    Stall stall = { fromMs * 1000, endMs * 1000 };
+    auto it = std::upper_bound(stalls_.begin(), stalls_.end(), stall,
+                               [](const Stall& a, const Stall& b) { return a.startUs < b.startUs; });
+    it = stalls_.insert(it, stall);
+
+    // Merge with overlapping neighbours
+    if (it != stalls_.begin() && std::prev(it)->endUs >= it->startUs) {
+        --it;
+        it->endUs = std::max(it->endUs, std::next(it)->endUs);
+        stalls_.erase(std::next(it));
+    }
+    while (std::next(it) != stalls_.end() && std::next(it)->startUs <= it->endUs) {
+        it->endUs = std::max(it->endUs, std::next(it)->endUs);
+        stalls_.erase(std::next(it));
+    }
+}
+
+// When bytes starting to go out at startUs are all transmitted. Time is
+// kept in microseconds so small writes on fast links do not round up.
+uint64_t SimLink::transmitEnd(uint64_t startUs, uint64_t bytes) const {
+    uint64_t t = startUs;
+    uint64_t remaining = bytes;
+    for (const Stall& stall : stalls_) {
+        if (stall.endUs <= t) continue;
+        if (stall.startUs <= t) {
+            t = stall.endUs;
+            continue;
+        }
+        if (spec_.bandwidth == 0 || remaining == 0) break;
+        uint64_t capacity = (stall.startUs - t) * spec_.bandwidth / 1000000;
+        if (remaining <= capacity) break;
+        remaining -= capacity;
+        t = stall.endUs;
+    }
+    if (spec_.bandwidth == 0) return t;
+    return t + (remaining * 1000000 + spec_.bandwidth - 1) / spec_.bandwidth;
+}
+
+// Bytes of a segment starting at startUs that are out by timeUs
+uint64_t SimLink::transmittedSince(uint64_t startUs, uint64_t timeUs) const {
+    if (spec_.bandwidth == 0) return 0;     // Unlimited links only hold bytes during stalls
+    uint64_t active = timeUs - startUs;
+    for (const Stall& stall : stalls_) {
+        uint64_t from = std::max(stall.startUs, startUs);
+        uint64_t to = std::min(stall.endUs, timeUs);
+        if (to > from) active -= to - from;
+    }
+    return active * spec_.bandwidth / 1000000;
+}
+
+// Byte offset transmitted by timeUs
+uint64_t SimLink::transmittedBy(uint64_t timeUs) {
+    // Segments done by now are no longer needed
+    while (!segments_.empty() && segments_.front().endUs <= timeUs) {
+        segments_.pop_front();
+    }
+    if (segments_.empty()) return written_;
+    const Segment& segment = segments_.front();
+    if (segment.startUs >= timeUs) return segment.offset;
+    return segment.offset + std::min(segment.bytes, transmittedSince(segment.startUs, timeUs));
+}
+
+size_t SimLink::send(const char* data, size_t size, uint64_t atMs) {
+    if (!open_ || size == 0) return 0;
+    uint64_t unsent = written_ - transmittedBy(atMs * 1000);
+    if (unsent >= spec_.sendBuffer) return 0;
+    size = (size_t)std::min<uint64_t>(size, spec_.sendBuffer - unsent);
+
+    uint64_t startUs = std::max(atMs * 1000, busyUntilUs_);
+    uint64_t endUs = transmitEnd(startUs, size);
+    segments_.push_back({ startUs, endUs, written_, size });
+    written_ += size;
+    busyUntilUs_ = endUs;
+
+    // Arrives in one piece once its last byte is through
+    uint64_t arrival = (endUs + 999) / 1000 + spec_.latencyMs;
+    inFlight_.append(data, size);
+    if (!arrivals_.empty() && arrivals_.back().timeMs == arrival) {
+        arrivals_.back().end = written_;
+    } else {
+        arrivals_.push_back({ arrival, written_ });
+    }
+    if (!deliveryScheduled_) {
+        deliveryScheduled_ = true;
+        clock_.at(arrivals_.front().timeMs, [this] { deliver(); });
+    }
+    return size;
+}
+
+void SimLink::deliver() {
+    deliveryScheduled_ = false;
+    if (!open_) return;
+
+    uint64_t end = delivered_;
+    while (!arrivals_.empty() && arrivals_.front().timeMs <= clock_.now()) {
+        end = arrivals_.front().end;
+        arrivals_.pop_front();
+    }
+    size_t size = (size_t)(end - delivered_);
+    const char* data = inFlight_.data() + inFlightHead_;
+    inFlightHead_ += size;
+    delivered_ = end;
+    receiver_(data, size);
+
+    if (inFlightHead_ == inFlight_.size()) {
+        inFlight_.clear();
+        inFlightHead_ = 0;
+    } else if (inFlightHead_ > inFlight_.size() / 2) {
+        inFlight_.erase(0, inFlightHead_);
+        inFlightHead_ = 0;
+    }
+    if (!arrivals_.empty() && !deliveryScheduled_) {
+        deliveryScheduled_ = true;
+        clock_.at(arrivals_.front().timeMs, [this] { deliver(); });
+    }
+}
+
+// ---------------------------------------------------------------- SyntheticDevice
+
+SyntheticDevice::SyntheticDevice(SimClock& clock, const SyntheticDeviceSpec& spec, Sink sink)
+    : clock_(clock), spec_(spec), sink_(std::move(sink)), random_(spec.seed), emitted_(0) {}
+
+void SyntheticDevice::start() {
+    if (spec_.rateHz == 0) return;
+    clock_.at(spec_.startMs, [this] { emitNext(); });
+}
+
+void SyntheticDevice::emitNext() {
+    uint64_t now = clock_.now();
+    if (spec_.durationMs != UINT64_MAX && now >= spec_.startMs + spec_.durationMs) {
+        return;
+    }
+
+    InputEvent event = {};
+    std::strncpy(event.device_id, spec_.id.c_str(), DEVICE_ID_MAX - 1);
+    event.type = spec_.type;
+    event.timestamp = now;
+    // Raw engine output only; distributions differ between standard libraries
+    if (spec_.type == DeviceType::Keyboard) {
+        event.data.keyboard.vkey = 'A' + (int)(random_() % 26);
+    } else {
+        event.data.mouse.dx = (int)(random_() % 17) - 8;
+        event.data.mouse.dy = (int)(random_() % 17) - 8;
+        event.data.mouse.buttons = random_() % 64 == 0 ? 0x0001 : 0;
+    }
+    emitted_++;
+    sink_(event);
+
+    // Exact long-run rate whatever the rounding of single intervals
+    uint64_t next = spec_.startMs + (emitted_ * 1000 + spec_.rateHz - 1) / spec_.rateHz;
+    clock_.at(std::max(next, now + 1), [this] { emitNext(); });
+}
+
+// ---------------------------------------------------------------- SimClient
+
+SimClient::SimClient(Simulation& sim, const SimLinkSpec& spec)
+    : sim_(sim), spec_(spec), connected_(false), answersHeartbeats_(true), received_(0), lastSeq_(0), missing_(0),
+      gapRecords_(0), controlRecords_(0), heartbeats_(0), sawEnd_(false), totalDx_(0), totalDy_(0), creditWindow_(0),
+      handleRate_(0), unhandled_(0), unhandledMax_(0), ungranted_(0), handleCarry_(0), handleScheduled_(false),
+      creditMerged_(0), creditDropped_(0) {}
+
+void SimClient::connect() {
+    if (down_) {
+        closedLinks_.push_back(std::move(down_));
+    }
+    down_ = std::make_unique<SimLink>(sim_.clock_, spec_,
+                                      [this](const char* data, size_t size) { onData(data, size); });
+    decoder_.reset();
+    buffer_.clear();
+    connected_ = true;
+}
+
+void SimClient::send(const std::string& line) {
+    if (!connected_) return;
+    SimLink* link = down_.get();
+    sim_.clock_.after(spec_.latencyMs, [this, link, line] {
+        if (link == down_.get() && link->isOpen()) {
+            sim_.command(*this, line);
+        }
+    });
+}
+
+void SimClient::useCredit(uint32_t window, uint32_t eventsPerSecond) {
+    creditWindow_ = std::max<uint32_t>(window, 1);
+    handleRate_ = eventsPerSecond;
+    unhandled_ = 0;
+    ungranted_ = 0;
+    send("credit " + std::to_string(creditWindow_));
+}
+
+// Every 10 ms, handles as many waiting events as the rate allows
+void SimClient::handleEvents() {
+    constexpr uint64_t TICK_MS = 10;
+    handleCarry_ += (uint64_t)handleRate_ * TICK_MS;
+    uint64_t handled = std::min<uint64_t>(handleCarry_ / 1000, unhandled_);
+    handleCarry_ = std::min<uint64_t>(handleCarry_ - handled * 1000, 1000);
+    unhandled_ -= handled;
+    grantHandled(handled);
+    if (unhandled_ > 0) {
+        sim_.clock_.after(TICK_MS, [this] { handleEvents(); });
+    } else {
+        handleScheduled_ = false;
+        handleCarry_ = 0;
+    }
+}
+
+void SimClient::grantHandled(uint64_t handled) {
+    ungranted_ += handled;
+    if (ungranted_ >= std::max<uint64_t>(creditWindow_ / 2, 1)) {
+        send("credit " + std::to_string(ungranted_));
+        ungranted_ = 0;
+    }
+}
+
+void SimClient::disconnect() {
+    if (!connected_) return;
+    down_->close();
+    connected_ = false;
+    sim_.detach(*this);
+}
+
+void SimClient::reconnect() {
+    disconnect();
+    connect();
+    if (sim_.attach(*this) && creditWindow_) {
+        useCredit(creditWindow_, handleRate_);
+    }
+}
+
+void SimClient::onData(const char* data, size_t size) {
+    // Decode straight from the link unless a partial record is waiting
+    if (!buffer_.empty()) {
+        buffer_.append(data, size);
+        data = buffer_.data();
+        size = buffer_.size();
+    }
+    uint64_t now = sim_.clock_.now();
+    size_t used = decoder_.decode(data, size, [this, now](const EventView& view) {
+        switch (view.kind) {
+            case EventKind::Keyboard:
+            case EventKind::Mouse:
+            case EventKind::Cursor:
+            case EventKind::Hotkey:
+                if (lastSeq_ != 0 && view.seq > lastSeq_ + 1) {
+                    missing_ += view.seq - lastSeq_ - 1;
+                }
+                if (view.seq > lastSeq_) {
+                    lastSeq_ = view.seq;
+                }
+                received_++;
+                latencies_.push_back((uint32_t)(now - std::min(now, view.timestamp)));
+                if (view.kind == EventKind::Mouse) {
+                    totalDx_ += view.dx;
+                    totalDy_ += view.dy;
+                }
+                if (creditWindow_) {
+                    if (handleRate_ == 0) {
+                        grantHandled(1);
+                    } else {
+                        unhandledMax_ = std::max(unhandledMax_, ++unhandled_);
+                        if (!handleScheduled_) {
+                            handleScheduled_ = true;
+                            sim_.clock_.after(10, [this] { handleEvents(); });
+                        }
+                    }
+                }
+                break;
+            case EventKind::Gap:
+                gapRecords_++;
+                controlRecords_++;
+                break;
+            case EventKind::End:
+                sawEnd_ = true;
+                controlRecords_++;
+                break;
+            case EventKind::Credit:
+                creditMerged_ = view.merged;
+                creditDropped_ = view.dropped;
+                controlRecords_++;
+                break;
+            case EventKind::Heartbeat:
+                heartbeats_++;
+                controlRecords_++;
+                if (answersHeartbeats_) {
+                    send("pong");
+                }
+                break;
+            default:
+                controlRecords_++;
+                break;
+        }
+    });
+    if (data == buffer_.data()) {
+        buffer_.erase(0, used);
+    } else {
+        buffer_.assign(data + used, size - used);
+    }
+}
+
+uint64_t SimClient::latencyPercentile(double fraction) const {
+    if (latencies_.empty()) return 0;
+    std::vector<uint32_t> sorted(latencies_);
+    size_t rank = std::min(sorted.size() - 1, (size_t)(fraction * (double)(sorted.size() - 1) + 0.5));
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+}
+
+// ---------------------------------------------------------------- Simulation
+
+Simulation::Simulation(size_t historySize, uint64_t startMs)
+    : clock_(startMs), fanout_(historySize), sender_(fanout_), flushScheduled_(false), nextSeq_(1), senderWakeAt_(UINT64_MAX) {}
+
+SyntheticDevice& Simulation::addDevice(const SyntheticDeviceSpec& spec) {
+    devices_.push_back(std::make_unique<SyntheticDevice>(clock_, spec, [this](const InputEvent& event) {
+        capture(event);
+    }));
+    devices_.back()->start();
+    return *devices_.back();
+}
+
+SimClient& Simulation::addClient(const SimLinkSpec& spec, StreamFormat format) {
+    clients_.push_back(std::make_unique<SimClient>(*this, spec));
+    SimClient& client = *clients_.back();
+    client.connect();
+    if (attach(client) && format != StreamFormat::Json) {
+        // Negotiated as part of connecting: the reply goes out before any events
+        command(client, std::string("format ") + STREAM_FORMAT_NAMES[(int)format]);
+    }
+    return client;
+}
+
+void Simulation::inject(InputEvent event) {
+    event.timestamp = clock_.now();
+    capture(event);
+}
+
+// Like the capture thread: everything captured in one tick is one batch
+void Simulation::capture(const InputEvent& event) {
+    stats_.captured++;
+    captureBatch_.push_back(event);
+    if (!flushScheduled_) {
+        flushScheduled_ = true;
+        clock_.at(clock_.now(), [this] { flushCapture(); });
+    }
+}
+
+void Simulation::flushCapture() {
+    flushScheduled_ = false;
+    size_t kept = pipeline_.process(captureBatch_.data(), captureBatch_.size());
+    publish(captureBatch_.data(), kept);
+    captureBatch_.clear();
+}
+
+void Simulation::publish(const InputEvent* events, size_t count) {
+    count = fanout_.budget().admitPending(pending_.size(), count);
+    if (count == 0) return;
+    for (size_t i = 0; i < count; ++i) {
+        pending_.push_back(events[i]);
+        pending_.back().seq = nextSeq_++;
+    }
+    fanout_.budget().report(MemoryUse::Pending, pending_.size() * sizeof(InputEvent));
+    stats_.published += count;
+    scheduleSender(clock_.now());
+}
+
+// The sender sleeps until the next batch, or its next retry while clients
+// have unsent bytes
+void Simulation::scheduleSender(uint64_t timeMs) {
+    if (senderWake_.valid() && senderWakeAt_ <= timeMs) return;
+    clock_.cancel(senderWake_);
+    senderWakeAt_ = timeMs;
+    senderWake_ = clock_.at(timeMs, [this] {
+        senderWake_ = TimerHandle();
+        senderRun();
+    });
+}
+
+// SimLink::send at now, as StreamSender calls it
+static auto linkSend(SimClient& client, uint64_t now) {
+    return [&link = client.link(), now](const char* data, size_t size) { return (long)link.send(data, size, now); };
+}
+
+// One pass of SocketServer::senderLoop: the whole queue as one batch, then
+// retries, heartbeats and timeouts for every client
+void Simulation::senderRun() {
+    uint64_t now = clock_.now();
+    if (!pending_.empty()) {
+        sending_.swap(pending_);
+        fanout_.budget().report(MemoryUse::Pending, 0);
+        stats_.batches++;
+
+        sender_.encodeBatch(sending_, [this](auto&& visit) {
+            for (ServerClient& client : connected_) visit(client);
+        });
+        std::vector<SimClient*> dropped;
+        for (ServerClient& client : connected_) {
+            ClientDrop drop = sender_.sendBatch(client, sending_, connected_.size(), now, linkSend(*client.client, now));
+            if (drop != ClientDrop::None) {
+                countDrop(drop);
+                dropped.push_back(client.client);
+            }
+        }
+        for (SimClient* client : dropped) evict(*client);
+        sending_.clear();
+    }
+
+    if (serviceClients(now)) {
+        scheduleSender(now + SEND_RETRY_MS);
+    }
+}
+
+// SocketServer::serviceClients; returns whether any backlog is left
+bool Simulation::serviceClients(uint64_t now) {
+    SenderPass pass;
+    std::vector<SimClient*> dropped;
+    for (ServerClient& client : connected_) {
+        ClientDrop drop = sender_.service(client, connected_.size(), now, pass, linkSend(*client.client, now));
+        if (drop != ClientDrop::None) {
+            countDrop(drop);
+            dropped.push_back(client.client);
+        } else {
+            watch(client);
+        }
+    }
+    for (SimClient* client : dropped) evict(*client);
+    stats_.heartbeats += pass.heartbeats;
+    sender_.report(pass, connected_.size());
+    return pass.backlogged;
+}
+
+// SocketServer::watchClient: one clock timer per client for its next
+// heartbeat or timeout
+void Simulation::watch(ServerClient& client) {
+    if (!sender_.rewatch(client)) return;
+    clock_.cancel(client.watchTimer);
+    client.watchTimer = clock_.at(client.watchAt, [this, simClient = client.client] { checkClient(*simClient); });
+}
+
+// SocketServer::checkClient
+void Simulation::checkClient(SimClient& client) {
+    ServerClient* entry = find(client);
+    if (!entry) return;
+    entry->watchTimer = TimerHandle();
+    entry->watchAt = UINT64_MAX;
+    uint64_t now = clock_.now();
+    SenderPass pass;
+    ClientDrop drop = sender_.service(*entry, connected_.size(), now, pass, linkSend(client, now));
+    stats_.heartbeats += pass.heartbeats;
+    if (drop != ClientDrop::None) {
+        countDrop(drop);
+        evict(client);
+        return;
+    }
+    watch(*entry);
+    if (pass.backlogged) {
+        scheduleSender(now + SEND_RETRY_MS);
+    }
+}
+
+void Simulation::countDrop(ClientDrop drop) {
+    if (drop == ClientDrop::WriteStalled) stats_.writeStalls++;
+    if (drop == ClientDrop::Silent) stats_.silentClients++;
+    if (drop == ClientDrop::OverBudget) stats_.backlogOverflows++;
+}
+
+// The server shuts the connection down; whatever is still in flight is lost
+void Simulation::evict(SimClient& client) {
+    client.down_->close();
+    client.connected_ = false;
+    detach(client);
+}
+
+// Like SocketServer's accept: refused when the budget cannot take one more client
+bool Simulation::attach(SimClient& client) {
+    if (!fanout_.budget().admits(connected_.size() + 1)) {
+        stats_.rejectedClients++;
+        client.down_->close();
+        client.connected_ = false;
+        return false;
+    }
+    connected_.emplace_back();
+    connected_.back().client = &client;
+    connected_.back().watch.reset(clock_.now());
+    watch(connected_.back());
+    return true;
+}
+
+void Simulation::detach(SimClient& client) {
+    if (ServerClient* entry = find(client)) {
+        clock_.cancel(entry->watchTimer);
+    }
+    connected_.erase(std::remove_if(connected_.begin(), connected_.end(),
+                                    [&client](const ServerClient& entry) { return entry.client == &client; }),
+                     connected_.end());
+}
+
+Simulation::ServerClient* Simulation::find(SimClient& client) {
+    for (ServerClient& entry : connected_) {
+        if (entry.client == &client) return &entry;
+    }
+    return nullptr;
+}
+
+// Replies queue behind the client's backlog, like SocketServer's
+void Simulation::command(SimClient& client, const std::string& line) {
+    ServerClient* entry = find(client);
+    if (!entry) return;
+    uint64_t now = clock_.now();
+    entry->watch.heard(now);
+    std::string reply;
+    fanout_.handleCommand(line, entry->stream, reply);
+    ClientDrop drop = sender_.queue(*entry, reply, connected_.size(), now, linkSend(client, now));
+    if (drop != ClientDrop::None) {
+        countDrop(drop);
+        evict(client);
+        return;
+    }
+    watch(*entry);
+    if (!entry->backlog.empty()) {
+        scheduleSender(now + SEND_RETRY_MS);
+    }
+}
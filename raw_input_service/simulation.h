@@ -0,0 +1,319 @@
+// simulation.h - Deterministic simulation of the capture-to-client path
+//
+// Synthetic devices feed a capture batch, a stage pipeline (pipeline.h)
+// and StreamFanout, whose output goes to clients over in-memory links.
+// Everything runs on a virtual millisecond clock, so latency and drop
+// outcomes are exactly the same on every run, and the clock jumps from one
+// event to the next, so idle time costs nothing.
+//
+// The sender is SocketServer's: the same StreamSender (stream_fanout.h)
+// never waits for a client, keeps what a link's send buffer cannot take in
+// that client's backlog, and sends heartbeats and evicts clients by the same
+// ClientTimeouts. Clients may use credit flow control (credit_queue.h).
+//
+//     Simulation sim;
+//     sim.pipeline().add(makePipeline(CoalesceStage()));
+//     sim.addDevice({ "mouse0", DeviceType::Mouse, 1000 });
+//     SimClient& slow = sim.addClient({ 20000, 5, 16 * 1024 });
+//     slow.link().stall(10000, 3000);
+//     sim.runFor(60000);
+//     uint64_t p99 = slow.latencyPercentile(0.99);
+//
+// Portable; builds and runs without Windows.
+#pragma once
+#include "input_client.h"
+#include "pipeline.h"
+#include "stream_fanout.h"
+#include "timer_wheel.h"
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// ---------------------------------------------------------------- Clock
+
+class SimClock {
+public:
+    using Callback = TimerWheel::Callback;
+
+    explicit SimClock(uint64_t startMs = 0) : wheel_(startMs), now_(startMs) {}
+
+    uint64_t now() const { return now_; }
+
+    // Times in the past run at the current time; ties run in call order
+    TimerHandle at(uint64_t timeMs, Callback callback) { return wheel_.scheduleAt(timeMs, std::move(callback)); }
+    TimerHandle after(uint64_t delayMs, Callback callback) { return at(now_ + delayMs, std::move(callback)); }
+    bool cancel(TimerHandle& handle) { return wheel_.cancel(handle); }
+
+    // Runs every event up to and including timeMs; returns how many ran
+    size_t runUntil(uint64_t timeMs);
+    size_t runFor(uint64_t ms) { return runUntil(now_ + ms); }
+
+private:
+    TimerWheel wheel_;
+    uint64_t now_;
+    std::vector<Callback> due_;
+};
+
+// ---------------------------------------------------------------- Links
+
+struct SimLinkSpec {
+    uint64_t bandwidth = 1000000;       // Bytes per second; 0 for unlimited
+    uint64_t latencyMs = 1;             // One way
+    size_t sendBuffer = 64 * 1024;      // Bytes a writer can queue before it blocks
+};
+
+// One direction of a connection. Bytes go out in order at the link's
+// bandwidth, except during stalls, and arrive latencyMs later.
+class SimLink {
+public:
+    using Receiver = std::function<void(const char* data, size_t size)>;
+
+    SimLink(SimClock& clock, const SimLinkSpec& spec, Receiver receiver);
+
+    // Nothing is transmitted from fromMs for durationMs (a peer that stops
+    // reading, a congested network, a peer that vanished with UINT64_MAX)
+    void stall(uint64_t fromMs, uint64_t durationMs);
+
+    // Non-blocking send at atMs: takes as much of data as fits in the send
+    // buffer next to the bytes not transmitted yet, and returns how much
+    size_t send(const char* data, size_t size, uint64_t atMs);
+
+    // Bytes still in flight are lost
+    void close() { open_ = false; }
+    bool isOpen() const { return open_; }
+
+    const SimLinkSpec& spec() const { return spec_; }
+    uint64_t bytesWritten() const { return written_; }
+
+private:
+    struct Stall {
+        uint64_t startUs;
+        uint64_t endUs;
+    };
+    struct Segment {
+        uint64_t startUs;               // Transmission start and end
+        uint64_t endUs;
+        uint64_t offset;                // Byte offset in the connection
+        uint64_t bytes;
+    };
+
+    struct Arrival {
+        uint64_t timeMs;
+        uint64_t end;                   // Byte offset that has arrived by then
+    };
+
+    uint64_t transmitEnd(uint64_t startUs, uint64_t bytes) const;
+    uint64_t transmittedSince(uint64_t startUs, uint64_t timeUs) const;
+    uint64_t transmittedBy(uint64_t timeUs);
+    void deliver();
+
+    SimClock& clock_;
+    SimLinkSpec spec_;
+    Receiver receiver_;
+    std::vector<Stall> stalls_;         // Sorted by start, not overlapping
+    std::deque<Segment> segments_;      // Oldest first, pruned as they are no longer needed
+    uint64_t written_;
+    uint64_t busyUntilUs_;
+    // Bytes written but not yet delivered, and when they arrive. Arrival
+    // times only grow, so one timer at a time serves the whole queue.
+    std::string inFlight_;
+    size_t inFlightHead_;
+    std::deque<Arrival> arrivals_;
+    uint64_t delivered_;
+    bool deliveryScheduled_;
+    bool open_;
+};
+
+// ---------------------------------------------------------------- Devices
+
+struct SyntheticDeviceSpec {
+    std::string id;
+    DeviceType type = DeviceType::Mouse;
+    uint32_t rateHz = 125;
+    uint64_t startMs = 0;
+    uint64_t durationMs = UINT64_MAX;
+    uint32_t seed = 1;
+};
+
+// Emits events at a fixed rate: mouse motion with an occasional click, or
+// key presses. The same seed gives the same events.
+class SyntheticDevice {
+public:
+    using Sink = std::function<void(const InputEvent&)>;
+
+    SyntheticDevice(SimClock& clock, const SyntheticDeviceSpec& spec, Sink sink);
+
+    void start();
+    uint64_t emitted() const { return emitted_; }
+
+private:
+    void emitNext();
+
+    SimClock& clock_;
+    SyntheticDeviceSpec spec_;
+    Sink sink_;
+    std::mt19937 random_;
+    uint64_t emitted_;
+};
+
+// ---------------------------------------------------------------- Clients
+
+class Simulation;
+
+class SimClient {
+public:
+    SimClient(Simulation& sim, const SimLinkSpec& spec);
+
+    // Sends a command line to the server ("resume 42"); it arrives after
+    // the link latency
+    void send(const std::string& line);
+    // Clients answer heartbeats with "pong" like the SDK does, unless told not to
+    void setAnswersHeartbeats(bool answers) { answersHeartbeats_ = answers; }
+    // Puts the client under credit flow control: it grants window credits,
+    // handles eventsPerSecond of what arrives (0 for as fast as it arrives)
+    // and grants again for every half window handled. Reconnects grant anew.
+    void useCredit(uint32_t window, uint32_t eventsPerSecond = 0);
+    void disconnect();
+    // Reconnects with a fresh link and decoder, in JSON like a new client
+    void reconnect();
+
+    SimLink& link() { return *down_; }
+    bool connected() const { return connected_; }
+
+    uint64_t received() const { return received_; }
+    uint64_t lastSeq() const { return lastSeq_; }
+    uint64_t missing() const { return missing_; }       // Skipped seq numbers, announced by gap records or not
+    uint64_t gapRecords() const { return gapRecords_; }
+    uint64_t controlRecords() const { return controlRecords_; }
+    uint64_t heartbeats() const { return heartbeats_; }
+    bool sawEnd() const { return sawEnd_; }
+    int64_t totalDx() const { return totalDx_; }        // Mouse motion received; merging keeps the sums
+    int64_t totalDy() const { return totalDy_; }
+    uint64_t unhandledMax() const { return unhandledMax_; }     // Most events waiting to be handled at once
+    uint64_t creditMerged() const { return creditMerged_; }     // From the last credit record
+    uint64_t creditDropped() const { return creditDropped_; }
+
+    // Capture-to-arrival latency of every event received, in ms
+    const std::vector<uint32_t>& latencies() const { return latencies_; }
+    uint64_t latencyPercentile(double fraction) const;
+
+private:
+    friend class Simulation;
+
+    void connect();
+    void onData(const char* data, size_t size);
+    void handleEvents();
+    void grantHandled(uint64_t handled);
+
+    Simulation& sim_;
+    SimLinkSpec spec_;
+    std::unique_ptr<SimLink> down_;     // Server to client
+    std::vector<std::unique_ptr<SimLink>> closedLinks_;   // Kept for deliveries already scheduled
+    StreamDecoder decoder_;
+    std::string buffer_;
+    bool connected_;
+    bool answersHeartbeats_;
+    uint64_t received_;
+    uint64_t lastSeq_;
+    uint64_t missing_;
+    uint64_t gapRecords_;
+    uint64_t controlRecords_;
+    uint64_t heartbeats_;
+    bool sawEnd_;
+    int64_t totalDx_;
+    int64_t totalDy_;
+    std::vector<uint32_t> latencies_;
+
+    uint32_t creditWindow_;             // 0 without credit flow control
+    uint32_t handleRate_;
+    uint64_t unhandled_;                // Received, waiting to be handled
+    uint64_t unhandledMax_;
+    uint64_t ungranted_;                // Handled since the last grant
+    uint64_t handleCarry_;              // Thousandths of an event of handling time left over
+    bool handleScheduled_;
+    uint64_t creditMerged_;
+    uint64_t creditDropped_;
+};
+
+// ---------------------------------------------------------------- Simulation
+
+struct SimStats {
+    uint64_t captured = 0;              // Events from devices and inject()
+    uint64_t published = 0;             // Events left after the pipeline
+    uint64_t batches = 0;               // Sender batches
+    uint64_t heartbeats = 0;
+    uint64_t writeStalls = 0;           // Clients evicted for taking nothing for writeTimeoutMs
+    uint64_t silentClients = 0;         // Clients evicted for not answering within pongTimeoutMs
+    uint64_t backlogOverflows = 0;      // Clients evicted for using more than their memory share
+    uint64_t rejectedClients = 0;       // Connections refused for lack of memory budget
+};
+
+class Simulation {
+public:
+    explicit Simulation(size_t historySize = 4096, uint64_t startMs = 0);
+
+    SimClock& clock() { return clock_; }
+    // Processing stages between capture and publish; empty passes everything
+    RuntimePipeline& pipeline() { return pipeline_; }
+
+    SyntheticDevice& addDevice(const SyntheticDeviceSpec& spec);
+    // Connects a client; any format but JSON is requested right away. The
+    // client is left disconnected if the memory budget has no room for it.
+    SimClient& addClient(const SimLinkSpec& spec = SimLinkSpec(), StreamFormat format = StreamFormat::Json);
+
+    // Heartbeat and eviction settings, as given to the service on its command line
+    void setTimeouts(const ClientTimeouts& timeouts) { sender_.setTimeouts(timeouts); }
+    // Memory ceiling (memory_budget.h); set before adding clients
+    void setMemoryBudget(size_t bytes) { fanout_.budget().setLimit(bytes); }
+
+    // Captures a hand-made event now (timestamp set to the current time)
+    void inject(InputEvent event);
+
+    size_t runFor(uint64_t ms) { return clock_.runFor(ms); }
+    size_t runUntil(uint64_t timeMs) { return clock_.runUntil(timeMs); }
+
+    const SimStats& stats() const { return stats_; }
+    const StreamFanout& fanout() const { return fanout_; }
+
+private:
+    friend class SimClient;
+
+    struct ServerClient : SenderClient {
+        SimClient* client = nullptr;
+    };
+
+    void capture(const InputEvent& event);
+    void flushCapture();
+    void publish(const InputEvent* events, size_t count);
+    void scheduleSender(uint64_t timeMs);
+    void senderRun();
+    bool serviceClients(uint64_t now);
+    void watch(ServerClient& client);
+    void checkClient(SimClient& client);
+    void countDrop(ClientDrop drop);
+    void evict(SimClient& client);
+    bool attach(SimClient& client);
+    void detach(SimClient& client);
+    void command(SimClient& client, const std::string& line);
+    ServerClient* find(SimClient& client);
+
+    SimClock clock_;
+    RuntimePipeline pipeline_;
+    StreamFanout fanout_;
+    StreamSender sender_;
+    std::vector<std::unique_ptr<SyntheticDevice>> devices_;
+    std::vector<std::unique_ptr<SimClient>> clients_;
+    std::vector<ServerClient> connected_;
+
+    std::vector<InputEvent> captureBatch_;
+    bool flushScheduled_;
+    std::vector<InputEvent> pending_;
+    std::vector<InputEvent> sending_;
+    uint64_t nextSeq_;
+    TimerHandle senderWake_;            // Next sender pass: a batch or a retry
+    uint64_t senderWakeAt_;
+    SimStats stats_;
+};
@@ -2,21 +2,29 @@
 #include "socket_server.h"
 
 std::string formatEventJson(const InputEvent& event) {
-    std::stringstream ss;
-    ss << "{\"device_id\":\"" << event.device_id << "\",";
-    
-    if (event.type == DeviceType::Keyboard) {
-        ss << "\"type\":\"keyboard\",";
-        ss << "\"vkey\":" << event.data.keyboard.vkey << ",";
-    } else if (event.type == DeviceType::Mouse) {
-        ss << "\"type\":\"mouse\",";
-        ss << "\"dx\":" << event.data.mouse.dx << ",";
-        ss << "\"dy\":" << event.data.mouse.dy << ",";
-        ss << "\"buttons\":" << event.data.mouse.buttons << ",";
+    char buffer[MAX_ENCODED_EVENT];
+    return std::string(buffer, encodeEventJson(event, buffer));
+}
+
+// Bytes a non-blocking socket took, 0 if its buffer is full, -1 on error
+static int sendSome(SOCKET clientSocket, const char* data, size_t size) {
+    size_t offset = 0;
+    while (offset < size) {
+        int sent = send(clientSocket, data + offset, (int)std::min<size_t>(size - offset, INT_MAX), 0);
+        if (sent == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                return -1;
+            }
+            break;
+        }
+        offset += sent;
     }
-    
-    ss << "\"timestamp\":" << event.timestamp << "}";
-    return ss.str();
+    return (int)offset;
+}
+
+// sendSome() on one socket, as StreamSender calls it
+static auto socketSend(SOCKET clientSocket) {
+    return [clientSocket](const char* data, size_t size) { return (long)sendSome(clientSocket, data, size); };
 }
 
 bool SocketServer::start(int port) {
@@ -25,10 +33,15 @@ bool SocketServer::start(int port) {
         LOG("WSAStartup failed");
         return false;
     }
+    if (!io_.open()) {
+        WSACleanup();
+        return false;
+    }
 
     listenSocket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (listenSocket_ == INVALID_SOCKET) {
         LOG("Failed to create socket: " + std::to_string(WSAGetLastError()));
+        io_.close();
         WSACleanup();
         return false;
     }
@@ -45,6 +58,8 @@ bool SocketServer::start(int port) {
     if (bind(listenSocket_, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
         LOG("Bind failed: " + std::to_string(WSAGetLastError()));
         closesocket(listenSocket_);
+        listenSocket_ = INVALID_SOCKET;
+        io_.close();
         WSACleanup();
         return false;
     }
@@ -52,47 +67,234 @@ bool SocketServer::start(int port) {
     if (listen(listenSocket_, SOMAXCONN) == SOCKET_ERROR) {
         LOG("Listen failed: " + std::to_string(WSAGetLastError()));
         closesocket(listenSocket_);
+        listenSocket_ = INVALID_SOCKET;
+        io_.close();
         WSACleanup();
         return false;
     }
 
     running_ = true;
-    acceptThread_ = std::thread(&SocketServer::acceptLoop, this);
+    startThreads();
 
     LOG("TCP server started on port " + std::to_string(port));
     return true;
 }
 
-void SocketServer::stop() {
+void SocketServer::startThreads() {
+    ioThread_ = std::thread([this] { io_.run(); });
+    acceptThread_ = std::thread(&SocketServer::acceptLoop, this);
+    senderThread_ = std::thread(&SocketServer::senderLoop, this);
+}
+
+void SocketServer::stopIoThread() {
+    io_.stop();
+    if (ioThread_.joinable()) {
+        ioThread_.join();
+    }
+}
+
+void SocketServer::startSession(SOCKET clientSocket) {
+    // Sends never wait; what a socket does not take stays in the client's backlog
+    u_long nonBlocking = 1;
+    if (ioctlsocket(clientSocket, FIONBIO, &nonBlocking) == SOCKET_ERROR || !io_.associate(clientSocket)) {
+        std::lock_guard<std::mutex> lock(clientsMutex_);
+        clients_.erase(clientSocket);
+        closesocket(clientSocket);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sessionsMutex_);
+        activeSessions_++;
+    }
+    // Runs here up to its first read, then on the I/O thread. Cleans up on
+    // disconnect, or leaves the socket to a hand-off.
+    clientSession(clientSocket);
+}
+
+void SocketServer::sessionExited() {
+    std::lock_guard<std::mutex> lock(sessionsMutex_);
+    activeSessions_--;
+    sessionsDone_.notify_all();
+}
+
+// Wakes sessions parked in a read until all have exited. A session may
+// start another read just after a cancel, so keep cancelling until it
+// sees the stop or hand-off flag.
+void SocketServer::waitForSessions() {
+    std::unique_lock<std::mutex> lock(sessionsMutex_);
+    while (activeSessions_ > 0) {
+        lock.unlock();
+        {
+            std::lock_guard<std::mutex> clientsLock(clientsMutex_);
+            for (const auto& client : clients_) {
+                io_.cancel(client.first);
+            }
+        }
+        lock.lock();
+        sessionsDone_.wait_for(lock, std::chrono::milliseconds(SOCKET_POLL_MS), [this] { return activeSessions_ == 0; });
+    }
+}
+
+void SocketServer::stop(int drainTimeoutMs) {
     if (!running_) return;
 
+    // No new clients, and the sender leaves what is still queued to us
+    stopping_ = true;
+    queueReady_.notify_all();
+    if (acceptThread_.joinable()) {
+        acceptThread_.join();
+    }
+    if (senderThread_.joinable()) {
+        senderThread_.join();
+    }
+
+    drain(drainTimeoutMs);
+
+    // Sessions close their sockets and exit
     running_ = false;
+    waitForSessions();
+    stopIoThread();
+    io_.close();
 
-    // Close listen socket to unblock accept()
     if (listenSocket_ != INVALID_SOCKET) {
         closesocket(listenSocket_);
         listenSocket_ = INVALID_SOCKET;
     }
+    stopping_ = false;
 
-    // Close all client connections
+    WSACleanup();
+    LOG("TCP server stopped");
+}
+
+// Sends everything still queued, then an end-of-stream record, giving
+// slow clients no more than drainTimeoutMs in total. Logs, summed over
+// clients, how many of the queued events got through in full and how many
+// did not: those whose records were still unsent at the deadline, and
+// events held for a client's credit.
+void SocketServer::drain(int drainTimeoutMs) {
+    std::vector<InputEvent> remaining;
     {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        for (SOCKET client : clients_) {
-            closesocket(client);
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        remaining.swap(pending_);
+    }
+
+    // What each client owes, in bytes from where the drain started
+    struct Owed {
+        size_t earlier = 0;             // Unsent bytes of events before the drain
+        std::vector<size_t> ends;       // Where each queued event's record ends, after earlier
+        size_t total = 0;               // earlier, the queued events and the end record
+        size_t unsent = 0;              // Left at the deadline
+        size_t held = 0;                // Events held for credit
+    };
+
+    std::lock_guard<std::mutex> lock(clientsMutex_);
+    ULONGLONG now = GetTickCount64();
+    ULONGLONG deadline = now + (ULONGLONG)drainTimeoutMs;
+    size_t clientCount = clients_.size();
+    std::map<SOCKET, Owed> owed;
+    std::vector<SOCKET> deadClients;
+
+    if (!remaining.empty()) {
+        sender_.encodeBatch(remaining, [this](auto&& visit) {
+            for (auto& client : clients_) visit(client.second);
+        }, true);
+    }
+    ControlRecord end = { "end", { { "seq", fanout_.lastSentSeq(), nullptr } }, 1 };
+    for (auto& client : clients_) {
+        Owed& o = owed[client.first];
+        o.earlier = client.second.backlog.size();
+        ClientDrop drop = ClientDrop::None;
+        if (!remaining.empty()) {
+            drop = sender_.sendBatch(client.second, remaining, clients_.size(), now, socketSend(client.first), &o.ends);
+        }
+        o.held = client.second.stream.credit.held().size();
+        std::string data;
+        StreamFanout::encodeControl(client.second.stream.format, end, data);
+        o.total = o.earlier + (o.ends.empty() ? 0 : o.ends.back()) + data.size();
+        if (dropping(drop, client.second) || !queueSend(client.first, client.second, data, now)) {
+            o.unsent = o.total;
+            deadClients.push_back(client.first);
         }
-        clients_.clear();
     }
+    dropClients(deadClients);
+    size_t late = deadClients.size();
+    deadClients.clear();
 
-    if (acceptThread_.joinable()) {
-        acceptThread_.join();
+    // Wait for the sockets to take what they still owe, up to the deadline
+    while (true) {
+        fd_set writeSet;
+        FD_ZERO(&writeSet);
+        size_t waiting = 0;
+        for (auto& client : clients_) {
+            if (client.second.backlog.empty()) continue;
+            if (!flush(client.first, client.second, now)) {
+                owed[client.first].unsent = client.second.backlog.size();
+                client.second.backlog.clear();
+                deadClients.push_back(client.first);
+            } else if (!client.second.backlog.empty()) {
+                FD_SET(client.first, &writeSet);
+                waiting++;
+            }
+        }
+        now = GetTickCount64();
+        if (waiting == 0 || now >= deadline) {
+            break;
+        }
+        timeval timeout = { 0, (long)std::min<ULONGLONG>(deadline - now, SOCKET_POLL_MS) * 1000 };
+        select(0, nullptr, &writeSet, nullptr, &timeout);
     }
+    dropClients(deadClients);
+    late += deadClients.size();
+    deadClients.clear();
 
-    WSACleanup();
-    LOG("TCP server stopped");
+    for (const auto& client : clients_) {
+        owed[client.first].unsent = client.second.backlog.size();
+        if (client.second.backlog.empty()) {
+            // Lets the client read everything and then see EOF
+            shutdown(client.first, SD_SEND);
+        } else {
+            deadClients.push_back(client.first);
+        }
+    }
+    late += deadClients.size();
+    dropClients(deadClients);
+
+    size_t flushed = 0;
+    size_t dropped = 0;
+    size_t earlierUnsent = 0;
+    for (const auto& entry : owed) {
+        const Owed& o = entry.second;
+        size_t written = o.total - o.unsent;
+        size_t queuedWritten = written > o.earlier ? written - o.earlier : 0;
+        size_t full = (size_t)(std::upper_bound(o.ends.begin(), o.ends.end(), queuedWritten) - o.ends.begin());
+        flushed += full;
+        dropped += o.ends.size() - full + o.held;
+        earlierUnsent += o.earlier > written ? o.earlier - written : 0;
+    }
+
+    if (clientCount == 0) {
+        LOG("Shutdown: " + std::to_string(remaining.size()) + " queued events discarded (no clients)");
+    } else {
+        // Counted per client: each of the remaining events once per client
+        LOG("Shutdown: " + std::to_string(remaining.size()) + " queued events for " + std::to_string(clientCount) +
+            " clients; " + std::to_string(flushed) + " flushed, " + std::to_string(dropped) +
+            " dropped (unsent at the deadline or held for credit); " + std::to_string(late) +
+            " clients missed the " + std::to_string(drainTimeoutMs) + " ms deadline" +
+            (earlierUnsent ? " with " + std::to_string(earlierUnsent) + " bytes of earlier events unsent" : ""));
+    }
 }
 
 void SocketServer::acceptLoop() {
-    while (running_) {
+    while (!stopping_ && !handingOff_) {
+        // Wait with a timeout so a hand-off can stop us without closing the socket
+        fd_set readSet;
+        FD_ZERO(&readSet);
+        FD_SET(listenSocket_, &readSet);
+        timeval timeout = { 0, SOCKET_POLL_MS * 1000 };
+        if (select(0, &readSet, nullptr, nullptr, &timeout) <= 0) {
+            continue;
+        }
+
         sockaddr_in clientAddr;
         int addrLen = sizeof(clientAddr);
         
@@ -112,61 +314,473 @@ void SocketServer::acceptLoop() {
                 closesocket(clientSocket);
                 continue;
             }
-            clients_.insert(clientSocket);
+            if (!fanout_.budget().admits(clients_.size() + 1)) {
+                LOG("Memory budget full, rejecting connection");
+                closesocket(clientSocket);
+                continue;
+            }
+            ULONGLONG now = GetTickCount64();
+            ClientState& client = clients_[clientSocket];
+            client.watch.reset(now);
+            watchClient(clientSocket, client, now);
         }
 
         char clientIP[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, INET_ADDRSTRLEN);
         LOG("Client connected: " + std::string(clientIP));
 
-        // Start client handler thread (detached - will clean up on disconnect)
-        std::thread(&SocketServer::clientHandler, this, clientSocket).detach();
+        startSession(clientSocket);
     }
 }
 
-void SocketServer::clientHandler(SOCKET clientSocket) {
+Session SocketServer::clientSession(SOCKET clientSocket) {
     char buffer[BUFFER_SIZE];
+    std::string pending;
+    {
+        // Pick up a partial command carried over by a hand-off
+        std::lock_guard<std::mutex> lock(clientsMutex_);
+        auto it = clients_.find(clientSocket);
+        if (it != clients_.end()) {
+            pending.swap(it->second.partial);
+        }
+    }
     
     while (running_) {
-        // Just wait for client disconnect or data (we don't process incoming data)
-        int bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0);
-        
-        if (bytesReceived <= 0) {
+        if (handingOff_) {
+            // The socket goes to the new process; keep it open and stop reading
+            std::lock_guard<std::mutex> lock(clientsMutex_);
+            auto it = clients_.find(clientSocket);
+            if (it != clients_.end()) {
+                it->second.partial.swap(pending);
+                sessionExited();
+                co_return;
+            }
+            break; // Already dropped by the sender
+        }
+
+        // Wait for client commands ("hello", "resume <seq>", "format <name>", "credit <n>") or disconnect
+        IoResult received = co_await io_.recv(clientSocket, buffer, BUFFER_SIZE - 1);
+        if (received.error == IO_CANCELLED) {
+            continue; // Woken for a stop or hand-off; the loop checks which
+        }
+        if (!received.ok() || received.bytes == 0) {
             break; // Client disconnected or error
         }
-        // Ignore any incoming data - this is a one-way stream
+
+        pending.append(buffer, received.bytes);
+        size_t pos;
+        while ((pos = pending.find('\n')) != std::string::npos) {
+            std::string line = pending.substr(0, pos);
+            pending.erase(0, pos + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty()) {
+                handleCommand(clientSocket, line);
+            }
+        }
+
+        // Anything else is not a command - don't let it grow unbounded
+        if (pending.size() > BUFFER_SIZE) {
+            pending.clear();
+        }
     }
 
     {
         std::lock_guard<std::mutex> lock(clientsMutex_);
-        clients_.erase(clientSocket);
+        auto it = clients_.find(clientSocket);
+        if (it != clients_.end()) {
+            io_.cancelTimer(it->second.watchTimer);
+            clients_.erase(it);
+        }
     }
     
+    io_.release(clientSocket);
     closesocket(clientSocket);
     LOG("Client disconnected");
+    sessionExited();
 }
 
-void SocketServer::broadcast(const std::string& message) {
-    std::string data = message + "\n";
-    
+void SocketServer::handleCommand(SOCKET clientSocket, const std::string& line) {
     std::lock_guard<std::mutex> lock(clientsMutex_);
-    
+    auto it = clients_.find(clientSocket);
+    if (it == clients_.end()) {
+        return; // Already dropped by the sender
+    }
+    ULONGLONG now = GetTickCount64();
+    it->second.watch.heard(now);
+
+    // A format change applies from the next batch the sender encodes
+    std::string reply;
+    CommandResult result = fanout_.handleCommand(line, it->second.stream, reply);
+    if (result == CommandResult::UnknownFormat) {
+        LOG("Unknown stream format: " + line);
+    } else if (result == CommandResult::UnknownCommand) {
+        LOG("Unknown client command: " + line);
+    }
+    // Queued behind anything the client has not taken yet, so it stays in stream order
+    if (!queueSend(clientSocket, it->second, reply, now)) {
+        dropClients({ clientSocket });
+        return;
+    }
+    watchClient(clientSocket, it->second, now);
+    if (!it->second.backlog.empty()) {
+        requestRetry();
+    }
+}
+
+// Caller must hold clientsMutex_. Sends what the socket takes right away
+// and keeps the rest for flush(); false if the client has to go.
+bool SocketServer::queueSend(SOCKET clientSocket, ClientState& client, const std::string& data, ULONGLONG now) {
+    return !dropping(sender_.queue(client, data, clients_.size(), now, socketSend(clientSocket)), client);
+}
+
+// Caller must hold clientsMutex_. False if the socket failed.
+bool SocketServer::flush(SOCKET clientSocket, ClientState& client, ULONGLONG now) {
+    return sender_.flush(client, now, socketSend(clientSocket));
+}
+
+// Caller must hold clientsMutex_. Logs why a client is evicted; true if it is.
+bool SocketServer::dropping(ClientDrop drop, const ClientState& client) {
+    if (drop != ClientDrop::None && drop != ClientDrop::Failed) {
+        LOG("Evicting client: " + sender_.describe(drop, client, clients_.size()));
+    }
+    return drop != ClientDrop::None;
+}
+
+// Caller must hold queueMutex_. How many of count new events fit in the
+// publish queue's share of the memory budget; the rest are refused before
+// they get a seq, so clients see no hole.
+size_t SocketServer::roomForPending(size_t count) {
+    MemoryBudget& budget = fanout_.budget();
+    size_t taken = budget.admitPending(pending_.size(), count);
+    if (taken < count && !pendingFull_) {
+        LOG("Publish queue full (" + std::to_string(budget.pendingLimit()) + " bytes), refusing events");
+    }
+    pendingFull_ = taken < count;
+    return taken;
+}
+
+void SocketServer::publish(InputEvent& event) {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        if (roomForPending(1) == 0) return;
+        event.seq = nextSeq_++;
+        pending_.push_back(event);
+        fanout_.budget().report(MemoryUse::Pending, pending_.size() * sizeof(InputEvent));
+    }
+    queueReady_.notify_one();
+}
+
+// Assigns sequence numbers to all events under one lock. The events are
+// moved out; the vector comes back empty but keeps a reusable buffer.
+void SocketServer::publishBatch(std::vector<InputEvent>& events) {
+    if (events.empty()) return;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        events.resize(roomForPending(events.size()));
+        for (InputEvent& event : events) {
+            event.seq = nextSeq_++;
+        }
+        if (pending_.empty()) {
+            pending_.swap(events);
+        } else {
+            pending_.insert(pending_.end(), events.begin(), events.end());
+        }
+        fanout_.budget().report(MemoryUse::Pending, pending_.size() * sizeof(InputEvent));
+    }
+    events.clear();
+    queueReady_.notify_one();
+}
+
+// Copies the events into the send queue under one lock
+void SocketServer::publishBatch(const InputEvent* events, size_t count) {
+    if (count == 0) return;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        size_t first = pending_.size();
+        pending_.insert(pending_.end(), events, events + roomForPending(count));
+        for (size_t i = first; i < pending_.size(); ++i) {
+            pending_[i].seq = nextSeq_++;
+        }
+        fanout_.budget().report(MemoryUse::Pending, pending_.size() * sizeof(InputEvent));
+    }
+    queueReady_.notify_one();
+}
+
+// Heartbeats and timeouts are not the sender's: each client has a timer
+// on the I/O thread for its next one (checkClient). The sender only wakes
+// up on its own to retry unsent bytes.
+void SocketServer::senderLoop() {
+    std::vector<InputEvent> batch;
+    bool backlogged = false;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(queueMutex_);
+            auto ready = [this] { return !pending_.empty() || retryPending_ || stopping_ || handingOff_; };
+            if (backlogged) {
+                queueReady_.wait_for(lock, std::chrono::milliseconds(SEND_RETRY_MS), ready);
+            } else {
+                queueReady_.wait(lock, ready);
+            }
+            if (stopping_ || handingOff_) {
+                break; // Pending events stay queued for the drain or hand-off
+            }
+            // Everything published since the last wakeup goes out as one batch
+            batch.swap(pending_);
+            retryPending_ = false;
+            fanout_.budget().report(MemoryUse::Pending, 0);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(clientsMutex_);
+            ULONGLONG now = GetTickCount64();
+            sendBatch(batch, now);
+            backlogged = serviceClients(now);
+        }
+        batch.clear();
+    }
+}
+
+// Caller must hold clientsMutex_. Never waits for a client. Returns the
+// number of clients dropped.
+size_t SocketServer::sendBatch(const std::vector<InputEvent>& batch, ULONGLONG now) {
+    if (batch.empty()) return 0;
+
+    sender_.encodeBatch(batch, [this](auto&& visit) {
+        for (auto& client : clients_) visit(client.second);
+    });
     std::vector<SOCKET> deadClients;
-    
-    for (SOCKET client : clients_) {
-        int result = send(client, data.c_str(), (int)data.length(), 0);
-        if (result == SOCKET_ERROR) {
-            deadClients.push_back(client);
+    for (auto& client : clients_) {
+        ClientDrop drop = sender_.sendBatch(client.second, batch, clients_.size(), now, socketSend(client.first));
+        if (dropping(drop, client.second)) {
+            deadClients.push_back(client.first);
+        }
+    }
+    dropClients(deadClients);
+    return deadClients.size();
+}
+
+// Caller must hold clientsMutex_. Retries unsent bytes, sends heartbeats,
+// evicts clients that stopped reading or answering or that are over their
+// memory share, and reports client memory. Returns whether any client
+// still has unsent bytes.
+bool SocketServer::serviceClients(ULONGLONG now) {
+    std::vector<SOCKET> deadClients;
+    SenderPass pass;
+    for (auto& client : clients_) {
+        ClientDrop drop = sender_.service(client.second, clients_.size(), now, pass, socketSend(client.first));
+        if (dropping(drop, client.second)) {
+            deadClients.push_back(client.first);
+        } else {
+            watchClient(client.first, client.second, now);
         }
     }
+    dropClients(deadClients);
+    sender_.report(pass, clients_.size());
+    return pass.backlogged;
+}
+
+// Caller must hold clientsMutex_. Moves the client's timer up to its next
+// heartbeat or timeout if that came closer (StreamSender::rewatch).
+void SocketServer::watchClient(SOCKET clientSocket, ClientState& client, ULONGLONG now) {
+    if (!sender_.rewatch(client)) return;
+    io_.cancelTimer(client.watchTimer);
+    ULONGLONG delay = client.watchAt > now ? client.watchAt - now : 0;
+    client.watchTimer = io_.addTimer(delay, [this, clientSocket] { checkClient(clientSocket); });
+}
 
-    // Remove dead clients
+// Runs on the I/O thread when a client's timer fires: sends a heartbeat or
+// evicts it if one is due, then sets the timer for the next
+void SocketServer::checkClient(SOCKET clientSocket) {
+    std::lock_guard<std::mutex> lock(clientsMutex_);
+    auto it = clients_.find(clientSocket);
+    if (it == clients_.end()) {
+        return; // Gone; its socket may have been reused
+    }
+    ClientState& client = it->second;
+    client.watchTimer = TimerHandle();
+    client.watchAt = UINT64_MAX;
+    if (stopping_ || handingOff_) {
+        return; // A failed hand-off sets the timer again when it resumes
+    }
+
+    ULONGLONG now = GetTickCount64();
+    SenderPass pass;
+    if (dropping(sender_.service(client, clients_.size(), now, pass, socketSend(clientSocket)), client)) {
+        dropClients({ clientSocket });
+        return;
+    }
+    watchClient(clientSocket, client, now);
+    if (pass.backlogged) {
+        requestRetry();
+    }
+}
+
+// Caller must hold clientsMutex_. Has the sender retry unsent bytes that
+// appeared outside its own passes.
+void SocketServer::requestRetry() {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        retryPending_ = true;
+    }
+    queueReady_.notify_one();
+}
+
+// Caller must hold clientsMutex_. Their sessions see the shutdown and
+// close the sockets.
+void SocketServer::dropClients(const std::vector<SOCKET>& deadClients) {
     for (SOCKET dead : deadClients) {
-        clients_.erase(dead);
-        closesocket(dead);
+        auto it = clients_.find(dead);
+        if (it != clients_.end()) {
+            io_.cancelTimer(it->second.watchTimer);
+            clients_.erase(it);
+        }
+        shutdown(dead, SD_BOTH);
     }
 }
 
 int SocketServer::getClientCount() const {
+    std::lock_guard<std::mutex> lock(clientsMutex_);
     return (int)clients_.size();
 }
+
+
+bool SocketServer::beginHandoff(HandoffState& state) {
+    if (!running_ || handingOff_.exchange(true)) {
+        return false;
+    }
+
+    queueReady_.notify_all();
+    if (acceptThread_.joinable()) {
+        acceptThread_.join();
+    }
+    if (senderThread_.joinable()) {
+        senderThread_.join();
+    }
+    waitForSessions();
+    stopIoThread();
+
+    // Capture is stopped by now (handoff.h), but relays keep publishing;
+    // those events stay here and follow the state in a second message
+    std::lock_guard<std::mutex> clientsLock(clientsMutex_);
+    std::lock_guard<std::mutex> queueLock(queueMutex_);
+    state.listenSocket = listenSocket_;
+    state.clients.clear();
+    for (const auto& client : clients_) {
+        // Unbound from our completion port so the new process can bind it
+        io_.release(client.first);
+        const ClientStream& stream = client.second.stream;
+        state.clients.push_back({ client.first, stream.format, client.second.partial, client.second.backlog,
+                                  stream.credit.enabled(), stream.credit.credits(),
+                                  std::vector<InputEvent>(stream.credit.held().begin(), stream.credit.held().end()) });
+    }
+    state.history.assign(fanout_.history().begin(), fanout_.history().end());
+    state.pending = pending_;
+    handoffPending_ = pending_.size();
+    state.nextSeq = nextSeq_;
+    state.lastSentSeq = fanout_.lastSentSeq();
+    return true;
+}
+
+void SocketServer::finishHandoff(bool transferred, std::vector<InputEvent>& published) {
+    if (!transferred) {
+        LOG("Hand-off failed, resuming service");
+        std::vector<SOCKET> sockets;
+        {
+            std::lock_guard<std::mutex> lock(clientsMutex_);
+            ULONGLONG now = GetTickCount64();
+            for (auto& client : clients_) {
+                sockets.push_back(client.first);
+                watchClient(client.first, client.second, now);
+            }
+        }
+        handingOff_ = false;
+        startThreads();
+        for (SOCKET clientSocket : sockets) {
+            startSession(clientSocket);
+        }
+        queueReady_.notify_one();
+        return;
+    }
+
+    // The new process holds its own descriptors, so closing ours (without
+    // shutdown) leaves the connections open
+    published.clear();
+    {
+        std::lock_guard<std::mutex> clientsLock(clientsMutex_);
+        std::lock_guard<std::mutex> queueLock(queueMutex_);
+        for (const auto& client : clients_) {
+            closesocket(client.first);
+        }
+        clients_.clear();
+        closesocket(listenSocket_);
+        listenSocket_ = INVALID_SOCKET;
+        published.assign(pending_.begin() + handoffPending_, pending_.end());
+        pending_.clear();
+        running_ = false;
+    }
+    handingOff_ = false;
+    io_.close();
+    WSACleanup();
+    LOG("Sockets released to the other process (" + std::to_string(published.size()) +
+        " events published since follow them)");
+}
+
+void SocketServer::release() {
+    HandoffState unused;
+    std::vector<InputEvent> published;
+    if (beginHandoff(unused)) {
+        finishHandoff(true, published);
+    }
+}
+
+bool SocketServer::adopt(HandoffState& state) {
+    if (running_) return false;
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        LOG("WSAStartup failed");
+        return false;
+    }
+    if (!io_.open()) {
+        WSACleanup();
+        return false;
+    }
+
+    listenSocket_ = state.listenSocket;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex_);
+        ULONGLONG now = GetTickCount64();
+        for (HandoffClient& client : state.clients) {
+            ClientState& adopted = clients_[client.socket];
+            adopted.stream.format = client.format;
+            if (client.credited) {
+                adopted.stream.credit.restore(client.credits, client.held);
+            }
+            adopted.partial = std::move(client.partial);
+            adopted.backlog = std::move(client.backlog);
+            adopted.watch.reset(now);
+            watchClient(client.socket, adopted, now);
+        }
+        fanout_.restore(state.history, state.lastSentSeq);
+    }
+    size_t queued = state.pending.size();
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        pending_.swap(state.pending);
+        nextSeq_ = state.nextSeq;
+    }
+
+    running_ = true;
+    startThreads();
+    for (const HandoffClient& client : state.clients) {
+        startSession(client.socket);
+    }
+    queueReady_.notify_one();
+
+    LOG("Took over " + std::to_string(state.clients.size()) + " clients and " +
+        std::to_string(queued) + " queued events at seq " + std::to_string(state.nextSeq));
+    return true;
+}
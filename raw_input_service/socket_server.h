@@ -1,9 +1,14 @@
 // socket_server.h - TCP server for streaming events
 #pragma once
 #include "common.h"
-#include <set>
+#include "async_io.h"
+#include "stream_fanout.h"
+#include "handoff.h"
+#include <map>
+#include <deque>
 #include <thread>
 #include <atomic>
+#include <condition_variable>
 
 class SocketServer {
 public:
@@ -12,23 +17,92 @@ public:
         return inst;
     }
 
+    // Call before start() or adopt()
+    void setTimeouts(const ClientTimeouts& timeouts) { sender_.setTimeouts(timeouts); }
+    void setMemoryBudget(size_t bytes) { fanout_.budget().setLimit(bytes); }
+    const MemoryBudget& memoryBudget() const { return fanout_.budget(); }
+
     bool start(int port = TCP_PORT);
-    void stop();
-    void broadcast(const std::string& message);
+    // Stops accepting, flushes queued events and an "end" record to every
+    // client within drainTimeoutMs, then joins all server threads
+    void stop(int drainTimeoutMs = SHUTDOWN_DRAIN_MS);
+    void publish(InputEvent& event);
+    void publishBatch(std::vector<InputEvent>& events);
+    void publishBatch(const InputEvent* events, size_t count);
     int getClientCount() const;
 
+    // Zero-downtime restart (handoff.h). beginHandoff stops all server
+    // threads and exports the state; finishHandoff either releases it,
+    // returning the events published since, or resumes serving. adopt
+    // starts serving from an imported state.
+    bool beginHandoff(HandoffState& state);
+    void finishHandoff(bool transferred, std::vector<InputEvent>& published);
+    bool adopt(HandoffState& state);
+    // Closes our descriptors without shutting the connections down, for
+    // when another process has taken them over
+    void release();
+
 private:
-    SocketServer() : running_(false), listenSocket_(INVALID_SOCKET) {}
+    // Stream, backlog and watch on GetTickCount64()
+    struct ClientState : SenderClient {
+        std::string partial;            // Unparsed command bytes while a hand-off runs
+    };
+
+    SocketServer() : listenSocket_(INVALID_SOCKET), running_(false), stopping_(false), handingOff_(false),
+                     activeSessions_(0), nextSeq_(1), pendingFull_(false), retryPending_(false), handoffPending_(0), fanout_(HISTORY_SIZE), sender_(fanout_) {}
     ~SocketServer() { stop(); }
 
+    void startThreads();
+    void stopIoThread();
+    void startSession(SOCKET clientSocket);
+    void sessionExited();
+    void waitForSessions();
     void acceptLoop();
-    void clientHandler(SOCKET clientSocket);
+    void senderLoop();
+    Session clientSession(SOCKET clientSocket);
+    void handleCommand(SOCKET clientSocket, const std::string& line);
+    size_t sendBatch(const std::vector<InputEvent>& batch, ULONGLONG now);
+    bool serviceClients(ULONGLONG now);
+    void watchClient(SOCKET clientSocket, ClientState& client, ULONGLONG now);
+    void checkClient(SOCKET clientSocket);
+    void requestRetry();
+    void drain(int drainTimeoutMs);
+    bool queueSend(SOCKET clientSocket, ClientState& client, const std::string& data, ULONGLONG now);
+    bool flush(SOCKET clientSocket, ClientState& client, ULONGLONG now);
+    bool dropping(ClientDrop drop, const ClientState& client);
+    size_t roomForPending(size_t count);
+    void dropClients(const std::vector<SOCKET>& deadClients);
 
     SOCKET listenSocket_;
     std::atomic<bool> running_;
-    std::set<SOCKET> clients_;
-    std::mutex clientsMutex_;
+    std::atomic<bool> stopping_;        // Draining: no new clients, sender stopped
+    std::map<SOCKET, ClientState> clients_;
+    mutable std::mutex clientsMutex_;
     std::thread acceptThread_;
+    std::thread senderThread_;
+
+    // Client sessions are coroutines reading commands on the I/O thread;
+    // stop and hand-off wait for them to let go of their sockets
+    IoContext io_;
+    std::thread ioThread_;
+    std::atomic<bool> handingOff_;
+    int activeSessions_;                // Guarded by sessionsMutex_
+    std::mutex sessionsMutex_;
+    std::condition_variable sessionsDone_;
+
+    // Events published by the capture thread, waiting for the sender
+    std::vector<InputEvent> pending_;
+    std::mutex queueMutex_;
+    std::condition_variable queueReady_;
+    ULONGLONG nextSeq_;                 // Guarded by queueMutex_
+    bool pendingFull_;                  // Guarded by queueMutex_; events are being refused
+    bool retryPending_;                 // Guarded by queueMutex_; unsent bytes outside a sender pass
+    size_t handoffPending_;             // Guarded by queueMutex_; pending_ events in the hand-off state
+
+    // History for "resume", encoding and command replies (guarded by
+    // clientsMutex_, except for the memory budget, which any thread may use)
+    StreamFanout fanout_;
+    StreamSender sender_;               // Guarded by clientsMutex_
 };
 
 // JSON formatter for events
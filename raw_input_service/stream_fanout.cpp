@@ -0,0 +1,211 @@
+// stream_fanout.cpp - Stream encoding shared by every client
+#include "stream_fanout.h"
+#include <sstream>
+
+void StreamFanout::encodeBatch(const std::vector<InputEvent>& batch, const bool needed[STREAM_FORMAT_COUNT],
+                               std::vector<size_t>* ends) {
+    for (size_t f = 0; f < STREAM_FORMAT_COUNT; ++f) {
+        encoded_[f].clear();
+        if (ends) ends[f].clear();
+    }
+    if (batch.empty()) return;
+
+    for (const InputEvent& event : batch) {
+        history_.push_back(event);
+    }
+    while (history_.size() > historySize_) {
+        history_.pop_front();
+    }
+    budget_.report(MemoryUse::History, history_.size() * sizeof(InputEvent));
+    lastSentSeq_ = batch.back().seq;
+
+    // Encode each format at most once, and only if someone wants it
+    for (size_t f = 0; f < STREAM_FORMAT_COUNT; ++f) {
+        if (!needed[f]) continue;
+        for (const InputEvent& event : batch) {
+            if ((StreamFormat)f == StreamFormat::Compact) {
+                compact_.encode(event, encoded_[f]);
+            } else {
+                appendEvent((StreamFormat)f, event, encoded_[f]);
+            }
+            if (ends) ends[f].push_back(encoded_[f].size());
+        }
+    }
+    if (!needed[(int)StreamFormat::Compact]) {
+        // Skipped batches leave the delta state stale
+        compact_.reset();
+    }
+}
+
+void StreamFanout::encodeCredited(ClientStream& stream, const std::vector<InputEvent>& batch, std::string& out,
+                                  std::vector<size_t>* ends) {
+    for (const InputEvent& event : batch) {
+        stream.credit.offer(event, [&](const InputEvent& allowed) {
+            encodeFor(stream, allowed, out);
+            if (ends) ends->push_back(out.size());
+        });
+    }
+}
+
+void StreamFanout::encodeFor(ClientStream& stream, const InputEvent& event, std::string& out) {
+    if (stream.format == StreamFormat::Compact) {
+        stream.compact.encode(event, out);
+    } else {
+        appendEvent(stream.format, event, out);
+    }
+}
+
+CommandResult StreamFanout::handleCommand(const std::string& line, ClientStream& stream, std::string& reply) {
+    StreamFormat& format = stream.format;
+    std::istringstream iss(line);
+    std::string command;
+    iss >> command;
+
+    if (command == "hello") {
+        // Reply with our protocol version and the last sent sequence number
+        ControlRecord hello = { "hello", {
+            { "protocol", (uint64_t)PROTOCOL_VERSION, nullptr },
+            { "seq", lastSentSeq_, nullptr } }, 2 };
+        encodeControl(format, hello, reply);
+    } else if (command == "resume") {
+        uint64_t afterSeq = 0;
+        if (iss >> afterSeq) {
+            encodeReplay(format, afterSeq, reply);
+            stream.compact.reset();
+        }
+    } else if (command == "format") {
+        // The reply is the last record in the old format; the stream uses
+        // the new one from the next batch on
+        std::string name;
+        iss >> name;
+        StreamFormat next;
+        if (!parseStreamFormat(name, next)) {
+            return CommandResult::UnknownFormat;
+        }
+        ControlRecord changed = { "format", { { "format", 0, STREAM_FORMAT_NAMES[(int)next] } }, 1 };
+        encodeControl(format, changed, reply);
+        format = next;
+        if (format == StreamFormat::Compact) {
+            // The new client has no delta state yet
+            compact_.reset();
+            stream.compact.reset();
+        }
+    } else if (command == "credit") {
+        // Held events go out first, then the new balance. Replies and
+        // replays are not counted against credit.
+        uint64_t credits = 0;
+        iss >> credits;
+        stream.credit.grant(credits);
+        stream.credit.release([&](const InputEvent& event) { encodeFor(stream, event, reply); });
+        encodeCreditStatus(stream, reply);
+    } else if (command == "memory") {
+        encodeMemoryStatus(format, reply);
+    } else if (command == "pong") {
+        // Answers a heartbeat; the caller already noted that the client is alive
+    } else {
+        return CommandResult::UnknownCommand;
+    }
+    return CommandResult::Ok;
+}
+
+void StreamFanout::encodeReplay(StreamFormat format, uint64_t afterSeq, std::string& out) {
+    if (afterSeq >= lastSentSeq_) {
+        return; // Client is up to date
+    }
+
+    // Tell the client about events that already fell out of the history
+    uint64_t oldest = history_.empty() ? lastSentSeq_ + 1 : history_.front().seq;
+    if (afterSeq + 1 < oldest) {
+        ControlRecord gap = { "gap", {
+            { "from", afterSeq + 1, nullptr },
+            { "to", oldest - 1, nullptr } }, 2 };
+        encodeControl(format, gap, out);
+    }
+
+    if (format == StreamFormat::Compact) {
+        // Replay with a private encoder, then make the shared stream
+        // start over from a keyframe so the client can follow it
+        CompactEncoder replay;
+        for (const InputEvent& event : history_) {
+            if (event.seq > afterSeq) {
+                replay.encode(event, out);
+            }
+        }
+        compact_.reset();
+    } else {
+        for (const InputEvent& event : history_) {
+            if (event.seq > afterSeq) {
+                appendEvent(format, event, out);
+            }
+        }
+    }
+}
+
+void StreamFanout::encodeControl(StreamFormat format, const ControlRecord& record, std::string& out) {
+    if (format == StreamFormat::Compact) {
+        CompactEncoder::encodeControl(record, out);
+    } else {
+        appendControl(format, record, out);
+    }
+}
+
+void StreamFanout::encodeHeartbeat(StreamFormat format, std::string& out) const {
+    ControlRecord heartbeat = { "heartbeat", { { "seq", lastSentSeq_, nullptr } }, 1 };
+    encodeControl(format, heartbeat, out);
+}
+
+void StreamFanout::encodeCreditStatus(const ClientStream& stream, std::string& out) {
+    ControlRecord status = { "credit", {
+        { "credits", stream.credit.credits(), nullptr },
+        { "held", (uint64_t)stream.credit.held().size(), nullptr },
+        { "merged", stream.credit.merged(), nullptr },
+        { "dropped", stream.credit.dropped(), nullptr } }, 4 };
+    encodeControl(stream.format, status, out);
+}
+
+void StreamFanout::encodeMemoryStatus(StreamFormat format, std::string& out) const {
+    ControlRecord status = { "memory", {
+        { "limit", budget_.limit(), nullptr },
+        { "used", budget_.used(), nullptr },
+        { "peak", budget_.peak(), nullptr },
+        { "clients", budget_.clients(), nullptr },
+        { "client_limit", budget_.clientLimit(budget_.clients()), nullptr },
+        { "history", budget_.used(MemoryUse::History), nullptr },
+        { "pending", budget_.used(MemoryUse::Pending), nullptr },
+        { "backlog", budget_.used(MemoryUse::Backlog), nullptr },
+        { "held", budget_.used(MemoryUse::Held), nullptr },
+        { "dropped", budget_.dropped(), nullptr } }, 10 };
+    encodeControl(format, status, out);
+}
+
+void StreamFanout::restore(const std::vector<InputEvent>& history, uint64_t lastSentSeq) {
+    history_.assign(history.begin(), history.end());
+    budget_.report(MemoryUse::History, history_.size() * sizeof(InputEvent));
+    lastSentSeq_ = lastSentSeq;
+    compact_.reset();
+}
+
+void StreamSender::report(const SenderPass& pass, size_t clientCount) {
+    MemoryBudget& budget = fanout_.budget();
+    budget.report(MemoryUse::Backlog, pass.backlogBytes);
+    budget.report(MemoryUse::Held, pass.heldBytes);
+    budget.reportClients(clientCount);
+}
+
+std::string StreamSender::describe(ClientDrop drop, const SenderClient& client, size_t clientCount) const {
+    switch (drop) {
+    case ClientDrop::None:
+        return "";
+    case ClientDrop::Failed:
+        return "connection failed";
+    case ClientDrop::OverBudget:
+        return "more than its " + std::to_string(fanout_.budget().clientLimit(clientCount)) +
+               " byte memory share in use";
+    case ClientDrop::WriteStalled:
+        return "nothing sent for " + std::to_string(timeouts_.writeTimeoutMs) + " ms (" +
+               std::to_string(client.backlog.size()) + " bytes unsent)";
+    case ClientDrop::Silent:
+        return "no reply for " + std::to_string(timeouts_.pongTimeoutMs) + " ms";
+    }
+    return "";
+}
@@ -0,0 +1,334 @@
+// stream_fanout.h - Encodes one event stream for many clients
+//
+// The socket-independent half of SocketServer: keeps the history for
+// "resume", encodes each batch once per stream format in use and answers
+// client commands. Clients under credit flow control (credit_queue.h) get
+// their events encoded one client at a time instead. StreamSender holds the
+// rules for getting those bytes to clients that may not keep up.
+// SocketServer sends over TCP and the simulation (simulation.h) over
+// in-memory links, both through StreamSender.
+#pragma once
+#include "compact_codec.h"
+#include "credit_queue.h"
+#include "memory_budget.h"
+#include "timer_wheel.h"
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+constexpr uint64_t HEARTBEAT_MS = 1000;         // Idle clients get a heartbeat record this often
+constexpr uint64_t WRITE_TIMEOUT_MS = 5000;     // Clients whose unsent bytes do not move this long are evicted
+constexpr uint64_t SEND_RETRY_MS = 5;           // Clients with unsent bytes are retried this often
+
+// When the sender gives up on a client; 0 turns a check off
+struct ClientTimeouts {
+    uint64_t heartbeatMs = HEARTBEAT_MS;
+    uint64_t writeTimeoutMs = WRITE_TIMEOUT_MS;
+    uint64_t pongTimeoutMs = 0;         // Clients must send a line ("pong") at least this often
+};
+
+enum class ClientCheck {
+    Ok,
+    Heartbeat,                          // Send one now
+    WriteStalled,                       // Evict: the socket took nothing for writeTimeoutMs
+    Silent                              // Evict: nothing heard for pongTimeoutMs
+};
+
+// Liveness of one client, on the sender's millisecond clock. A client that
+// has to answer heartbeats gets them even while events flow, since it may
+// have nothing else to say. nextCheck() tells when to look again, so the
+// owner can keep one timer per client instead of polling.
+class ClientWatch {
+public:
+    void reset(uint64_t now) { lastSent_ = lastHeard_ = lastHeartbeat_ = lastProgress_ = now; }
+    void sent(uint64_t now) { lastSent_ = now; }                // Bytes queued for the client
+    void progressed(uint64_t now) { lastProgress_ = now; }      // Unsent bytes appeared or moved
+    void heard(uint64_t now) { lastHeard_ = now; }              // A line arrived from the client
+
+    ClientCheck check(uint64_t now, bool backlogged, const ClientTimeouts& timeouts) {
+        if (backlogged && timeouts.writeTimeoutMs && now - lastProgress_ >= timeouts.writeTimeoutMs) {
+            return ClientCheck::WriteStalled;
+        }
+        if (timeouts.pongTimeoutMs && now - lastHeard_ >= timeouts.pongTimeoutMs) {
+            return ClientCheck::Silent;
+        }
+        if (timeouts.heartbeatMs && !backlogged && now - lastHeartbeat_ >= timeouts.heartbeatMs &&
+            (now - lastSent_ >= timeouts.heartbeatMs ||
+             (timeouts.pongTimeoutMs && now - lastHeard_ >= timeouts.heartbeatMs))) {
+            lastHeartbeat_ = now;
+            return ClientCheck::Heartbeat;
+        }
+        return ClientCheck::Ok;
+    }
+
+    // The earliest time check() may return anything but Ok, UINT64_MAX if
+    // never. Later sends and replies only move it back.
+    uint64_t nextCheck(bool backlogged, const ClientTimeouts& timeouts) const {
+        uint64_t due = UINT64_MAX;
+        if (backlogged && timeouts.writeTimeoutMs) {
+            due = std::min(due, lastProgress_ + timeouts.writeTimeoutMs);
+        }
+        if (timeouts.pongTimeoutMs) {
+            due = std::min(due, lastHeard_ + timeouts.pongTimeoutMs);
+        }
+        if (timeouts.heartbeatMs && !backlogged) {
+            uint64_t quiet = lastSent_ + timeouts.heartbeatMs;
+            if (timeouts.pongTimeoutMs) quiet = std::min(quiet, lastHeard_ + timeouts.heartbeatMs);
+            due = std::min(due, std::max(lastHeartbeat_ + timeouts.heartbeatMs, quiet));
+        }
+        return due;
+    }
+
+private:
+    uint64_t lastSent_ = 0;
+    uint64_t lastHeard_ = 0;
+    uint64_t lastHeartbeat_ = 0;
+    uint64_t lastProgress_ = 0;
+};
+
+// What the fanout keeps per client
+struct ClientStream {
+    StreamFormat format = StreamFormat::Json;
+    CreditQueue credit;                 // Off until the client's first "credit"
+    CompactEncoder compact;             // Delta state of a credit client's compact stream
+};
+
+enum class CommandResult {
+    Ok,
+    UnknownCommand,
+    UnknownFormat
+};
+
+class StreamFanout {
+public:
+    explicit StreamFanout(size_t historySize)
+        : historySize_(historySize), lastSentSeq_(0), budget_(MEMORY_BUDGET_DEFAULT, historySize * sizeof(InputEvent)) {}
+
+    // Adds a batch about to be sent to the history and encodes it for every
+    // format marked in needed; read the bytes back with encoded(). Mark only
+    // the formats of clients without credit flow control. With ends, which
+    // then points to STREAM_FORMAT_COUNT vectors, ends[f] receives the
+    // offset just past each event's record in encoded(f).
+    void encodeBatch(const std::vector<InputEvent>& batch, const bool needed[STREAM_FORMAT_COUNT],
+                     std::vector<size_t>* ends = nullptr);
+    const std::string& encoded(StreamFormat format) const { return encoded_[(int)format]; }
+
+    // Encodes what a credit client may have of the batch given to the last
+    // encodeBatch() and holds the rest. ends, if given, receives the offset
+    // just past each record appended to out.
+    void encodeCredited(ClientStream& stream, const std::vector<InputEvent>& batch, std::string& out,
+                        std::vector<size_t>* ends = nullptr);
+
+    // Handles one command line ("hello", "resume <seq>", "format <name>",
+    // "credit <n>", "memory", "pong") from a client. reply receives the bytes to send
+    // back; stream is updated by "format" and "credit".
+    CommandResult handleCommand(const std::string& line, ClientStream& stream, std::string& reply);
+
+    // A gap record if events after afterSeq already left the history, then
+    // every event after afterSeq still in it
+    void encodeReplay(StreamFormat format, uint64_t afterSeq, std::string& out);
+
+    static void encodeControl(StreamFormat format, const ControlRecord& record, std::string& out);
+    // {"type":"heartbeat","seq":<last sent seq>}
+    void encodeHeartbeat(StreamFormat format, std::string& out) const;
+    // {"type":"credit","credits":<left>,"held":<events>,"merged":<total>,"dropped":<total>}
+    static void encodeCreditStatus(const ClientStream& stream, std::string& out);
+    // {"type":"memory",...}: the budget, its use per subsystem in bytes, and
+    // how many published events were refused for lack of room
+    void encodeMemoryStatus(StreamFormat format, std::string& out) const;
+
+    // Memory ceiling shared by the history, the publish queue and the clients
+    MemoryBudget& budget() { return budget_; }
+    const MemoryBudget& budget() const { return budget_; }
+
+    uint64_t lastSentSeq() const { return lastSentSeq_; }
+    const std::deque<InputEvent>& history() const { return history_; }   // Oldest first
+
+    // Continues a stream exported by a hand-off
+    void restore(const std::vector<InputEvent>& history, uint64_t lastSentSeq);
+
+private:
+    static void encodeFor(ClientStream& stream, const InputEvent& event, std::string& out);
+
+    size_t historySize_;
+    std::deque<InputEvent> history_;
+    uint64_t lastSentSeq_;
+    std::string encoded_[STREAM_FORMAT_COUNT];   // Per-batch encode buffers
+    CompactEncoder compact_;            // Shared by all compact clients without credit
+    MemoryBudget budget_;
+};
+
+// What the sender keeps per client, whatever carries the bytes
+struct SenderClient {
+    ClientStream stream;                // Format and credit state
+    std::string backlog;                // Encoded bytes the connection has not taken yet
+    ClientWatch watch;                  // Heartbeats and timeouts, on the sender's clock
+    TimerHandle watchTimer;             // The owner's timer for watchAt
+    uint64_t watchAt = UINT64_MAX;      // When watchTimer fires; UINT64_MAX with none
+};
+
+// Why the sender gives up on a client
+enum class ClientDrop {
+    None,
+    Failed,                             // The connection failed
+    OverBudget,                         // More than its memory share in use
+    WriteStalled,                       // The connection took nothing for writeTimeoutMs
+    Silent                              // Nothing heard for pongTimeoutMs
+};
+
+// Totals of one service pass over every client
+struct SenderPass {
+    size_t backlogBytes = 0;
+    size_t heldBytes = 0;
+    size_t heartbeats = 0;
+    bool backlogged = false;            // Some client still has unsent bytes; retry after SEND_RETRY_MS
+};
+
+// The sender's rules. It never waits for a client: what a connection does
+// not take waits in the client's backlog and is retried, and clients over
+// their memory share or past a timeout are dropped. Heartbeats and
+// timeouts come from a timer per client: the owner calls rewatch() after
+// anything that touched a client and service() when its timer fires. The caller owns the
+// clients and their connections and drops the ones a call reports; send
+// is called as send(data, size) and returns the bytes the connection took,
+// or a negative number if it failed. clientCount is the number of clients
+// sharing the memory budget.
+class StreamSender {
+public:
+    explicit StreamSender(StreamFanout& fanout) : fanout_(fanout) {}
+
+    void setTimeouts(const ClientTimeouts& timeouts) { timeouts_ = timeouts; }
+    const ClientTimeouts& timeouts() const { return timeouts_; }
+
+    // Encodes a batch once per format that clients without credit use.
+    // eachClient(f) calls f(SenderClient&) for every client. With
+    // countRecords, sendBatch() can report where each event's record ends.
+    template <typename EachClient>
+    void encodeBatch(const std::vector<InputEvent>& batch, EachClient&& eachClient, bool countRecords = false) {
+        bool needed[STREAM_FORMAT_COUNT] = {};
+        eachClient([&needed](SenderClient& client) {
+            if (!client.stream.credit.enabled()) {
+                needed[(int)client.stream.format] = true;
+            }
+        });
+        fanout_.encodeBatch(batch, needed, countRecords ? recordEnds_ : nullptr);
+    }
+
+    // Queues the batch given to encodeBatch() for one client: the shared
+    // encoding, or what its credit allows, encoded for it alone. ends, if
+    // given after encodeBatch() counted records, receives the offset just
+    // past each event's record in the bytes queued.
+    template <typename Send>
+    ClientDrop sendBatch(SenderClient& client, const std::vector<InputEvent>& batch, size_t clientCount, uint64_t now,
+                         Send&& send, std::vector<size_t>* ends = nullptr) {
+        if (!client.stream.credit.enabled()) {
+            if (ends) *ends = recordEnds_[(int)client.stream.format];
+            return queue(client, fanout_.encoded(client.stream.format), clientCount, now, send);
+        }
+        client.stream.credit.setHoldLimit(fanout_.budget().holdLimit(fanout_.budget().clientLimit(clientCount)));
+        credited_.clear();
+        if (ends) ends->clear();
+        fanout_.encodeCredited(client.stream, batch, credited_, ends);
+        return queue(client, credited_, clientCount, now, send);
+    }
+
+    // Sends what the connection takes right away and keeps the rest behind
+    // anything already waiting, so replies stay in stream order
+    template <typename Send>
+    ClientDrop queue(SenderClient& client, const std::string& data, size_t clientCount, uint64_t now, Send&& send) {
+        if (data.empty()) return ClientDrop::None;
+        client.watch.sent(now);
+
+        size_t offset = 0;
+        if (client.backlog.empty()) {
+            long sent = send(data.data(), data.size());
+            if (sent < 0) {
+                return ClientDrop::Failed;
+            }
+            offset = (size_t)sent;
+            if (offset == data.size()) {
+                return ClientDrop::None;
+            }
+            client.watch.progressed(now);   // The stall clock starts with the first unsent byte
+        }
+
+        // Unsent bytes and events held for credit share the client's part of the budget
+        if (client.backlog.size() + heldBytes(client) + (data.size() - offset) >
+            fanout_.budget().clientLimit(clientCount)) {
+            return ClientDrop::OverBudget;
+        }
+        client.backlog.append(data, offset, std::string::npos);
+        return ClientDrop::None;
+    }
+
+    // Offers the backlog to the connection again; false if it failed
+    template <typename Send>
+    bool flush(SenderClient& client, uint64_t now, Send&& send) {
+        long sent = send(client.backlog.data(), client.backlog.size());
+        if (sent < 0) {
+            return false;
+        }
+        if (sent > 0) {
+            client.backlog.erase(0, (size_t)sent);
+            client.watch.progressed(now);
+        }
+        return true;
+    }
+
+    // Retries unsent bytes, checks the client's memory share and timeouts
+    // and sends a heartbeat when one is due; adds the client to pass
+    template <typename Send>
+    ClientDrop service(SenderClient& client, size_t clientCount, uint64_t now, SenderPass& pass, Send&& send) {
+        if (!client.backlog.empty() && !flush(client, now, send)) {
+            return ClientDrop::Failed;
+        }
+
+        // Shares shrink as clients join
+        if (client.backlog.size() + heldBytes(client) > fanout_.budget().clientLimit(clientCount)) {
+            return ClientDrop::OverBudget;
+        }
+
+        ClientCheck check = client.watch.check(now, !client.backlog.empty(), timeouts_);
+        if (check == ClientCheck::WriteStalled) return ClientDrop::WriteStalled;
+        if (check == ClientCheck::Silent) return ClientDrop::Silent;
+        if (check == ClientCheck::Heartbeat) {
+            std::string heartbeat;
+            fanout_.encodeHeartbeat(client.stream.format, heartbeat);
+            pass.heartbeats++;
+            ClientDrop drop = queue(client, heartbeat, clientCount, now, send);
+            if (drop != ClientDrop::None) return drop;
+        }
+        pass.backlogged = pass.backlogged || !client.backlog.empty();
+        pass.backlogBytes += client.backlog.size();
+        pass.heldBytes += heldBytes(client);
+        return ClientDrop::None;
+    }
+
+    // Whether the client's timer must be scheduled again, for watchAt: its
+    // next heartbeat or timeout (ClientWatch::nextCheck) moved earlier than
+    // the timer. One that moved later lets the timer fire early, and the
+    // owner schedules it again after service(). A fired timer leaves
+    // watchAt at UINT64_MAX.
+    bool rewatch(SenderClient& client) const {
+        uint64_t due = client.watch.nextCheck(!client.backlog.empty(), timeouts_);
+        if (due >= client.watchAt) return false;
+        client.watchAt = due;
+        return true;
+    }
+
+    // Reports a finished service pass, after the drops, to the memory budget
+    void report(const SenderPass& pass, size_t clientCount);
+
+    // Why the client is dropped, for the log
+    std::string describe(ClientDrop drop, const SenderClient& client, size_t clientCount) const;
+
+private:
+    static size_t heldBytes(const SenderClient& client) { return client.stream.credit.held().size() * sizeof(InputEvent); }
+
+    StreamFanout& fanout_;
+    ClientTimeouts timeouts_;
+    std::string credited_;              // Reused encode buffer for credit clients
+    std::vector<size_t> recordEnds_[STREAM_FORMAT_COUNT];     // Of the last batch, if counted
+};
@@ -0,0 +1,120 @@
+// task_pool.cpp - Work-stealing pool implementation
+#include "task_pool.h"
+#include <algorithm>
+#include <cstdint>
+
+// Index of the pool worker running on this thread, or SIZE_MAX elsewhere
+static thread_local size_t t_workerIndex = SIZE_MAX;
+
+void TaskPool::start(size_t workerCount) {
+    if (!workers_.empty()) return;   // Workers are created once per process
+    if (workerCount == 0) {
+        workerCount = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency() / 2), 4);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+        stopping_ = false;
+    }
+    for (size_t i = 0; i < workerCount; ++i) {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    accepting_ = true;
+    for (size_t i = 0; i < workerCount; ++i) {
+        workers_[i]->thread = std::thread(&TaskPool::workerLoop, this, i);
+    }
+}
+
+void TaskPool::stop() {
+    if (!accepting_) return;
+
+    // Once every deque lock has been taken with accepting_ cleared, no
+    // submit() can still be pushing
+    accepting_ = false;
+    for (auto& worker : workers_) {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+
+    for (auto& worker : workers_) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+    // workers_ stays, so a submit() racing with stop still indexes valid deques
+}
+
+bool TaskPool::submit(Task task) {
+    if (!accepting_) return false;
+
+    size_t index = t_workerIndex;
+    if (index >= workers_.size()) {
+        index = nextWorker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+    }
+    {
+        Worker& worker = *workers_[index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (!accepting_) return false;
+        worker.tasks.push_back(std::move(task));
+        queued_.fetch_add(1);
+    }
+    wakeOne();
+    return true;
+}
+
+void TaskPool::wakeOne() {
+    // Taking the lock orders the push before a sleeper's predicate check
+    { std::lock_guard<std::mutex> lock(sleepMutex_); }
+    wake_.notify_one();
+}
+
+bool TaskPool::popLocal(size_t index, Task& task) {
+    Worker& worker = *workers_[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.tasks.empty()) return false;
+    task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    return true;
+}
+
+bool TaskPool::steal(size_t thief, Task& task) {
+    for (size_t offset = 1; offset < workers_.size(); ++offset) {
+        Worker& victim = *workers_[(thief + offset) % workers_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskPool::workerLoop(size_t index) {
+    t_workerIndex = index;
+
+    while (true) {
+        Task task;
+        if (popLocal(index, task) || steal(index, task)) {
+            queued_.fetch_sub(1);
+            try {
+                task();
+            } catch (...) {
+                // A failing job must not take the worker down
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex_);
+        wake_.wait(lock, [this] { return queued_.load() > 0 || stopping_; });
+        if (stopping_ && queued_.load() == 0) {
+            break;
+        }
+    }
+
+    t_workerIndex = SIZE_MAX;
+}
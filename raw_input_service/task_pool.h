@@ -0,0 +1,65 @@
+// task_pool.h - Work-stealing pool for background service work
+//
+// Each worker owns a deque. A worker pops its own newest task first and,
+// when its deque is empty, steals the oldest task from another worker.
+// Jobs submitted from outside the pool are spread round-robin over the
+// deques; jobs a task submits stay on its own worker's deque.
+//
+// submit() only takes one deque lock for a push and never waits for a job
+// to run, so the capture and sender threads can hand work off safely.
+// Jobs must not block on those threads either.
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskPool {
+public:
+    using Task = std::function<void()>;
+
+    static TaskPool& instance() {
+        static TaskPool inst;
+        return inst;
+    }
+
+    // workerCount 0 picks from the core count (1 to 4 workers). The pool
+    // runs once per process; start() after stop() does nothing.
+    void start(size_t workerCount = 0);
+
+    // Runs every queued task, then joins the workers
+    void stop();
+
+    // False once the pool is stopped (or before it started); the caller
+    // then runs the job itself or drops it
+    bool submit(Task task);
+
+    size_t workerCount() const { return workers_.size(); }
+
+private:
+    TaskPool() : accepting_(false), nextWorker_(0), queued_(0), stopping_(false) {}
+    ~TaskPool() { stop(); }
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;         // Guarded by mutex; owner uses the back
+        std::thread thread;
+    };
+
+    void workerLoop(size_t index);
+    bool popLocal(size_t index, Task& task);
+    bool steal(size_t thief, Task& task);
+    void wakeOne();
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<bool> accepting_;
+    std::atomic<size_t> nextWorker_;
+    std::atomic<size_t> queued_;        // Tasks pushed and not popped yet
+    std::mutex sleepMutex_;
+    std::condition_variable wake_;
+    bool stopping_;                     // Guarded by sleepMutex_
+};
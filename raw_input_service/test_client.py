@@ -41,18 +41,31 @@ def main():
                             device_id = event.get('device_id', 'unknown')
                             event_type = event.get('type', 'unknown')
                             timestamp = event.get('timestamp', 0)
+                            # Flag 1: replayed by a macro rather than typed
+                            source = " (macro)" if event.get('flags', 0) & 1 else ""
                             
                             if event_type == 'keyboard':
                                 vkey = event.get('vkey', 0)
-                                # Try to get key name
-                                key_name = chr(vkey) if 32 <= vkey <= 126 else f"VK_{vkey}"
-                                print(f"[{timestamp}] KEYBOARD {device_id}: Key={key_name} (VK={vkey})")
+                                char_code = event.get('char', 0)
+                                # The typed character if any, else the key code
+                                key_name = repr(chr(char_code)) if char_code else f"VK_{vkey}"
+                                print(f"[{timestamp}] KEYBOARD{source} {device_id}: Key={key_name} (VK={vkey} scan={event.get('scan', 0):#x} mods={event.get('mods', 0):#x})")
                             
                             elif event_type == 'mouse':
                                 dx = event.get('dx', 0)
                                 dy = event.get('dy', 0)
                                 buttons = event.get('buttons', 0)
-                                print(f"[{timestamp}] MOUSE {device_id}: dx={dx:+4d} dy={dy:+4d} buttons={buttons}")
+                                print(f"[{timestamp}] MOUSE{source} {device_id}: dx={dx:+4d} dy={dy:+4d} buttons={buttons}")
+                            
+                            elif event_type == 'cursor':
+                                x = event.get('x', 0)
+                                y = event.get('y', 0)
+                                abs_x = event.get('abs_x', 0)
+                                abs_y = event.get('abs_y', 0)
+                                print(f"[{timestamp}] CURSOR {device_id}: x={x} y={y} abs={abs_x},{abs_y}")
+                            
+                            elif event_type == 'hotkey':
+                                print(f"[{timestamp}] HOTKEY {device_id}: {event.get('hotkey', 0)}")
                             
                             else:
                                 print(f"[{timestamp}] UNKNOWN: {line}")
@@ -0,0 +1,28 @@
+// check.h - Minimal assertions for the tests in this directory
+//
+// CHECK records a failure with its location and carries on, so one run
+// reports every broken expectation. A test's main() returns
+// checkResult(), which ctest reads as pass (0) or fail.
+#pragma once
+#include <cstdio>
+
+inline int& checkFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            checkFailures()++; \
+        } \
+    } while (0)
+
+inline int checkResult() {
+    if (checkFailures() > 0) {
+        std::printf("%d checks failed\n", checkFailures());
+        return 1;
+    }
+    return 0;
+}
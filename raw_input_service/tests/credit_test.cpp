@@ -0,0 +1,88 @@
+// credit_test.cpp - What CreditQueue holds for a client without credit
+//
+// Feeds a queue that never gets credit with event mixes that split held
+// motion and checks that it holds no more than its limit plus one motion
+// event per device and flags, and that the motion still adds up.
+#include "check.h"
+#include "credit_queue.h"
+
+constexpr size_t LIMIT = 64;
+
+static InputEvent mouseEvent(const char* device, int dx, int buttons) {
+    InputEvent event = {};
+    setDeviceId(event, device, 4);
+    event.type = DeviceType::Mouse;
+    event.data.mouse.dx = dx;
+    event.data.mouse.buttons = buttons;
+    return event;
+}
+
+static InputEvent keyEvent(const char* device, int vkey) {
+    InputEvent event = {};
+    setDeviceId(event, device, 4);
+    event.type = DeviceType::Keyboard;
+    event.data.keyboard.vkey = vkey;
+    return event;
+}
+
+static CreditQueue withoutCredit() {
+    CreditQueue queue;
+    queue.grant(0);
+    queue.setHoldLimit(LIMIT);
+    return queue;
+}
+
+static int64_t heldDx(const CreditQueue& queue) {
+    int64_t dx = 0;
+    for (const InputEvent& event : queue.held()) {
+        if (event.type == DeviceType::Mouse) dx += event.data.mouse.dx;
+    }
+    return dx;
+}
+
+int main() {
+    auto ignore = [](const InputEvent&) {};
+
+    // Button changes and motion from one mouse, alternating
+    CreditQueue buttons = withoutCredit();
+    for (int i = 0; i < 10000; ++i) {
+        buttons.offer(mouseEvent("ms0", 0, 1), ignore);
+        buttons.offer(mouseEvent("ms0", 1, 0), ignore);
+    }
+    CHECK(buttons.held().size() <= LIMIT + 1);
+    CHECK(buttons.dropped() > 0);
+    CHECK(heldDx(buttons) == 10000);
+
+    // Keys from a keyboard between motion from two mice
+    CreditQueue mixed = withoutCredit();
+    for (int i = 0; i < 10000; ++i) {
+        mixed.offer(keyEvent("kb0", 0x41), ignore);
+        mixed.offer(mouseEvent("ms0", 1, 0), ignore);
+        mixed.offer(mouseEvent("ms1", 0, 2), ignore);
+        mixed.offer(mouseEvent("ms1", 2, 0), ignore);
+    }
+    CHECK(mixed.held().size() <= LIMIT + 2);
+    CHECK(heldDx(mixed) == 30000);
+
+    // Real and replayed motion from one mouse, alternating
+    CreditQueue replayed = withoutCredit();
+    for (int i = 0; i < 10000; ++i) {
+        replayed.offer(mouseEvent("ms0", 1, 0), ignore);
+        InputEvent synthetic = mouseEvent("ms0", 2, 0);
+        synthetic.flags = EVENT_FLAG_SYNTHETIC;
+        replayed.offer(synthetic, ignore);
+    }
+    CHECK(replayed.held().size() == 2);
+    CHECK(heldDx(replayed) == 30000);
+    CHECK(replayed.held()[0].flags != replayed.held()[1].flags);
+
+    // Released events make room for keys again, within the same bound
+    mixed.grant(LIMIT / 2);
+    CHECK(mixed.release(ignore) == LIMIT / 2);
+    for (int i = 0; i < 1000; ++i) {
+        mixed.offer(mouseEvent("ms1", 0, 2), ignore);
+        mixed.offer(mouseEvent("ms1", 1, 0), ignore);
+    }
+    CHECK(mixed.held().size() <= LIMIT + 2);
+    return checkResult();
+}
@@ -0,0 +1,157 @@
+// cursor_test.cpp - CursorEngine ballistics, clamping, publishing and hand-off
+//
+// The curve table interpolates between its points and is flat outside
+// them; a report moves the cursor by the gain for its speed. Cursors stop
+// at their screen's edges, and a cursor event goes out only when the
+// cursor reaches another pixel. save() and restore() carry sub-pixel
+// positions into a new engine, which skips positions off the new screen
+// and rejects malformed state.
+#include "check.h"
+#include "cursor.h"
+#include <cmath>
+#include <cstring>
+
+static const CursorScreen DESKTOP{ 0, 0, 1000, 1000 };
+
+static bool near(double a, double b) { return std::fabs(a - b) < 1e-4; }
+
+// Users u (mouse ms0) and v (mouse ms1), with the cursor file rules
+static void configure(CursorEngine& cursors, const std::string& rules) {
+    UserDevices users;
+    CursorConfig config;
+    std::string error;
+    CHECK(UserDevices::parse("u device ms0\nv device ms1\n", users, error));
+    CHECK(CursorConfig::parse(rules, users, config, error));
+    cursors.configure(config, DESKTOP);
+}
+
+static InputEvent motion(const char* device, int dx, int dy) {
+    InputEvent event = {};
+    setDeviceId(event, device, std::strlen(device));
+    event.type = DeviceType::Mouse;
+    event.data.mouse.dx = dx;
+    event.data.mouse.dy = dy;
+    return event;
+}
+
+// The cursor events of one batch holding a single report
+static std::vector<InputEvent> move(CursorEngine& cursors, const char* device, int dx, int dy) {
+    InputEvent event = motion(device, dx, dy);
+    std::vector<InputEvent> moved;
+    cursors.update(&event, 1, moved);
+    return moved;
+}
+
+static bool at(const std::vector<InputEvent>& moved, const char* user, int x, int y) {
+    return moved.size() == 1 && std::strcmp(moved[0].device_id, user) == 0 && moved[0].type == DeviceType::Cursor &&
+           moved[0].data.cursor.x == x && moved[0].data.cursor.y == y;
+}
+
+static void testCurve() {
+    CursorCurve curve({ { 0, 1.0 }, { 4, 1.0 }, { 16, 2.0 }, { 40, 3.0 } });
+    CHECK(near(curve.gain(0), 1.0));
+    CHECK(near(curve.gain(4), 1.0));
+    CHECK(near(curve.gain(10), 1.5));
+    CHECK(near(curve.gain(16), 2.0));
+    CHECK(near(curve.gain(28), 2.5));
+    CHECK(near(curve.gain(40), 3.0));
+    CHECK(near(curve.gain(63), 3.0));
+    CHECK(near(curve.gain(1000), 3.0));
+    // Between two table entries: 1.5 at 10, 1.5833 at 11
+    CHECK(near(curve.gain(10.5f), 1.5 + (1.0 / 12) / 2));
+
+    // Flat before the first point, and the default is a gain of 1
+    CursorCurve late({ { 8, 2.0 }, { 16, 4.0 } });
+    CHECK(near(late.gain(0), 2.0));
+    CHECK(near(late.gain(12), 3.0));
+    CHECK(near(CursorCurve().gain(20), 1.0));
+
+    // One report of speed 10 moves 15 pixels, of speed 5 (3, 4) by 1.0833
+    CursorEngine cursors;
+    configure(cursors, "* curve 0 1.0  4 1.0  16 2.0  40 3.0\n");
+    CHECK(at(move(cursors, "ms0", 10, 0), "u", 515, 500));
+    CHECK(at(move(cursors, "ms0", 3, 4), "u", 518, 504));
+}
+
+static void testClamping() {
+    CursorEngine cursors;
+    configure(cursors, "u screen 100 200 300 100\n");
+    CHECK(at(move(cursors, "ms0", -1000, -1000), "u", 100, 200));
+    CHECK(at(move(cursors, "ms0", 1000, 0), "u", 399, 200));
+    CHECK(at(move(cursors, "ms0", 0, 1000), "u", 399, 299));
+    CHECK(move(cursors, "ms0", 5, 5).empty());              // Pinned in the corner
+
+    // v has no screen of its own and gets the whole desktop
+    CHECK(at(move(cursors, "ms1", 2000, -2000), "v", 999, 0));
+    std::vector<InputEvent> moved = move(cursors, "ms1", -2000, 2000);
+    CHECK(at(moved, "v", 0, 999));
+    CHECK(moved.size() == 1 && moved[0].data.cursor.abs_x == 32 && moved[0].data.cursor.abs_y == 65503);
+}
+
+static void testPublishing() {
+    CursorEngine cursors;
+    configure(cursors, "* curve 0 0.25\n");
+    CHECK(at(move(cursors, "ms0", 1, 0), "u", 500, 500));   // First move: 500.25
+    CHECK(move(cursors, "ms0", 1, 0).empty());
+    CHECK(move(cursors, "ms0", 1, 0).empty());
+    CHECK(at(move(cursors, "ms0", 1, 0), "u", 501, 500));
+    CHECK(move(cursors, "ms0", 0, 0).empty());
+    CHECK(move(cursors, "mouse9", 40, 40).empty());         // No user's mouse
+
+    // Several reports in a batch give one event per user that moved
+    InputEvent batch[] = { motion("ms0", 8, 0), motion("ms1", 0, 8), motion("ms0", 8, 0), motion("kb0", 0, 0) };
+    batch[3].type = DeviceType::Keyboard;
+    batch[1].timestamp = 7;
+    batch[2].timestamp = 9;
+    std::vector<InputEvent> moved;
+    cursors.update(batch, 4, moved);
+    CHECK(moved.size() == 2);
+    CHECK(moved.size() == 2 && std::strcmp(moved[0].device_id, "u") == 0 && moved[0].data.cursor.x == 505 &&
+          moved[0].timestamp == 9);
+    CHECK(moved.size() == 2 && std::strcmp(moved[1].device_id, "v") == 0 && moved[1].data.cursor.y == 502 &&
+          moved[1].timestamp == 7);
+}
+
+static void testSaveRestore() {
+    CursorEngine cursors;
+    configure(cursors, "* curve 0 0.25\n");
+    move(cursors, "ms0", 10, -6);                           // u at 502.5, 498.5
+    move(cursors, "ms1", -1, 0);                            // v at 499.75, 500
+    std::string saved;
+    cursors.save(saved);
+
+    // Same rules: both go on from the sub-pixel position, without
+    // republishing the pixel the old engine published
+    CursorEngine next;
+    configure(next, "* curve 0 0.25\n");
+    const uint8_t* in = (const uint8_t*)saved.data();
+    CHECK(next.restore(in, in + saved.size()));
+    CHECK(in == (const uint8_t*)saved.data() + saved.size());
+    CHECK(move(next, "ms0", 1, 1).empty());                 // 502.75, 498.75
+    CHECK(at(move(next, "ms0", 1, 1), "u", 503, 499));
+    CHECK(at(move(next, "ms1", 1, 0), "v", 500, 500));
+
+    // v's new screen does not hold the saved position, so v starts over
+    CursorEngine moved;
+    configure(moved, "* curve 0 0.25\nv screen 600 600 200 200\n");
+    in = (const uint8_t*)saved.data();
+    CHECK(moved.restore(in, in + saved.size()));
+    CHECK(at(move(moved, "ms0", 2, 0), "u", 503, 498));
+    CHECK(at(move(moved, "ms1", 2, 0), "v", 700, 700));
+
+    // Cut anywhere, the state is malformed
+    for (size_t cut = 0; cut < saved.size(); ++cut) {
+        CursorEngine broken;
+        configure(broken, "");
+        in = (const uint8_t*)saved.data();
+        CHECK(!broken.restore(in, in + cut));
+    }
+}
+
+int main() {
+    testCurve();
+    testClamping();
+    testPublishing();
+    testSaveRestore();
+    return checkResult();
+}
@@ -0,0 +1,180 @@
+// desktop_layout_test.cpp - DesktopLayout lookups, absolute coordinates and
+// cursors crossing monitors
+//
+// monitorAt() agrees with a linear search over the monitors at every pixel
+// of a layout with gaps, mixed heights and negative coordinates, around it,
+// and at random points of random layouts. normalize() gives
+// floor((offset + 0.5) * 65536 / extent) for every pixel of every extent
+// from 1 to 32768, and scaling the result back lands on the same pixel. A
+// cursor crosses to a neighbour along a shared edge and takes on its DPI
+// scale; past a shorter neighbour, into a gap or onto a monitor not its
+// user's, it stops at the edge and slides along it.
+#include "check.h"
+#include "cursor.h"
+#include <cstring>
+#include <random>
+
+static MonitorRect monitorRect(int left, int top, int width, int height, float scale = 1.0f) {
+    MonitorRect monitor;
+    monitor.left = left;
+    monitor.top = top;
+    monitor.width = width;
+    monitor.height = height;
+    monitor.scale = scale;
+    return monitor;
+}
+
+static uint8_t linearMonitorAt(const std::vector<MonitorRect>& monitors, int x, int y) {
+    for (size_t index = 0; index < monitors.size(); ++index) {
+        if (monitors[index].contains(x, y)) return (uint8_t)index;
+    }
+    return LAYOUT_NO_MONITOR;
+}
+
+static void testMonitorAt() {
+    // Left of the primary and above it, a gap, then a short one and a tall one
+    std::vector<MonitorRect> monitors = {
+        monitorRect(0, 0, 1920, 1080), monitorRect(-1280, -224, 1280, 1024, 1.25f),
+        monitorRect(1920, 300, 1024, 768), monitorRect(3044, -600, 1080, 1920, 1.5f),
+        monitorRect(0, 1080, 800, 600, 2.0f),
+    };
+    std::string error;
+    CHECK(DesktopLayout::validate(monitors, error));
+    DesktopLayout layout;
+    layout.build(monitors);
+    const MonitorRect& bounds = layout.bounds();
+    CHECK(bounds.left == -1280 && bounds.top == -600 && bounds.right() == 4124 && bounds.bottom() == 1680);
+
+    size_t mismatches = 0;
+    for (int y = bounds.top - 2; y < bounds.bottom() + 2; ++y) {
+        for (int x = bounds.left - 2; x < bounds.right() + 2; ++x) {
+            if (layout.monitorAt(x, y) != linearMonitorAt(monitors, x, y)) ++mismatches;
+        }
+    }
+    CHECK(mismatches == 0);
+    CHECK(layout.monitorAt(3000, 500) == LAYOUT_NO_MONITOR);   // In the gap
+    CHECK(layout.monitorAt(INT32_MIN, INT32_MAX) == LAYOUT_NO_MONITOR);
+
+    // Random layouts of up to 8 monitors that pass validate()
+    std::mt19937 random(72);
+    for (int round = 0; round < 200; ++round) {
+        std::vector<MonitorRect> placed;
+        for (int attempt = 0; attempt < 40 && placed.size() < 8; ++attempt) {
+            MonitorRect monitor = monitorRect((int)(random() % 6000) - 3000, (int)(random() % 4000) - 2000,
+                                              1 + (int)(random() % 2500), 1 + (int)(random() % 1600));
+            placed.push_back(monitor);
+            if (!DesktopLayout::validate(placed, error)) placed.pop_back();
+        }
+        layout.build(placed);
+        const MonitorRect& box = layout.bounds();
+        for (int point = 0; point < 2000; ++point) {
+            int x = box.left - 5 + (int)(random() % (uint32_t)(box.width + 10));
+            int y = box.top - 5 + (int)(random() % (uint32_t)(box.height + 10));
+            if (layout.monitorAt(x, y) != linearMonitorAt(placed, x, y)) ++mismatches;
+        }
+        // Every monitor's corners are its own
+        for (size_t index = 0; index < placed.size(); ++index) {
+            const MonitorRect& monitor = placed[index];
+            if (layout.monitorAt(monitor.left, monitor.top) != index ||
+                layout.monitorAt(monitor.right() - 1, monitor.bottom() - 1) != index) {
+                ++mismatches;
+            }
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+// Every pixel of a one-row desktop of each width, offset from the origin;
+// heights go through the same code. The expected value is kept as a
+// running quotient and remainder.
+static void testNormalize() {
+    size_t wrong = 0;
+    DesktopLayout layout;
+    for (int extent = 1; extent <= LAYOUT_EXTENT_MAX; ++extent) {
+        const int left = -(extent / 2);
+        const int top = extent / 3;
+        layout.build({ monitorRect(left, top, extent, 1) });
+        // floor((2 * offset + 1) * 32768 / extent), stepping offset by one
+        uint64_t quotient = 32768 / (uint64_t)extent;
+        uint64_t remainder = 32768 % (uint64_t)extent;
+        const uint64_t stepQuotient = 65536 / (uint64_t)extent;
+        const uint64_t stepRemainder = 65536 % (uint64_t)extent;
+        for (int offset = 0; offset < extent; ++offset) {
+            uint16_t absX, absY;
+            layout.normalize(left + offset, top, absX, absY);
+            // Scaled back, as SendInput does, the result is the same pixel
+            if (absX != quotient || (int)(((uint64_t)absX * (uint64_t)extent) >> 16) != offset) {
+                ++wrong;
+            }
+            quotient += stepQuotient;
+            remainder += stepRemainder;
+            if (remainder >= (uint64_t)extent) {
+                ++quotient;
+                remainder -= (uint64_t)extent;
+            }
+        }
+    }
+    CHECK(wrong == 0);
+}
+
+// Users u (mouse ms0), on every monitor, and w (mouse ms1), on monitor 0 only
+static void configureCursors(CursorEngine& cursors) {
+    UserDevices users;
+    CursorConfig config;
+    std::string error;
+    CHECK(UserDevices::parse("u device ms0\nw device ms1\n", users, error));
+    CHECK(CursorConfig::parse("* monitor 0 0 1000 800\n"
+                              "* monitor 1000 0 1000 600 2\n"       // Shorter, at 200%
+                              "* monitor 2100 0 500 500\n"          // Past a 100-pixel gap
+                              "w monitors 0\n",
+                              users, config, error));
+    cursors.configure(config, CursorScreen{ 0, 0, 2600, 800 });
+}
+
+// Where a report of dx, dy takes the mouse's cursor; INT32_MIN if it did
+// not reach another pixel
+static std::pair<int, int> move(CursorEngine& cursors, const char* device, int dx, int dy) {
+    InputEvent event = {};
+    setDeviceId(event, device, std::strlen(device));
+    event.type = DeviceType::Mouse;
+    event.data.mouse.dx = dx;
+    event.data.mouse.dy = dy;
+    std::vector<InputEvent> moved;
+    cursors.update(&event, 1, moved);
+    if (moved.size() != 1) return { INT32_MIN, INT32_MIN };
+    return { moved[0].data.cursor.x, moved[0].data.cursor.y };
+}
+
+static void testEdgeCrossing() {
+    CursorEngine cursors;
+    configureCursors(cursors);
+    using Point = std::pair<int, int>;
+
+    // u starts in the middle of the desktop, on monitor 1 at 200%
+    CHECK(move(cursors, "ms0", -50, 0) == Point(1200, 400));
+    CHECK(move(cursors, "ms0", -200, 0) == Point(800, 400));       // Crossed onto monitor 0
+    CHECK(move(cursors, "ms0", 10, 0) == Point(810, 400));         // At 100% now
+    CHECK(move(cursors, "ms0", 0, 300) == Point(810, 700));
+
+    // Below monitor 1's bottom edge it stops and slides along monitor 0's
+    CHECK(move(cursors, "ms0", 1000, 0) == Point(999, 700));
+    CHECK(move(cursors, "ms0", 40, -100) == Point(999, 600));
+    CHECK(move(cursors, "ms0", 1, -1) == Point(1000, 599));         // Shared edge: crosses
+
+    // Into the gap before monitor 2 it stops at monitor 1's right edge
+    CHECK(move(cursors, "ms0", 100, 0) == Point(1200, 599));
+    CHECK(move(cursors, "ms0", 420, -50) == Point(1999, 499));
+    CHECK(move(cursors, "ms0", 20, 0) == Point(INT32_MIN, INT32_MIN));
+
+    // w may not enter monitor 1, even across the shared edge
+    CHECK(move(cursors, "ms1", 1000, 0) == Point(999, 400));
+    CHECK(move(cursors, "ms1", 1, 0) == Point(INT32_MIN, INT32_MIN));
+    CHECK(move(cursors, "ms1", -999, 500) == Point(0, 799));
+}
+
+int main() {
+    testMonitorAt();
+    testNormalize();
+    testEdgeCrossing();
+    return checkResult();
+}
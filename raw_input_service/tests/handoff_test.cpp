@@ -0,0 +1,235 @@
+// handoff_test.cpp - Hand-off state and sockets between two processes
+//
+// The parent plays the old service: it serves one TCP client, sends its
+// state over an AF_UNIX socket pair and closes its own descriptors. The
+// forked child plays the new one: it checks the state it reads, then
+// writes to the adopted client and accepts a new client on the adopted
+// listening socket. The client must stay connected throughout. A cursor
+// moved in the parent goes on from the same position in the child, and a
+// macro recorded in the parent is there in the child.
+#include "check.h"
+#include "cursor.h"
+#include "handoff_channel.h"
+#include "macro.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstring>
+
+static InputEvent keyEvent(uint64_t seq, int vkey) {
+    InputEvent event = {};
+    setDeviceId(event, "0x1A2B3C", 8);
+    event.type = DeviceType::Keyboard;
+    event.data.keyboard.vkey = vkey;
+    event.timestamp = 1700000000000ull + seq;
+    event.seq = seq;
+    return event;
+}
+
+// User u's cursor, driven by mouse ms0, on a 1000x1000 desktop with a gain of 1
+static void configureCursors(CursorEngine& cursors) {
+    UserDevices users;
+    CursorConfig config;
+    std::string error;
+    CHECK(UserDevices::parse("u device ms0\n", users, error));
+    CHECK(CursorConfig::parse("u screen 0 0 1000 1000\n", users, config, error));
+    cursors.configure(config, CursorScreen{ 0, 0, 1000, 1000 });
+}
+
+// The cursor event after moving ms0 by dx, dy
+static InputEvent moveCursor(CursorEngine& cursors, int dx, int dy) {
+    InputEvent event = {};
+    setDeviceId(event, "ms0", 3);
+    event.type = DeviceType::Mouse;
+    event.data.mouse.dx = dx;
+    event.data.mouse.dy = dy;
+    std::vector<InputEvent> moved;
+    cursors.update(&event, 1, moved);
+    return moved.empty() ? InputEvent{} : moved.back();
+}
+
+static void configureMacros(MacroEngine& macros) {
+    UserDevices users;
+    MacroConfig config;
+    std::string error;
+    CHECK(UserDevices::parse("u device ms0\n", users, error));
+    CHECK(MacroConfig::parse("u record 1 100\n", users, config, error));
+    macros.configure(config);
+}
+
+static InputEvent hotkeyEvent(uint16_t id) {
+    InputEvent event = {};
+    setDeviceId(event, "ms0", 3);
+    event.type = DeviceType::Hotkey;
+    event.data.hotkey.id = id;
+    return event;
+}
+
+// Both engines' state, the way the service hands it off
+static std::string saveStages(CursorEngine& cursors, MacroEngine& macros) {
+    std::string stages;
+    cursors.save(stages);
+    macros.save(stages);
+    return stages;
+}
+
+static HandoffState sampleState() {
+    HandoffState state;
+    state.nextSeq = 42;
+    state.lastSentSeq = 39;
+    state.cut.tick = 123456;
+    state.cut.count = 3;
+    HandoffClient client;
+    client.format = StreamFormat::Compact;
+    client.partial = "cred";
+    client.backlog = std::string("\x01\x02\x00\x03", 4);
+    client.credited = true;
+    client.credits = 7;
+    client.held = { keyEvent(38, 0x41), keyEvent(39, 0x42) };
+    state.clients.push_back(client);
+    state.history = { keyEvent(37, 0x43), keyEvent(38, 0x41), keyEvent(39, 0x42) };
+    state.pending = { keyEvent(40, 0x44), keyEvent(41, 0x45) };
+    // The cursor starts in the middle of its screen
+    CursorEngine cursors;
+    configureCursors(cursors);
+    InputEvent moved = moveCursor(cursors, 100, 50);
+    CHECK(moved.type == DeviceType::Cursor && moved.data.cursor.x == 600 && moved.data.cursor.y == 550);
+    // Macro 1 holds one mouse event
+    MacroEngine macros;
+    configureMacros(macros);
+    InputEvent recorded[] = { hotkeyEvent(100), InputEvent{}, hotkeyEvent(100) };
+    setDeviceId(recorded[1], "ms0", 3);
+    recorded[1].type = DeviceType::Mouse;
+    recorded[1].data.mouse.dx = 7;
+    CHECK(macros.process(recorded, 3) == 1);
+    state.stages = saveStages(cursors, macros);
+    return state;
+}
+
+static bool sameEvents(const std::vector<InputEvent>& a, const std::vector<InputEvent>& b) {
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(InputEvent)) == 0;
+}
+
+static bool readLine(int fd, const char* expected) {
+    char buffer[64] = {};
+    size_t length = std::strlen(expected);
+    size_t got = 0;
+    while (got < length) {
+        ssize_t n = recv(fd, buffer + got, length - got, 0);
+        if (n <= 0) return false;
+        got += (size_t)n;
+    }
+    return std::memcmp(buffer, expected, length) == 0;
+}
+
+static void setTimeout(int fd) {
+    timeval timeout = { 5, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// The new process
+static int adopt(int channelFd) {
+    HandoffChannel channel(channelFd);
+    HandoffState expected = sampleState();
+    HandoffState state;
+    CHECK(readHandoffState(channel, state));
+    CHECK(state.listenSocket != HANDOFF_NO_SOCKET);
+    CHECK(state.nextSeq == expected.nextSeq && state.lastSentSeq == expected.lastSentSeq);
+    CHECK(state.cut.tick == expected.cut.tick && state.cut.count == expected.cut.count);
+    CHECK(sameEvents(state.history, expected.history));
+    CHECK(sameEvents(state.pending, expected.pending));
+    CHECK(state.stages == expected.stages);
+
+    CursorEngine cursors;
+    MacroEngine macros;
+    configureCursors(cursors);
+    configureMacros(macros);
+    const uint8_t* in = (const uint8_t*)state.stages.data();
+    const uint8_t* end = in + state.stages.size();
+    CHECK(cursors.restore(in, end) && macros.restore(in, end) && in == end);
+    CHECK(saveStages(cursors, macros) == state.stages);
+    InputEvent moved = moveCursor(cursors, 1, 0);
+    CHECK(moved.type == DeviceType::Cursor && moved.data.cursor.x == 601 && moved.data.cursor.y == 550);
+    CHECK(state.clients.size() == 1);
+    if (state.clients.size() != 1) return checkResult();
+
+    const HandoffClient& client = state.clients[0];
+    const HandoffClient& sent = expected.clients[0];
+    CHECK(client.socket != HANDOFF_NO_SOCKET);
+    CHECK(client.format == sent.format && client.partial == sent.partial && client.backlog == sent.backlog);
+    CHECK(client.credited && client.credits == sent.credits);
+    CHECK(sameEvents(client.held, sent.held));
+
+    uint8_t ack = 1;
+    std::vector<InputEvent> published;
+    CHECK(channel.write(&ack, 1));
+    CHECK(readHandoffEvents(channel, published));
+    CHECK(published.size() == 1 && published[0].seq == 42);
+
+    // The adopted client still talks to the process that accepted it
+    CHECK(send(client.socket, "adopted\n", 8, 0) == 8);
+    int second = accept(state.listenSocket, nullptr, nullptr);
+    CHECK(second >= 0);
+    if (second >= 0) {
+        CHECK(send(second, "welcome\n", 8, 0) == 8);
+        close(second);
+    }
+    closeHandoffSockets(state);
+    return checkResult();
+}
+
+int main() {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        std::perror("socketpair");
+        return 1;
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        close(pair[0]);
+        _exit(adopt(pair[1]));
+    }
+    close(pair[1]);
+
+    // Created after the fork, so the child only has what it is sent
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLength = sizeof(address);
+    CHECK(bind(listener, (sockaddr*)&address, sizeof(address)) == 0 && listen(listener, 4) == 0);
+    CHECK(getsockname(listener, (sockaddr*)&address, &addressLength) == 0);
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(connect(client, (sockaddr*)&address, sizeof(address)) == 0);
+    int served = accept(listener, nullptr, nullptr);
+    CHECK(served >= 0);
+    setTimeout(client);
+
+    HandoffState state = sampleState();
+    state.listenSocket = listener;
+    state.clients[0].socket = served;
+    HandoffChannel channel(pair[0]);
+    CHECK(writeHandoffState(channel, state));
+
+    // Closing without shutdown leaves the connection to the child
+    closeHandoffSockets(state);
+    uint8_t ack = 0;
+    CHECK(channel.read(&ack, 1) && ack == 1);
+    CHECK(writeHandoffEvents(channel, { keyEvent(42, 0x46) }));
+
+    CHECK(readLine(client, "adopted\n"));
+    int second = socket(AF_INET, SOCK_STREAM, 0);
+    setTimeout(second);
+    CHECK(connect(second, (sockaddr*)&address, sizeof(address)) == 0);
+    CHECK(readLine(second, "welcome\n"));
+    close(second);
+    close(client);
+
+    int status = 0;
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    close(pair[0]);
+    return checkResult();
+}
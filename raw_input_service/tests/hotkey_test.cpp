@@ -0,0 +1,211 @@
+// hotkey_test.cpp - Which hotkey files HotkeyTable accepts, and what
+// HotkeyStage makes of the keys typed
+//
+// Two chords from the same point of a user's sequences must not both be
+// typed by one key-down; build() refuses such files and accepts chords
+// that differ in a key both look at or are completed by different keys.
+// Keyboards come from the users file (user_rules.h), not the hotkey file.
+//
+// Through HotkeyStage, a chord fires only with exactly its modifiers held,
+// a sequence fires on its last step and starts over on a wrong key or
+// after HOTKEY_STEP_MS, and the auto-repeats and releases of the keys that
+// typed a step are dropped.
+#include "check.h"
+#include "hotkey.h"
+#include <initializer_list>
+
+static const char USERS[] = "u device 0x1\nv device 0x2\n";
+
+constexpr uint16_t SCAN_LSHIFT = 0x2A;
+constexpr uint16_t SCAN_CTRL = 0x1D;
+constexpr uint16_t SCAN_ALT = 0x38;
+
+static bool builds(const char* text) {
+    UserDevices users;
+    HotkeyConfig config;
+    HotkeyTable table;
+    std::string error;
+    return UserDevices::parse(USERS, users, error) &&
+           HotkeyConfig::parse(text, users, config, error) && table.build(config, error);
+}
+
+static void testTables() {
+    CHECK(builds("u hotkey 1 Ctrl+P\nu hotkey 2 Ctrl+Shift+P\nu hotkey 3 P\n"));
+    CHECK(builds("u hotkey 1 LCtrl+P\nu hotkey 2 LCtrl+Shift+P\n"));
+    CHECK(builds("u hotkey 1 Ctrl+P W\nu hotkey 2 Ctrl+P Q\n"));
+    CHECK(builds("u hotkey 1 Ctrl+Shift\nu hotkey 2 Ctrl+Shift+P\n"));
+    CHECK(builds("u hotkey 1 Ctrl+P\nv hotkey 2 LCtrl+P\n"));
+
+    // Both fire when Left Ctrl and P are held
+    CHECK(!builds("u hotkey 1 Ctrl+P\nu hotkey 2 LCtrl+P\n"));
+    CHECK(!builds("u hotkey 1 LCtrl+P\nu hotkey 2 RCtrl+P\n"));
+    CHECK(!builds("u hotkey 1 Ctrl+P W\nu hotkey 2 LCtrl+P Q\n"));
+    CHECK(!builds("u hotkey 1 Ctrl+Space W\nu hotkey 2 Ctrl+Space LCtrl+W\nu hotkey 3 Ctrl+Space Ctrl+W\n"));
+    // A "*" hotkey is every user's
+    CHECK(!builds("u hotkey 1 LAlt+F4\n* hotkey 2 Alt+F4\n"));
+    // Repeats and prefixes, as before
+    CHECK(!builds("u hotkey 1 Ctrl+P\nu hotkey 2 Ctrl+P\n"));
+    CHECK(!builds("u hotkey 1 Ctrl+P\nu hotkey 2 Ctrl+P W\n"));
+
+    // Devices come from the users file alone
+    CHECK(!builds("u device 0x3\nu hotkey 1 Ctrl+P\n"));
+    CHECK(!builds("w hotkey 1 Ctrl+P\n"));
+    UserDevices users;
+    std::string error;
+    CHECK(!UserDevices::parse("u device 0x1\nv device 0x1\n", users, error));
+}
+
+static InputEvent key(const char* device, int vkey, bool up, uint16_t scan = 0, uint64_t time = 0) {
+    InputEvent event = {};
+    setDeviceId(event, device, std::strlen(device));
+    event.type = DeviceType::Keyboard;
+    event.data.keyboard.vkey = vkey;
+    event.data.keyboard.scan = scan;
+    event.data.keyboard.up = up ? 1 : 0;
+    event.timestamp = time;
+    return event;
+}
+
+static InputEvent down(int vkey, uint16_t scan = 0, uint64_t time = 0) { return key("0x1", vkey, false, scan, time); }
+static InputEvent up(int vkey, uint16_t scan = 0, uint64_t time = 0) { return key("0x1", vkey, true, scan, time); }
+
+// A hotkey file's HotkeyStage
+class Hotkeys {
+public:
+    explicit Hotkeys(const char* text) : stage_(&table_) {
+        UserDevices users;
+        HotkeyConfig config;
+        std::string error;
+        CHECK(UserDevices::parse(USERS, users, error));
+        CHECK(HotkeyConfig::parse(text, users, config, error) && table_.build(config, error));
+    }
+    Hotkeys(const Hotkeys&) = delete;
+    Hotkeys& operator=(const Hotkeys&) = delete;
+
+    // What one batch of events comes out as: "+Ctrl" for a key going down,
+    // "-Ctrl" for one going up, "#1" for hotkey 1, "2:" before those of
+    // keyboard 0x2
+    std::string type(std::initializer_list<InputEvent> typed) {
+        std::vector<InputEvent> events(typed);
+        events.resize(stage_.process(events.data(), events.size()));
+        std::string out;
+        for (const InputEvent& event : events) {
+            if (!out.empty()) out += ' ';
+            if (std::strcmp(event.device_id, "0x1") != 0) out.append(event.device_id + 2).append(":");
+            if (event.type == DeviceType::Hotkey) {
+                out.append("#").append(std::to_string(event.data.hotkey.id));
+            } else if (event.type == DeviceType::Keyboard) {
+                out.append(event.data.keyboard.up ? "-" : "+").append(keyName((uint8_t)event.data.keyboard.vkey));
+            } else {
+                out += "?";
+            }
+        }
+        return out;
+    }
+
+private:
+    HotkeyTable table_;
+    HotkeyStage stage_;
+};
+
+static void testFiring() {
+    Hotkeys hotkeys("u hotkey 1 Ctrl+P\nu hotkey 2 LAlt+F4\n* hotkey 3 Ctrl+Shift\n");
+    CHECK(hotkeys.type({ down(0x11, SCAN_CTRL), down('P'), up('P'), up(0x11, SCAN_CTRL) }) == "+Ctrl #1 -Ctrl");
+    // Either Ctrl; other keys may be held
+    CHECK(hotkeys.type({ down('A'), down(0x11, KEYMAP_EXTENDED | SCAN_CTRL), down('P') }) == "+A +Ctrl #1");
+    CHECK(hotkeys.type({ up('P'), up(0x11, KEYMAP_EXTENDED | SCAN_CTRL), up('A') }) == "-Ctrl -A");
+    // LAlt only
+    CHECK(hotkeys.type({ down(0x12, KEYMAP_EXTENDED | SCAN_ALT), down(0x73), up(0x73) }) == "+Alt +F4 -F4");
+    CHECK(hotkeys.type({ up(0x12, KEYMAP_EXTENDED | SCAN_ALT), down(0x12, SCAN_ALT), down(0x73) }) ==
+          "-Alt +Alt #2");
+    CHECK(hotkeys.type({ up(0x73), up(0x12, SCAN_ALT) }) == "-Alt");
+    // A chord of modifiers fires on the last one down; "*" is every keyboard's
+    CHECK(hotkeys.type({ down(0x10, SCAN_LSHIFT), down(0x11, SCAN_CTRL), up(0x11, SCAN_CTRL) }) == "+Shift #3");
+    CHECK(hotkeys.type({ key("0x9", 0x11, false, SCAN_CTRL), key("0x9", 0x10, false, SCAN_LSHIFT) }) ==
+          "9:+Ctrl 9:#3");
+    CHECK(hotkeys.type({ up(0x10, SCAN_LSHIFT), key("0x9", 'P', false) }) == "-Shift 9:+P");
+}
+
+static void testExactModifiers() {
+    Hotkeys hotkeys("u hotkey 1 Ctrl+P\nu hotkey 2 P\nv hotkey 3 LCtrl+P\n");
+    // Ctrl+P does not fire with Shift also held, nor does P
+    CHECK(hotkeys.type({ down(0x11, SCAN_CTRL), down(0x10, SCAN_LSHIFT), down('P'), up('P') }) ==
+          "+Ctrl +Shift +P -P");
+    CHECK(hotkeys.type({ up(0x10, SCAN_LSHIFT), down('P'), up('P'), up(0x11, SCAN_CTRL) }) == "-Shift #1 -Ctrl");
+    CHECK(hotkeys.type({ down('P'), up('P') }) == "#2");
+    // With both Ctrls down, releasing one leaves Ctrl held
+    CHECK(hotkeys.type({ down(0x11, SCAN_CTRL), down(0x11, KEYMAP_EXTENDED | SCAN_CTRL), up(0x11, SCAN_CTRL),
+                         down('P'), up('P') }) == "+Ctrl +Ctrl -Ctrl #1");
+    CHECK(hotkeys.type({ up(0x11, KEYMAP_EXTENDED | SCAN_CTRL), down('P'), up('P') }) == "-Ctrl #2");
+    // LCtrl+P is not typed with Right Ctrl
+    CHECK(hotkeys.type({ key("0x2", 0x11, false, KEYMAP_EXTENDED | SCAN_CTRL), key("0x2", 'P', false) }) ==
+          "2:+Ctrl 2:+P");
+    CHECK(hotkeys.type({ key("0x2", 'P', true), key("0x2", 0x11, true, KEYMAP_EXTENDED | SCAN_CTRL),
+                         key("0x2", 0x11, false, SCAN_CTRL), key("0x2", 'P', false) }) == "2:-P 2:-Ctrl 2:+Ctrl 2:#3");
+}
+
+static void testSequences() {
+    Hotkeys hotkeys("u hotkey 1 Ctrl+Space W\nu hotkey 2 Ctrl+Space Ctrl+Q Ctrl+Q\nu hotkey 3 Q\n");
+    CHECK(hotkeys.type({ down(0x11, SCAN_CTRL), down(0x20), up(0x20), up(0x11, SCAN_CTRL), down('W'), up('W') }) ==
+          "+Ctrl -Ctrl #1");
+    // Modifiers between steps do not start it over
+    CHECK(hotkeys.type({ down(0x11, SCAN_CTRL), down(0x20), up(0x20), down('Q'), up('Q'), down('Q'), up('Q') }) ==
+          "+Ctrl #2");
+    CHECK(hotkeys.type({ down(0x20), up(0x20), up(0x11, SCAN_CTRL), down(0x10, SCAN_LSHIFT), up(0x10, SCAN_LSHIFT),
+                         down('W') }) == "-Ctrl +Shift -Shift #1");
+    // A key that is no next step starts it over, and is tried as the start
+    // of another sequence
+    CHECK(hotkeys.type({ up('W'), down(0x11, SCAN_CTRL), down(0x20), up(0x20), up(0x11, SCAN_CTRL), down('E'),
+                         up('E'), down('W') }) == "+Ctrl -Ctrl +E -E +W");
+    CHECK(hotkeys.type({ up('W'), down(0x11, SCAN_CTRL), down(0x20), up(0x20), up(0x11, SCAN_CTRL), down('Q'),
+                         up('Q') }) == "-W +Ctrl -Ctrl #3");
+    // Keyboards keep their own place in their sequences
+    CHECK(hotkeys.type({ down(0x11, SCAN_CTRL), down(0x20), key("0x2", 'W', false), up(0x20), up(0x11, SCAN_CTRL),
+                         down('W') }) == "+Ctrl 2:+W -Ctrl #1");
+}
+
+static void testStepTimeout() {
+    Hotkeys hotkeys("u hotkey 1 Ctrl+Space W\nu hotkey 2 W\n");
+    const uint64_t start = 1700000000000ull;
+    CHECK(hotkeys.type({ down(0x11, SCAN_CTRL, start), down(0x20, 0, start), up(0x20, 0, start + 100),
+                         up(0x11, SCAN_CTRL, start + 200), down('W', 0, start + HOTKEY_STEP_MS) }) ==
+          "+Ctrl -Ctrl #1");
+    // One millisecond later, the sequence has started over and W is hotkey 2
+    CHECK(hotkeys.type({ up('W', 0, start + 2000), down(0x11, SCAN_CTRL, start + 3000),
+                         down(0x20, 0, start + 3000), up(0x20, 0, start + 3100), up(0x11, SCAN_CTRL, start + 3200),
+                         down('W', 0, start + 3000 + HOTKEY_STEP_MS + 1) }) == "+Ctrl -Ctrl #2");
+    // The wait is from the last step, not the first
+    Hotkeys three("u hotkey 1 A B C\n");
+    CHECK(three.type({ down('A', 0, start), up('A', 0, start), down('B', 0, start + HOTKEY_STEP_MS),
+                       up('B', 0, start + HOTKEY_STEP_MS), down('C', 0, start + 2 * HOTKEY_STEP_MS) }) == "#1");
+}
+
+static void testSwallowing() {
+    Hotkeys hotkeys("u hotkey 1 Ctrl+P\nu hotkey 2 Ctrl+Space W\n");
+    // Auto-repeats of the key that fired are dropped; Ctrl's are not
+    CHECK(hotkeys.type({ down(0x11, SCAN_CTRL), down('P'), down('P'), down('P'), down(0x11, SCAN_CTRL) }) ==
+          "+Ctrl #1 +Ctrl");
+    // Nor is a release that comes in a later batch
+    CHECK(hotkeys.type({ up('P') }).empty());
+    // Once released, P is typed again
+    CHECK(hotkeys.type({ down('P'), down('P') }) == "#1");
+    CHECK(hotkeys.type({ up(0x11, SCAN_CTRL), up('P'), down('P'), up('P') }) == "-Ctrl +P -P");
+    // The first step's key, held through the second, stays dropped
+    CHECK(hotkeys.type({ down(0x11, SCAN_CTRL), down(0x20), down(0x20), up(0x11, SCAN_CTRL), down('W'), down(0x20),
+                         down('W'), up('W'), up(0x20) }) == "+Ctrl -Ctrl #2");
+    // Events of other types pass through in place
+    InputEvent mouse = {};
+    setDeviceId(mouse, "0x1", 3);
+    mouse.type = DeviceType::Mouse;
+    CHECK(hotkeys.type({ down(0x11, SCAN_CTRL), mouse, down('P'), mouse, up('P') }) == "+Ctrl ? #1 ?");
+}
+
+int main() {
+    testTables();
+    testFiring();
+    testExactModifiers();
+    testSequences();
+    testStepTimeout();
+    testSwallowing();
+    return checkResult();
+}
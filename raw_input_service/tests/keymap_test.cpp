@@ -0,0 +1,199 @@
+// keymap_test.cpp - Layout tables, KeymapStage modifiers and key names
+//
+// Types on a keyboard through KeymapStage and checks the WM_CHAR values
+// and mods it fills in: Shift, Caps Lock and Ctrl on the US layout, AltGr
+// (Right Alt or Ctrl+Alt) on the German one, the French number row.
+// sidedKey() tells left from right modifiers by scan code, and every
+// virtual key's name reads back as the same key.
+#include "check.h"
+#include "keymap.h"
+#include <string>
+
+constexpr uint16_t SCAN_LSHIFT = 0x2A;
+constexpr uint16_t SCAN_RSHIFT = 0x36;
+constexpr uint16_t SCAN_CTRL = 0x1D;
+constexpr uint16_t SCAN_ALT = 0x38;
+constexpr uint16_t SCAN_CAPS = 0x3A;
+
+// One keyboard, typing through its own KeymapStage
+class Keyboard {
+public:
+    explicit Keyboard(const KeyLayout* layout) : layouts_(layout), stage_(&layouts_) {}
+
+    // The event a press (or release) of vkey becomes; scan 0 lets the
+    // layout fill it in, as for remapped keys
+    InputEvent key(int vkey, bool up = false, uint16_t scan = 0) {
+        InputEvent event = {};
+        setDeviceId(event, "kb0", 3);
+        event.type = DeviceType::Keyboard;
+        event.data.keyboard.vkey = vkey;
+        event.data.keyboard.scan = scan;
+        event.data.keyboard.up = up ? 1 : 0;
+        stage_.process(&event, 1);
+        return event;
+    }
+
+    uint16_t type(int vkey) {
+        uint16_t ch = key(vkey).data.keyboard.ch;
+        key(vkey, true);
+        return ch;
+    }
+
+    void press(int vkey, uint16_t scan) { key(vkey, false, scan); }
+    void release(int vkey, uint16_t scan) { key(vkey, true, scan); }
+    void tap(int vkey, uint16_t scan) {
+        press(vkey, scan);
+        release(vkey, scan);
+    }
+
+private:
+    KeyLayouts layouts_;
+    KeymapStage stage_;
+};
+
+static void testUs() {
+    Keyboard keyboard(&KEYMAP_US);
+    InputEvent a = keyboard.key('A');
+    CHECK(a.data.keyboard.ch == 'a' && a.data.keyboard.scan == 0x1E && a.data.keyboard.mods == 0);
+    CHECK(keyboard.key('A', true).data.keyboard.ch == 0);             // Releases give no character
+    CHECK(keyboard.type(0xBA) == ';' && keyboard.type(0xDE) == '\'');
+
+    keyboard.press(0x10, SCAN_LSHIFT);
+    InputEvent shifted = keyboard.key('A');
+    CHECK(shifted.data.keyboard.ch == 'A' && shifted.data.keyboard.mods == KEY_MOD_SHIFT);
+    CHECK(keyboard.type('1') == '!' && keyboard.type(0xBF) == '?' && keyboard.type(0xC0) == '~');
+    keyboard.press(0x10, SCAN_RSHIFT);
+    keyboard.release(0x10, SCAN_LSHIFT);                               // Right Shift still held
+    CHECK(keyboard.type('2') == '@');
+    keyboard.release(0x10, SCAN_RSHIFT);
+    CHECK(keyboard.type('2') == '2');
+
+    // Caps Lock toggles on the press, not on auto-repeat, and only shifts letters
+    keyboard.press(0x14, SCAN_CAPS);
+    keyboard.press(0x14, SCAN_CAPS);
+    keyboard.release(0x14, SCAN_CAPS);
+    InputEvent caps = keyboard.key('Q');
+    CHECK(caps.data.keyboard.ch == 'Q' && caps.data.keyboard.mods == KEY_MOD_CAPS);
+    CHECK(keyboard.type('1') == '1');
+    keyboard.press(0x10, SCAN_LSHIFT);
+    CHECK(keyboard.type('Q') == 'q' && keyboard.type('1') == '!');
+    keyboard.release(0x10, SCAN_LSHIFT);
+    keyboard.tap(0x14, SCAN_CAPS);
+    CHECK(keyboard.type('Q') == 'q');
+
+    // Ctrl gives control characters for letters, Backspace and Enter only
+    keyboard.press(0x11, SCAN_CTRL);
+    InputEvent ctrlC = keyboard.key('C');
+    CHECK(ctrlC.data.keyboard.ch == 0x03 && ctrlC.data.keyboard.mods == KEY_MOD_CTRL);
+    CHECK(keyboard.type(0x08) == 0x7F && keyboard.type(0x0D) == '\n' && keyboard.type('1') == 0);
+    // Without AltGr, Ctrl+Alt and Right Alt are Ctrl and Alt
+    keyboard.press(0x12, KEYMAP_EXTENDED | SCAN_ALT);
+    InputEvent ctrlAlt = keyboard.key('Q');
+    CHECK(ctrlAlt.data.keyboard.ch == 0 && ctrlAlt.data.keyboard.mods == (KEY_MOD_CTRL | KEY_MOD_ALT));
+    keyboard.release(0x11, SCAN_CTRL);
+    keyboard.release(0x12, KEYMAP_EXTENDED | SCAN_ALT);
+    CHECK(keyboard.type('Q') == 'q');
+
+    // Keyboards keep their own modifiers
+    Keyboard other(&KEYMAP_US);
+    other.press(0x10, SCAN_LSHIFT);
+    CHECK(keyboard.type('A') == 'a' && other.type('A') == 'A');
+}
+
+static void testDeAltGr() {
+    Keyboard keyboard(&KEYMAP_DE);
+    CHECK(keyboard.type('Z') == 'z' && keyboard.key('Z').data.keyboard.scan == 0x15);
+    CHECK(keyboard.type(0xDB) == 0xDF && keyboard.type(0xBA) == 0xFC);
+
+    // Right Alt is AltGr and takes the place of Ctrl and Alt
+    keyboard.press(0x12, KEYMAP_EXTENDED | SCAN_ALT);
+    InputEvent at = keyboard.key('Q');
+    CHECK(at.data.keyboard.ch == '@' && at.data.keyboard.mods == KEY_MOD_ALTGR);
+    CHECK(keyboard.type('E') == 0x20AC && keyboard.type('M') == 0xB5);
+    CHECK(keyboard.type('7') == '{' && keyboard.type('0') == '}' && keyboard.type(0xDB) == '\\');
+    CHECK(keyboard.type(0xE2) == '|' && keyboard.type('A') == 0);
+    keyboard.release(0x12, KEYMAP_EXTENDED | SCAN_ALT);
+    CHECK(keyboard.type('Q') == 'q');
+
+    // So is Ctrl+Alt; Left Alt alone is not
+    keyboard.press(0x11, SCAN_CTRL);
+    keyboard.press(0x12, SCAN_ALT);
+    CHECK(keyboard.type('Q') == '@' && keyboard.type('8') == '[');
+    keyboard.release(0x11, SCAN_CTRL);
+    InputEvent alt = keyboard.key('Q');
+    CHECK(alt.data.keyboard.ch == 0 && alt.data.keyboard.mods == KEY_MOD_ALT);
+    keyboard.release(0x12, SCAN_ALT);
+
+    // Shift+AltGr reaches the fourth level; umlauts follow Caps Lock
+    keyboard.press(0x10, SCAN_LSHIFT);
+    CHECK(keyboard.type('3') == 0xA7);
+    keyboard.press(0x12, KEYMAP_EXTENDED | SCAN_ALT);
+    CHECK(keyboard.type('Q') == 0);
+    keyboard.release(0x12, KEYMAP_EXTENDED | SCAN_ALT);
+    keyboard.release(0x10, SCAN_LSHIFT);
+    keyboard.tap(0x14, SCAN_CAPS);
+    CHECK(keyboard.type(0xBA) == 0xDC && keyboard.type(0xC0) == 0xD6 && keyboard.type(0xDB) == 0xDF);
+}
+
+static void testFrNumberRow() {
+    Keyboard keyboard(&KEYMAP_FR);
+    const uint16_t plain[] = { '&', 0xE9, '"', '\'', '(', '-', 0xE8, '_', 0xE7, 0xE0 };
+    const uint16_t altGr[] = { 0, 0, '#', '{', '[', '|', 0, '\\', '^', '@' };
+    for (int digit = 1; digit <= 10; ++digit) {
+        int vkey = '0' + digit % 10;
+        CHECK(keyboard.type(vkey) == plain[digit - 1]);
+        keyboard.press(0x10, SCAN_LSHIFT);
+        CHECK(keyboard.type(vkey) == (uint16_t)vkey);
+        keyboard.release(0x10, SCAN_LSHIFT);
+        keyboard.press(0x12, KEYMAP_EXTENDED | SCAN_ALT);
+        CHECK(keyboard.type(vkey) == altGr[digit - 1]);
+        keyboard.release(0x12, KEYMAP_EXTENDED | SCAN_ALT);
+    }
+    // Caps Lock shifts letters only, as the table says for this row
+    keyboard.tap(0x14, SCAN_CAPS);
+    CHECK(keyboard.type('1') == '&' && keyboard.type('A') == 'A');
+    CHECK(keyboard.key('A').data.keyboard.scan == 0x10 && keyboard.key('Q').data.keyboard.scan == 0x1E);
+}
+
+static void testSidedKeys() {
+    CHECK(sidedKey(0x10, SCAN_LSHIFT) == 0xA0);
+    CHECK(sidedKey(0x10, SCAN_RSHIFT) == 0xA1);
+    CHECK(sidedKey(0x10, KEYMAP_EXTENDED | SCAN_LSHIFT) == 0xA0);     // Shift some keys fake
+    CHECK(sidedKey(0x11, SCAN_CTRL) == 0xA2);
+    CHECK(sidedKey(0x11, KEYMAP_EXTENDED | SCAN_CTRL) == 0xA3);
+    CHECK(sidedKey(0x12, SCAN_ALT) == 0xA4);
+    CHECK(sidedKey(0x12, KEYMAP_EXTENDED | SCAN_ALT) == 0xA5);
+    CHECK(sidedKey(0x2E, 0xE053) == 0x2E && sidedKey('A', 0x1E) == 'A' && sidedKey(0xA3, 0) == 0xA3);
+    for (int vkey = 0; vkey < (int)KEYMAP_KEYS; ++vkey) {
+        uint8_t sideless = sidelessKey((uint8_t)vkey);
+        CHECK(vkey >= 0xA0 && vkey <= 0xA5 ? sideless == 0x10 + (vkey - 0xA0) / 2 : sideless == vkey);
+    }
+    // The common rows give sided keys the scan codes sidedKey() reads
+    for (uint8_t sided = 0xA0; sided <= 0xA5; ++sided) {
+        CHECK(sidedKey(sidelessKey(sided), KEYMAP_US.scans[sided]) == sided);
+    }
+}
+
+static void testNames() {
+    for (int vkey = 0; vkey < (int)KEYMAP_KEYS; ++vkey) {
+        std::string name = keyName((uint8_t)vkey);
+        CHECK(!name.empty() && keyFromName(name) == vkey);
+        for (char& c : name) {
+            if (c >= 'A' && c <= 'Z') c = (char)(c + 32);
+        }
+        CHECK(keyFromName(name) == vkey);
+    }
+    CHECK(std::string(keyName('A')) == "A" && std::string(keyName(0x7B)) == "F12");
+    CHECK(std::string(keyName(0x87)) == "F24" && std::string(keyName(0x07)) == "0x07");
+    CHECK(keyFromName("lctrl") == 0xA2 && keyFromName("NUM5") == 0x65 && keyFromName("\\") == 0xDC);
+    CHECK(keyFromName("") == -1 && keyFromName("Ctrl+") == -1 && keyFromName("F25") == -1);
+}
+
+int main() {
+    testUs();
+    testDeAltGr();
+    testFrNumberRow();
+    testSidedKeys();
+    testNames();
+    return checkResult();
+}
@@ -0,0 +1,256 @@
+// macro_test.cpp - Macro recording, its format, and MacroEngine state
+//
+// A key and mouse sequence from two devices reads back from MacroWriter's
+// format event by event, with its gaps. Releases of keys held before the
+// recording started are left out, and so are trailing modifier presses. A
+// recording stops at MACRO_BYTES_MAX with every event before the limit
+// kept. Through MacroEngine, hotkeys record a macro that save() and
+// restore() carry into a new engine, which replays it unchanged.
+#include "check.h"
+#include "macro.h"
+#include <cstring>
+#include <future>
+
+static InputEvent keyEvent(const char* device, int vkey, bool up, uint16_t ch = 0, uint16_t mods = 0) {
+    InputEvent event = {};
+    setDeviceId(event, device, std::strlen(device));
+    event.type = DeviceType::Keyboard;
+    event.data.keyboard.vkey = vkey;
+    event.data.keyboard.scan = (uint16_t)(0x10 + vkey % 64);
+    event.data.keyboard.ch = ch;
+    event.data.keyboard.mods = mods;
+    event.data.keyboard.up = up ? 1 : 0;
+    return event;
+}
+
+static InputEvent mouseEvent(const char* device, int dx, int dy, int buttons = 0) {
+    InputEvent event = {};
+    setDeviceId(event, device, std::strlen(device));
+    event.type = DeviceType::Mouse;
+    event.data.mouse.dx = dx;
+    event.data.mouse.dy = dy;
+    event.data.mouse.buttons = buttons;
+    return event;
+}
+
+static InputEvent hotkeyEvent(const char* device, uint16_t id) {
+    InputEvent event = {};
+    setDeviceId(event, device, std::strlen(device));
+    event.type = DeviceType::Hotkey;
+    event.data.hotkey.id = id;
+    return event;
+}
+
+// Every event of the macro with the gap before it
+static std::vector<std::pair<InputEvent, uint64_t>> readAll(const Macro& macro) {
+    MacroReader reader(std::make_shared<const Macro>(macro));
+    std::vector<std::pair<InputEvent, uint64_t>> events;
+    InputEvent event;
+    uint64_t delta;
+    while (reader.next(event, delta)) events.emplace_back(event, delta);
+    return events;
+}
+
+static bool sameEvent(const InputEvent& a, const InputEvent& b) {
+    return std::memcmp(&a, &b, sizeof(InputEvent)) == 0;
+}
+
+static void testRoundTrip() {
+    const InputEvent sequence[] = {
+        keyEvent("kb0", 0x10, false, 0, KEY_MOD_SHIFT), keyEvent("kb0", 'H', false, 'H', KEY_MOD_SHIFT),
+        keyEvent("kb0", 'H', true), keyEvent("kb0", 0x10, true),
+        mouseEvent("0x1A2B3C", 12, -7), mouseEvent("0x1A2B3C", -300, 4096, 1),
+        keyEvent("kb0", 'I', false, 'i'), mouseEvent("0x1A2B3C", 0, 0, 0), keyEvent("kb0", 'I', true),
+    };
+    const uint64_t times[] = { 5000, 5000, 5180, 5900, 6000, 6125, 1000000, 1000000, 3000000 };
+    MacroWriter writer;
+    for (size_t i = 0; i < 9; ++i) CHECK(writer.append(sequence[i], times[i]));
+    Macro macro = writer.finish();
+    CHECK(macro.events == 9 && macro.durationUs == 3000000 - 5000);
+
+    std::vector<std::pair<InputEvent, uint64_t>> read = readAll(macro);
+    CHECK(read.size() == 9);
+    for (size_t i = 0; i < read.size() && i < 9; ++i) {
+        CHECK(sameEvent(read[i].first, sequence[i]));
+        CHECK(read[i].second == (i == 0 ? 0 : times[i] - times[i - 1]));
+    }
+
+    // A small mouse record is 5 bytes once its device is defined
+    MacroWriter mice;
+    mice.append(mouseEvent("ms0", 1, 1), 0);
+    size_t first = mice.finish().bytes.size();
+    mice.append(mouseEvent("ms0", 1, 1), 0);
+    mice.append(mouseEvent("ms0", -5, 9), 100);
+    CHECK(mice.finish().bytes.size() == first + 5);
+
+    // The writer is empty again after finish()
+    CHECK(writer.finish().events == 0);
+    // Cut short, the reader stops at the last whole record
+    macro.bytes.resize(macro.bytes.size() - 1);
+    CHECK(readAll(macro).size() == 8);
+}
+
+static void testTrimming() {
+    // Ctrl and A were down before the recording; their releases are left out
+    MacroWriter writer;
+    CHECK(writer.append(keyEvent("kb0", 0xA2, true), 100));
+    CHECK(writer.append(keyEvent("kb0", 'A', true), 110));
+    CHECK(writer.append(keyEvent("kb0", 'B', false, 'b'), 200));
+    CHECK(writer.append(keyEvent("kb0", 'A', true), 210));
+    CHECK(writer.append(keyEvent("kb0", 'B', true), 300));
+    CHECK(writer.append(keyEvent("kb0", 'B', true), 310));        // Released twice
+    Macro macro = writer.finish();
+    std::vector<std::pair<InputEvent, uint64_t>> read = readAll(macro);
+    CHECK(macro.events == 2 && read.size() == 2 && macro.durationUs == 100);
+    CHECK(read.size() == 2 && read[0].first.data.keyboard.vkey == 'B' && !read[0].first.data.keyboard.up &&
+          read[0].second == 0 && read[1].first.data.keyboard.up && read[1].second == 100);
+
+    // Trailing modifier presses, the start of the stop hotkey, are cut off;
+    // earlier ones stay, as do modifier releases
+    CHECK(writer.append(keyEvent("kb0", 0xA0, false), 1000));
+    CHECK(writer.append(keyEvent("kb0", 'C', false, 'C', KEY_MOD_SHIFT), 1010));
+    CHECK(writer.append(keyEvent("kb0", 0xA0, true), 1020));
+    CHECK(writer.append(mouseEvent("ms0", 3, 3), 1030));
+    CHECK(writer.append(keyEvent("kb0", 0xA2, false), 2000));
+    CHECK(writer.append(keyEvent("kb0", 0xA4, false), 2050));
+    CHECK(writer.append(keyEvent("kb0", 0x5B, false), 2060));
+    macro = writer.finish();
+    read = readAll(macro);
+    CHECK(macro.events == 4 && read.size() == 4 && macro.durationUs == 30);
+    CHECK(read.size() == 4 && read[3].first.type == DeviceType::Mouse);
+
+    // A recording of only modifier presses is empty
+    CHECK(writer.append(keyEvent("kb0", 0x11, false), 0));
+    CHECK(writer.append(keyEvent("kb0", 0x10, false), 5));
+    macro = writer.finish();
+    CHECK(macro.events == 0 && macro.bytes.empty() && macro.durationUs == 0);
+}
+
+static void testSizeLimit() {
+    MacroWriter writer;
+    size_t appended = 0;
+    uint64_t time = 0;
+    while (writer.append(mouseEvent("ms0", 100, -100, (int)(appended % 2)), time)) {
+        ++appended;
+        time += 125;
+    }
+    CHECK(!writer.append(mouseEvent("ms0", 100, -100), time));         // Still full
+    Macro macro = writer.finish();
+    CHECK(macro.events == appended && macro.bytes.size() <= MACRO_BYTES_MAX);
+    CHECK(macro.bytes.size() + 8 > MACRO_BYTES_MAX);                    // The next record did not fit
+    CHECK(macro.durationUs == (appended - 1) * 125);
+    std::vector<std::pair<InputEvent, uint64_t>> read = readAll(macro);
+    CHECK(read.size() == appended && read.back().first.data.mouse.buttons == (int)((appended - 1) % 2));
+
+    // Through the engine, a full recording stops itself and is kept
+    UserDevices users;
+    MacroConfig config;
+    std::string error;
+    CHECK(UserDevices::parse("u device ms0\n", users, error));
+    CHECK(MacroConfig::parse("u record 1 100\n", users, config, error));
+    MacroEngine engine;
+    engine.configure(config);
+    InputEvent start = hotkeyEvent("ms0", 100);
+    CHECK(engine.process(&start, 1) == 0);
+    std::vector<InputEvent> batch(4096, mouseEvent("ms0", 100, -100));
+    for (size_t sent = 0; sent < appended + batch.size(); sent += batch.size()) {
+        CHECK(engine.process(batch.data(), batch.size()) == batch.size());
+    }
+    std::string saved;
+    engine.save(saved);
+    CHECK(saved.size() > MACRO_BYTES_MAX - 64 && saved.size() < MACRO_BYTES_MAX + 64);
+    // The next record hotkey starts a new recording rather than stopping one
+    InputEvent again[] = { hotkeyEvent("ms0", 100), mouseEvent("ms0", 1, 0), hotkeyEvent("ms0", 100) };
+    CHECK(engine.process(again, 3) == 1);
+    saved.clear();
+    engine.save(saved);
+    CHECK(saved.size() < 64);
+}
+
+// What replaying a macro through a started engine gives its sink
+class Replayed {
+public:
+    explicit Replayed(size_t expected) : expected_(expected) {}
+
+    void sink(InputEvent* events, size_t count) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        events_.insert(events_.end(), events, events + count);
+        if (events_.size() == expected_) done_.set_value();
+    }
+
+    std::vector<InputEvent> wait() {
+        done_.get_future().wait_for(std::chrono::seconds(5));
+        std::lock_guard<std::mutex> lock(mutex_);
+        return events_;
+    }
+
+private:
+    size_t expected_;
+    std::mutex mutex_;
+    std::vector<InputEvent> events_;
+    std::promise<void> done_;
+};
+
+static void configureEngine(MacroEngine& engine) {
+    UserDevices users;
+    MacroConfig config;
+    std::string error;
+    CHECK(UserDevices::parse("u device ms0\nu device kb0\nv device ms1\n", users, error));
+    CHECK(MacroConfig::parse("u record 1 100\nu play 1 101\n* record 2 200\n* play 2 201\n", users, config, error));
+    engine.configure(config);
+}
+
+static void testSaveRestore() {
+    MacroEngine engine;
+    configureEngine(engine);
+    const InputEvent typed[] = { keyEvent("kb0", 'A', false, 'a'), mouseEvent("ms0", 4, -2),
+                                 keyEvent("kb0", 'A', true) };
+    InputEvent batch[] = { hotkeyEvent("kb0", 100), typed[0], typed[1], typed[2], hotkeyEvent("ms0", 100) };
+    CHECK(engine.process(batch, 5) == 3);
+    CHECK(std::memcmp(batch, typed, sizeof(typed)) == 0);               // Recording passes events on
+    InputEvent other[] = { hotkeyEvent("ms1", 200), mouseEvent("ms1", 9, 9), hotkeyEvent("ms1", 200) };
+    CHECK(engine.process(other, 3) == 1);
+    // A device of no user records a macro of its own, which is not saved
+    InputEvent stranger[] = { hotkeyEvent("ms9", 200), mouseEvent("ms9", 1, 1), hotkeyEvent("ms9", 200) };
+    CHECK(engine.process(stranger, 3) == 1);
+    std::string saved;
+    engine.save(saved);
+
+    MacroEngine next;
+    configureEngine(next);
+    const uint8_t* in = (const uint8_t*)saved.data();
+    CHECK(next.restore(in, in + saved.size()) && in == (const uint8_t*)saved.data() + saved.size());
+    std::string resaved;
+    next.save(resaved);
+    CHECK(resaved == saved);
+
+    // Replayed, the macro is the typed events, marked synthetic
+    Replayed replayed(3);
+    next.start([&replayed](InputEvent* events, size_t count) { replayed.sink(events, count); });
+    InputEvent play = hotkeyEvent("kb0", 101);
+    CHECK(next.process(&play, 1) == 0);
+    std::vector<InputEvent> events = replayed.wait();
+    CHECK(events.size() == 3);
+    for (size_t i = 0; i < events.size() && i < 3; ++i) {
+        CHECK(events[i].flags == EVENT_FLAG_SYNTHETIC);
+        events[i].flags = 0;
+        CHECK(sameEvent(events[i], typed[i]));
+    }
+    next.stop();
+
+    // Cut anywhere, the state is malformed
+    for (size_t cut = 0; cut < saved.size(); ++cut) {
+        MacroEngine broken;
+        configureEngine(broken);
+        in = (const uint8_t*)saved.data();
+        CHECK(!broken.restore(in, in + cut));
+    }
+}
+
+int main() {
+    testRoundTrip();
+    testTrimming();
+    testSizeLimit();
+    testSaveRestore();
+    return checkResult();
+}
@@ -0,0 +1,147 @@
+// motion_test.cpp - Vector motion scaling against the scalar reference
+//
+// scaleMotion() must match scaleMotionScalar() bit for bit, deltas and
+// carry, for any factor, carry and length, including lengths that end in
+// a scalar tail and arrays longer than one MOTION_BLOCK. RemapStage, which
+// gathers each device's motion out of interleaved batches, must give what
+// scaling every event in order would.
+//
+// CMake builds this once per instruction set the compiler can target
+// (motion_test_sse41, motion_test_avx2); those skip on CPUs without it.
+#include "check.h"
+#include "motion_kernel.h"
+#include "remap.h"
+#include <cstdio>
+#include <random>
+#include <vector>
+
+constexpr int SKIPPED = 77;             // SKIP_RETURN_CODE in CMakeLists.txt
+
+static const char* kernelPath() {
+#if defined(MOTION_KERNEL_AVX2)
+    return "avx2";
+#elif defined(MOTION_KERNEL_SSE41)
+    return "sse4.1";
+#else
+    return "scalar";
+#endif
+}
+
+static bool cpuSupported() {
+#if defined(__GNUC__) && defined(MOTION_KERNEL_AVX2)
+    return __builtin_cpu_supports("avx2");
+#elif defined(__GNUC__) && defined(MOTION_KERNEL_SSE41)
+    return __builtin_cpu_supports("sse4.1");
+#else
+    return true;
+#endif
+}
+
+static bool matches(const std::vector<int32_t>& deltas, int32_t factor, int32_t carry) {
+    std::vector<int32_t> expected = deltas;
+    std::vector<int32_t> actual = deltas;
+    int32_t expectedCarry = carry;
+    int32_t actualCarry = carry;
+    scaleMotionScalar(expected.data(), expected.size(), factor, expectedCarry);
+    scaleMotion(actual.data(), actual.size(), factor, actualCarry);
+    return expected == actual && expectedCarry == actualCarry;
+}
+
+static void checkKernel() {
+    std::mt19937 random(7);
+    const int32_t factorMax = (int32_t)REMAP_SCALE_MAX * MOTION_SCALE_ONE;
+
+    // Extremes: clamped deltas, the largest factors, both ends of the carry
+    for (int32_t factor : { factorMax, -factorMax, MOTION_SCALE_ONE, -1, 0, 1 }) {
+        for (int32_t carry : { 0, MOTION_SCALE_ONE / 2, MOTION_SCALE_ONE - 1 }) {
+            std::vector<int32_t> deltas = { INT32_MAX, INT32_MIN, MOTION_DELTA_MAX, -MOTION_DELTA_MAX, 0, 1, -1 };
+            for (size_t length = 0; length <= deltas.size(); ++length) {
+                CHECK(matches(std::vector<int32_t>(deltas.begin(), deltas.begin() + length), factor, carry));
+            }
+        }
+    }
+
+    // Random runs: short ones for every tail length, some past MOTION_BLOCK
+    size_t mismatches = 0;
+    for (int run = 0; run < 20000; ++run) {
+        size_t length = run % 500 == 0 ? MOTION_BLOCK * 2 + random() % 16 : random() % 70;
+        int mode = (int)(random() % 4);
+        std::vector<int32_t> deltas(length);
+        for (int32_t& delta : deltas) {
+            if (mode == 0) delta = (int32_t)(random() % 7) - 3;
+            else if (mode == 1) delta = (int32_t)random();
+            else if (mode == 2) delta = (int32_t)(random() % 200001) - 100000;
+            else delta = (int32_t)(random() % 65) - 32;
+        }
+        int32_t factor = (int32_t)(random() % (2 * (uint32_t)factorMax + 1)) - factorMax;
+        int32_t carry = (int32_t)(random() % MOTION_SCALE_ONE);
+        mismatches += matches(deltas, factor, carry) ? 0 : 1;
+    }
+    CHECK(mismatches == 0);
+}
+
+static InputEvent mouseEvent(const char* device, int dx, int dy) {
+    InputEvent event = {};
+    setDeviceId(event, device, std::strlen(device));
+    event.type = DeviceType::Mouse;
+    event.data.mouse.dx = dx;
+    event.data.mouse.dy = dy;
+    return event;
+}
+
+static void checkStage() {
+    auto path = std::filesystem::temp_directory_path() / "motion_test_remap.txt";
+    {
+        std::ofstream file(path);
+        file << "ms0 scale 1.37 -0.5\nms1 scale 0.3\n* scale 2.75 1\n";
+    }
+    RemapSource source;
+    std::string error;
+    CHECK(source.load(path.string(), error));
+    std::filesystem::remove(path);
+    std::shared_ptr<const RemapTable> table = source.current();
+    if (!table) return;
+
+    // Interleaved devices, through the stage, batch after batch
+    static const char* const ids[] = { "ms0", "ms1", "ms2" };
+    std::mt19937 random(11);
+    RemapStage stage(&source);
+    int32_t carryX[3], carryY[3];
+    for (int device = 0; device < 3; ++device) carryX[device] = carryY[device] = MOTION_SCALE_ONE / 2;
+    size_t mismatches = 0;
+    for (int batch = 0; batch < 2000; ++batch) {
+        std::vector<InputEvent> events;
+        std::vector<InputEvent> expected;
+        size_t count = random() % 64;
+        for (size_t i = 0; i < count; ++i) {
+            int device = (int)(random() % 3);
+            InputEvent event = mouseEvent(ids[device], (int)(random() % 81) - 40, (int)(random() % 81) - 40);
+            events.push_back(event);
+
+            // One event at a time, the way the scaling was specified
+            const DeviceRemap* remap = table->find(ids[device]);
+            int32_t dx = event.data.mouse.dx;
+            int32_t dy = event.data.mouse.dy;
+            scaleMotionScalar(&dx, 1, remap->scaleX, carryX[device]);
+            scaleMotionScalar(&dy, 1, remap->scaleY, carryY[device]);
+            event.data.mouse.dx = dx;
+            event.data.mouse.dy = dy;
+            if (dx != 0 || dy != 0) expected.push_back(event);
+        }
+        events.resize(stage.process(events.data(), events.size()));
+        mismatches += events.size() == expected.size() &&
+                      std::memcmp(events.data(), expected.data(), events.size() * sizeof(InputEvent)) == 0 ? 0 : 1;
+    }
+    CHECK(mismatches == 0);
+}
+
+int main() {
+    if (!cpuSupported()) {
+        std::printf("skipped: this CPU has no %s\n", kernelPath());
+        return SKIPPED;
+    }
+    std::printf("kernel: %s\n", kernelPath());
+    checkKernel();
+    checkStage();
+    return checkResult();
+}
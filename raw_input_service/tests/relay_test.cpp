@@ -0,0 +1,186 @@
+// relay_test.cpp - An UpstreamRelay against a loopback upstream service
+//
+// The upstream is a one-client service built on StreamFanout, as
+// SocketServer answers commands. It is down when the relay starts, so the
+// relay's first connect fails and its reconnect must still ask for the
+// compact format. Events come through with the relay's prefix. After the
+// upstream drops the connection, the relay reconnects, asks for compact
+// again and resumes without repeating events.
+#include "check.h"
+#include "relay.h"
+#include "stream_fanout.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+
+constexpr int WAIT_MS = 5000;           // Covers the relay's 1 s reconnect delay
+
+static InputEvent keyEvent(uint64_t seq, int vkey) {
+    InputEvent event = {};
+    setDeviceId(event, "kbd0", 4);
+    event.type = DeviceType::Keyboard;
+    event.data.keyboard.vkey = vkey;
+    event.seq = seq;
+    return event;
+}
+
+// One client at a time on 127.0.0.1. The port is bound at construction
+// but refuses connections until listen().
+class Upstream {
+public:
+    Upstream() : fanout_(HISTORY) {
+        listener_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        CHECK(::bind(listener_, (sockaddr*)&addr, sizeof(addr)) == 0);
+        CHECK(::getsockname(listener_, (sockaddr*)&addr, &len) == 0);
+        port_ = ntohs(addr.sin_port);
+    }
+
+    ~Upstream() {
+        drop();
+        ::close(listener_);
+    }
+
+    uint16_t port() const { return port_; }
+    StreamFormat format() const { return stream_.format; }
+
+    bool listen() { return ::listen(listener_, 1) == 0; }
+
+    bool accept() {
+        if (!readable(listener_)) return false;
+        client_ = ::accept(listener_, nullptr, nullptr);
+        stream_ = ClientStream();
+        lines_.clear();
+        return client_ >= 0;
+    }
+
+    // Answers command lines until one starting with command was answered
+    bool serveUntil(const std::string& command) {
+        for (;;) {
+            size_t newline;
+            while ((newline = lines_.find('\n')) != std::string::npos) {
+                std::string line = lines_.substr(0, newline);
+                lines_.erase(0, newline + 1);
+                std::string reply;
+                fanout_.handleCommand(line, stream_, reply);
+                if (!sendAll(reply)) return false;
+                if (line.compare(0, command.size(), command) == 0) return true;
+            }
+            char buffer[256];
+            if (!readable(client_)) return false;
+            ssize_t got = ::recv(client_, buffer, sizeof(buffer), 0);
+            if (got <= 0) return false;
+            lines_.append(buffer, (size_t)got);
+        }
+    }
+
+    bool publish(const std::vector<InputEvent>& batch) {
+        bool needed[STREAM_FORMAT_COUNT] = {};
+        needed[(int)stream_.format] = true;
+        fanout_.encodeBatch(batch, needed);
+        return sendAll(fanout_.encoded(stream_.format));
+    }
+
+    void drop() {
+        if (client_ >= 0) ::close(client_);
+        client_ = -1;
+    }
+
+private:
+    static constexpr size_t HISTORY = 64;
+
+    static bool readable(int fd) {
+        pollfd p = { fd, POLLIN, 0 };
+        return ::poll(&p, 1, WAIT_MS) == 1;
+    }
+
+    bool sendAll(const std::string& data) {
+        for (size_t sent = 0; sent < data.size();) {
+            ssize_t n = ::send(client_, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            sent += (size_t)n;
+        }
+        return true;
+    }
+
+    StreamFanout fanout_;
+    ClientStream stream_;
+    int listener_ = -1;
+    int client_ = -1;
+    uint16_t port_ = 0;
+    std::string lines_;
+};
+
+// What the relay published, as the service's SocketServer would get it
+class Published {
+public:
+    void publish(std::vector<InputEvent>& batch) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        events_.insert(events_.end(), batch.begin(), batch.end());
+        batch.clear();
+        changed_.notify_all();
+    }
+
+    // Waits until count events arrived, and returns them
+    std::vector<InputEvent> waitFor(size_t count) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait_for(lock, std::chrono::milliseconds(WAIT_MS), [&] { return events_.size() >= count; });
+        return events_;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::vector<InputEvent> events_;
+};
+
+int main() {
+    Upstream upstream;
+    Published published;
+    UpstreamRelay relay("127.0.0.1", upstream.port(), "up/",
+                        [&published](std::vector<InputEvent>& batch) { published.publish(batch); },
+                        [](const std::string&) {});
+    relay.start();
+
+    // Down at start: the relay's first connect is refused
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK(upstream.listen());
+    CHECK(upstream.accept());
+    CHECK(upstream.serveUntil("format"));
+    CHECK(upstream.format() == StreamFormat::Compact);
+
+    CHECK(upstream.publish({ keyEvent(1, 0x41), keyEvent(2, 0x42), keyEvent(3, 0x43) }));
+    std::vector<InputEvent> events = published.waitFor(3);
+    CHECK(events.size() == 3);
+    for (size_t i = 0; i < events.size(); ++i) {
+        CHECK(std::strcmp(events[i].device_id, "up/kbd0") == 0);
+        CHECK(events[i].type == DeviceType::Keyboard);
+        CHECK(events[i].data.keyboard.vkey == (int)(0x41 + i));
+    }
+
+    // Lost and found again: compact once more, resuming after seq 3
+    upstream.drop();
+    CHECK(upstream.accept());
+    CHECK(upstream.serveUntil("resume 3"));
+    CHECK(upstream.format() == StreamFormat::Compact);
+
+    CHECK(upstream.publish({ keyEvent(4, 0x44), keyEvent(5, 0x45) }));
+    events = published.waitFor(5);
+    CHECK(events.size() == 5);
+    for (size_t i = 3; i < events.size(); ++i) {
+        CHECK(std::strcmp(events[i].device_id, "up/kbd0") == 0);
+        CHECK(events[i].data.keyboard.vkey == (int)(0x41 + i));
+    }
+
+    relay.stop();
+    return checkResult();
+}
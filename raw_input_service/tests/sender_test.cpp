@@ -0,0 +1,114 @@
+// sender_test.cpp - StreamSender isolates clients from a stalled one
+//
+// Runs the simulation (simulation.h) with a 1 kHz mouse, a keyboard and
+// three clients, one of whose links stops transmitting for 20 s. With a
+// 500 ms write timeout the stalled client is dropped 500 ms after its send
+// buffer fills; without one it keeps its backlog and gets every event once
+// the link recovers. Either way the other clients see no extra latency,
+// since the sender never waits for a client.
+//
+// Then, with no devices at all, an idle client gets a heartbeat every
+// heartbeat interval to the millisecond, and one that stops answering them
+// is evicted the millisecond its pong timeout runs out: both come from the
+// client's own timer, not from a periodic check.
+#include "check.h"
+#include "simulation.h"
+
+constexpr uint64_t STALL_AT_MS = 100000;
+constexpr uint64_t STALL_MS = 20000;
+constexpr uint64_t WRITE_TIMEOUT = 500;
+constexpr uint64_t FILL_MS = 100;       // The stalled client's send buffer is full by then
+constexpr uint64_t HEARTBEAT_MS_IDLE = 100;
+constexpr uint64_t PONG_TIMEOUT_MS = 350;
+
+struct Run {
+    uint64_t droppedAtMs = 0;           // 0 if the stalled client stayed connected
+    uint64_t writeStalls = 0;
+    uint64_t peakMs[3] = {};            // Highest capture-to-arrival latency per client
+    uint64_t missing[3] = {};
+    uint64_t received[3] = {};
+};
+
+static Run run(uint64_t writeTimeoutMs) {
+    Simulation sim(4096);
+    ClientTimeouts timeouts;
+    timeouts.writeTimeoutMs = writeTimeoutMs;
+    sim.setTimeouts(timeouts);
+    sim.addDevice({ "mouse0", DeviceType::Mouse, 1000, 0, UINT64_MAX, 7 });
+    sim.addDevice({ "kbd0", DeviceType::Keyboard, 30, 0, UINT64_MAX, 9 });
+    SimClient* clients[3] = {
+        &sim.addClient({ 10000000, 1, 64 * 1024 }),
+        &sim.addClient({ 10000000, 2, 64 * 1024 }, StreamFormat::Binary),
+        // A small send buffer fills within a few batches of the stall
+        &sim.addClient({ 200000, 5, 512 }, StreamFormat::Compact),
+    };
+    clients[2]->link().stall(STALL_AT_MS, STALL_MS);
+
+    Run result;
+    sim.runUntil(STALL_AT_MS);
+    for (uint64_t ms = STALL_AT_MS; ms < STALL_AT_MS + STALL_MS && result.droppedAtMs == 0; ++ms) {
+        sim.runUntil(ms);
+        if (!clients[2]->connected()) result.droppedAtMs = ms;
+    }
+    sim.runUntil(STALL_AT_MS + 2 * STALL_MS);
+
+    result.writeStalls = sim.stats().writeStalls;
+    for (int i = 0; i < 3; ++i) {
+        result.peakMs[i] = clients[i]->latencyPercentile(1.0);
+        result.missing[i] = clients[i]->missing();
+        result.received[i] = clients[i]->received();
+    }
+    return result;
+}
+
+static void testIdle() {
+    Simulation sim(4096);
+    ClientTimeouts timeouts;
+    timeouts.heartbeatMs = HEARTBEAT_MS_IDLE;
+    timeouts.pongTimeoutMs = PONG_TIMEOUT_MS;
+    sim.setTimeouts(timeouts);
+    SimClient& answering = sim.addClient({ 10000000, 1, 64 * 1024 });
+    SimClient& silent = sim.addClient({ 10000000, 1, 64 * 1024 });
+    silent.setAnswersHeartbeats(false);
+
+    uint64_t droppedAtMs = 0;
+    for (uint64_t ms = 1; ms <= 2000; ++ms) {
+        sim.runUntil(ms);
+        if (!silent.connected()) {
+            droppedAtMs = ms;
+            break;
+        }
+        // One to each client on every multiple of the interval
+        CHECK(sim.stats().heartbeats == 2 * (ms / HEARTBEAT_MS_IDLE));
+    }
+    CHECK(droppedAtMs == PONG_TIMEOUT_MS);
+    CHECK(sim.stats().silentClients == 1);
+    CHECK(silent.heartbeats() == PONG_TIMEOUT_MS / HEARTBEAT_MS_IDLE);
+
+    sim.runUntil(2000);
+    CHECK(answering.connected());
+    CHECK(answering.heartbeats() >= 2000 / HEARTBEAT_MS_IDLE - 1);
+}
+
+int main() {
+    Run timed = run(WRITE_TIMEOUT);
+    CHECK(timed.writeStalls == 1);
+    CHECK(timed.droppedAtMs >= STALL_AT_MS + WRITE_TIMEOUT);
+    CHECK(timed.droppedAtMs <= STALL_AT_MS + FILL_MS + WRITE_TIMEOUT);
+    // Link latency plus at most one sender retry
+    CHECK(timed.peakMs[0] <= 1 + SEND_RETRY_MS);
+    CHECK(timed.peakMs[1] <= 2 + SEND_RETRY_MS);
+    CHECK(timed.missing[0] == 0 && timed.missing[1] == 0);
+
+    Run untimed = run(0);
+    CHECK(untimed.droppedAtMs == 0 && untimed.writeStalls == 0);
+    CHECK(untimed.peakMs[0] <= 1 + SEND_RETRY_MS);
+    CHECK(untimed.peakMs[1] <= 2 + SEND_RETRY_MS);
+    // The stalled client waits out the stall and loses nothing
+    CHECK(untimed.peakMs[2] >= STALL_MS);
+    CHECK(untimed.missing[2] == 0);
+    CHECK(untimed.received[2] + 10 >= untimed.received[0]);
+
+    testIdle();
+    return checkResult();
+}
@@ -0,0 +1,230 @@
+// timer_wheel_test.cpp - TimerWheel against a sorted model, and IoContext timers
+//
+// Timers at every level fire at exactly their deadline, however the clock
+// is stepped: cascades across all four levels, deadlines past the wheel's
+// span that get parked and re-placed, cancels (also through stale handles
+// whose slot was reused) and ties within a tick, which fire in scheduling
+// order. A random run checks every step against a multimap. Last, a session
+// sleeping on an IoContext with a virtual clock wakes exactly when
+// advanceClock() reaches its deadline.
+#include "check.h"
+#include "async_io.h"
+#include "timer_wheel.h"
+#include <future>
+#include <map>
+#include <random>
+#include <utility>
+#include <vector>
+
+constexpr uint64_t LEVEL_SPAN[] = { 64, 64 * 64, 64 * 64 * 64, 64 * 64 * 64 * 64 };
+constexpr uint64_t WHEEL_SPAN = LEVEL_SPAN[3];
+
+// Advances to nowMs and runs what is due, like IoContext::runTimers
+static void advance(TimerWheel& wheel, uint64_t nowMs) {
+    std::vector<TimerWheel::Callback> due;
+    wheel.advance(nowMs, due);
+    for (TimerWheel::Callback& callback : due) {
+        callback();
+    }
+}
+
+// One timer per level fires at its deadline and not a tick before
+static void testCascade() {
+    const uint64_t start = 1000003;     // Not aligned to any level
+    TimerWheel wheel(start);
+    const uint64_t delays[] = { 37, LEVEL_SPAN[0] + 5, LEVEL_SPAN[1] + 77, LEVEL_SPAN[2] + 4099 };
+    std::vector<uint64_t> fired;
+    for (uint64_t delay : delays) {
+        wheel.schedule(delay, [&fired, &wheel] { fired.push_back(wheel.now()); });
+    }
+    CHECK(wheel.size() == 4);
+
+    for (size_t i = 0; i < 4; ++i) {
+        uint64_t deadline = start + delays[i];
+        advance(wheel, deadline - 1);
+        CHECK(fired.size() == i);
+        advance(wheel, deadline);
+        CHECK(fired.size() == i + 1);
+        CHECK(fired.size() == i + 1 && fired[i] == deadline);
+    }
+    CHECK(wheel.size() == 0);
+    CHECK(wheel.timeUntilNext() == -1);
+
+    // The same in 1 ms steps across two level-1 and one level-2 boundary
+    TimerWheel stepped(0);
+    uint64_t steppedAt = 0;
+    stepped.schedule(LEVEL_SPAN[1] + 3, [&] { steppedAt = stepped.now(); });
+    for (uint64_t now = 1; now <= LEVEL_SPAN[1] + 3; ++now) {
+        advance(stepped, now);
+        CHECK(steppedAt == 0 || now == LEVEL_SPAN[1] + 3);
+    }
+    CHECK(steppedAt == LEVEL_SPAN[1] + 3);
+}
+
+// Deadlines beyond the wheel's span park at its far end and are placed
+// again each time they come around
+static void testFarDeadlines() {
+    TimerWheel wheel(5);
+    const uint64_t deadline = 5 + 3 * WHEEL_SPAN + 12345;
+    bool fired = false;
+    wheel.scheduleAt(deadline, [&fired] { fired = true; });
+
+    for (uint64_t now = 5; now + WHEEL_SPAN / 3 < deadline; now += WHEEL_SPAN / 3) {
+        advance(wheel, now);
+        CHECK(!fired);
+        int64_t wait = wheel.timeUntilNext();
+        CHECK(wait > 0 && (uint64_t)wait <= deadline - now);
+    }
+    advance(wheel, deadline - 1);
+    CHECK(!fired);
+    CHECK(wheel.timeUntilNext() == 1);
+    advance(wheel, deadline);
+    CHECK(fired);
+}
+
+// A handle cancels its own timer once; later cancels, and cancels through
+// a copy after the slot went to another timer, do nothing
+static void testCancel() {
+    TimerWheel wheel(0);
+    int fired = 0;
+    TimerHandle first = wheel.schedule(100, [&fired] { fired |= 1; });
+    TimerHandle stale = first;
+    CHECK(wheel.cancel(first));
+    CHECK(!first.valid());
+    CHECK(!wheel.cancel(first));
+    TimerHandle copy = stale;
+    CHECK(!wheel.cancel(copy));
+
+    TimerHandle second = wheel.schedule(100, [&fired] { fired |= 2; });
+    CHECK(second.index == stale.index);           // The freed slot is reused
+    CHECK(!wheel.cancel(stale));
+    CHECK(wheel.size() == 1);
+    advance(wheel, 100);
+    CHECK(fired == 2);
+
+    TimerHandle done = second;
+    CHECK(!wheel.cancel(done));                   // Already fired
+    TimerHandle none;
+    CHECK(!wheel.cancel(none));
+
+    // Cancelled from a callback run before its own tick comes
+    TimerHandle later;
+    wheel.schedule(10, [&] { CHECK(wheel.cancel(later)); });
+    later = wheel.schedule(11, [&fired] { fired |= 4; });
+    advance(wheel, 110);
+    advance(wheel, 200);
+    CHECK(fired == 2);
+    CHECK(wheel.size() == 0);
+}
+
+// Timers due in the same tick fire in the order they were scheduled,
+// whatever level they waited on
+static void testSameTick() {
+    TimerWheel wheel(0);
+    const uint64_t deadline = LEVEL_SPAN[2] + 500;
+    std::vector<int> order;
+    wheel.scheduleAt(deadline, [&order] { order.push_back(0); });         // Level 2
+    advance(wheel, deadline - 2000);
+    wheel.scheduleAt(deadline, [&order] { order.push_back(1); });         // Level 1
+    advance(wheel, deadline - 10);
+    wheel.scheduleAt(deadline, [&order] { order.push_back(2); });         // Level 0
+    wheel.scheduleAt(deadline, [&order] { order.push_back(3); });
+    advance(wheel, deadline + 50);
+    wheel.scheduleAt(deadline, [&order] { order.push_back(4); });         // In the past
+    wheel.scheduleAt(deadline + 1, [&order] { order.push_back(5); });
+    advance(wheel, deadline + 50);
+    CHECK((order == std::vector<int>{ 0, 1, 2, 3, 4, 5 }));
+}
+
+// Random schedules, cancels and steps against a multimap keyed by
+// (deadline, scheduling order)
+static void testAgainstModel() {
+    std::mt19937_64 random(64);
+    TimerWheel wheel(0);
+    std::map<std::pair<uint64_t, int>, TimerHandle> model;
+    std::vector<int> fired;
+    int nextId = 0;
+
+    for (int step = 0; step < 200000; ++step) {
+        uint64_t now = wheel.now();
+        switch (random() % 4) {
+            case 0:
+            case 1: {
+                // Mostly near, sometimes on the upper levels or past the span
+                uint64_t range = LEVEL_SPAN[random() % 10 == 0 ? 3 : random() % 3];
+                uint64_t delay = random() % range;
+                if (random() % 1000 == 0) delay = WHEEL_SPAN + random() % WHEEL_SPAN;
+                int id = nextId++;
+                model[{ now + delay, id }] = wheel.schedule(delay, [&fired, id] { fired.push_back(id); });
+                break;
+            }
+            case 2:
+                if (!model.empty()) {
+                    auto it = model.begin();
+                    std::advance(it, (long)(random() % model.size()));
+                    CHECK(wheel.cancel(it->second));
+                    model.erase(it);
+                }
+                break;
+            default: {
+                uint64_t to = now + random() % (random() % 50 == 0 ? LEVEL_SPAN[2] : 40);
+                fired.clear();
+                advance(wheel, to);
+                std::vector<int> expected;
+                while (!model.empty() && model.begin()->first.first <= to) {
+                    expected.push_back(model.begin()->first.second);
+                    model.erase(model.begin());
+                }
+                CHECK(fired == expected);
+                break;
+            }
+        }
+        CHECK(wheel.size() == model.size());
+    }
+}
+
+// A sleeping session on a virtual clock wakes at its deadline and not
+// before. Probe timers added after each step run after everything due by
+// then, so once a probe ran the loop has caught up.
+static Session sleeper(IoContext& io, uint64_t ms, std::promise<uint64_t>& woke) {
+    co_await io.sleep(ms);
+    woke.set_value(io.now());
+}
+
+static void catchUp(IoContext& io) {
+    std::promise<void> probe;
+    io.addTimer(0, [&probe] { probe.set_value(); });
+    probe.get_future().wait();
+}
+
+static void testVirtualSleep() {
+    IoContext io;
+    CHECK(io.open());
+    io.useVirtualClock(1000);
+    std::thread loop([&io] { io.run(); });
+
+    std::promise<uint64_t> woke;
+    std::future<uint64_t> wokeAt = woke.get_future();
+    sleeper(io, 250, woke);
+    io.advanceClock(249);
+    catchUp(io);
+    CHECK(wokeAt.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+    io.advanceClock(1);
+    catchUp(io);
+    CHECK(wokeAt.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    CHECK(wokeAt.get() == 1250);
+
+    io.stop();
+    loop.join();
+    io.close();
+}
+
+int main() {
+    testCascade();
+    testFarDeadlines();
+    testCancel();
+    testSameTick();
+    testAgainstModel();
+    testVirtualSleep();
+    return checkResult();
+}
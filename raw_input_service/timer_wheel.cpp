@@ -0,0 +1,194 @@
+// timer_wheel.cpp - Hierarchical timing wheel implementation
+#include "timer_wheel.h"
+#include <algorithm>
+#include <bit>
+
+TimerWheel::TimerWheel(uint64_t nowMs) : now_(nowMs), active_(0), freeList_(NIL), nextOrder_(0), occupied_{} {
+    for (auto& level : heads_) {
+        for (uint32_t& head : level) {
+            head = NIL;
+        }
+    }
+}
+
+TimerHandle TimerWheel::scheduleAt(uint64_t deadlineMs, Callback callback) {
+    uint32_t index = freeList_;
+    if (index != NIL) {
+        freeList_ = nodes_[index].next;
+    } else {
+        index = (uint32_t)nodes_.size();
+        nodes_.push_back(Node{});
+        nodes_[index].generation = 0;
+    }
+
+    Node& node = nodes_[index];
+    node.deadline = deadlineMs;
+    node.order = nextOrder_++;
+    node.callback = std::move(callback);
+    node.active = true;
+    active_++;
+    place(index);
+    return TimerHandle{ index, node.generation };
+}
+
+bool TimerWheel::cancel(TimerHandle& handle) {
+    TimerHandle target = handle;
+    handle = TimerHandle();
+    if (!target.valid() || target.index >= nodes_.size()) return false;
+
+    Node& node = nodes_[target.index];
+    if (!node.active || node.generation != target.generation) {
+        return false; // Fired or cancelled already; the slot may be reused
+    }
+    unlink(target.index);
+    release(target.index);
+    return true;
+}
+
+// Puts a timer in the slot of the level whose span covers its distance
+void TimerWheel::place(uint32_t index) {
+    uint64_t deadline = nodes_[index].deadline;
+    if (deadline <= now_) {
+        link(index, DUE_LEVEL, 0);
+        return;
+    }
+
+    // Too far out for the wheel: park at its far end and re-place from there
+    const uint64_t span = 1ull << (SLOT_BITS * LEVELS);
+    uint64_t target = deadline - now_ >= span ? now_ + span - 1 : deadline;
+    uint64_t delta = target - now_;
+
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1ull << (SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    link(index, level, (uint32_t)(target >> (SLOT_BITS * level)) & (SLOTS - 1));
+}
+
+void TimerWheel::link(uint32_t index, int level, uint32_t slot) {
+    Node& node = nodes_[index];
+    node.level = (uint8_t)level;
+    node.slot = (uint8_t)slot;
+    node.prev = NIL;
+    node.next = heads_[level][slot];
+    if (node.next != NIL) {
+        nodes_[node.next].prev = index;
+    }
+    heads_[level][slot] = index;
+    if (level < LEVELS) {
+        occupied_[level] |= 1ull << slot;
+    }
+}
+
+void TimerWheel::unlink(uint32_t index) {
+    Node& node = nodes_[index];
+    if (node.prev != NIL) {
+        nodes_[node.prev].next = node.next;
+    } else {
+        heads_[node.level][node.slot] = node.next;
+        if (node.next == NIL && node.level < LEVELS) {
+            occupied_[node.level] &= ~(1ull << node.slot);
+        }
+    }
+    if (node.next != NIL) {
+        nodes_[node.next].prev = node.prev;
+    }
+}
+
+// Detaches a whole slot; returns its first node (linked through next)
+uint32_t TimerWheel::takeSlot(int level, uint32_t slot) {
+    uint32_t head = heads_[level][slot];
+    heads_[level][slot] = NIL;
+    if (level < LEVELS) {
+        occupied_[level] &= ~(1ull << slot);
+    }
+    return head;
+}
+
+void TimerWheel::release(uint32_t index) {
+    Node& node = nodes_[index];
+    node.active = false;
+    node.generation++;
+    node.callback = nullptr;
+    node.next = freeList_;
+    freeList_ = index;
+    active_--;
+}
+
+// The first tick after now_ at which a level-0 slot fires or a higher
+// slot has to be spread out; UINT64_MAX with an empty wheel
+uint64_t TimerWheel::nextTick() const {
+    uint64_t best = UINT64_MAX;
+    for (int level = 0; level < LEVELS; ++level) {
+        uint64_t mask = occupied_[level];
+        if (!mask) continue;
+        int shift = SLOT_BITS * level;
+        uint64_t period = now_ >> shift;
+        // Distance 1..64 to the next occupied slot after the current one
+        int start = (int)((period + 1) & (SLOTS - 1));
+        uint64_t distance = (uint64_t)std::countr_zero(std::rotr(mask, start)) + 1;
+        uint64_t tick = (period + distance) << shift;
+        if (tick < best) best = tick;
+    }
+    return best;
+}
+
+// Collects the due timers of a detached slot into expiring_
+void TimerWheel::expire(uint32_t index) {
+    while (index != NIL) {
+        uint32_t next = nodes_[index].next;
+        if (nodes_[index].deadline > now_) {
+            place(index);
+        } else {
+            expiring_.push_back(index);
+        }
+        index = next;
+    }
+}
+
+// Hands this tick's timers over in the order they were scheduled. Slots
+// are filled front first and cascades mix levels, so sort.
+void TimerWheel::emit(std::vector<Callback>& due) {
+    if (expiring_.size() > 1) {
+        std::sort(expiring_.begin(), expiring_.end(),
+                  [this](uint32_t a, uint32_t b) { return nodes_[a].order < nodes_[b].order; });
+    }
+    for (uint32_t index : expiring_) {
+        due.push_back(std::move(nodes_[index].callback));
+        release(index);
+    }
+    expiring_.clear();
+}
+
+void TimerWheel::advance(uint64_t nowMs, std::vector<Callback>& due) {
+    expire(takeSlot(DUE_LEVEL, 0));
+    emit(due);
+
+    // Jump straight from one occupied tick to the next
+    uint64_t tick;
+    while ((tick = nextTick()) <= nowMs) {
+        now_ = tick;
+        for (int level = LEVELS - 1; level >= 1; --level) {
+            int shift = SLOT_BITS * level;
+            if (now_ & ((1ull << shift) - 1)) continue;
+            uint32_t index = takeSlot(level, (uint32_t)(now_ >> shift) & (SLOTS - 1));
+            while (index != NIL) {
+                uint32_t next = nodes_[index].next;
+                place(index);
+                index = next;
+            }
+        }
+        expire(takeSlot(0, (uint32_t)now_ & (SLOTS - 1)));
+        expire(takeSlot(DUE_LEVEL, 0));
+        emit(due);
+    }
+    if (nowMs > now_) {
+        now_ = nowMs;
+    }
+}
+
+int64_t TimerWheel::timeUntilNext() const {
+    if (heads_[DUE_LEVEL][0] != NIL) return 0;
+    uint64_t tick = nextTick();
+    return tick == UINT64_MAX ? -1 : (int64_t)(tick - now_);
+}
@@ -0,0 +1,88 @@
+// timer_wheel.h - Hierarchical timing wheel
+//
+// Four levels of 64 slots each at 1 ms resolution cover about 4.6 hours;
+// later deadlines park in the top level and are re-placed when it comes
+// around. Inserting and cancelling a timer is O(1). As time passes, a slot
+// of a higher level is spread over the level below when its turn comes,
+// so every timer is moved at most once per level.
+//
+// The wheel has no clock of its own: advance(now) fires whatever is due at
+// now. IoContext drives it from its loop timeout (real or virtual clock,
+// see async_io.h); tests can drive one directly with made-up times.
+//
+// Not thread-safe; the owner serializes access.
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+struct TimerHandle {
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
+
+    bool valid() const { return index != UINT32_MAX; }
+};
+
+class TimerWheel {
+public:
+    using Callback = std::function<void()>;
+
+    explicit TimerWheel(uint64_t nowMs = 0);
+
+    // Fires once, at the first advance() at or after the deadline
+    TimerHandle scheduleAt(uint64_t deadlineMs, Callback callback);
+    TimerHandle schedule(uint64_t delayMs, Callback callback) { return scheduleAt(now_ + delayMs, std::move(callback)); }
+
+    // False if the timer already fired or was cancelled. Clears the handle.
+    bool cancel(TimerHandle& handle);
+
+    // Moves the clock to nowMs (never backwards) and appends the callbacks
+    // of every timer due by then to due, earliest first and in scheduling
+    // order within a tick. The caller runs them, so callbacks may schedule
+    // and cancel freely.
+    void advance(uint64_t nowMs, std::vector<Callback>& due);
+
+    // Milliseconds until the wheel needs advance() again, or -1 with no
+    // timers. May be early for timers far out (a higher-level slot is due).
+    int64_t timeUntilNext() const;
+
+    uint64_t now() const { return now_; }
+    size_t size() const { return active_; }
+
+private:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint32_t SLOTS = 1u << SLOT_BITS;
+    static constexpr uint32_t NIL = UINT32_MAX;
+    static constexpr int DUE_LEVEL = LEVELS;   // List of timers scheduled in the past
+
+    struct Node {
+        uint64_t deadline;
+        uint64_t order;                 // Scheduling order, for ties within a tick
+        Callback callback;
+        uint32_t prev;
+        uint32_t next;
+        uint32_t generation;
+        uint8_t level;
+        uint8_t slot;
+        bool active;
+    };
+
+    void place(uint32_t index);
+    void link(uint32_t index, int level, uint32_t slot);
+    void unlink(uint32_t index);
+    uint32_t takeSlot(int level, uint32_t slot);
+    void release(uint32_t index);
+    uint64_t nextTick() const;
+    void expire(uint32_t head);
+    void emit(std::vector<Callback>& due);
+
+    uint64_t now_;
+    size_t active_;
+    std::vector<Node> nodes_;
+    uint32_t freeList_;
+    uint64_t nextOrder_;
+    std::vector<uint32_t> expiring_;          // Scratch for one tick
+    uint32_t heads_[LEVELS + 1][SLOTS];
+    uint64_t occupied_[LEVELS];               // Bit per non-empty slot
+};
@@ -0,0 +1,159 @@
+// user_rules.h - Users, their devices, and per-user rule files
+//
+// The users file (--users) is the one place that gives devices to users,
+// one per line:
+//
+//     user_1   device  0x1A2B3C
+//     user_1   device  0x4D5E6F        # a user may have several
+//     user_2   device  0x7A8B9C
+//
+// A device belongs to at most one user. The cursor, hotkey and macro files
+// give those users rules in the same layout, "user directive fields...",
+// with "*" for rules every user shares; they do not list devices. Every
+// user of the users file is a user of each of them, with or without rules
+// of their own. User names are at most DEVICE_ID_MAX - 1 characters, since
+// cursor events carry them as their device_id.
+//
+// UserRules<Config, User> reads such a file for a config class, which
+// derives from it and parses its own directives with
+//
+//     bool parseRule(User& user, const std::string& directive, std::istringstream& fields);
+//
+// and may check the whole file afterwards with bool finish(std::string& error).
+#pragma once
+#include "event_types.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Reads path into text
+inline bool readRuleFile(const std::string& path, std::string& text, std::string& error) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        error = "cannot read " + path;
+        return false;
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    text = contents.str();
+    return true;
+}
+
+// Calls rule(name, directive, fields) for each "name directive fields..."
+// line, without comments and blank lines. On failure, error names the line.
+template <typename Rule>
+bool parseRuleLines(const std::string& text, std::string& error, Rule rule) {
+    std::istringstream lines(text);
+    std::string line;
+    for (int number = 1; std::getline(lines, line); ++number) {
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+        std::istringstream fields(line);
+        std::string name, directive;
+        if (!(fields >> name)) continue;
+        if (!(fields >> directive) || name.size() >= DEVICE_ID_MAX || !rule(name, directive, fields)) {
+            error = "line " + std::to_string(number) + ": " + line;
+            return false;
+        }
+    }
+    return true;
+}
+
+struct UserDevice {
+    std::string name;
+    std::vector<std::string> devices;
+};
+
+// The users file
+class UserDevices {
+public:
+    // Parses a users file's text. On failure, error names the line.
+    static bool parse(const std::string& text, UserDevices& users, std::string& error) {
+        return parseRuleLines(text, error, [&](const std::string& name, const std::string& directive,
+                                               std::istringstream& fields) {
+            std::string device, extra;
+            if (name == "*" || directive != "device" || !(fields >> device) || fields >> extra ||
+                device.size() >= DEVICE_ID_MAX || users.userOf(device)) {
+                return false;
+            }
+            auto user = std::find_if(users.users_.begin(), users.users_.end(),
+                                     [&](const UserDevice& u) { return u.name == name; });
+            if (user == users.users_.end()) {
+                users.users_.push_back(UserDevice{ name, {} });
+                user = users.users_.end() - 1;
+            }
+            user->devices.push_back(device);
+            return true;
+        });
+    }
+
+    // Reads and parses path
+    static bool load(const std::string& path, UserDevices& users, std::string& error) {
+        std::string text;
+        return readRuleFile(path, text, error) && parse(text, users, error);
+    }
+
+    const std::vector<UserDevice>& users() const { return users_; }
+
+private:
+    bool userOf(const std::string& device) const {
+        for (const UserDevice& user : users_) {
+            if (std::find(user.devices.begin(), user.devices.end(), device) != user.devices.end()) return true;
+        }
+        return false;
+    }
+
+    std::vector<UserDevice> users_;
+};
+
+// A rule file of the users in a UserDevices. User needs name and devices
+// members; users() has one per user of the users file, in its order.
+template <typename Config, typename User>
+class UserRules {
+public:
+    // Parses a rule file's text. Rules of users missing from the users file
+    // fail. On failure, error names the line.
+    static bool parse(const std::string& text, const UserDevices& users, Config& config, std::string& error) {
+        for (const UserDevice& user : users.users()) {
+            config.users_.push_back(User());
+            config.users_.back().name = user.name;
+            config.users_.back().devices = user.devices;
+        }
+        return parseRuleLines(text, error,
+                              [&](const std::string& name, const std::string& directive, std::istringstream& fields) {
+                                  User* user = config.userNamed(name);
+                                  return user && config.parseRule(*user, directive, fields);
+                              }) &&
+               config.finish(error);
+    }
+
+    // Reads and parses path
+    static bool load(const std::string& path, const UserDevices& users, Config& config, std::string& error) {
+        std::string text;
+        return readRuleFile(path, text, error) && parse(text, users, config, error);
+    }
+
+    const std::vector<User>& users() const { return users_; }
+    const User& defaults() const { return defaults_; }
+
+protected:
+    bool isDefaults(const User& user) const { return &user == &defaults_; }
+
+    // Runs once the whole file parsed; configs with checks of their own hide it
+    bool finish(std::string&) { return true; }
+
+    std::vector<User> users_;
+    User defaults_;                     // The "*" rules
+
+private:
+    User* userNamed(const std::string& name) {
+        if (name == "*") return &defaults_;
+        for (User& user : users_) {
+            if (user.name == name) return &user;
+        }
+        return nullptr;
+    }
+};